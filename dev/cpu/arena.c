@@ -0,0 +1,324 @@
+/*
+CPU benchmark for the memory placement of train_gpt2.c (llmc/arena.h).
+
+Compares two ways of allocating the large buffers of the model:
+1) malloc, and the first write from the main thread, as the model did before (fread of
+   the checkpoint, calloc, memset): the default 4 KB pages, all on the main thread's node
+2) the arena: 2 MB aligned blocks with madvise(MADV_HUGEPAGE), and arena_first_touch
+   from the OpenMP threads, each on the pages of its static share
+
+on three access patterns of the training step:
+- adamw: the optimizer's streaming pass over params, grads, m and v, with every
+  thread on a contiguous range (as gpt2_update)
+- gather: rows of C floats at random token ids of a (V, C) table (as the wte rows of
+  encoder_forward/encoder_backward)
+- page walk: one float from every 4 KB page of the params, in a random order, which is
+  all TLB misses with 4 KB pages (the worst case for e.g. a (C, OC) weight walked by column)
+
+For every run it reports the time, the dTLB load misses (from perf_event_open, if the
+kernel lets us count them), how much of the buffers is on 2 MB pages (AnonHugePages in
+/proc/self/smaps), and on machines with more than one NUMA node, the fraction of the
+pages of every thread's share that are on that thread's own node (move_pages).
+*/
+
+// Compile Examples:
+//
+//      gcc -O3 -march=native -fopenmp arena.c -lm -o arena
+//      OMP_PROC_BIND=spread OMP_PLACES=cores ./arena [num_parameters, default 32M]
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "../../llmc/arena.h"
+
+#define C 768
+#define V 50304
+#define REDUCE_BLOCK 256
+#define REPEATS 5
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int num_threads(void) {
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// dTLB load misses of the calling thread and its children (the OpenMP workers
+// are created inside, on the first parallel region)
+
+int tlb_counter_open(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+long long tlb_counter_read(int fd) {
+    long long count = -1;
+    if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count)) { return -1; }
+    return count;
+}
+
+// ----------------------------------------------------------------------------
+// where the pages are
+
+long long huge_page_bytes(const void* ptr, size_t bytes) {
+    FILE* f = fopen("/proc/self/smaps", "r");
+    if (f == NULL) { return -1; }
+    unsigned long lo = (unsigned long)ptr, hi = lo + bytes;
+    char line[512];
+    int inside = 0;
+    long long total = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        unsigned long start, end;
+        long long kb;
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            inside = start < hi && lo < end;
+        } else if (inside && sscanf(line, "AnonHugePages: %lld kB", &kb) == 1) {
+            total += kb * 1024;
+        }
+    }
+    fclose(f);
+    return total;
+}
+
+int num_numa_nodes(void) {
+    int n = 0;
+    char path[64];
+    while (1) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", n);
+        if (access(path, F_OK) != 0) { return n > 0 ? n : 1; }
+        n++;
+    }
+}
+
+int node_of_cpu(int cpu) {
+    char path[96];
+    for (int node = 0; node < 64; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+        if (access(path, F_OK) == 0) { return node; }
+    }
+    return 0;
+}
+
+// the fraction of the pages of every thread's static share of [ptr, ptr + bytes) that
+// are on the thread's own node, sampled every 64th page. -1 if move_pages is not there
+double local_page_fraction(const void* ptr, size_t bytes) {
+    int nt = num_threads();
+    int* thread_node = (int*)malloc(nt * sizeof(int));
+    #pragma omp parallel
+    {
+#ifdef _OPENMP
+        int tid = omp_get_thread_num();
+#else
+        int tid = 0;
+#endif
+        thread_node[tid] = node_of_cpu(sched_getcpu());
+    }
+    size_t num_pages = bytes / ARENA_PAGE;
+    size_t stride = 64;
+    size_t n = (num_pages + stride - 1) / stride;
+    void** pages = (void**)malloc(n * sizeof(void*));
+    int* status = (int*)malloc(n * sizeof(int));
+    for (size_t i = 0; i < n; i++) { pages[i] = (char*)ptr + i * stride * ARENA_PAGE; }
+    long ret = syscall(SYS_move_pages, 0, n, pages, NULL, status, 0);
+    double fraction = -1.0;
+    if (ret == 0) {
+        size_t local = 0, total = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (status[i] < 0) { continue; }
+            // the thread of this page in a schedule(static) loop over the pages
+            size_t page = i * stride;
+            int tid = (int)(page * nt / num_pages);
+            local += status[i] == thread_node[tid];
+            total++;
+        }
+        fraction = total > 0 ? (double)local / total : -1.0;
+    }
+    free(pages);
+    free(status);
+    free(thread_node);
+    return fraction;
+}
+
+// ----------------------------------------------------------------------------
+// the two allocation strategies
+
+float* alloc_malloc(size_t n) {
+    float* p = (float*)malloc(n * sizeof(float));
+    memset(p, 0, n * sizeof(float)); // the main thread touches everything
+    return p;
+}
+
+float* alloc_arena(Arena* arena, size_t n) {
+    float* p = (float*)arena_alloc(arena, n * sizeof(float));
+    arena_first_touch(p, n * sizeof(float));
+    return p;
+}
+
+// ----------------------------------------------------------------------------
+// the access patterns
+
+void adamw(float* params, const float* grads, float* m, float* v, size_t n) {
+    // as gpt2_update: one contiguous range per thread
+    size_t nt = num_threads();
+    size_t chunk = (n + nt - 1) / nt;
+    chunk = (chunk + REDUCE_BLOCK - 1) / REDUCE_BLOCK * REDUCE_BLOCK;
+    #pragma omp parallel for schedule(static, chunk)
+    for (size_t i = 0; i < n; i++) {
+        float g = grads[i];
+        float mi = 0.9f * m[i] + 0.1f * g;
+        float vi = 0.999f * v[i] + 0.001f * g * g;
+        m[i] = mi;
+        v[i] = vi;
+        params[i] -= 1e-4f * (mi / (sqrtf(vi) + 1e-8f) + 0.01f * params[i]);
+    }
+}
+
+float gather(const float* table, const int* ids, int num_ids, float* out) {
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < num_ids; i++) {
+        const float* row = table + (size_t)ids[i] * C;
+        float* o = out + (size_t)i * C;
+        for (int c = 0; c < C; c++) { o[c] += row[c]; }
+    }
+    return out[0];
+}
+
+float page_walk(const float* buf, const size_t* order, size_t num_pages) {
+    float sum = 0.0f;
+    #pragma omp parallel for schedule(static) reduction(+:sum)
+    for (size_t i = 0; i < num_pages; i++) {
+        sum += buf[order[i] * (ARENA_PAGE / sizeof(float))];
+    }
+    return sum;
+}
+
+// ----------------------------------------------------------------------------
+
+typedef struct { double ms; long long tlb; } Measurement;
+
+int tlb_fd = -1;
+
+void report(const char* label, Measurement* m) {
+    printf("  %-10s %9.2f ms", label, m->ms);
+    if (m->tlb >= 0) { printf("  %12lld dTLB misses", m->tlb); } else { printf("  %12s dTLB misses", "n/a"); }
+    printf("\n");
+}
+
+#define MEASURE(result, call) do { \
+    double best = 1e30; long long best_tlb = -1; \
+    for (int rep = 0; rep < REPEATS; rep++) { \
+        if (tlb_fd >= 0) { ioctl(tlb_fd, PERF_EVENT_IOC_RESET, 0); ioctl(tlb_fd, PERF_EVENT_IOC_ENABLE, 0); } \
+        double t0 = now(); \
+        call; \
+        double t = now() - t0; \
+        if (tlb_fd >= 0) { ioctl(tlb_fd, PERF_EVENT_IOC_DISABLE, 0); } \
+        if (t < best) { best = t; best_tlb = tlb_counter_read(tlb_fd); } \
+    } \
+    (result).ms = best * 1e3; (result).tlb = best_tlb; \
+} while (0)
+
+int main(int argc, char** argv) {
+    size_t n = argc > 1 ? (size_t)atoll(argv[1]) : (size_t)32 * 1024 * 1024;
+    int num_ids = 4 * 1024; // B*T = 4 * 1024
+    size_t num_pages = n * sizeof(float) / ARENA_PAGE;
+    srand(1337);
+    int* ids = (int*)malloc(num_ids * sizeof(int));
+    for (int i = 0; i < num_ids; i++) { ids[i] = rand() % V; }
+    size_t* order = (size_t*)malloc(num_pages * sizeof(size_t));
+    for (size_t i = 0; i < num_pages; i++) { order[i] = i; }
+    for (size_t i = num_pages - 1; i > 0; i--) {
+        size_t j = ((size_t)rand() * RAND_MAX + rand()) % (i + 1);
+        size_t tmp = order[i]; order[i] = order[j]; order[j] = tmp;
+    }
+    float* out = (float*)calloc((size_t)num_ids * C, sizeof(float));
+
+    tlb_fd = tlb_counter_open();
+    int nodes = num_numa_nodes();
+    printf("%zu parameters (%.0f MB per buffer), %d threads, %d NUMA node(s), dTLB counter %s\n",
+           n, n * sizeof(float) / 1e6, num_threads(), nodes, tlb_fd >= 0 ? "available" : "not available");
+    FILE* thp = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (thp != NULL) {
+        char line[128];
+        if (fgets(line, sizeof(line), thp) != NULL) { printf("transparent huge pages: %s", line); }
+        fclose(thp);
+    }
+
+    for (int version = 1; version <= 2; version++) {
+        Arena arena;
+        arena_init(&arena);
+        float *params, *grads, *m, *v, *table;
+        if (version == 1) {
+            params = alloc_malloc(n); grads = alloc_malloc(n); m = alloc_malloc(n); v = alloc_malloc(n);
+            table = alloc_malloc((size_t)V * C);
+        } else {
+            params = alloc_arena(&arena, n); grads = alloc_arena(&arena, n); m = alloc_arena(&arena, n); v = alloc_arena(&arena, n);
+            table = alloc_arena(&arena, (size_t)V * C);
+        }
+        for (size_t i = 0; i < n; i += 1024) { grads[i] = 1e-3f; }
+
+        Measurement r_adamw, r_gather, r_walk;
+        float sink = 0.0f;
+        MEASURE(r_adamw, adamw(params, grads, m, v, n));
+        MEASURE(r_gather, sink += gather(table, ids, num_ids, out));
+        MEASURE(r_walk, sink += page_walk(params, order, num_pages));
+
+        printf("%d) %s\n", version, version == 1 ? "malloc, touched by the main thread" : "arena, 2 MB pages, parallel first touch");
+        report("adamw", &r_adamw);
+        report("gather", &r_gather);
+        report("page walk", &r_walk);
+        // neighbouring mappings are merged, so measure all buffers together and clip
+        size_t total = (4 * n + (size_t)V * C) * sizeof(float);
+        long long huge = 0;
+        float* buffers[5] = {params, grads, m, v, table};
+        size_t sizes[5] = {n, n, n, n, (size_t)V * C};
+        for (int b = 0; b < 5 && huge >= 0; b++) {
+            long long h = huge_page_bytes(buffers[b], sizes[b] * sizeof(float));
+            huge = h < 0 ? -1 : huge + (h < (long long)(sizes[b] * sizeof(float)) ? h : (long long)(sizes[b] * sizeof(float)));
+        }
+        if (huge >= 0) { printf("  on 2 MB pages: %.0f%% of %.0f MB\n", 100.0 * huge / total, total / 1e6); }
+        if (nodes > 1) {
+            double local = local_page_fraction(params, n * sizeof(float));
+            printf("  params pages on the node of the thread that updates them: %.0f%%\n", 100.0 * local);
+        }
+        if (sink == 12345.0f) { printf("%f\n", sink); }
+
+        if (version == 1) {
+            free(params); free(grads); free(m); free(v); free(table);
+        } else {
+            arena_free(&arena);
+        }
+    }
+    free(ids);
+    free(order);
+    free(out);
+    return 0;
+}
@@ -0,0 +1,269 @@
+/*
+CPU benchmark for the load balance of causal attention across OpenMP threads.
+
+Because of the causal mask, query row t of attention attends to t+1 keys, so the
+work per row grows linearly with t. Kernel 0 splits (b, t, h) statically over the
+threads, as train_gpt2.c used to do: the threads that get early rows finish long
+before the ones that get late rows. Kernel 1 pairs row t with row T-1-t, so that
+every iteration costs the same T+1 dot products, as train_gpt2.c now does. The
+backward is run the same way, by rows (dquery) and then by columns (dkey, dvalue).
+
+For each kernel we report the busy time of every thread and the imbalance,
+max / mean of the per-thread busy times (1.0 is perfect balance).
+*/
+
+// Compile Examples:
+//
+//      gcc -Ofast -march=native -fopenmp attention_balance.c -lm -o attention_balance
+//      OMP_NUM_THREADS=8 ./attention_balance
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <omp.h>
+
+// ----------------------------------------------------------------------------
+// per-row and per-column pieces of attention, same as in train_gpt2.c
+
+void attention_forward_row(float* out, float* preatt, float* att, const float* inp,
+                           int b, int t, int h, int T, int C, int NH) {
+    int C3 = C*3;
+    int hs = C / NH;
+    float scale = 1.0 / sqrtf(hs);
+    const float* query_t = inp + b * T * C3 + t * C3 + h * hs;
+    float* preatt_bth = preatt + b*NH*T*T + h*T*T + t*T;
+    float* att_bth = att + b*NH*T*T + h*T*T + t*T;
+    float maxval = -10000.0f;
+    for (int t2 = 0; t2 <= t; t2++) {
+        const float* key_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C;
+        float val = 0.0f;
+        for (int i = 0; i < hs; i++) { val += query_t[i] * key_t2[i]; }
+        val *= scale;
+        if (val > maxval) { maxval = val; }
+        preatt_bth[t2] = val;
+    }
+    float expsum = 0.0f;
+    for (int t2 = 0; t2 <= t; t2++) {
+        float expv = expf(preatt_bth[t2] - maxval);
+        expsum += expv;
+        att_bth[t2] = expv;
+    }
+    float expsum_inv = expsum == 0.0f ? 0.0f : 1.0f / expsum;
+    for (int t2 = 0; t2 < T; t2++) { att_bth[t2] = t2 <= t ? att_bth[t2] * expsum_inv : 0.0f; }
+    float* out_bth = out + b * T * C + t * C + h * hs;
+    for (int i = 0; i < hs; i++) { out_bth[i] = 0.0f; }
+    for (int t2 = 0; t2 <= t; t2++) {
+        const float* value_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C*2;
+        for (int i = 0; i < hs; i++) { out_bth[i] += att_bth[t2] * value_t2[i]; }
+    }
+}
+
+void attention_backward_row(float* dinp, float* dpreatt, float* datt, const float* dout,
+                            const float* inp, const float* att, int b, int t, int h, int T, int C, int NH) {
+    int C3 = C*3;
+    int hs = C / NH;
+    float scale = 1.f / sqrtf(hs);
+    const float* att_bth = att + b*NH*T*T + h*T*T + t*T;
+    float* datt_bth = datt + b*NH*T*T + h*T*T + t*T;
+    float* dpreatt_bth = dpreatt + b*NH*T*T + h*T*T + t*T;
+    float* dquery_t = dinp + b * T * C3 + t * C3 + h * hs;
+    const float* dout_bth = dout + b * T * C + t * C + h * hs;
+    for (int t2 = 0; t2 <= t; t2++) {
+        const float* value_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C*2;
+        for (int i = 0; i < hs; i++) { datt_bth[t2] += value_t2[i] * dout_bth[i]; }
+    }
+    float dot = 0.0f;
+    for (int t2 = 0; t2 <= t; t2++) { dot += att_bth[t2] * datt_bth[t2]; }
+    for (int t3 = 0; t3 <= t; t3++) { dpreatt_bth[t3] += att_bth[t3] * (datt_bth[t3] - dot); }
+    for (int t2 = 0; t2 <= t; t2++) {
+        const float* key_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C;
+        for (int i = 0; i < hs; i++) { dquery_t[i] += key_t2[i] * dpreatt_bth[t2] * scale; }
+    }
+}
+
+void attention_backward_col(float* dinp, const float* dpreatt, const float* dout,
+                            const float* inp, const float* att, int b, int t2, int h, int T, int C, int NH) {
+    int C3 = C*3;
+    int hs = C / NH;
+    float scale = 1.f / sqrtf(hs);
+    float* dkey_t2 = dinp + b * T * C3 + t2 * C3 + h * hs + C;
+    float* dvalue_t2 = dinp + b * T * C3 + t2 * C3 + h * hs + C*2;
+    for (int t = t2; t < T; t++) {
+        float a = att[b*NH*T*T + h*T*T + t*T + t2];
+        float dp = dpreatt[b*NH*T*T + h*T*T + t*T + t2];
+        const float* query_t = inp + b * T * C3 + t * C3 + h * hs;
+        const float* dout_bth = dout + b * T * C + t * C + h * hs;
+        for (int i = 0; i < hs; i++) {
+            dvalue_t2[i] += a * dout_bth[i];
+            dkey_t2[i] += query_t[i] * dp * scale;
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+// the two schedules. every thread records the time it spent in its share of the
+// loops (nowait, so waiting at the barrier is not counted as busy time)
+
+typedef struct {
+    float *inp, *out, *preatt, *att;
+    float *dinp, *dout, *dpreatt, *datt;
+    int B, T, C, NH;
+} Attention;
+
+void forward_kernel(int kernel_num, Attention* a, double* busy) {
+    int B = a->B, T = a->T, C = a->C, NH = a->NH;
+    #pragma omp parallel
+    {
+        double start = omp_get_wtime();
+        if (kernel_num == 0) {
+            #pragma omp for collapse(3) nowait
+            for (int b = 0; b < B; b++) {
+                for (int t = 0; t < T; t++) {
+                    for (int h = 0; h < NH; h++) {
+                        attention_forward_row(a->out, a->preatt, a->att, a->inp, b, t, h, T, C, NH);
+                    }
+                }
+            }
+        } else {
+            int num_pairs = (T + 1) / 2;
+            #pragma omp for collapse(3) nowait
+            for (int b = 0; b < B; b++) {
+                for (int h = 0; h < NH; h++) {
+                    for (int p = 0; p < num_pairs; p++) {
+                        attention_forward_row(a->out, a->preatt, a->att, a->inp, b, p, h, T, C, NH);
+                        if (T-1-p != p) { attention_forward_row(a->out, a->preatt, a->att, a->inp, b, T-1-p, h, T, C, NH); }
+                    }
+                }
+            }
+        }
+        busy[omp_get_thread_num()] += omp_get_wtime() - start;
+    }
+}
+
+void backward_kernel(int kernel_num, Attention* a, double* busy) {
+    int B = a->B, T = a->T, C = a->C, NH = a->NH;
+    #pragma omp parallel
+    {
+        double start = omp_get_wtime();
+        double busy_rows = 0.0;
+        if (kernel_num == 0) {
+            #pragma omp for collapse(3) nowait
+            for (int b = 0; b < B; b++) {
+                for (int t = 0; t < T; t++) {
+                    for (int h = 0; h < NH; h++) {
+                        attention_backward_row(a->dinp, a->dpreatt, a->datt, a->dout, a->inp, a->att, b, t, h, T, C, NH);
+                    }
+                }
+            }
+            busy_rows = omp_get_wtime() - start;
+            #pragma omp barrier
+            start = omp_get_wtime();
+            #pragma omp for collapse(3) nowait
+            for (int b = 0; b < B; b++) {
+                for (int t2 = 0; t2 < T; t2++) {
+                    for (int h = 0; h < NH; h++) {
+                        attention_backward_col(a->dinp, a->dpreatt, a->dout, a->inp, a->att, b, t2, h, T, C, NH);
+                    }
+                }
+            }
+        } else {
+            int num_pairs = (T + 1) / 2;
+            #pragma omp for collapse(3) nowait
+            for (int b = 0; b < B; b++) {
+                for (int h = 0; h < NH; h++) {
+                    for (int p = 0; p < num_pairs; p++) {
+                        attention_backward_row(a->dinp, a->dpreatt, a->datt, a->dout, a->inp, a->att, b, p, h, T, C, NH);
+                        if (T-1-p != p) { attention_backward_row(a->dinp, a->dpreatt, a->datt, a->dout, a->inp, a->att, b, T-1-p, h, T, C, NH); }
+                    }
+                }
+            }
+            busy_rows = omp_get_wtime() - start;
+            #pragma omp barrier
+            start = omp_get_wtime();
+            #pragma omp for collapse(3) nowait
+            for (int b = 0; b < B; b++) {
+                for (int h = 0; h < NH; h++) {
+                    for (int p = 0; p < num_pairs; p++) {
+                        attention_backward_col(a->dinp, a->dpreatt, a->dout, a->inp, a->att, b, p, h, T, C, NH);
+                        if (T-1-p != p) { attention_backward_col(a->dinp, a->dpreatt, a->dout, a->inp, a->att, b, T-1-p, h, T, C, NH); }
+                    }
+                }
+            }
+        }
+        busy[omp_get_thread_num()] += busy_rows + omp_get_wtime() - start;
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+float* make_random_float(size_t N) {
+    float* arr = (float*)malloc(N * sizeof(float));
+    for (size_t i = 0; i < N; i++) {
+        arr[i] = ((float)rand() / RAND_MAX) * 2.0 - 1.0; // range -1..1
+    }
+    return arr;
+}
+
+float* make_zeros_float(size_t N) {
+    return (float*)calloc(N, sizeof(float));
+}
+
+void report(const char* name, int kernel_num, double* busy, int num_threads, int runs) {
+    double max = 0.0, mean = 0.0, min = 1e30;
+    for (int i = 0; i < num_threads; i++) {
+        double t = busy[i] / runs;
+        if (t > max) { max = t; }
+        if (t < min) { min = t; }
+        mean += t / num_threads;
+    }
+    printf("%s kernel #%d: per-thread busy time min %8.3f ms, mean %8.3f ms, max %8.3f ms, imbalance (max/mean) %.3f\n",
+           name, kernel_num, min * 1000, mean * 1000, max * 1000, max / mean);
+    if (num_threads <= 16) {
+        printf("    per thread (ms):");
+        for (int i = 0; i < num_threads; i++) { printf(" %.2f", busy[i] / runs * 1000); }
+        printf("\n");
+    }
+}
+
+int main(int argc, char **argv) {
+    srand(0);
+
+    Attention a;
+    a.B = 1;
+    a.T = 1024;
+    a.C = 768;
+    a.NH = 12;
+    int RUNS = 3;
+    int B = a.B, T = a.T, C = a.C, NH = a.NH;
+    int num_threads = omp_get_max_threads();
+    printf("B=%d T=%d C=%d NH=%d, OpenMP threads: %d\n", B, T, C, NH, num_threads);
+
+    a.inp = make_random_float((size_t)B * T * 3 * C);
+    a.dout = make_random_float((size_t)B * T * C);
+    a.out = make_zeros_float((size_t)B * T * C);
+    a.preatt = make_zeros_float((size_t)B * NH * T * T);
+    a.att = make_zeros_float((size_t)B * NH * T * T);
+    a.dinp = make_zeros_float((size_t)B * T * 3 * C);
+    a.dpreatt = make_zeros_float((size_t)B * NH * T * T);
+    a.datt = make_zeros_float((size_t)B * NH * T * T);
+
+    double* busy = (double*)calloc(num_threads, sizeof(double));
+    for (int kernel_num = 0; kernel_num < 2; kernel_num++) {
+        for (int i = 0; i < num_threads; i++) { busy[i] = 0.0; }
+        for (int r = 0; r < RUNS; r++) { forward_kernel(kernel_num, &a, busy); }
+        report("forward ", kernel_num, busy, num_threads, RUNS);
+    }
+    for (int kernel_num = 0; kernel_num < 2; kernel_num++) {
+        for (int i = 0; i < num_threads; i++) { busy[i] = 0.0; }
+        for (int r = 0; r < RUNS; r++) { backward_kernel(kernel_num, &a, busy); }
+        report("backward", kernel_num, busy, num_threads, RUNS);
+    }
+
+    free(busy);
+    free(a.inp); free(a.dout); free(a.out); free(a.preatt); free(a.att);
+    free(a.dinp); free(a.dpreatt); free(a.datt);
+    return 0;
+}
@@ -0,0 +1,444 @@
+/*
+CPU benchmark of attention as per-head matrix products vs the old per-row dot products.
+
+Kernel 0 is the previous attention of train_gpt2.c: one query row at a time, with a
+separate dot product per (t, t2) for query @ key^T, and att @ value accumulated row by row.
+Kernel 1 is the current one: tiles of ATTENTION_TILE query rows, where the scores are
+computed 4 keys at a time per query row, the products with att (att @ value, and in the
+backward dpreatt @ key, dpreatt^T @ query, att^T @ dout) accumulate an
+(ATTENTION_TILE, ATTENTION_CHUNK) block in registers, and the tiles above the causal
+diagonal are skipped. The backward is timed the same way.
+
+Both are run on the head-major qkv layout. We report the time and the GFLOP/s of the
+causal products, next to the GFLOP/s of matmul_forward (the tiled matmul of train_gpt2.c)
+on a (T, C) x (C, C) problem, which is what attention should keep up with as T grows.
+*/
+
+// Compile Examples:
+//
+//      gcc -Ofast -march=native -fopenmp attention_gemm.c -lm -o attention_gemm
+//      OMP_NUM_THREADS=8 ./attention_gemm
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+// defines: fast_expf, as train_gpt2.c uses for the softmax
+#include "../../llmc/fastmath.h"
+
+// ----------------------------------------------------------------------------
+// kernel 0: per row, as train_gpt2.c used to do (head-major layout)
+
+void attention_forward_row(float* out, float* preatt, float* att, const float* inp,
+                           int b, int t, int h, int T, int C, int NH) {
+    int hs = C / NH;
+    float scale = 1.0 / sqrtf(hs);
+    const float* query_t = inp + b * T * 3 * C + h * T * hs + t * hs;
+    const float* key = inp + b * T * 3 * C + (NH + h) * T * hs;
+    const float* value = inp + b * T * 3 * C + (2 * NH + h) * T * hs;
+    float* preatt_bth = preatt + b*NH*T*T + h*T*T + t*T;
+    float* att_bth = att + b*NH*T*T + h*T*T + t*T;
+    float maxval = -10000.0f;
+    for (int t2 = 0; t2 <= t; t2++) {
+        const float* key_t2 = key + t2 * hs;
+        float val = 0.0f;
+        for (int i = 0; i < hs; i++) { val += query_t[i] * key_t2[i]; }
+        val *= scale;
+        if (val > maxval) { maxval = val; }
+        preatt_bth[t2] = val;
+    }
+    float expsum = 0.0f;
+    for (int t2 = 0; t2 <= t; t2++) {
+        float expv = fast_expf(preatt_bth[t2] - maxval);
+        expsum += expv;
+        att_bth[t2] = expv;
+    }
+    float expsum_inv = expsum == 0.0f ? 0.0f : 1.0f / expsum;
+    for (int t2 = 0; t2 < T; t2++) { att_bth[t2] = t2 <= t ? att_bth[t2] * expsum_inv : 0.0f; }
+    float* out_bth = out + b * T * C + t * C + h * hs;
+    for (int i = 0; i < hs; i++) { out_bth[i] = 0.0f; }
+    for (int t2 = 0; t2 <= t; t2++) {
+        const float* value_t2 = value + t2 * hs;
+        for (int i = 0; i < hs; i++) { out_bth[i] += att_bth[t2] * value_t2[i]; }
+    }
+}
+
+void attention_backward_row(float* dinp, float* dpreatt, float* datt, const float* dout,
+                            const float* inp, const float* att, int b, int t, int h, int T, int C, int NH) {
+    int hs = C / NH;
+    float scale = 1.f / sqrtf(hs);
+    const float* key = inp + b * T * 3 * C + (NH + h) * T * hs;
+    const float* value = inp + b * T * 3 * C + (2 * NH + h) * T * hs;
+    const float* att_bth = att + b*NH*T*T + h*T*T + t*T;
+    float* datt_bth = datt + b*NH*T*T + h*T*T + t*T;
+    float* dpreatt_bth = dpreatt + b*NH*T*T + h*T*T + t*T;
+    float* dquery_t = dinp + b * T * 3 * C + h * T * hs + t * hs;
+    const float* dout_bth = dout + b * T * C + t * C + h * hs;
+    for (int t2 = 0; t2 <= t; t2++) {
+        const float* value_t2 = value + t2 * hs;
+        for (int i = 0; i < hs; i++) { datt_bth[t2] += value_t2[i] * dout_bth[i]; }
+    }
+    float dot = 0.0f;
+    for (int t2 = 0; t2 <= t; t2++) { dot += att_bth[t2] * datt_bth[t2]; }
+    for (int t3 = 0; t3 <= t; t3++) { dpreatt_bth[t3] += att_bth[t3] * (datt_bth[t3] - dot); }
+    for (int t2 = 0; t2 <= t; t2++) {
+        const float* key_t2 = key + t2 * hs;
+        for (int i = 0; i < hs; i++) { dquery_t[i] += key_t2[i] * dpreatt_bth[t2] * scale; }
+    }
+}
+
+void attention_backward_col(float* dinp, const float* dpreatt, const float* dout,
+                            const float* inp, const float* att, int b, int t2, int h, int T, int C, int NH) {
+    int hs = C / NH;
+    float scale = 1.f / sqrtf(hs);
+    float* dkey_t2 = dinp + b * T * 3 * C + (NH + h) * T * hs + t2 * hs;
+    float* dvalue_t2 = dinp + b * T * 3 * C + (2 * NH + h) * T * hs + t2 * hs;
+    const float* query = inp + b * T * 3 * C + h * T * hs;
+    for (int t = t2; t < T; t++) {
+        float a = att[b*NH*T*T + h*T*T + t*T + t2];
+        float dp = dpreatt[b*NH*T*T + h*T*T + t*T + t2];
+        const float* query_t = query + t * hs;
+        const float* dout_bth = dout + b * T * C + t * C + h * hs;
+        for (int i = 0; i < hs; i++) {
+            dvalue_t2[i] += a * dout_bth[i];
+            dkey_t2[i] += query_t[i] * dp * scale;
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+// kernel 1: tiles of rows as matrix products, same as in train_gpt2.c
+
+#define ATTENTION_TILE 8
+#define ATTENTION_CHUNK 16
+#define ATTENTION_MASK_LOWER 0
+#define ATTENTION_MASK_UPPER 1
+
+// c[i, j] (+)= alpha * (a[i, :n] . b[j, :n]) for the rows i0 <= i < i1 and the unmasked
+// columns j <= i, e.g. the query @ key^T scores. Row i of a is at a + i * lda, etc.
+void attention_matmul_nt(float* c, int ldc, const float* a, int lda, const float* b, int ldb,
+                         int i0, int i1, int n, float alpha, int accumulate) {
+    // left of the diagonal tile, in groups of 4 columns, so that every load of a
+    // feeds 4 dot products
+    int j_full = i0 - i0 % 4;
+    for (int j = 0; j < j_full; j += 4) {
+        const float* b0 = b + j * ldb;
+        const float* b1 = b0 + ldb;
+        const float* b2 = b1 + ldb;
+        const float* b3 = b2 + ldb;
+        for (int i = i0; i < i1; i++) {
+            const float* a_i = a + i * lda;
+            float v0 = 0.0f, v1 = 0.0f, v2 = 0.0f, v3 = 0.0f;
+            #pragma omp simd reduction(+:v0, v1, v2, v3)
+            for (int k = 0; k < n; k++) {
+                float x = a_i[k];
+                v0 += x * b0[k];
+                v1 += x * b1[k];
+                v2 += x * b2[k];
+                v3 += x * b3[k];
+            }
+            float* c_ij = c + i * ldc + j;
+            c_ij[0] = (accumulate ? c_ij[0] : 0.0f) + alpha * v0;
+            c_ij[1] = (accumulate ? c_ij[1] : 0.0f) + alpha * v1;
+            c_ij[2] = (accumulate ? c_ij[2] : 0.0f) + alpha * v2;
+            c_ij[3] = (accumulate ? c_ij[3] : 0.0f) + alpha * v3;
+        }
+    }
+    // the rest, one column at a time, up to the diagonal
+    for (int j = j_full; j < i1; j++) {
+        const float* b_j = b + j * ldb;
+        for (int i = (j > i0 ? j : i0); i < i1; i++) {
+            const float* a_i = a + i * lda;
+            float val = 0.0f;
+            #pragma omp simd reduction(+:val)
+            for (int k = 0; k < n; k++) {
+                val += a_i[k] * b_j[k];
+            }
+            c[i * ldc + j] = (accumulate ? c[i * ldc + j] : 0.0f) + alpha * val;
+        }
+    }
+}
+
+// c[i, :n] (+)= alpha * sum_j a(i, j) * b[j, :n] for the rows i0 <= i < i1, where the sum
+// runs over the j < N that the mask allows, and a(i, j) = a[i * a_row + j * a_col] so that
+// a can also be a transpose, e.g. att @ value (mask lower) and att^T @ dout (mask upper)
+void attention_matmul_nn(float* c, int ldc, const float* a, int a_row, int a_col,
+                         const float* b, int ldb, int i0, int i1, int N, int n,
+                         float alpha, int mask, int accumulate) {
+    // the j where all the rows of the tile are unmasked, and the diagonal tile j in [i0, i1)
+    int full_start = mask == ATTENTION_MASK_UPPER ? i1 : 0;
+    int full_end = mask == ATTENTION_MASK_LOWER ? i0 : N;
+    int rows = i1 - i0;
+    for (int k0 = 0; k0 < n; k0 += ATTENTION_CHUNK) {
+        int kc = n - k0 < ATTENTION_CHUNK ? n - k0 : ATTENTION_CHUNK;
+        // the (ATTENTION_TILE, ATTENTION_CHUNK) block of c is accumulated in registers,
+        // and every row chunk of b is loaded once for all the rows of the tile
+        float acc[ATTENTION_TILE][ATTENTION_CHUNK];
+        for (int r = 0; r < ATTENTION_TILE; r++) {
+            for (int k = 0; k < ATTENTION_CHUNK; k++) { acc[r][k] = 0.0f; }
+        }
+        if (rows == ATTENTION_TILE && kc == ATTENTION_CHUNK) {
+            // the fast path, with compile time trip counts
+            for (int j = full_start; j < full_end; j++) {
+                const float* b_j = b + j * ldb + k0;
+                for (int r = 0; r < ATTENTION_TILE; r++) {
+                    float a_ij = a[(i0 + r) * a_row + j * a_col];
+                    #pragma omp simd
+                    for (int k = 0; k < ATTENTION_CHUNK; k++) {
+                        acc[r][k] += a_ij * b_j[k];
+                    }
+                }
+            }
+        } else {
+            for (int j = full_start; j < full_end; j++) {
+                const float* b_j = b + j * ldb + k0;
+                for (int r = 0; r < rows; r++) {
+                    float a_ij = a[(i0 + r) * a_row + j * a_col];
+                    for (int k = 0; k < kc; k++) {
+                        acc[r][k] += a_ij * b_j[k];
+                    }
+                }
+            }
+        }
+        // the diagonal tile, masked per element
+        for (int j = i0; j < i1 && j < N; j++) {
+            const float* b_j = b + j * ldb + k0;
+            for (int r = 0; r < rows; r++) {
+                int i = i0 + r;
+                if (mask == ATTENTION_MASK_LOWER ? j > i : j < i) { continue; }
+                float a_ij = a[i * a_row + j * a_col];
+                for (int k = 0; k < kc; k++) {
+                    acc[r][k] += a_ij * b_j[k];
+                }
+            }
+        }
+        for (int r = 0; r < rows; r++) {
+            float* c_i = c + (i0 + r) * ldc + k0;
+            for (int k = 0; k < kc; k++) {
+                c_i[k] = (accumulate ? c_i[k] : 0.0f) + alpha * acc[r][k];
+            }
+        }
+    }
+}
+
+void attention_forward_tile(float* out, float* preatt, float* att, const float* inp,
+                            int b, int tile, int h, int T, int C, int NH) {
+    int hs = C / NH;
+    float scale = 1.0 / sqrtf(hs);
+    int i0 = tile * ATTENTION_TILE;
+    int i1 = i0 + ATTENTION_TILE < T ? i0 + ATTENTION_TILE : T;
+    const float* query = inp + b * T * 3 * C + h * T * hs;
+    const float* key = inp + b * T * 3 * C + (NH + h) * T * hs;
+    const float* value = inp + b * T * 3 * C + (2 * NH + h) * T * hs;
+    float* preatt_bh = preatt + b*NH*T*T + h*T*T;
+    float* att_bh = att + b*NH*T*T + h*T*T;
+    attention_matmul_nt(preatt_bh, T, query, hs, key, hs, i0, i1, hs, scale, 0);
+    for (int t = i0; t < i1; t++) {
+        float* preatt_bth = preatt_bh + t*T;
+        float* att_bth = att_bh + t*T;
+        float maxval = -10000.0f;
+        for (int t2 = 0; t2 <= t; t2++) { if (preatt_bth[t2] > maxval) { maxval = preatt_bth[t2]; } }
+        float expsum = 0.0f;
+        for (int t2 = 0; t2 <= t; t2++) {
+            float expv = fast_expf(preatt_bth[t2] - maxval);
+            expsum += expv;
+            att_bth[t2] = expv;
+        }
+        float expsum_inv = expsum == 0.0f ? 0.0f : 1.0f / expsum;
+        for (int t2 = 0; t2 < T; t2++) { att_bth[t2] = t2 <= t ? att_bth[t2] * expsum_inv : 0.0f; }
+    }
+    attention_matmul_nn(out + b * T * C + h * hs, C, att_bh, T, 1, value, hs, i0, i1, T, hs, 1.0f, ATTENTION_MASK_LOWER, 0);
+}
+
+void attention_backward_rows(float* dinp, float* dpreatt, float* datt, const float* dout,
+                             const float* inp, const float* att, int b, int tile, int h, int T, int C, int NH) {
+    int hs = C / NH;
+    float scale = 1.f / sqrtf(hs);
+    int i0 = tile * ATTENTION_TILE;
+    int i1 = i0 + ATTENTION_TILE < T ? i0 + ATTENTION_TILE : T;
+    const float* key = inp + b * T * 3 * C + (NH + h) * T * hs;
+    const float* value = inp + b * T * 3 * C + (2 * NH + h) * T * hs;
+    float* dquery = dinp + b * T * 3 * C + h * T * hs;
+    const float* att_bh = att + b*NH*T*T + h*T*T;
+    float* datt_bh = datt + b*NH*T*T + h*T*T;
+    float* dpreatt_bh = dpreatt + b*NH*T*T + h*T*T;
+    attention_matmul_nt(datt_bh, T, dout + b * T * C + h * hs, C, value, hs, i0, i1, hs, 1.0f, 1);
+    for (int t = i0; t < i1; t++) {
+        const float* att_bth = att_bh + t*T;
+        float* datt_bth = datt_bh + t*T;
+        float* dpreatt_bth = dpreatt_bh + t*T;
+        float dot = 0.0f;
+        for (int t2 = 0; t2 <= t; t2++) { dot += att_bth[t2] * datt_bth[t2]; }
+        for (int t3 = 0; t3 <= t; t3++) { dpreatt_bth[t3] += att_bth[t3] * (datt_bth[t3] - dot); }
+    }
+    attention_matmul_nn(dquery, hs, dpreatt_bh, T, 1, key, hs, i0, i1, T, hs, scale, ATTENTION_MASK_LOWER, 1);
+}
+
+void attention_backward_cols(float* dinp, const float* dpreatt, const float* dout,
+                             const float* inp, const float* att, int b, int tile, int h, int T, int C, int NH) {
+    int hs = C / NH;
+    float scale = 1.f / sqrtf(hs);
+    int j0 = tile * ATTENTION_TILE;
+    int j1 = j0 + ATTENTION_TILE < T ? j0 + ATTENTION_TILE : T;
+    const float* query = inp + b * T * 3 * C + h * T * hs;
+    float* dkey = dinp + b * T * 3 * C + (NH + h) * T * hs;
+    float* dvalue = dinp + b * T * 3 * C + (2 * NH + h) * T * hs;
+    attention_matmul_nn(dkey, hs, dpreatt + b*NH*T*T + h*T*T, 1, T, query, hs, j0, j1, T, hs, scale, ATTENTION_MASK_UPPER, 1);
+    attention_matmul_nn(dvalue, hs, att + b*NH*T*T + h*T*T, 1, T, dout + b * T * C + h * hs, C, j0, j1, T, hs, 1.0f, ATTENTION_MASK_UPPER, 1);
+}
+
+// ----------------------------------------------------------------------------
+// the passes, with the paired schedule of train_gpt2.c. unit = rows for kernel 0, tiles for 1
+
+void forward(int kernel_num, float* out, float* preatt, float* att, const float* inp, int B, int T, int C, int NH) {
+    int units = kernel_num == 0 ? T : (T + ATTENTION_TILE - 1) / ATTENTION_TILE;
+    int num_pairs = (units + 1) / 2;
+    #pragma omp parallel for collapse(3)
+    for (int b = 0; b < B; b++) {
+        for (int h = 0; h < NH; h++) {
+            for (int p = 0; p < num_pairs; p++) {
+                for (int k = 0; k < 2; k++) {
+                    int u = k == 0 ? p : units-1-p;
+                    if (k == 1 && u == p) { continue; }
+                    if (kernel_num == 0) { attention_forward_row(out, preatt, att, inp, b, u, h, T, C, NH); }
+                    else { attention_forward_tile(out, preatt, att, inp, b, u, h, T, C, NH); }
+                }
+            }
+        }
+    }
+}
+
+void backward(int kernel_num, float* dinp, float* dpreatt, float* datt, const float* dout,
+              const float* inp, const float* att, int B, int T, int C, int NH) {
+    int units = kernel_num == 0 ? T : (T + ATTENTION_TILE - 1) / ATTENTION_TILE;
+    int num_pairs = (units + 1) / 2;
+    #pragma omp parallel
+    {
+        #pragma omp for collapse(3)
+        for (int b = 0; b < B; b++) {
+            for (int h = 0; h < NH; h++) {
+                for (int p = 0; p < num_pairs; p++) {
+                    for (int k = 0; k < 2; k++) {
+                        int u = k == 0 ? p : units-1-p;
+                        if (k == 1 && u == p) { continue; }
+                        if (kernel_num == 0) { attention_backward_row(dinp, dpreatt, datt, dout, inp, att, b, u, h, T, C, NH); }
+                        else { attention_backward_rows(dinp, dpreatt, datt, dout, inp, att, b, u, h, T, C, NH); }
+                    }
+                }
+            }
+        }
+        #pragma omp for collapse(3)
+        for (int b = 0; b < B; b++) {
+            for (int h = 0; h < NH; h++) {
+                for (int p = 0; p < num_pairs; p++) {
+                    for (int k = 0; k < 2; k++) {
+                        int u = k == 0 ? p : units-1-p;
+                        if (k == 1 && u == p) { continue; }
+                        if (kernel_num == 0) { attention_backward_col(dinp, dpreatt, dout, inp, att, b, u, h, T, C, NH); }
+                        else { attention_backward_cols(dinp, dpreatt, dout, inp, att, b, u, h, T, C, NH); }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// the tiled matmul_forward of train_gpt2.c, as the reference for matmul throughput
+void matmul_forward(float* out, const float* inp, const float* weight, int BT, int C, int OC) {
+    #pragma omp parallel for
+    for (int obt = 0; obt < BT; obt += 8) {
+        for (int o = 0; o < OC; o++) {
+            float result[8] = {0};
+            for (int i = 0; i < C; i++) {
+                float w = weight[i + o * C];
+                for (int ibt = 0; ibt < 8; ibt++) { result[ibt] += inp[(obt + ibt) * C + i] * w; }
+            }
+            for (int ibt = 0; ibt < 8; ibt++) { out[(obt + ibt) * OC + o] = result[ibt]; }
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+float* make_random_float(size_t N) {
+    float* arr = (float*)malloc(N * sizeof(float));
+    for (size_t i = 0; i < N; i++) { arr[i] = ((float)rand() / RAND_MAX) * 2.0f - 1.0f; }
+    return arr;
+}
+
+float max_abs_diff(const float* a, const float* b, size_t n) {
+    float m = 0.0f;
+    for (size_t i = 0; i < n; i++) { float d = fabsf(a[i] - b[i]); m = d > m ? d : m; }
+    return m;
+}
+
+int main(int argc, char **argv) {
+    srand(0);
+    int B = 1;
+    int C = 768;
+    int NH = 12;
+    int hs = C / NH;
+    int Ts[4] = {64, 256, 512, 1024};
+    int repeats = 3;
+    printf("threads: %d, B = %d, C = %d, NH = %d\n", omp_get_max_threads(), B, C, NH);
+
+    for (int k = 0; k < 4; k++) {
+        int T = Ts[k];
+        size_t nqkv = (size_t)B * T * 3 * C;
+        size_t natt = (size_t)B * NH * T * T;
+        float* inp = make_random_float(nqkv);
+        float* dout = make_random_float((size_t)B * T * C);
+        float* weight = make_random_float((size_t)C * C);
+        float* mm_out = (float*)malloc((size_t)B * T * C * sizeof(float));
+        float* preatt = (float*)malloc(natt * sizeof(float));
+        float* att = (float*)malloc(natt * sizeof(float));
+        float* dpreatt = (float*)malloc(natt * sizeof(float));
+        float* datt = (float*)malloc(natt * sizeof(float));
+        float* out[2];
+        float* dinp[2];
+        double fwd_ms[2], bwd_ms[2];
+        for (int kernel_num = 0; kernel_num < 2; kernel_num++) {
+            out[kernel_num] = (float*)malloc((size_t)B * T * C * sizeof(float));
+            dinp[kernel_num] = (float*)malloc(nqkv * sizeof(float));
+            fwd_ms[kernel_num] = 1e30;
+            bwd_ms[kernel_num] = 1e30;
+            for (int r = 0; r < repeats; r++) {
+                memset(dinp[kernel_num], 0, nqkv * sizeof(float));
+                memset(dpreatt, 0, natt * sizeof(float));
+                memset(datt, 0, natt * sizeof(float));
+                double t0 = omp_get_wtime();
+                forward(kernel_num, out[kernel_num], preatt, att, inp, B, T, C, NH);
+                double t1 = omp_get_wtime();
+                backward(kernel_num, dinp[kernel_num], dpreatt, datt, dout, inp, att, B, T, C, NH);
+                double t2 = omp_get_wtime();
+                if ((t1 - t0) * 1e3 < fwd_ms[kernel_num]) { fwd_ms[kernel_num] = (t1 - t0) * 1e3; }
+                if ((t2 - t1) * 1e3 < bwd_ms[kernel_num]) { bwd_ms[kernel_num] = (t2 - t1) * 1e3; }
+            }
+        }
+        double mm_ms = 1e30;
+        for (int r = 0; r < repeats; r++) {
+            double t0 = omp_get_wtime();
+            matmul_forward(mm_out, inp, weight, B * T, C, C);
+            double t1 = omp_get_wtime();
+            if ((t1 - t0) * 1e3 < mm_ms) { mm_ms = (t1 - t0) * 1e3; }
+        }
+        // multiply-adds of the causal products: the forward has 2 (scores, att @ value),
+        // the backward 4, each over T(T+1)/2 positions of hs per head
+        double fwd_flops = 2.0 * 2.0 * B * NH * (T * (T + 1) / 2.0) * hs;
+        double bwd_flops = 2.0 * fwd_flops;
+        double mm_flops = 2.0 * B * T * C * C;
+        printf("T = %4d | per row: fwd %8.2f ms (%5.1f GFLOP/s), bwd %8.2f ms (%5.1f GFLOP/s)"
+               " | tiled: fwd %8.2f ms (%5.1f GFLOP/s), bwd %8.2f ms (%5.1f GFLOP/s)"
+               " | matmul_forward %5.1f GFLOP/s | max diff out %.2e dinp %.2e\n",
+               T, fwd_ms[0], fwd_flops / fwd_ms[0] * 1e-6, bwd_ms[0], bwd_flops / bwd_ms[0] * 1e-6,
+               fwd_ms[1], fwd_flops / fwd_ms[1] * 1e-6, bwd_ms[1], bwd_flops / bwd_ms[1] * 1e-6,
+               mm_flops / mm_ms * 1e-6,
+               max_abs_diff(out[0], out[1], (size_t)B * T * C), max_abs_diff(dinp[0], dinp[1], nqkv));
+        free(inp); free(dout); free(weight); free(mm_out);
+        free(preatt); free(att); free(dpreatt); free(datt);
+        for (int i = 0; i < 2; i++) { free(out[i]); free(dinp[i]); }
+    }
+    return 0;
+}
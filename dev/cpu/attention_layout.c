@@ -0,0 +1,246 @@
+/*
+CPU benchmark of the QKV layout that attention reads from.
+
+The QKV matmul naturally writes (B, T, 3C): at every position the query, key and value
+vectors of all heads, interleaved. Attention for one head then reads its keys and values
+3C floats apart, one hs-float vector per 9 KB (GPT-2 small) stride, so every key is a new
+page region for the prefetchers and the TLB. Kernel 0 reads that interleaved layout, as
+train_gpt2.c used to. Kernel 1 reads the head-major layout (B, 3, NH, T, hs) that
+train_gpt2.c now has the QKV matmul write directly, where the T keys of a head are
+contiguous. The arithmetic is identical, so the two must agree bitwise, which we check.
+
+We time the forward and the backward pass (rows, then columns, as in train_gpt2.c) at
+T = 256 and T = 1024.
+*/
+
+// Compile Examples:
+//
+//      gcc -Ofast -march=native -fopenmp attention_layout.c -lm -o attention_layout
+//      OMP_NUM_THREADS=8 ./attention_layout
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+
+// ----------------------------------------------------------------------------
+// attention, as in train_gpt2.c, for both layouts
+
+int qkv_offset(int head_major, int b, int t, int qkv, int h, int T, int C, int NH) {
+    int hs = C / NH;
+    if (head_major) { return b * T * 3 * C + (qkv * NH + h) * T * hs + t * hs; }
+    return b * T * 3 * C + t * 3 * C + qkv * C + h * hs;
+}
+
+void attention_forward_row(float* out, float* preatt, float* att, const float* inp,
+                           int b, int t, int h, int T, int C, int NH, int head_major) {
+    int hs = C / NH;
+    float scale = 1.0 / sqrtf(hs);
+    int ts = head_major ? hs : 3 * C;
+    const float* query_t = inp + qkv_offset(head_major, b, t, 0, h, T, C, NH);
+    const float* key = inp + qkv_offset(head_major, b, 0, 1, h, T, C, NH);
+    const float* value = inp + qkv_offset(head_major, b, 0, 2, h, T, C, NH);
+    float* preatt_bth = preatt + b*NH*T*T + h*T*T + t*T;
+    float* att_bth = att + b*NH*T*T + h*T*T + t*T;
+    float maxval = -10000.0f;
+    for (int t2 = 0; t2 <= t; t2++) {
+        const float* key_t2 = key + t2 * ts;
+        float val = 0.0f;
+        for (int i = 0; i < hs; i++) { val += query_t[i] * key_t2[i]; }
+        val *= scale;
+        if (val > maxval) { maxval = val; }
+        preatt_bth[t2] = val;
+    }
+    float expsum = 0.0f;
+    for (int t2 = 0; t2 <= t; t2++) {
+        float expv = expf(preatt_bth[t2] - maxval);
+        expsum += expv;
+        att_bth[t2] = expv;
+    }
+    float expsum_inv = expsum == 0.0f ? 0.0f : 1.0f / expsum;
+    for (int t2 = 0; t2 < T; t2++) { att_bth[t2] = t2 <= t ? att_bth[t2] * expsum_inv : 0.0f; }
+    float* out_bth = out + b * T * C + t * C + h * hs;
+    for (int i = 0; i < hs; i++) { out_bth[i] = 0.0f; }
+    for (int t2 = 0; t2 <= t; t2++) {
+        const float* value_t2 = value + t2 * ts;
+        for (int i = 0; i < hs; i++) { out_bth[i] += att_bth[t2] * value_t2[i]; }
+    }
+}
+
+void attention_backward_row(float* dinp, float* dpreatt, float* datt, const float* dout,
+                            const float* inp, const float* att, int b, int t, int h, int T, int C, int NH,
+                            int head_major) {
+    int hs = C / NH;
+    float scale = 1.f / sqrtf(hs);
+    int ts = head_major ? hs : 3 * C;
+    const float* key = inp + qkv_offset(head_major, b, 0, 1, h, T, C, NH);
+    const float* value = inp + qkv_offset(head_major, b, 0, 2, h, T, C, NH);
+    const float* att_bth = att + b*NH*T*T + h*T*T + t*T;
+    float* datt_bth = datt + b*NH*T*T + h*T*T + t*T;
+    float* dpreatt_bth = dpreatt + b*NH*T*T + h*T*T + t*T;
+    float* dquery_t = dinp + qkv_offset(head_major, b, t, 0, h, T, C, NH);
+    const float* dout_bth = dout + b * T * C + t * C + h * hs;
+    for (int t2 = 0; t2 <= t; t2++) {
+        const float* value_t2 = value + t2 * ts;
+        for (int i = 0; i < hs; i++) { datt_bth[t2] += value_t2[i] * dout_bth[i]; }
+    }
+    float dot = 0.0f;
+    for (int t2 = 0; t2 <= t; t2++) { dot += att_bth[t2] * datt_bth[t2]; }
+    for (int t3 = 0; t3 <= t; t3++) { dpreatt_bth[t3] += att_bth[t3] * (datt_bth[t3] - dot); }
+    for (int t2 = 0; t2 <= t; t2++) {
+        const float* key_t2 = key + t2 * ts;
+        for (int i = 0; i < hs; i++) { dquery_t[i] += key_t2[i] * dpreatt_bth[t2] * scale; }
+    }
+}
+
+void attention_backward_col(float* dinp, const float* dpreatt, const float* dout,
+                            const float* inp, const float* att, int b, int t2, int h, int T, int C, int NH,
+                            int head_major) {
+    int hs = C / NH;
+    float scale = 1.f / sqrtf(hs);
+    int ts = head_major ? hs : 3 * C;
+    float* dkey_t2 = dinp + qkv_offset(head_major, b, t2, 1, h, T, C, NH);
+    float* dvalue_t2 = dinp + qkv_offset(head_major, b, t2, 2, h, T, C, NH);
+    const float* query = inp + qkv_offset(head_major, b, 0, 0, h, T, C, NH);
+    for (int t = t2; t < T; t++) {
+        float a = att[b*NH*T*T + h*T*T + t*T + t2];
+        float dp = dpreatt[b*NH*T*T + h*T*T + t*T + t2];
+        const float* query_t = query + t * ts;
+        const float* dout_bth = dout + b * T * C + t * C + h * hs;
+        for (int i = 0; i < hs; i++) {
+            dvalue_t2[i] += a * dout_bth[i];
+            dkey_t2[i] += query_t[i] * dp * scale;
+        }
+    }
+}
+
+void attention_forward(float* out, float* preatt, float* att, const float* inp,
+                       int B, int T, int C, int NH, int head_major) {
+    int num_pairs = (T + 1) / 2;
+    #pragma omp parallel for collapse(3)
+    for (int b = 0; b < B; b++) {
+        for (int h = 0; h < NH; h++) {
+            for (int p = 0; p < num_pairs; p++) {
+                attention_forward_row(out, preatt, att, inp, b, p, h, T, C, NH, head_major);
+                if (T-1-p != p) { attention_forward_row(out, preatt, att, inp, b, T-1-p, h, T, C, NH, head_major); }
+            }
+        }
+    }
+}
+
+void attention_backward(float* dinp, float* dpreatt, float* datt, const float* dout,
+                        const float* inp, const float* att, int B, int T, int C, int NH, int head_major) {
+    int num_pairs = (T + 1) / 2;
+    #pragma omp parallel
+    {
+        #pragma omp for collapse(3)
+        for (int b = 0; b < B; b++) {
+            for (int h = 0; h < NH; h++) {
+                for (int p = 0; p < num_pairs; p++) {
+                    attention_backward_row(dinp, dpreatt, datt, dout, inp, att, b, p, h, T, C, NH, head_major);
+                    if (T-1-p != p) { attention_backward_row(dinp, dpreatt, datt, dout, inp, att, b, T-1-p, h, T, C, NH, head_major); }
+                }
+            }
+        }
+        #pragma omp for collapse(3)
+        for (int b = 0; b < B; b++) {
+            for (int h = 0; h < NH; h++) {
+                for (int p = 0; p < num_pairs; p++) {
+                    attention_backward_col(dinp, dpreatt, dout, inp, att, b, p, h, T, C, NH, head_major);
+                    if (T-1-p != p) { attention_backward_col(dinp, dpreatt, dout, inp, att, b, T-1-p, h, T, C, NH, head_major); }
+                }
+            }
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+float* make_random_float(size_t N) {
+    float* arr = (float*)malloc(N * sizeof(float));
+    for (size_t i = 0; i < N; i++) { arr[i] = ((float)rand() / RAND_MAX) * 2.0f - 1.0f; }
+    return arr;
+}
+
+// copies an interleaved (B, T, 3C) qkv into the head-major layout, or back
+void convert_qkv(float* dst, const float* src, int to_head_major, int B, int T, int C, int NH) {
+    int hs = C / NH;
+    for (int b = 0; b < B; b++) {
+        for (int t = 0; t < T; t++) {
+            for (int qkv = 0; qkv < 3; qkv++) {
+                for (int h = 0; h < NH; h++) {
+                    const float* s = src + qkv_offset(!to_head_major, b, t, qkv, h, T, C, NH);
+                    float* d = dst + qkv_offset(to_head_major, b, t, qkv, h, T, C, NH);
+                    memcpy(d, s, hs * sizeof(float));
+                }
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    srand(0);
+    int C = 768;
+    int NH = 12;
+    int Ts[2] = {256, 1024};
+    int Bs[2] = {4, 1};
+    int repeats = 5;
+    printf("threads: %d, C = %d, NH = %d\n", omp_get_max_threads(), C, NH);
+
+    for (int k = 0; k < 2; k++) {
+        int B = Bs[k];
+        int T = Ts[k];
+        size_t nqkv = (size_t)B * T * 3 * C;
+        size_t natt = (size_t)B * NH * T * T;
+        float* inp = make_random_float(nqkv);
+        float* dout = make_random_float((size_t)B * T * C);
+        float* inp_layout = (float*)malloc(nqkv * sizeof(float));
+        float* dinp = (float*)malloc(nqkv * sizeof(float));
+        float* out[2];
+        float* dinp_check[2];
+        float* preatt = (float*)malloc(natt * sizeof(float));
+        float* att = (float*)malloc(natt * sizeof(float));
+        float* dpreatt = (float*)malloc(natt * sizeof(float));
+        float* datt = (float*)malloc(natt * sizeof(float));
+        double fwd_ms[2], bwd_ms[2];
+
+        for (int head_major = 0; head_major < 2; head_major++) {
+            if (head_major) { convert_qkv(inp_layout, inp, 1, B, T, C, NH); }
+            else { memcpy(inp_layout, inp, nqkv * sizeof(float)); }
+            out[head_major] = (float*)malloc((size_t)B * T * C * sizeof(float));
+            fwd_ms[head_major] = 1e30;
+            bwd_ms[head_major] = 1e30;
+            for (int r = 0; r < repeats; r++) {
+                double start = omp_get_wtime();
+                attention_forward(out[head_major], preatt, att, inp_layout, B, T, C, NH, head_major);
+                double mid = omp_get_wtime();
+                memset(dinp, 0, nqkv * sizeof(float));
+                memset(dpreatt, 0, natt * sizeof(float));
+                memset(datt, 0, natt * sizeof(float));
+                double mid2 = omp_get_wtime();
+                attention_backward(dinp, dpreatt, datt, dout, inp_layout, att, B, T, C, NH, head_major);
+                double end = omp_get_wtime();
+                if ((mid - start) * 1e3 < fwd_ms[head_major]) { fwd_ms[head_major] = (mid - start) * 1e3; }
+                if ((end - mid2) * 1e3 < bwd_ms[head_major]) { bwd_ms[head_major] = (end - mid2) * 1e3; }
+            }
+            // keep dinp in the interleaved layout for the comparison
+            dinp_check[head_major] = (float*)malloc(nqkv * sizeof(float));
+            if (head_major) { convert_qkv(dinp_check[head_major], dinp, 0, B, T, C, NH); }
+            else { memcpy(dinp_check[head_major], dinp, nqkv * sizeof(float)); }
+        }
+
+        int same = memcmp(out[0], out[1], (size_t)B * T * C * sizeof(float)) == 0
+                && memcmp(dinp_check[0], dinp_check[1], nqkv * sizeof(float)) == 0;
+        printf("B = %d, T = %4d | interleaved: fwd %8.2f ms, bwd %8.2f ms | head-major: fwd %8.2f ms, bwd %8.2f ms"
+               " | speedup fwd %.2fx, bwd %.2fx | bitwise identical: %d\n",
+               B, T, fwd_ms[0], bwd_ms[0], fwd_ms[1], bwd_ms[1],
+               fwd_ms[0] / fwd_ms[1], bwd_ms[0] / bwd_ms[1], same);
+
+        free(inp); free(dout); free(inp_layout); free(dinp);
+        free(preatt); free(att); free(dpreatt); free(datt);
+        for (int i = 0; i < 2; i++) { free(out[i]); free(dinp_check[i]); }
+    }
+    return 0;
+}
@@ -0,0 +1,243 @@
+/*
+CPU benchmark of the paged KV cache of llmc/kvcache.h, against a contiguous max_seq_len
+buffer per session, as decoding had it before.
+
+Attention of a decode step: every session of a batch has one new query per head,
+attending to all its cached positions. Kernel 0 reads them from a contiguous
+(NH, max_seq_len, hs) buffer per session, kernel 1 gathers them from KV_BLOCK_SIZE
+blocks of a shared pool through the session's block table, as attention_forward_cached
+in train_gpt2.c. The sessions grow a token at a time, round robin, so their blocks end up
+interleaved in the pool, as with a server. The arithmetic is identical, so the two must
+agree bitwise, which we check. We time a step at a few lengths of the sessions.
+
+Then the memory: how many sessions fit in the KV memory of GPT-2 small (12 layers,
+C = 768, max_seq_len = 1024) at a few budgets, when their lengths are very different: a
+prompt and a reply of a random length, most of them short, a few up to max_seq_len. The
+contiguous cache reserves max_seq_len positions per session, the paged one takes blocks
+off the pool until it is out of them.
+*/
+
+// Compile Examples:
+//
+//      gcc -Ofast -march=native -fopenmp kvcache_paged.c -lm -o kvcache_paged
+//      OMP_NUM_THREADS=8 ./kvcache_paged
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+// defines: KVPool, KVCache, kv_blocks, kvpool_init, kvcache_init, kvcache_reserve, kvpool_key, kvpool_value
+#include "../../llmc/kvcache.h"
+
+#define S 16 // sessions decoded together
+#define MAX_T 1024
+
+// ----------------------------------------------------------------------------
+// decode attention: one query per session and head, at position n - 1
+
+void attention_decode_contiguous(float* out, float* att, const float* query, float** key, float** value,
+                                 int n, int C, int NH) {
+    // key, value are S buffers of (NH, MAX_T, hs)
+    int hs = C / NH;
+    float scale = 1.0f / sqrtf(hs);
+    #pragma omp parallel for collapse(2)
+    for (int s = 0; s < S; s++) {
+        for (int h = 0; h < NH; h++) {
+            const float* query_h = query + s * C + h * hs;
+            const float* key_h = key[s] + (size_t)h * MAX_T * hs;
+            const float* value_h = value[s] + (size_t)h * MAX_T * hs;
+            float* att_h = att + ((size_t)s * NH + h) * MAX_T;
+            float* out_h = out + s * C + h * hs;
+            float maxval = -10000.0f;
+            for (int t2 = 0; t2 < n; t2++) {
+                const float* key_t2 = key_h + (size_t)t2 * hs;
+                float val = 0.0f;
+                #pragma omp simd reduction(+:val)
+                for (int i = 0; i < hs; i++) { val += query_h[i] * key_t2[i]; }
+                val *= scale;
+                att_h[t2] = val;
+                if (val > maxval) { maxval = val; }
+            }
+            float expsum = 0.0f;
+            for (int t2 = 0; t2 < n; t2++) {
+                float expv = expf(att_h[t2] - maxval);
+                expsum += expv;
+                att_h[t2] = expv;
+            }
+            float expsum_inv = 1.0f / expsum;
+            for (int i = 0; i < hs; i++) { out_h[i] = 0.0f; }
+            for (int t2 = 0; t2 < n; t2++) {
+                const float* value_t2 = value_h + (size_t)t2 * hs;
+                float a = att_h[t2] * expsum_inv;
+                #pragma omp simd
+                for (int i = 0; i < hs; i++) { out_h[i] += a * value_t2[i]; }
+            }
+        }
+    }
+}
+
+void attention_decode_paged(float* out, float* att, const float* query, KVCache* caches,
+                            int n, int C, int NH) {
+    int hs = C / NH;
+    float scale = 1.0f / sqrtf(hs);
+    int nb = kv_blocks(n);
+    #pragma omp parallel for collapse(2)
+    for (int s = 0; s < S; s++) {
+        for (int h = 0; h < NH; h++) {
+            const KVPool* pool = caches[s].pool;
+            const int* block_table = caches[s].block_table;
+            const float* query_h = query + s * C + h * hs;
+            float* att_h = att + ((size_t)s * NH + h) * MAX_T;
+            float* out_h = out + s * C + h * hs;
+            float maxval = -10000.0f;
+            for (int b = 0; b < nb; b++) {
+                const float* key = kvpool_key(pool, 0, block_table[b], h);
+                int t0 = b * KV_BLOCK_SIZE;
+                int bn = n - t0 < KV_BLOCK_SIZE ? n - t0 : KV_BLOCK_SIZE;
+                for (int j = 0; j < bn; j++) {
+                    const float* key_t2 = key + j * hs;
+                    float val = 0.0f;
+                    #pragma omp simd reduction(+:val)
+                    for (int i = 0; i < hs; i++) { val += query_h[i] * key_t2[i]; }
+                    val *= scale;
+                    att_h[t0 + j] = val;
+                    if (val > maxval) { maxval = val; }
+                }
+            }
+            float expsum = 0.0f;
+            for (int t2 = 0; t2 < n; t2++) {
+                float expv = expf(att_h[t2] - maxval);
+                expsum += expv;
+                att_h[t2] = expv;
+            }
+            float expsum_inv = 1.0f / expsum;
+            for (int i = 0; i < hs; i++) { out_h[i] = 0.0f; }
+            for (int b = 0; b < nb; b++) {
+                const float* value = kvpool_value(pool, 0, block_table[b], h);
+                int t0 = b * KV_BLOCK_SIZE;
+                int bn = n - t0 < KV_BLOCK_SIZE ? n - t0 : KV_BLOCK_SIZE;
+                for (int j = 0; j < bn; j++) {
+                    const float* value_t2 = value + j * hs;
+                    float a = att_h[t0 + j] * expsum_inv;
+                    #pragma omp simd
+                    for (int i = 0; i < hs; i++) { out_h[i] += a * value_t2[i]; }
+                }
+            }
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+float* make_random_float(size_t n) {
+    float* x = (float*)malloc(n * sizeof(float));
+    for (size_t i = 0; i < n; i++) { x[i] = (float)rand() / RAND_MAX * 2.0f - 1.0f; }
+    return x;
+}
+
+// a session's length: a prompt of 16 to 80 tokens, and a reply of 1 to 128 tokens, or in
+// one in ten sessions a long context of up to MAX_T
+int session_length(void) {
+    if (rand() % 10 == 0) { return 64 + rand() % (MAX_T - 63); }
+    return 16 + rand() % 65 + 1 + rand() % 128;
+}
+
+int main(int argc, char **argv) {
+    srand(0);
+    int C = 768;
+    int NH = 12;
+    int hs = C / NH;
+    int Ns[3] = {128, 512, 1024};
+    int repeats = 20;
+    printf("threads: %d, C = %d, NH = %d, %d sessions, blocks of %d positions\n", omp_get_max_threads(), C, NH, S, KV_BLOCK_SIZE);
+
+    // the same keys and values in both caches, positions appended round robin
+    KVPool pool;
+    kvpool_init(&pool, 1, NH, C, S * kv_blocks(MAX_T), 0);
+    KVCache caches[S];
+    float* key[S];
+    float* value[S];
+    for (int s = 0; s < S; s++) {
+        kvcache_init(&caches[s], &pool, MAX_T);
+        key[s] = make_random_float((size_t)NH * MAX_T * hs);
+        value[s] = make_random_float((size_t)NH * MAX_T * hs);
+    }
+    for (int t = 0; t < MAX_T; t++) {
+        for (int s = 0; s < S; s++) {
+            if (!kvcache_reserve(&caches[s], 1)) { printf("Error: out of blocks\n"); exit(EXIT_FAILURE); }
+            for (int h = 0; h < NH; h++) {
+                memcpy(kvcache_key(&caches[s], 0, h, t), key[s] + ((size_t)h * MAX_T + t) * hs, hs * sizeof(float));
+                memcpy(kvcache_value(&caches[s], 0, h, t), value[s] + ((size_t)h * MAX_T + t) * hs, hs * sizeof(float));
+            }
+            caches[s].pos++;
+        }
+    }
+    float* query = make_random_float((size_t)S * C);
+    float* att = (float*)malloc((size_t)S * NH * MAX_T * sizeof(float));
+    float* out[2];
+    out[0] = (float*)malloc((size_t)S * C * sizeof(float));
+    out[1] = (float*)malloc((size_t)S * C * sizeof(float));
+
+    for (int k = 0; k < 3; k++) {
+        int n = Ns[k];
+        double ms[2] = {1e30, 1e30};
+        for (int paged = 0; paged < 2; paged++) {
+            for (int r = 0; r < repeats; r++) {
+                double start = omp_get_wtime();
+                if (paged) { attention_decode_paged(out[1], att, query, caches, n, C, NH); }
+                else { attention_decode_contiguous(out[0], att, query, key, value, n, C, NH); }
+                double t = (omp_get_wtime() - start) * 1e3;
+                if (t < ms[paged]) { ms[paged] = t; }
+            }
+        }
+        int same = memcmp(out[0], out[1], (size_t)S * C * sizeof(float)) == 0;
+        printf("n = %4d | contiguous %7.3f ms | paged %7.3f ms | paged/contiguous %.2f | bitwise identical: %d\n",
+               n, ms[0], ms[1], ms[1] / ms[0], same);
+        if (!same) { printf("FAILED\n"); exit(EXIT_FAILURE); }
+    }
+    for (int s = 0; s < S; s++) {
+        kvcache_free(&caches[s]);
+        free(key[s]);
+        free(value[s]);
+    }
+    kvpool_free(&pool);
+
+    // the memory: only the block tables matter, so the pool's blocks are a float each
+    size_t position_bytes = 2 * 12 * 768 * sizeof(float); // K and V of GPT-2 small
+    size_t budgets_mb[3] = {1024, 4096, 16384};
+    printf("\nGPT-2 small, max_seq_len %d: %.1f KB of KV per position, %.1f MB per contiguous session\n",
+           MAX_T, position_bytes / 1024.0, (double)position_bytes * MAX_T / (1 << 20));
+    for (int k = 0; k < 3; k++) {
+        size_t budget = budgets_mb[k] << 20;
+        int contiguous = (int)(budget / (position_bytes * MAX_T));
+        int blocks = (int)(budget / (position_bytes * KV_BLOCK_SIZE));
+        KVPool sim;
+        kvpool_init(&sim, 1, 1, 1, blocks, 0);
+        int capacity = blocks; // each session takes at least a block
+        KVCache* sessions = (KVCache*)malloc(capacity * sizeof(KVCache));
+        int paged = 0;
+        long positions = 0;
+        srand(1);
+        for (;;) {
+            int len = session_length();
+            kvcache_init(&sessions[paged], &sim, MAX_T);
+            if (!kvcache_reserve(&sessions[paged], len)) { free(sessions[paged].block_table); break; }
+            sessions[paged].pos = len;
+            positions += len;
+            paged++;
+        }
+        printf("%5zu MB | contiguous: %4d sessions | paged: %5d sessions, %.1fx, mean length %.0f, %.1f%% of the blocks unused\n",
+               budgets_mb[k], contiguous, paged, (double)paged / contiguous, (double)positions / paged,
+               100.0 * (1.0 - (double)positions / ((double)(blocks - sim.num_free) * KV_BLOCK_SIZE)));
+        for (int i = 0; i < paged; i++) { kvcache_free(&sessions[i]); }
+        free(sessions);
+        kvpool_free(&sim);
+    }
+    free(query);
+    free(att);
+    free(out[0]);
+    free(out[1]);
+    return 0;
+}
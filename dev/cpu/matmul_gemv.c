@@ -0,0 +1,276 @@
+/*
+CPU benchmark of the matmul forward pass when decoding: B*T of 1 to a few rows, where
+every matmul is a matrix-vector product, bound by reading the weights from memory.
+
+Kernel 0 is what train_gpt2.c did below 8 rows: matmul_forward_naive, which splits the
+rows over the threads, so a single row runs on a single thread.
+Kernel 1 splits the output channels over the threads, and takes MATMUL_GEMV_COLS dot
+products at a time (one load of the input for several weight rows).
+Kernel 2 is kernel 1 with software prefetch of the weights MATMUL_GEMV_PREFETCH groups of
+output channels ahead, into all the cache levels (T0).
+Kernel 3 prefetches with the non-temporal hint (NTA) instead, as the weights are read just
+once per token. It was 3-4x slower than no prefetch at all on the machine it was tuned on
+(a VM), where T0 was about 10% faster, but it may be worth checking on others.
+Kernel 4 is kernel 2 with register tiles of MATMUL_GEMV_ROWS rows, so that each weight it
+loads is used for all of them: the matmul_forward_gemv of train_gpt2.c. It matters for the
+k+1 rows that verify k draft tokens in speculative decoding (see speculative_gpt2.c),
+where a pass over all of them should cost little more than over one.
+
+For the five matmuls of a GPT-2 (124M) layer and the LM head, we report the time and the
+bandwidth each kernel gets out of reading the weights, next to the read bandwidth of the
+machine (a sum over a buffer much larger than the caches), and what that bandwidth means
+for decoding: tokens/s = bandwidth / bytes of the weights of the whole model.
+*/
+
+// Compile Examples:
+//
+//      gcc -Ofast -march=native -fopenmp matmul_gemv.c -lm -o matmul_gemv
+//      OMP_NUM_THREADS=8 ./matmul_gemv
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <omp.h>
+
+#define MATMUL_GEMV_COLS 4
+#define MATMUL_GEMV_ROWS 4
+#define MATMUL_GEMV_PREFETCH 8
+#define CACHE_LINE_FLOATS 16
+#define RUNS 20
+
+// ----------------------------------------------------------------------------
+// kernels
+
+void matmul_forward_naive(float* out, const float* inp, const float* weight, const float* bias,
+                          int BT, int C, int OC) {
+    #pragma omp parallel for
+    for (int bt = 0; bt < BT; bt++) {
+        for (int o = 0; o < OC; o++) {
+            float val = (bias != NULL) ? bias[o] : 0.0f;
+            for (int i = 0; i < C; i++) {
+                val += inp[bt * C + i] * weight[o*C + i];
+            }
+            out[bt * OC + o] = val;
+        }
+    }
+}
+
+// prefetch: 0 none, 1 to all cache levels (T0), 2 non-temporal (NTA)
+void matmul_forward_gemv(float* out, const float* inp, const float* weight, const float* bias,
+                         int BT, int C, int OC, int prefetch) {
+    #pragma omp parallel for schedule(static)
+    for (int o0 = 0; o0 < OC; o0 += MATMUL_GEMV_COLS) {
+        int cols = OC - o0 < MATMUL_GEMV_COLS ? OC - o0 : MATMUL_GEMV_COLS;
+        // the weights MATMUL_GEMV_PREFETCH groups ahead, while reading these for the first row
+        const float* ahead = weight + (size_t)(o0 + MATMUL_GEMV_PREFETCH * MATMUL_GEMV_COLS) * C;
+        int can_prefetch = prefetch && o0 + (MATMUL_GEMV_PREFETCH + 1) * MATMUL_GEMV_COLS <= OC;
+        for (int bt = 0; bt < BT; bt++) {
+            const float* x = inp + (size_t)bt * C;
+            const float* w = weight + (size_t)o0 * C;
+            float sum[MATMUL_GEMV_COLS];
+            if (cols == MATMUL_GEMV_COLS) {
+                // a vector of partial sums per output channel, a cache line wide
+                float acc[MATMUL_GEMV_COLS][CACHE_LINE_FLOATS] = {{0.0f}};
+                int i0 = 0;
+                for (; i0 + CACHE_LINE_FLOATS <= C; i0 += CACHE_LINE_FLOATS) {
+                    if (can_prefetch && bt == 0) {
+                        for (int c = 0; c < MATMUL_GEMV_COLS; c++) {
+                            if (prefetch == 1) { __builtin_prefetch(ahead + c * C + i0, 0, 3); }
+                            else { __builtin_prefetch(ahead + c * C + i0, 0, 0); }
+                        }
+                    }
+                    for (int c = 0; c < MATMUL_GEMV_COLS; c++) {
+                        for (int k = 0; k < CACHE_LINE_FLOATS; k++) {
+                            acc[c][k] += x[i0 + k] * w[c * C + i0 + k];
+                        }
+                    }
+                }
+                for (int c = 0; c < MATMUL_GEMV_COLS; c++) {
+                    sum[c] = 0.0f;
+                    for (int k = 0; k < CACHE_LINE_FLOATS; k++) { sum[c] += acc[c][k]; }
+                    for (int i = i0; i < C; i++) { sum[c] += x[i] * w[c * C + i]; }
+                }
+            } else {
+                for (int c = 0; c < cols; c++) {
+                    sum[c] = 0.0f;
+                    for (int i = 0; i < C; i++) { sum[c] += x[i] * w[c * C + i]; }
+                }
+            }
+            for (int c = 0; c < cols; c++) {
+                out[(size_t)bt * OC + o0 + c] = sum[c] + ((bias != NULL) ? bias[o0 + c] : 0.0f);
+            }
+        }
+    }
+}
+
+static inline __attribute__((always_inline))
+void matmul_gemv_tile_(float sum[MATMUL_GEMV_ROWS][MATMUL_GEMV_COLS], const float* x, const int rows,
+                       const float* w, const float* ahead, int C) {
+    float acc[MATMUL_GEMV_ROWS][MATMUL_GEMV_COLS][CACHE_LINE_FLOATS] = {{{0.0f}}};
+    int i0 = 0;
+    for (; i0 + CACHE_LINE_FLOATS <= C; i0 += CACHE_LINE_FLOATS) {
+        if (ahead != NULL) {
+            for (int c = 0; c < MATMUL_GEMV_COLS; c++) { __builtin_prefetch(ahead + c * C + i0, 0, 3); }
+        }
+        for (int r = 0; r < rows; r++) {
+            for (int c = 0; c < MATMUL_GEMV_COLS; c++) {
+                for (int k = 0; k < CACHE_LINE_FLOATS; k++) {
+                    acc[r][c][k] += x[r * C + i0 + k] * w[c * C + i0 + k];
+                }
+            }
+        }
+    }
+    for (int r = 0; r < rows; r++) {
+        for (int c = 0; c < MATMUL_GEMV_COLS; c++) {
+            sum[r][c] = 0.0f;
+            for (int k = 0; k < CACHE_LINE_FLOATS; k++) { sum[r][c] += acc[r][c][k]; }
+            for (int i = i0; i < C; i++) { sum[r][c] += x[r * C + i] * w[c * C + i]; }
+        }
+    }
+}
+
+void matmul_forward_gemv_tiled(float* out, const float* inp, const float* weight, const float* bias,
+                               int BT, int C, int OC) {
+    #pragma omp parallel for schedule(static)
+    for (int o0 = 0; o0 < OC; o0 += MATMUL_GEMV_COLS) {
+        int cols = OC - o0 < MATMUL_GEMV_COLS ? OC - o0 : MATMUL_GEMV_COLS;
+        const float* w = weight + (size_t)o0 * C;
+        const float* ahead = weight + (size_t)(o0 + MATMUL_GEMV_PREFETCH * MATMUL_GEMV_COLS) * C;
+        int can_prefetch = o0 + (MATMUL_GEMV_PREFETCH + 1) * MATMUL_GEMV_COLS <= OC;
+        for (int r0 = 0; r0 < BT; r0 += MATMUL_GEMV_ROWS) {
+            int rows = BT - r0 < MATMUL_GEMV_ROWS ? BT - r0 : MATMUL_GEMV_ROWS;
+            const float* x = inp + (size_t)r0 * C;
+            const float* prefetch = can_prefetch && r0 == 0 ? ahead : NULL;
+            float sum[MATMUL_GEMV_ROWS][MATMUL_GEMV_COLS];
+            if (cols == MATMUL_GEMV_COLS) {
+                switch (rows) {
+                    case 1: matmul_gemv_tile_(sum, x, 1, w, prefetch, C); break;
+                    case 2: matmul_gemv_tile_(sum, x, 2, w, prefetch, C); break;
+                    case 3: matmul_gemv_tile_(sum, x, 3, w, prefetch, C); break;
+                    default: matmul_gemv_tile_(sum, x, MATMUL_GEMV_ROWS, w, prefetch, C); break;
+                }
+            } else {
+                for (int r = 0; r < rows; r++) {
+                    for (int c = 0; c < cols; c++) {
+                        sum[r][c] = 0.0f;
+                        for (int i = 0; i < C; i++) { sum[r][c] += x[r * C + i] * w[c * C + i]; }
+                    }
+                }
+            }
+            for (int r = 0; r < rows; r++) {
+                for (int c = 0; c < cols; c++) {
+                    out[(size_t)(r0 + r) * OC + o0 + c] = sum[r][c] + ((bias != NULL) ? bias[o0 + c] : 0.0f);
+                }
+            }
+        }
+    }
+}
+
+void matmul_forward(int kernel_num, float* out, const float* inp, const float* weight, const float* bias,
+                    int BT, int C, int OC) {
+    switch (kernel_num) {
+        case 0: matmul_forward_naive(out, inp, weight, bias, BT, C, OC); break;
+        case 1: matmul_forward_gemv(out, inp, weight, bias, BT, C, OC, 0); break;
+        case 2: matmul_forward_gemv(out, inp, weight, bias, BT, C, OC, 1); break;
+        case 3: matmul_forward_gemv(out, inp, weight, bias, BT, C, OC, 2); break;
+        case 4: matmul_forward_gemv_tiled(out, inp, weight, bias, BT, C, OC); break;
+        default: printf("Invalid kernel number\n"); exit(1);
+    }
+}
+#define NUM_KERNELS 5
+
+// ----------------------------------------------------------------------------
+
+float* make_random_float(size_t N) {
+    float* arr = (float*)malloc(N * sizeof(float));
+    for (size_t i = 0; i < N; i++) { arr[i] = ((float)rand() / RAND_MAX) * 2.0 - 1.0; }
+    return arr;
+}
+
+double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// the read bandwidth of the machine, in GB/s: the best of a few parallel sums over n floats
+double read_bandwidth(const float* x, size_t n) {
+    double best = 0.0;
+    for (int r = 0; r < 5; r++) {
+        double start = now_s();
+        float sum = 0.0f;
+        #pragma omp parallel for simd reduction(+:sum)
+        for (size_t i = 0; i < n; i++) { sum += x[i]; }
+        double s = now_s() - start;
+        if (sum == 12345.0f) { printf("!"); } // keep the sum
+        double gbs = n * sizeof(float) / s / 1e9;
+        if (gbs > best) { best = gbs; }
+    }
+    return best;
+}
+
+int main(int argc, char **argv) {
+    srand(137);
+    int C = 768;
+    int L = 12;
+    int Vp = 50304;
+    // qkv, attention projection, fc, fc projection, LM head
+    int shapes[][2] = {{C, 3 * C}, {C, C}, {C, 4 * C}, {4 * C, C}, {C, Vp}};
+    const char* names[] = {"qkv", "attproj", "fc", "fcproj", "lm head"};
+    int num_shapes = 5;
+    int max_rows = 8;
+
+    size_t model_bytes = (size_t)L * 12 * C * C * sizeof(float) + (size_t)Vp * C * sizeof(float);
+    size_t big = 256 * 1024 * 1024 / sizeof(float); // 256 MB, far beyond the caches
+    float* buffer = make_random_float(big);
+    double bandwidth = read_bandwidth(buffer, big);
+    printf("threads: %d, read bandwidth: %.1f GB/s\n", omp_get_max_threads(), bandwidth);
+    printf("weights of GPT-2 (124M): %.0f MB, so at most %.1f tokens/s at B=1\n\n", model_bytes / 1e6, bandwidth * 1e9 / model_bytes);
+
+    // every weight matrix several times over, so that they come from memory, not the caches
+    size_t copies = 8;
+    double kernel_s[NUM_KERNELS] = {0.0};
+    for (int s = 0; s < num_shapes; s++) {
+        int Ci = shapes[s][0], OC = shapes[s][1];
+        float* weight = make_random_float(copies * OC * Ci);
+        float* bias = make_random_float(OC);
+        float* inp = make_random_float(max_rows * Ci);
+        float* out = (float*)malloc(max_rows * OC * sizeof(float));
+        float* ref = (float*)malloc(max_rows * OC * sizeof(float));
+        for (int rows = 1; rows <= max_rows; rows *= 2) {
+            matmul_forward(0, ref, inp, weight, bias, rows, Ci, OC);
+            printf("%-8s rows=%d (%d x %d):", names[s], rows, Ci, OC);
+            for (int k = 0; k < NUM_KERNELS; k++) {
+                matmul_forward(k, out, inp, weight, bias, rows, Ci, OC);
+                for (int i = 0; i < rows * OC; i++) {
+                    if (fabsf(out[i] - ref[i]) > 1e-3f * (1.0f + fabsf(ref[i]))) {
+                        printf("\nMismatch of kernel %d at %d: %f vs %f\n", k, i, out[i], ref[i]);
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                double start = now_s();
+                for (int r = 0; r < RUNS; r++) {
+                    matmul_forward(k, out, inp, weight + (r % copies) * (size_t)OC * Ci, bias, rows, Ci, OC);
+                }
+                double t = (now_s() - start) / RUNS;
+                if (rows == 1) { kernel_s[k] += t * (s < 4 ? L : 1); }
+                printf("  #%d %7.3f ms %5.1f GB/s", k, t * 1e3, (double)OC * Ci * sizeof(float) / t / 1e9);
+            }
+            printf("\n");
+        }
+        free(weight);
+        free(bias);
+        free(inp);
+        free(out);
+        free(ref);
+    }
+    printf("\nthe matmuls of one decoded token (B=1):\n");
+    for (int k = 0; k < NUM_KERNELS; k++) {
+        printf("kernel #%d: %.2f ms, %.1f tokens/s, %.0f%% of the read bandwidth\n", k, kernel_s[k] * 1e3,
+               1.0 / kernel_s[k], 100.0 * model_bytes / kernel_s[k] / 1e9 / bandwidth);
+    }
+    free(buffer);
+    return 0;
+}
@@ -0,0 +1,159 @@
+/*
+CPU benchmark for the threading structure of train_gpt2.c.
+
+Compares two ways of running the same sequence of per-layer ops with OpenMP:
+1) one "#pragma omp parallel for" per op (a fork/join for every op)
+2) one "#pragma omp parallel" region around the whole pass, where each op is an
+   orphaned "#pragma omp for" (static partition + barrier), like train_gpt2.c does
+
+The ops mimic a transformer block (layernorm -> matmul -> gelu -> matmul -> residual)
+at small B*T, where the threading overhead is a large fraction of the step.
+*/
+
+// Compile Examples:
+//
+//      gcc -Ofast -march=native -fopenmp parallel_regions.c -lm -o parallel_regions
+//      OMP_NUM_THREADS=8 ./parallel_regions
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// ----------------------------------------------------------------------------
+// ops, written once with orphaned worksharing. In version 1) below we wrap every
+// single call in its own parallel region, in version 2) we wrap the whole pass.
+
+void layernorm_rows(float* out, const float* inp, int N, int C) {
+    #pragma omp for
+    for (int i = 0; i < N; i++) {
+        const float* x = inp + i * C;
+        float m = 0.0f;
+        for (int j = 0; j < C; j++) { m += x[j]; }
+        m /= C;
+        float v = 0.0f;
+        for (int j = 0; j < C; j++) { v += (x[j] - m) * (x[j] - m); }
+        float s = 1.0f / sqrtf(v / C + 1e-5f);
+        for (int j = 0; j < C; j++) { out[i * C + j] = (x[j] - m) * s; }
+    }
+}
+
+void matmul_rows(float* out, const float* inp, const float* weight, int N, int C, int OC) {
+    #pragma omp for
+    for (int o = 0; o < OC; o++) {
+        for (int i = 0; i < N; i++) {
+            float val = 0.0f;
+            for (int j = 0; j < C; j++) { val += inp[i * C + j] * weight[o * C + j]; }
+            out[i * OC + o] = val;
+        }
+    }
+}
+
+void gelu_elementwise(float* out, const float* inp, int n) {
+    #pragma omp for
+    for (int i = 0; i < n; i++) {
+        float x = inp[i];
+        out[i] = 0.5f * x * (1.0f + tanhf(0.7978845608f * (x + 0.044715f * x * x * x)));
+    }
+}
+
+void residual_elementwise(float* out, const float* inp1, const float* inp2, int n) {
+    #pragma omp for
+    for (int i = 0; i < n; i++) { out[i] = inp1[i] + inp2[i]; }
+}
+
+// ----------------------------------------------------------------------------
+// the two variants
+
+typedef struct {
+    int N, C, L;
+    float *x, *ln, *fc, *fc_gelu, *proj;
+    float *fcw, *projw;
+} Workload;
+
+void pass_region_per_op(Workload* w) {
+    int N = w->N, C = w->C;
+    for (int l = 0; l < w->L; l++) {
+        #pragma omp parallel
+        layernorm_rows(w->ln, w->x, N, C);
+        #pragma omp parallel
+        matmul_rows(w->fc, w->ln, w->fcw, N, C, 4*C);
+        #pragma omp parallel
+        gelu_elementwise(w->fc_gelu, w->fc, N*4*C);
+        #pragma omp parallel
+        matmul_rows(w->proj, w->fc_gelu, w->projw, N, 4*C, C);
+        #pragma omp parallel
+        residual_elementwise(w->x, w->x, w->proj, N*C);
+    }
+}
+
+void pass_single_region(Workload* w) {
+    int N = w->N, C = w->C;
+    #pragma omp parallel
+    {
+        for (int l = 0; l < w->L; l++) {
+            layernorm_rows(w->ln, w->x, N, C);
+            matmul_rows(w->fc, w->ln, w->fcw, N, C, 4*C);
+            gelu_elementwise(w->fc_gelu, w->fc, N*4*C);
+            matmul_rows(w->proj, w->fc_gelu, w->projw, N, 4*C, C);
+            residual_elementwise(w->x, w->x, w->proj, N*C);
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+float* make_random_float(size_t N) {
+    float* arr = (float*)malloc(N * sizeof(float));
+    for (size_t i = 0; i < N; i++) {
+        arr[i] = ((float)rand() / RAND_MAX) * 2.0 - 1.0; // range -1..1
+    }
+    return arr;
+}
+
+double time_pass(void (*pass)(Workload*), Workload* w, int runs) {
+    struct timespec start, end;
+    pass(w); // warmup, also spins up the OpenMP thread pool
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < runs; i++) { pass(w); }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9) / runs;
+}
+
+int main(int argc, char **argv) {
+    srand(137);
+    int C = 128; // small channels and B*T, where overheads dominate
+    int L = 12;
+    int RUNS = 50;
+    int Ns[] = {8, 16, 64, 256};
+
+    #ifdef _OPENMP
+    printf("OpenMP threads: %d\n", omp_get_max_threads());
+    #endif
+
+    for (int k = 0; k < (int)(sizeof(Ns) / sizeof(Ns[0])); k++) {
+        Workload w;
+        w.N = Ns[k]; w.C = C; w.L = L;
+        w.x = make_random_float(w.N * C);
+        w.ln = make_random_float(w.N * C);
+        w.fc = make_random_float(w.N * 4*C);
+        w.fc_gelu = make_random_float(w.N * 4*C);
+        w.proj = make_random_float(w.N * C);
+        w.fcw = make_random_float(4*C * C);
+        w.projw = make_random_float(C * 4*C);
+        for (int i = 0; i < 4*C * C; i++) { w.fcw[i] *= 0.05f; w.projw[i] *= 0.05f; }
+
+        double t_per_op = time_pass(pass_region_per_op, &w, RUNS);
+        double t_single = time_pass(pass_single_region, &w, RUNS);
+        printf("B*T=%4d: region per op %8.3f ms, single region %8.3f ms, saved %6.1f us per layer\n",
+               w.N, t_per_op * 1000, t_single * 1000, (t_per_op - t_single) * 1e6 / L);
+
+        free(w.x); free(w.ln); free(w.fc); free(w.fc_gelu); free(w.proj); free(w.fcw); free(w.projw);
+    }
+    return 0;
+}
@@ -0,0 +1,285 @@
+/*
+CPU microbenchmarks of the token samplers at V = 50257 (GPT-2's vocabulary).
+
+- softmax + sample_mult: what train_gpt2.c did, a softmax into a probs vector (with libm
+  expf), then a walk over the probabilities
+- sample_softmax: llmc/sampler.h without a config, fast_expf twice per token
+- the Sampler of llmc/sampler.h, without filters and with temperature, top-k, top-p and min-p
+- top-k by sorting all the logits (qsort), what the heap saves
+
+Before timing, the Sampler's candidates are checked against a reference that sorts all
+the tokens by probability and applies min-p, top-k and top-p to the sorted list: the same
+tokens with the same probabilities (up to the last token of the nucleus, where the two
+sum in different orders). And the frequencies of many samples from a small vocabulary
+are checked against the probabilities, as are those of speculative sampling: draft
+tokens from one distribution, kept or replaced with sampler_speculative_accept and
+sampler_speculative_residual, must come out distributed as the other.
+*/
+
+// Compile Examples:
+//
+//      gcc -Ofast -march=native -fopenmp sampler.c -lm -o sampler
+//      OMP_NUM_THREADS=8 ./sampler
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+// defines: Sampler, sampler_init, sampler_candidates, sampler_sample, sampler_sample_rows
+#include "../../llmc/sampler.h"
+
+#define V 50257
+#define ROWS 8
+#define RUNS 200
+
+// ----------------------------------------------------------------------------
+// references
+
+void softmax_cpu(float* probs, const float* logits, int n) {
+    float maxval = -10000.0f;
+    for (int i = 0; i < n; i++) { if (logits[i] > maxval) { maxval = logits[i]; } }
+    float sum = 0.0f;
+    for (int i = 0; i < n; i++) { probs[i] = expf(logits[i] - maxval); sum += probs[i]; }
+    for (int i = 0; i < n; i++) { probs[i] /= sum; }
+}
+
+int sample_mult(float* probabilities, int n, float coin) {
+    float cdf = 0.0f;
+    for (int i = 0; i < n; i++) {
+        cdf += probabilities[i];
+        if (coin < cdf) { return i; }
+    }
+    return n - 1;
+}
+
+typedef struct { float value; int index; } Candidate;
+
+int compare_descending(const void* a, const void* b) {
+    float x = ((const Candidate*)a)->value, y = ((const Candidate*)b)->value;
+    return (x < y) - (x > y);
+}
+
+// all the tokens sorted by probability, then min-p, top-k and top-p in that order.
+// returns the number of candidates, sorted by index, with their exp((logit - max) / t)
+int reference_candidates(Candidate* c, const float* logits, int n, SamplerConfig config) {
+    float max = logits[0];
+    for (int i = 0; i < n; i++) { max = fmaxf(max, logits[i]); }
+    for (int i = 0; i < n; i++) {
+        c[i].value = fast_expf((logits[i] - max) / config.temperature);
+        c[i].index = i;
+    }
+    qsort(c, n, sizeof(Candidate), compare_descending);
+    int count = n;
+    if (config.min_p > 0.0f) {
+        int k = 0;
+        while (k < count && logits[c[k].index] >= max + config.temperature * logf(config.min_p)) { k++; }
+        count = k;
+    }
+    if (config.top_k > 0 && config.top_k < count) { count = config.top_k; }
+    if (config.top_p < 1.0f) {
+        double sum = 0.0;
+        for (int k = 0; k < count; k++) { sum += c[k].value; }
+        double cumulative = 0.0;
+        int k = 0;
+        while (k < count) {
+            cumulative += c[k++].value;
+            if (cumulative >= config.top_p * sum) { break; }
+        }
+        count = k;
+    }
+    return count;
+}
+
+int compare_index(const void* a, const void* b) { return ((const Candidate*)a)->index - ((const Candidate*)b)->index; }
+
+// ----------------------------------------------------------------------------
+
+double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+float randn(unsigned long long* state) {
+    float u1 = random_f32(state) + 1e-7f, u2 = random_f32(state);
+    return sqrtf(-2.0f * logf(u1)) * cosf(6.2831853f * u2);
+}
+
+// logits like those of a language model: most tokens far below a few likely ones
+void make_logits(float* logits, int n, unsigned long long* state) {
+    for (int i = 0; i < n; i++) { logits[i] = 2.0f * randn(state); }
+    for (int i = 0; i < 20; i++) { logits[random_u32(state) % n] += 8.0f + 4.0f * random_f32(state); }
+}
+
+int main(int argc, char **argv) {
+    unsigned long long state = 1337;
+    float* logits = (float*)malloc((size_t)ROWS * V * sizeof(float));
+    for (int r = 0; r < ROWS; r++) { make_logits(logits + (size_t)r * V, V, &state); }
+    float* probs = (float*)malloc(V * sizeof(float));
+    Candidate* reference = (Candidate*)malloc(V * sizeof(Candidate));
+    Candidate* mine = (Candidate*)malloc(V * sizeof(Candidate));
+
+    SamplerConfig configs[] = {
+        {1.0f, 0, 1.0f, 0.0f},
+        {0.8f, 40, 1.0f, 0.0f},
+        {1.0f, 0, 0.9f, 0.0f},
+        {1.0f, 0, 1.0f, 0.05f},
+        {0.8f, 40, 0.9f, 0.05f},
+        {1.0f, 4096, 1.0f, 0.0f},
+        {1.2f, 0, 0.05f, 0.0f},
+    };
+    const char* names[] = {"plain", "t=0.8 top-k 40", "top-p 0.9", "min-p 0.05", "t=0.8 top-k 40 top-p 0.9 min-p 0.05",
+                           "top-k 4096 (quickselect)", "t=1.2 top-p 0.05"};
+    int num_configs = 7;
+
+    // the candidates against the reference
+    int allok = 1;
+    for (int c = 0; c < num_configs; c++) {
+        Sampler sampler;
+        sampler_init(&sampler, V, 1, configs[c]);
+        int bad = 0, boundary = 0, count_sum = 0;
+        for (int r = 0; r < ROWS; r++) {
+            const float* row = logits + (size_t)r * V;
+            float total;
+            int count = sampler_candidates(&sampler, row, sampler.indices, sampler.values, &total);
+            int ref_count = reference_candidates(reference, row, V, configs[c]);
+            count_sum += count;
+            for (int j = 0; j < count; j++) { mine[j].index = sampler.indices[j]; mine[j].value = sampler.values[j]; }
+            if (abs(count - ref_count) == 1 && configs[c].top_p < 1.0f) {
+                // the last token of the nucleus, where the sums differ in their last bits
+                boundary++;
+                count = ref_count = count < ref_count ? count : ref_count;
+                qsort(mine, count, sizeof(Candidate), compare_descending);
+            } else if (count != ref_count) {
+                bad++;
+                continue;
+            }
+            qsort(mine, count, sizeof(Candidate), compare_index);
+            qsort(reference, ref_count, sizeof(Candidate), compare_index);
+            float mass = 0.0f;
+            for (int j = 0; j < count; j++) {
+                bad += mine[j].index != reference[j].index || mine[j].value != reference[j].value;
+                mass += mine[j].value;
+            }
+            bad += boundary == 0 && fabsf(mass - total) > 1e-4f * total;
+        }
+        int ok = bad == 0;
+        printf("candidates, %-36s: %6.1f per row, %d differ, %d at the nucleus boundary: %s\n",
+               names[c], (float)count_sum / ROWS, bad, boundary, ok ? "OK" : "FAIL");
+        allok &= ok;
+        sampler_free(&sampler);
+    }
+
+    // sample frequencies on a small vocabulary, with top-k 8 and temperature 0.7
+    {
+        int n = 64, samples = 400000;
+        SamplerConfig config = {0.7f, 8, 1.0f, 0.0f};
+        Sampler sampler;
+        sampler_init(&sampler, n, 1, config);
+        float small[64];
+        make_logits(small, n, &state);
+        int ref_count = reference_candidates(reference, small, n, config);
+        double sum = 0.0;
+        for (int j = 0; j < ref_count; j++) { sum += reference[j].value; }
+        int counts[64] = {0};
+        for (int s = 0; s < samples; s++) { counts[sampler_sample(&sampler, small, random_f32(&state))]++; }
+        double max_z = 0.0;
+        int outside = samples;
+        for (int j = 0; j < ref_count; j++) {
+            double p = reference[j].value / sum;
+            double z = fabs(counts[reference[j].index] - p * samples) / sqrt(samples * p * (1 - p) + 1e-9);
+            if (z > max_z) { max_z = z; }
+            outside -= counts[reference[j].index];
+        }
+        int ok = max_z < 5.0 && outside == 0;
+        printf("frequencies of %d samples: max %.2f standard deviations off, %d outside the top-k: %s\n", samples, max_z, outside, ok ? "OK" : "FAIL");
+        allok &= ok;
+        sampler_free(&sampler);
+    }
+    // speculative sampling: drafts from q (temperature 1.5), kept or replaced under p
+    // (temperature 0.8, top-p 0.95), must be distributed as p
+    {
+        int n = 64, samples = 400000;
+        float small[64], p[64], q[64];
+        make_logits(small, n, &state);
+        SamplerConfig target_config = {0.8f, 0, 0.95f, 0.0f}, draft_config = {1.5f, 0, 1.0f, 0.0f};
+        Sampler target, draft;
+        sampler_init(&target, n, 1, target_config);
+        sampler_init(&draft, n, 1, draft_config);
+        sampler_probs(&target, small, p);
+        sampler_probs(&draft, small, q);
+        int counts[64] = {0};
+        int accepted = 0;
+        for (int s = 0; s < samples; s++) {
+            int token = sample_mult(q, n, random_f32(&state));
+            if (sampler_speculative_accept(p, q, token, random_f32(&state))) {
+                accepted++;
+            } else {
+                token = sampler_speculative_residual(p, q, n, random_f32(&state));
+            }
+            counts[token]++;
+        }
+        double max_z = 0.0;
+        int outside = 0;
+        for (int j = 0; j < n; j++) {
+            if (p[j] == 0.0f) { outside += counts[j]; continue; }
+            double z = fabs(counts[j] - (double)p[j] * samples) / sqrt(samples * p[j] * (1 - p[j]));
+            if (z > max_z) { max_z = z; }
+        }
+        int ok = max_z < 5.0 && outside == 0;
+        printf("speculative sampling, %d samples, %.1f%% accepted: max %.2f standard deviations off p, %d outside it: %s\n",
+               samples, 100.0 * accepted / samples, max_z, outside, ok ? "OK" : "FAIL");
+        allok &= ok;
+        sampler_free(&target);
+        sampler_free(&draft);
+    }
+    if (!allok) { printf("overall okay: 0\n"); return EXIT_FAILURE; }
+
+    // benchmarks, one row at a time
+    printf("\nmicroseconds per sampled token, V = %d:\n", V);
+    volatile int sink = 0;
+    double start = now_s();
+    for (int i = 0; i < RUNS; i++) {
+        softmax_cpu(probs, logits + (size_t)(i % ROWS) * V, V);
+        sink += sample_mult(probs, V, random_f32(&state));
+    }
+    printf("%-48s %8.1f\n", "softmax + sample_mult", (now_s() - start) / RUNS * 1e6);
+    start = now_s();
+    for (int i = 0; i < RUNS; i++) { sink += sample_softmax(logits + (size_t)(i % ROWS) * V, V, random_f32(&state)); }
+    printf("%-48s %8.1f\n", "sample_softmax", (now_s() - start) / RUNS * 1e6);
+    for (int c = 0; c < num_configs; c++) {
+        Sampler sampler;
+        sampler_init(&sampler, V, ROWS, configs[c]);
+        start = now_s();
+        for (int i = 0; i < RUNS; i++) { sink += sampler_sample(&sampler, logits + (size_t)(i % ROWS) * V, random_f32(&state)); }
+        char label[64];
+        snprintf(label, sizeof(label), "Sampler, %s", names[c]);
+        printf("%-48s %8.1f\n", label, (now_s() - start) / RUNS * 1e6);
+        sampler_free(&sampler);
+    }
+    start = now_s();
+    for (int i = 0; i < RUNS; i++) {
+        reference_candidates(reference, logits + (size_t)(i % ROWS) * V, V, configs[1]);
+        sink += reference[0].index;
+    }
+    printf("%-48s %8.1f\n", "top-k 40 by qsort", (now_s() - start) / RUNS * 1e6);
+
+    // batched: ROWS rows at once, each with its own rng state, over the threads
+    {
+        Sampler sampler;
+        sampler_init(&sampler, V, ROWS, configs[4]);
+        unsigned long long states[ROWS];
+        int tokens[ROWS];
+        for (int r = 0; r < ROWS; r++) { states[r] = 1000 + r; }
+        start = now_s();
+        for (int i = 0; i < RUNS / ROWS; i++) { sampler_sample_rows(&sampler, logits, ROWS, V, states, tokens); }
+        char label[64];
+        snprintf(label, sizeof(label), "sampler_sample_rows, %d rows, per row", ROWS);
+        printf("%-48s %8.1f\n", label, (now_s() - start) / (RUNS / ROWS * ROWS) * 1e6);
+        sampler_free(&sampler);
+    }
+    printf("overall okay: 1\n");
+    return sink == 12345 ? 1 : EXIT_SUCCESS;
+}
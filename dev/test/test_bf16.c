@@ -0,0 +1,138 @@
+/*
+Tests llmc/bf16.h: round to nearest even against a reference, the vectorized row
+conversion against the scalar one, that stochastic rounding is unbiased, and the
+dot product tiles against double precision, for every tile size
+
+compile and run as (from dev/test directory)
+make test_bf16 && ./test_bf16
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "../../llmc/bf16.h"
+
+// sweep float bit patterns with this stride
+#define STRIDE 4099
+
+float float_from_bits(uint32_t b) { float f; memcpy(&f, &b, 4); return f; }
+
+// the nearest bf16, ties to even, from the two candidates around f
+bf16 reference_round(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, 4);
+    bf16 lo = (bf16)(bits >> 16);
+    bf16 hi = (bf16)(lo + 1);
+    double dlo = fabs((double)f - bf16_to_float(lo));
+    // above the largest bf16, the next value is 2^128, which is rounded to infinity. the
+    // bits tell infinity, isinf doesn't under -ffinite-math-only (-Ofast)
+    double vhi = (hi & 0x7fff) == 0x7f80 ? copysign(ldexp(1.0, 128), f) : bf16_to_float(hi);
+    double dhi = fabs((double)f - vhi);
+    if (dlo < dhi) { return lo; }
+    if (dhi < dlo) { return hi; }
+    return (lo & 1) ? hi : lo;
+}
+
+int main(void) {
+    int allok = 1;
+
+    // round to nearest even, for all finite, normal floats (sampled)
+    int bad = 0;
+    long count = 0;
+    for (uint64_t b = 0x00800000; b < 0xff800000ull; b += STRIDE) {
+        uint32_t bits = (uint32_t)b;
+        if ((bits & 0x7f800000) == 0x7f800000 || (bits & 0x7f800000) == 0) { continue; }
+        float f = float_from_bits(bits);
+        bad += float_to_bf16(f) != reference_round(f);
+        count++;
+    }
+    bf16 nan = float_to_bf16(NAN);
+    int ok = bad == 0 && nan != float_to_bf16(INFINITY) && (nan & 0x7f80) == 0x7f80 && (nan & 0x7f) != 0;
+    printf("float_to_bf16: %d of %ld wrong: %s\n", bad, count, ok ? "OK" : "FAIL");
+    allok &= ok;
+
+    // the row conversion (AVX512-BF16 if available) matches the scalar one
+    int n = 1000;
+    float* x = (float*)malloc(n * sizeof(float));
+    bf16* y = (bf16*)malloc(n * sizeof(bf16));
+    srand(1337);
+    for (int i = 0; i < n; i++) { x[i] = ((float)rand() / RAND_MAX * 2.0f - 1.0f) * powf(2.0f, rand() % 40 - 20); }
+    bf16_from_float_row(y, x, n);
+    bad = 0;
+    for (int i = 0; i < n; i++) { bad += y[i] != float_to_bf16(x[i]); }
+    ok = bad == 0;
+    printf("bf16_from_float_row: %d of %d differ: %s\n", bad, n, ok ? "OK" : "FAIL");
+    allok &= ok;
+
+    // stochastic rounding is unbiased: the mean of many roundings of x is x
+    double max_bias = 0.0;
+    for (int k = 0; k < 100; k++) {
+        float f = x[k];
+        double mean = 0.0;
+        int samples = 1 << 16;
+        for (int s = 0; s < samples; s++) { mean += bf16_to_float(float_to_bf16_stochastic(f, bf16_random(s, k))); }
+        mean /= samples;
+        // in units of the spacing of bf16 around f
+        double ulp = fabs(bf16_to_float(float_to_bf16(f) + 1) - bf16_to_float(float_to_bf16(f)));
+        double bias = fabs(mean - f) / ulp;
+        if (bias > max_bias) { max_bias = bias; }
+    }
+    ok = max_bias < 0.01;
+    printf("stochastic rounding: max bias %.4f of a bf16 step: %s\n", max_bias, ok ? "OK" : "FAIL");
+    allok &= ok;
+
+    // small updates to a bf16 weight: lost with round to nearest, kept in expectation with
+    // stochastic rounding (as in gpt2_update, but without the fp32 master weight)
+    bf16 w_nearest = float_to_bf16(1.0f), w_stochastic = float_to_bf16(1.0f);
+    for (int step = 0; step < 10000; step++) {
+        w_nearest = float_to_bf16(bf16_to_float(w_nearest) + 1e-4f);
+        w_stochastic = float_to_bf16_stochastic(bf16_to_float(w_stochastic) + 1e-4f, bf16_random(0, step));
+    }
+    ok = bf16_to_float(w_nearest) == 1.0f && fabsf(bf16_to_float(w_stochastic) - 2.0f) < 0.1f;
+    printf("1 + 10000 * 1e-4: %f round to nearest, %f stochastic: %s\n", bf16_to_float(w_nearest), bf16_to_float(w_stochastic), ok ? "OK" : "FAIL");
+    allok &= ok;
+
+    // the dot product tiles, every tile size, against double precision, and against the
+    // same dot products computed as 1x1 tiles (which must give the same bits)
+    int sizes[] = {1, 31, 32, 100, 768};
+    double max_err = 0.0;
+    bad = 0;
+    for (int si = 0; si < 5; si++) {
+        int len = sizes[si];
+        bf16* a = (bf16*)malloc(BF16_TILE_ROWS * len * sizeof(bf16));
+        bf16* b = (bf16*)malloc(BF16_TILE_COLS * len * sizeof(bf16));
+        for (int i = 0; i < BF16_TILE_ROWS * len; i++) { a[i] = float_to_bf16((float)rand() / RAND_MAX * 2.0f - 1.0f); }
+        for (int i = 0; i < BF16_TILE_COLS * len; i++) { b[i] = float_to_bf16((float)rand() / RAND_MAX * 2.0f - 1.0f); }
+        for (int rows = 1; rows <= BF16_TILE_ROWS; rows++) {
+            for (int cols = 1; cols <= BF16_TILE_COLS; cols++) {
+                float out[BF16_TILE_ROWS * BF16_TILE_COLS];
+                bf16_dot_tile(out, BF16_TILE_COLS, a, len, rows, b, len, cols, len);
+                for (int r = 0; r < rows; r++) {
+                    for (int c = 0; c < cols; c++) {
+                        double ref = 0.0, mag = 0.0;
+                        for (int i = 0; i < len; i++) {
+                            double p = (double)bf16_to_float(a[r * len + i]) * bf16_to_float(b[c * len + i]);
+                            ref += p;
+                            mag += fabs(p);
+                        }
+                        double err = fabs(out[r * BF16_TILE_COLS + c] - ref) / mag;
+                        if (err > max_err) { max_err = err; }
+                        float single;
+                        bf16_dot_tile(&single, 1, a + r * len, len, 1, b + c * len, len, 1, len);
+                        bad += single != out[r * BF16_TILE_COLS + c];
+                    }
+                }
+            }
+        }
+        free(a);
+        free(b);
+    }
+    ok = max_err < 1e-6 && bad == 0;
+    printf("bf16_dot_tile: max error %.2e (relative to the sum of |products|), %d differ by tile size: %s\n", max_err, bad, ok ? "OK" : "FAIL");
+    allok &= ok;
+
+    free(x);
+    free(y);
+    printf("overall okay: %d\n", allok);
+    return allok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,102 @@
+/*
+Tests the accuracy of llmc/fastmath.h against double precision references,
+and against the libm versions that the kernels used before (expf, tanhf, coshf)
+
+compile and run as (from dev/test directory)
+make test_fastmath && ./test_fastmath
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "../../llmc/fastmath.h"
+
+// sweep float bit patterns with this stride, i.e. every 16th float in the range
+#define STRIDE 16
+
+// the error of y in units of the last place of the correctly rounded float result
+double ulp_error(float y, double ref) {
+    float ref_f = (float)ref;
+    if (ref_f == 0.0f) { return y == 0.0f ? 0.0 : INFINITY; }
+    int e;
+    frexpf(ref_f, &e);
+    double ulp = ldexp(1.0, e - 24);
+    return fabs((double)y - ref) / ulp;
+}
+
+float float_from_bits(uint32_t b) { float f; memcpy(&f, &b, 4); return f; }
+uint32_t bits_from_float(float f) { uint32_t b; memcpy(&b, &f, 4); return b; }
+
+int check(const char* label, double err, double bound) {
+    int ok = err <= bound;
+    printf("%-44s %10.3g (bound %g) %s\n", label, err, bound, ok ? "OK" : "FAIL");
+    return ok;
+}
+
+int main(void) {
+    int allok = 1;
+
+    // exp over the normal range, both signs
+    double exp_fast = 0.0, exp_libm = 0.0;
+    for (int sign = 0; sign < 2; sign++) {
+        float limit = sign ? 87.33f : 88.37f;
+        for (uint32_t b = 0; b <= bits_from_float(limit); b += STRIDE) {
+            float x = float_from_bits(b | (sign ? 0x80000000u : 0u));
+            double ref = exp((double)x);
+            double e1 = ulp_error(fast_expf(x), ref);
+            double e2 = ulp_error(expf(x), ref);
+            if (e1 > exp_fast) { exp_fast = e1; }
+            if (e2 > exp_libm) { exp_libm = e2; }
+        }
+    }
+    printf("%-44s %10.3g\n", "expf (libm) max ulp", exp_libm);
+    allok &= check("fast_expf max ulp on [-87.33, 88.37]", exp_fast, 2.0);
+    // the clamped ends
+    allok &= check("fast_expf(-100) flushed to zero", fast_expf(-100.0f), 0.0);
+    allok &= check("fast_expf(100) saturates instead of inf", isinf(fast_expf(100.0f)) ? 1.0 : 0.0, 0.0);
+
+    // tanh over all normal |x| up to 20 (it is +-1 in float long before that), both signs
+    double tanh_fast = 0.0, tanh_libm = 0.0, sech2_fast = 0.0;
+    for (int sign = 0; sign < 2; sign++) {
+        for (uint32_t b = bits_from_float(1e-30f); b <= bits_from_float(20.0f); b += STRIDE) {
+            float x = float_from_bits(b | (sign ? 0x80000000u : 0u));
+            double ref = tanh((double)x);
+            float t = fast_tanhf(x);
+            double e1 = ulp_error(t, ref);
+            double e2 = ulp_error(tanhf(x), ref);
+            if (e1 > tanh_fast) { tanh_fast = e1; }
+            if (e2 > tanh_libm) { tanh_libm = e2; }
+            double c = cosh((double)x);
+            double e3 = ulp_error(fast_sech2f(x), 1.0 / (c * c));
+            if (e3 > sech2_fast) { sech2_fast = e3; }
+        }
+    }
+    printf("%-44s %10.3g\n", "tanhf (libm) max ulp", tanh_libm);
+    allok &= check("fast_tanhf max ulp", tanh_fast, 3.0);
+    allok &= check("fast_tanhf(+-30) is exactly +-1", fabs(fast_tanhf(30.0f) - 1.0f) + fabs(fast_tanhf(-30.0f) + 1.0f), 0.0);
+    allok &= check("fast_sech2f max ulp", sech2_fast, 5.0);
+
+    // GeLU forward and backward, as in train_gpt2.c, vs the libm formulas they replaced,
+    // on the range where activations live. Errors relative to max(1, |reference|)
+    float s = sqrtf(2.0f / M_PI);
+    double gelu_err = 0.0, dgelu_err = 0.0;
+    for (float x = -20.0f; x <= 20.0f; x += 1.0f / 1024) {
+        float cube = 0.044715f * x * x * x;
+        float arg = s * (x + cube);
+        float old_gelu = 0.5f * x * (1.0f + tanhf(arg));
+        float new_gelu = 0.5f * x * (1.0f + fast_tanhf(arg));
+        double c = cosh((double)arg);
+        double old_dgelu = 0.5 * (1.0 + tanh((double)arg)) + x * 0.5 / (c * c) * s * (1.0f + 3.0f * 0.044715f * x * x);
+        float t = fast_tanhf(arg);
+        float new_dgelu = 0.5f * (1.0f + t) + x * 0.5f * fast_sech2f(arg) * s * (1.0f + 3.0f * 0.044715f * x * x);
+        double e1 = fabs((double)new_gelu - old_gelu) / fmax(1.0, fabs(old_gelu));
+        double e2 = fabs((double)new_dgelu - old_dgelu) / fmax(1.0, fabs(old_dgelu));
+        if (e1 > gelu_err) { gelu_err = e1; }
+        if (e2 > dgelu_err) { dgelu_err = e2; }
+    }
+    allok &= check("gelu forward max error vs libm tanhf", gelu_err, 1e-6);
+    allok &= check("gelu backward max error vs double reference", dgelu_err, 1e-5);
+
+    printf("overall okay: %d\n", allok);
+    return allok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
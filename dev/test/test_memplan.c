@@ -0,0 +1,74 @@
+/*
+Tests the memory planner of llmc/memplan.h: tensors that are alive at the same
+time must never overlap, and the plan should stay close to the live peak
+
+compile and run as (from dev/test directory)
+make test_memplan && ./test_memplan
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include "../../llmc/memplan.h"
+
+#define NUM_TENSORS 500
+#define NUM_STEPS 200
+#define ALIGNMENT 16
+
+int check_plan(MemPlanTensor* t, int n, size_t total) {
+    for (int i = 0; i < n; i++) {
+        if (!memplan_is_used(&t[i])) { continue; }
+        if (t[i].offset % ALIGNMENT != 0 || t[i].offset + t[i].size > total) {
+            printf("tensor %d misplaced: offset %zu size %zu total %zu\n", i, t[i].offset, t[i].size, total);
+            return 0;
+        }
+        for (int j = 0; j < i; j++) {
+            if (!memplan_is_used(&t[j]) || !memplan_alive_together(&t[i], &t[j])) { continue; }
+            if (t[i].offset < t[j].offset + t[j].size && t[j].offset < t[i].offset + t[i].size) {
+                printf("tensors %d and %d overlap\n", i, j);
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+int main(void) {
+    int allok = 1;
+    srand(1337);
+
+    // random lifetimes and sizes, some tensors never used
+    MemPlanTensor t[NUM_TENSORS];
+    memplan_init(t, NUM_TENSORS);
+    size_t sum = 0;
+    for (int i = 0; i < NUM_TENSORS; i++) {
+        t[i].size = 1 + rand() % 10000;
+        if (rand() % 10 == 0) { continue; }
+        int a = rand() % NUM_STEPS;
+        int b = a + rand() % 20;
+        memplan_use(&t[i], b);
+        memplan_use(&t[i], a);
+        sum += t[i].size;
+    }
+    size_t total = memplan_assign(t, NUM_TENSORS, ALIGNMENT);
+    size_t peak = memplan_peak(t, NUM_TENSORS, ALIGNMENT);
+    int ok = check_plan(t, NUM_TENSORS, total) && total >= peak;
+    printf("random: sum %zu, planned %zu, live peak %zu (%.2fx peak): %s\n", sum, total, peak, (double)total / peak, ok ? "OK" : "FAIL");
+    allok &= ok;
+
+    // a chain like the layers of a backward pass: a, then b = f(a), then c = g(b), ...
+    // every tensor is alive together with its neighbours only, so 2 of the largest suffice
+    MemPlanTensor chain[NUM_STEPS];
+    memplan_init(chain, NUM_STEPS);
+    for (int i = 0; i < NUM_STEPS; i++) {
+        chain[i].size = 1000 * (1 + i % 4);
+        memplan_use(&chain[i], i);
+        memplan_use(&chain[i], i + 1);
+    }
+    total = memplan_assign(chain, NUM_STEPS, ALIGNMENT);
+    peak = memplan_peak(chain, NUM_STEPS, ALIGNMENT);
+    ok = check_plan(chain, NUM_STEPS, total) && total == peak;
+    printf("chain: planned %zu, live peak %zu: %s\n", total, peak, ok ? "OK" : "FAIL");
+    allok &= ok;
+
+    printf("overall okay: %d\n", allok);
+    return allok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,198 @@
+/*
+Tests the prefix cache of llmc/prefixcache.h over the paged KV cache of llmc/kvcache.h.
+Stands in for the model with keys and values that are a hash of the tokens up to each
+position, as the real ones depend on the whole prefix. Requests share a few system
+prompts, reuse the cached prefixes, decode, roll back (into shared blocks too) and end,
+under a small budget and pool. Every position must always read back the hash of its own
+prefix, the blocks must be accounted for, and the tree must stay within its budget
+
+compile and run as (from dev/test directory)
+make test_prefixcache && ./test_prefixcache
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include "../../llmc/prefixcache.h"
+
+#define NUM_REQUESTS 2000
+#define NUM_PROMPTS 6 // system prompts
+#define MAX_T 256
+#define POOL_BLOCKS 96
+#define BUDGET_BLOCKS 48
+#define LIVE 3 // requests in flight
+
+unsigned int prefix_hash(const int* tokens, int t) {
+    unsigned int h = 2166136261u;
+    for (int i = 0; i <= t; i++) { h = (h ^ (unsigned int)tokens[i]) * 16777619u; }
+    return h;
+}
+
+// "runs the model" over positions cache->pos to n - 1: writes the hashes of their prefixes
+void fill(KVCache* cache, const int* tokens, int n) {
+    if (!kvcache_reserve(cache, n - cache->pos)) {
+        printf("pool out of blocks\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int t = cache->pos; t < n; t++) {
+        unsigned int h = prefix_hash(tokens, t);
+        kvcache_key(cache, 0, 0, t)[0] = (float)(h & 0xffff);
+        kvcache_value(cache, 0, 0, t)[0] = (float)(h >> 16);
+    }
+    cache->pos = n;
+}
+
+int check_cache(const KVCache* cache, const int* tokens) {
+    for (int t = 0; t < cache->pos; t++) {
+        unsigned int h = prefix_hash(tokens, t);
+        if (kvcache_key(cache, 0, 0, t)[0] != (float)(h & 0xffff) || kvcache_value(cache, 0, 0, t)[0] != (float)(h >> 16)) {
+            printf("position %d of %d reads back the wrong keys and values\n", t, cache->pos);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// the holders of each block must be the tree and the live caches, and the rest free
+int check_blocks(const PrefixCache* pc, KVCache* caches, int* live) {
+    const KVPool* pool = pc->pool;
+    int refs[POOL_BLOCKS] = {0};
+    int tree_blocks = 0;
+    for (int i = 0; i < pc->num_nodes; i++) {
+        for (int b = 0; b < pc->nodes[i]->num_blocks; b++) { refs[pc->nodes[i]->blocks[b]]++; }
+        tree_blocks += pc->nodes[i]->num_blocks;
+    }
+    for (int s = 0; s < LIVE; s++) {
+        if (!live[s]) { continue; }
+        for (int b = 0; b < caches[s].num_blocks; b++) { refs[caches[s].block_table[b]]++; }
+    }
+    int free_blocks = 0;
+    for (int b = 0; b < POOL_BLOCKS; b++) {
+        if (refs[b] != pool->ref_counts[b]) {
+            printf("block %d has %d holders, counted %d\n", b, refs[b], pool->ref_counts[b]);
+            return 0;
+        }
+        free_blocks += refs[b] == 0;
+    }
+    if (free_blocks != pool->num_free || tree_blocks != pc->num_blocks) {
+        printf("free blocks %d, pool says %d; tree blocks %d, tree says %d\n", free_blocks, pool->num_free, tree_blocks, pc->num_blocks);
+        return 0;
+    }
+    return 1;
+}
+
+int main(void) {
+    int allok = 1;
+    srand(1337);
+    KVPool pool;
+    kvpool_init(&pool, 1, 1, 1, POOL_BLOCKS, 0);
+    PrefixCache pc;
+    prefixcache_init(&pc, &pool, BUDGET_BLOCKS);
+
+    // system prompts of 20 to 100 tokens, the first two sharing their first 40
+    int prompts[NUM_PROMPTS][100];
+    int prompt_len[NUM_PROMPTS];
+    for (int p = 0; p < NUM_PROMPTS; p++) {
+        prompt_len[p] = 20 + rand() % 81;
+        for (int i = 0; i < 100; i++) { prompts[p][i] = rand() % 50; }
+    }
+    prompt_len[0] = prompt_len[1] = 90;
+    for (int i = 0; i < 40; i++) { prompts[1][i] = prompts[0][i]; }
+
+    KVCache caches[LIVE];
+    int tokens[LIVE][MAX_T];
+    int live[LIVE] = {0};
+    int max_tree = 0;
+    for (int r = 0; r < NUM_REQUESTS && allok; r++) {
+        int s = r % LIVE;
+        if (live[s]) {
+            // the request in this slot ends: check it, maybe cache its whole sequence
+            allok &= check_cache(&caches[s], tokens[s]);
+            if (rand() % 4 == 0) { prefixcache_insert(&pc, tokens[s], caches[s].pos, &caches[s]); }
+            kvcache_free(&caches[s]);
+            prefixcache_trim(&pc);
+            live[s] = 0;
+        }
+        // a new request: a system prompt, a question, and a reply
+        int p = rand() % NUM_PROMPTS;
+        int n = prompt_len[p] + 1 + rand() % 40;
+        for (int i = 0; i < prompt_len[p]; i++) { tokens[s][i] = prompts[p][i]; }
+        for (int i = prompt_len[p]; i < MAX_T; i++) { tokens[s][i] = rand() % 50; }
+        kvcache_init(&caches[s], &pool, MAX_T);
+        live[s] = 1;
+        int matched = prefixcache_match(&pc, tokens[s], n, &caches[s]);
+        if (matched % KV_BLOCK_SIZE != 0 || matched >= n) {
+            printf("matched %d of %d tokens\n", matched, n);
+            allok = 0;
+        }
+        allok &= check_cache(&caches[s], tokens[s]);
+        // make room in the pool for the rest of the request, past the blocks it shares
+        int need = kv_blocks(n + 48) + 1 - caches[s].num_blocks;
+        if (pool.num_free < need) { prefixcache_evict(&pc, need - pool.num_free); }
+        fill(&caches[s], tokens[s], n);
+        prefixcache_insert(&pc, tokens[s], n, &caches[s]);
+        // decode, and now and then roll back, possibly into the shared blocks
+        int end = n + 8 + rand() % 40;
+        fill(&caches[s], tokens[s], end);
+        if (rand() % 3 == 0) {
+            int back = rand() % end;
+            kvcache_truncate(&caches[s], back);
+            for (int i = back; i < MAX_T; i++) { tokens[s][i] = rand() % 50; }
+            fill(&caches[s], tokens[s], back + 1 + rand() % 8);
+        }
+        allok &= check_cache(&caches[s], tokens[s]);
+        allok &= check_blocks(&pc, caches, live);
+        if (pc.num_blocks > max_tree) { max_tree = pc.num_blocks; }
+    }
+    printf("%lld lookups, hit rate %.2f, %.2f of the prompt tokens found, %lld blocks cached, %lld evicted\n",
+           pc.stats.lookups, prefixcache_hit_rate(&pc), prefixcache_token_hit_rate(&pc),
+           pc.stats.inserted_blocks, pc.stats.evicted_blocks);
+    int ok = max_tree <= BUDGET_BLOCKS && prefixcache_hit_rate(&pc) > 0.5f && pc.stats.evicted_blocks > 0;
+    printf("tree at most %d blocks of a budget of %d, with hits and evictions: %s\n", max_tree, BUDGET_BLOCKS, ok ? "OK" : "FAIL");
+    allok &= ok;
+
+    // once no sequence holds blocks of the tree, it trims down to its budget
+    for (int s = 0; s < LIVE; s++) {
+        if (live[s]) { kvcache_free(&caches[s]); }
+    }
+    prefixcache_trim(&pc);
+    ok = pc.num_blocks <= BUDGET_BLOCKS;
+    printf("tree within its budget with no sequences left: %s\n", ok ? "OK" : "FAIL");
+    allok &= ok;
+
+    // a match that is given back leaves the pool and the stats as they were
+    KVCache cache;
+    PrefixCacheStats stats = pc.stats;
+    int num_free = pool.num_free;
+    kvcache_init(&cache, &pool, MAX_T);
+    int n = prompt_len[0] + 1;
+    prefixcache_match(&pc, prompts[0], n, &cache);
+    prefixcache_unmatch(&pc, n, &cache);
+    kvcache_free(&cache);
+    ok = pool.num_free == num_free && memcmp(&stats, &pc.stats, sizeof(stats)) == 0;
+    printf("an undone match changes nothing: %s\n", ok ? "OK" : "FAIL");
+    allok &= ok;
+
+    // and with a budget of 0, it caches nothing
+    PrefixCache none;
+    prefixcache_init(&none, &pool, 0);
+    kvcache_init(&cache, &pool, MAX_T);
+    fill(&cache, tokens[0], 4 * KV_BLOCK_SIZE);
+    prefixcache_insert(&none, tokens[0], cache.pos, &cache);
+    kvcache_free(&cache);
+    kvcache_init(&cache, &pool, MAX_T);
+    int matched = prefixcache_match(&none, tokens[0], cache.max_seq_len, &cache);
+    kvcache_free(&cache);
+    ok = none.num_blocks == 0 && matched == 0;
+    printf("a budget of 0 caches nothing: %s\n", ok ? "OK" : "FAIL");
+    allok &= ok;
+    prefixcache_free(&none);
+
+    // every block goes back to the pool
+    prefixcache_free(&pc);
+    ok = pool.num_free == POOL_BLOCKS;
+    printf("all blocks free at the end: %s\n", ok ? "OK" : "FAIL");
+    allok &= ok;
+    kvpool_free(&pool);
+
+    printf("overall okay: %d\n", allok);
+    return allok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
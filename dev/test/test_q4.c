@@ -0,0 +1,116 @@
+/*
+Tests llmc/q4.h: fp16 conversions against a reference, that quantization to q4 is within
+half a step of every weight, and the dot product tiles against double precision on the
+dequantized weights, for every tile size
+
+compile and run as (from dev/test directory)
+make test_q4 && ./test_q4
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "../../llmc/q4.h"
+
+// the nearest half, ties to even, by search over all finite halves of the same sign
+fp16 reference_fp16(float f) {
+    fp16 sign = signbit(f) ? 0x8000 : 0;
+    double a = fabs((double)f);
+    if (a >= 65520.0) { return sign | 0x7c00; }
+    fp16 best = 0;
+    double best_err = 1e30;
+    for (fp16 h = 0; h < 0x7c00; h++) {
+        double err = fabs(a - fp16_to_float(h));
+        if (err < best_err || (err == best_err && (h & 1) == 0)) { best = h; best_err = err; }
+    }
+    return sign | best;
+}
+
+float randf(void) { return (float)rand() / RAND_MAX * 2.0f - 1.0f; }
+
+int main(void) {
+    int allok = 1;
+    srand(1337);
+
+    // every half converts to float and back to itself
+    int bad = 0;
+    for (uint32_t h = 0; h < 0x10000; h++) {
+        if ((h & 0x7c00) == 0x7c00 && (h & 0x3ff) != 0) { continue; } // NaN
+        bad += float_to_fp16(fp16_to_float((fp16)h)) != h;
+    }
+    // and floats round to the nearest one: random magnitudes, halfway points, subnormals
+    int count = 0;
+    for (int k = 0; k < 2000; k++) {
+        float f;
+        if (k % 3 == 0) { f = randf() * powf(2.0f, rand() % 40 - 25); }
+        else if (k % 3 == 1) { fp16 h = rand() % 0x7bff; f = 0.5f * (fp16_to_float(h) + fp16_to_float(h + 1)); }
+        else { f = randf() * 6.1e-05f; }
+        bad += float_to_fp16(f) != reference_fp16(f);
+        count++;
+    }
+    int ok = bad == 0 && float_to_fp16(1e6f) == 0x7c00 && (float_to_fp16(NAN) & 0x7fff) > 0x7c00;
+    printf("fp16: %d of %d wrong: %s\n", bad, 0x10000 - 2046 + count, ok ? "OK" : "FAIL");
+    allok &= ok;
+
+    // quantization: every weight is within half a step (plus the rounding of the scale and
+    // min to fp16) of its dequantized value
+    int rows = 16, n = 768;
+    float* w = (float*)malloc(rows * n * sizeof(float));
+    for (int i = 0; i < rows * n; i++) { w[i] = randf() * 0.1f * (1 + i / n); }
+    for (int i = 0; i < Q4_GROUP; i++) { w[i] = 0.25f; } // a constant group, scale 0
+    q4_block* blocks = (q4_block*)malloc(rows * n / Q4_GROUP * sizeof(q4_block));
+    q4_quantize_rows(blocks, w, rows, n);
+    float* deq = (float*)malloc(rows * n * sizeof(float));
+    for (int r = 0; r < rows; r++) { q4_dequantize_row(deq + r * n, blocks + r * n / Q4_GROUP, n); }
+    double max_err = 0.0;
+    for (int g = 0; g < rows * n / Q4_GROUP; g++) {
+        float lo = w[g * Q4_GROUP], hi = lo;
+        for (int i = 0; i < Q4_GROUP; i++) { lo = fminf(lo, w[g * Q4_GROUP + i]); hi = fmaxf(hi, w[g * Q4_GROUP + i]); }
+        double step = (hi - lo) / 15.0;
+        for (int i = 0; i < Q4_GROUP; i++) {
+            double err = fabs(deq[g * Q4_GROUP + i] - w[g * Q4_GROUP + i]) - 0.5 * step;
+            double slack = 1e-3 * (fabs(lo) + fabs(hi)) + 1e-7;
+            if (err / slack > max_err) { max_err = err / slack; }
+        }
+    }
+    ok = max_err <= 1.0 && deq[0] == fp16_to_float(float_to_fp16(0.25f));
+    printf("q4_quantize_rows: error beyond half a step %.3f of the fp16 slack: %s\n", max_err, ok ? "OK" : "FAIL");
+    allok &= ok;
+
+    // the dot product tiles, every tile size, against double precision, and against the
+    // same dot products computed as 1x1 tiles (which must give the same bits)
+    float* a = (float*)malloc(Q4_TILE_ROWS * n * sizeof(float));
+    for (int i = 0; i < Q4_TILE_ROWS * n; i++) { a[i] = randf(); }
+    max_err = 0.0;
+    bad = 0;
+    int shapes[][2] = {{Q4_TILE_ROWS, Q4_TILE_COLS}, {1, Q4_ROW_TILE_COLS}, {3, 2}, {1, 5}, {8, 1}};
+    for (int s = 0; s < 5; s++) {
+        int tr = shapes[s][0], tc = shapes[s][1];
+        float out[Q4_TILE_ROWS * Q4_ROW_TILE_COLS];
+        q4_dot_tile(out, tc, a, n, tr, blocks, n / Q4_GROUP, tc, n);
+        for (int r = 0; r < tr; r++) {
+            for (int c = 0; c < tc; c++) {
+                double ref = 0.0, mag = 0.0;
+                for (int i = 0; i < n; i++) {
+                    ref += (double)a[r * n + i] * deq[c * n + i];
+                    mag += fabs((double)a[r * n + i] * deq[c * n + i]);
+                }
+                double err = fabs(out[r * tc + c] - ref) / mag;
+                if (err > max_err) { max_err = err; }
+                float single;
+                q4_dot_tile(&single, 1, a + r * n, n, 1, blocks + c * n / Q4_GROUP, n / Q4_GROUP, 1, n);
+                bad += single != out[r * tc + c];
+            }
+        }
+    }
+    ok = max_err < 1e-5 && bad == 0;
+    printf("q4_dot_tile: max error %.2e (relative to the sum of |products|), %d differ by tile size: %s\n", max_err, bad, ok ? "OK" : "FAIL");
+    allok &= ok;
+
+    free(w);
+    free(blocks);
+    free(deq);
+    free(a);
+    printf("overall okay: %d\n", allok);
+    return allok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,6 +1,9 @@
 // must run `python layernorm.py` first to generate the reference data
 // then compile for example as `gcc layernorm.c -o layernorm -lm`
 // and then run as `./layernorm` to see the output
+// this also checks the single-pass (Welford) statistics that train_gpt2.c uses,
+// layernorm_row_stats below is a copy of it. When changing one, change the other,
+// and compile this with -Ofast -march=native too, the way train_gpt2.c is compiled
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -43,6 +46,68 @@ void layernorm_forward(float* out, float* mean, float* rstd,
     }
 }
 
+// the single-pass version of the mean and rstd, as in train_gpt2.c: Welford's running
+// mean and M2 = sum((x - mean)^2) in LAYERNORM_LANES interleaved lanes, merged pairwise
+#define LAYERNORM_LANES 16
+void layernorm_row_stats(float* mean, float* rstd, const float* x, int C) {
+    float eps = 1e-5f;
+    float lane_mean[LAYERNORM_LANES];
+    float lane_m2[LAYERNORM_LANES];
+    float lane_n[LAYERNORM_LANES];
+    int full = C / LAYERNORM_LANES;
+    for (int j = 0; j < LAYERNORM_LANES; j++) {
+        lane_mean[j] = 0.0f;
+        lane_m2[j] = 0.0f;
+        lane_n[j] = (float)full;
+    }
+    for (int k = 0; k < full; k++) {
+        const float* x_k = x + k * LAYERNORM_LANES;
+        float inv_n = 1.0f / (float)(k + 1);
+        for (int j = 0; j < LAYERNORM_LANES; j++) {
+            float delta = x_k[j] - lane_mean[j];
+            lane_mean[j] += delta * inv_n;
+            lane_m2[j] += delta * (x_k[j] - lane_mean[j]);
+        }
+    }
+    for (int j = 0; j < C - full * LAYERNORM_LANES; j++) {
+        float xj = x[full * LAYERNORM_LANES + j];
+        lane_n[j] += 1.0f;
+        float delta = xj - lane_mean[j];
+        lane_mean[j] += delta / lane_n[j];
+        lane_m2[j] += delta * (xj - lane_mean[j]);
+    }
+    for (int stride = 1; stride < LAYERNORM_LANES; stride *= 2) {
+        for (int j = 0; j + stride < LAYERNORM_LANES; j += 2 * stride) {
+            float na = lane_n[j];
+            float nb = lane_n[j + stride];
+            if (nb == 0.0f) { continue; }
+            float n = na + nb;
+            float delta = lane_mean[j + stride] - lane_mean[j];
+            lane_mean[j] += delta * (nb / n);
+            lane_m2[j] += lane_m2[j + stride] + delta * delta * (na * nb / n);
+            lane_n[j] = n;
+        }
+    }
+    *mean = lane_mean[0];
+    *rstd = 1.0f / sqrtf(lane_m2[0] / C + eps);
+}
+
+void layernorm_forward_welford(float* out, float* mean, float* rstd,
+                               float* inp, float* weight, float* bias,
+                               int B, int T, int C) {
+    for (int bt = 0; bt < B * T; bt++) {
+        float* x = inp + bt * C;
+        float m, s;
+        layernorm_row_stats(&m, &s, x, C);
+        float* out_bt = out + bt * C;
+        for (int i = 0; i < C; i++) {
+            out_bt[i] = (s * (x[i] - m)) * weight[i] + bias[i];
+        }
+        mean[bt] = m;
+        rstd[bt] = s;
+    }
+}
+
 void layernorm_backward(float* dinp, float* dweight, float* dbias,
                         float* dout, float* inp, float* weight, float* mean, float* rstd,
                         int B, int T, int C) {
@@ -86,27 +151,27 @@ void layernorm_backward(float* dinp, float* dweight, float* dbias,
     }
 }
 
-// poor man's tensor checker
-int check_tensor(float *a, float *b, int n, char* label) {
+// poor man's tensor checker, prints every element if verbose, else just the max error
+int check_tensor(float *a, float *b, int n, char* label, float tol, int verbose) {
     int ok = 1;
+    float maxdiff = 0.0f;
     printf("%s\n", label);
     for (int i = 0; i < n; i++) {
-        if (fabs(a[i] - b[i]) <= 1e-5) {
-            printf("OK ");
-        } else {
-            printf("NOT OK ");
-            ok = 0;
+        float diff = fabsf(a[i] - b[i]);
+        maxdiff = diff > maxdiff ? diff : maxdiff;
+        if (diff > tol) { ok = 0; }
+        if (verbose) {
+            printf(diff <= tol ? "OK " : "NOT OK ");
+            printf("%f %f\n", a[i], b[i]);
         }
-        printf("%f %f\n", a[i], b[i]);
     }
+    if (!verbose) { printf("%s max diff %e\n", ok ? "OK" : "NOT OK", maxdiff); }
     return ok;
 }
 
-int main() {
-
-    int B = 2; // batch
-    int T = 3; // time / sequence length
-    int C = 4; // number of channels
+// reads the reference data written by layernorm.py and checks our forward and backward
+// passes against it. Returns 1 if everything matched
+int check_case(const char* filename, int B, int T, int C, float tol, int verbose) {
 
     float* x = (float*) malloc(B * T * C * sizeof(float));
     float* w = (float*) malloc(C * sizeof(float));
@@ -120,10 +185,10 @@ int main() {
     float* db = (float*) malloc(C * sizeof(float));
 
     // read reference information from Python
-    FILE *file = fopen("ln.bin", "rb");
+    FILE *file = fopen(filename, "rb");
     if (file == NULL) {
-        printf("Error opening file\n");
-        return 1;
+        printf("Error opening file %s\n", filename);
+        return 0;
     }
     fread(x, sizeof(float), B * T * C, file);
     fread(w, sizeof(float), C, file);
@@ -138,6 +203,7 @@ int main() {
     fclose(file);
 
     // now let's calculate everything ourselves
+    int ok = 1;
 
     // forward pass
     float* c_out = (float*) malloc(B * T * C * sizeof(float));
@@ -146,20 +212,26 @@ int main() {
     layernorm_forward(c_out, c_mean, c_rstd, x, w, b, B, T, C);
 
     // check correctness of forward pass
-    check_tensor(out, c_out, B*T*C, "out");
-    check_tensor(mean, c_mean, B*T, "mean");
-    check_tensor(rstd, c_rstd, B*T, "rstd");
+    ok &= check_tensor(out, c_out, B*T*C, "out", tol, verbose);
+    ok &= check_tensor(mean, c_mean, B*T, "mean", tol, verbose);
+    ok &= check_tensor(rstd, c_rstd, B*T, "rstd", tol, verbose);
+
+    // and of the single-pass forward pass of train_gpt2.c
+    layernorm_forward_welford(c_out, c_mean, c_rstd, x, w, b, B, T, C);
+    ok &= check_tensor(out, c_out, B*T*C, "out (welford)", tol, verbose);
+    ok &= check_tensor(mean, c_mean, B*T, "mean (welford)", tol, verbose);
+    ok &= check_tensor(rstd, c_rstd, B*T, "rstd (welford)", tol, verbose);
 
     // backward pass (note calloc inits grads to zero)
     float* c_dx = (float*) calloc(B * T * C, sizeof(float));
-    float* c_dw = (float*) calloc(B * T, sizeof(float));
-    float* c_db = (float*) calloc(B * T, sizeof(float));
+    float* c_dw = (float*) calloc(C, sizeof(float));
+    float* c_db = (float*) calloc(C, sizeof(float));
     layernorm_backward(c_dx, c_dw, c_db, dout, x, w, c_mean, c_rstd, B, T, C);
 
     // check correctness of backward pass
-    check_tensor(c_dx, dx, B*T*C, "dx");
-    check_tensor(c_dw, dw, C, "dw");
-    check_tensor(c_db, db, C, "db");
+    ok &= check_tensor(c_dx, dx, B*T*C, "dx", tol, verbose);
+    ok &= check_tensor(c_dw, dw, C, "dw", tol, verbose);
+    ok &= check_tensor(c_db, db, C, "db", tol, verbose);
 
     free(x);
     free(w);
@@ -171,5 +243,21 @@ int main() {
     free(dx);
     free(dw);
     free(db);
-    return 0;
+    free(c_out);
+    free(c_mean);
+    free(c_rstd);
+    free(c_dx);
+    free(c_dw);
+    free(c_db);
+    return ok;
+}
+
+int main() {
+    // the small example from the tutorial, B = 2, T = 3, C = 4, printed in full
+    int ok = check_case("ln.bin", 2, 3, 4, 1e-5f, 1);
+    // a larger one, with rows whose mean is large compared to their spread. The gradients
+    // sum over B*T = 256 rows, so the tolerance is relative to their size
+    ok &= check_case("ln_large.bin", 4, 64, 771, 1e-3f, 0);
+    printf("overall okay: %d\n", ok);
+    return ok ? 0 : 1;
 }
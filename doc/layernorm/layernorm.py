@@ -68,3 +68,30 @@ with open('ln.bin', 'wb') as file:
     write(dx, file) # (B, T, C)
     write(dw, file) # (C, )
     write(db, file) # (C, )
+
+# a larger case, for the single-pass statistics of train_gpt2.c: C is not a multiple of
+# the vector width, and the mean of each row is large compared to its standard deviation,
+# which is where one-pass variance formulas lose their precision. The reference is
+# computed in double precision, from inputs that are exactly representable in float
+B = 4
+T = 64
+C = 771
+x = (torch.randn(B, T, C) + 50.0).double()
+w = torch.randn(C, dtype=torch.float64)
+b = torch.randn(C, dtype=torch.float64)
+out, cache = LayerNorm.forward(x, w, b)
+dout = torch.randn(B, T, C).double()
+dx, dw, db = LayerNorm.backward(dout, cache)
+x, w, mean, rstd = cache
+
+with open('ln_large.bin', 'wb') as file:
+    write(x, file) # (B, T, C)
+    write(w, file) # (C, )
+    write(b, file) # (C, )
+    write(out, file) # (B, T, C)
+    write(mean, file) # (B, T)
+    write(rstd, file) # (B, T)
+    write(dout, file) # (B, T, C)
+    write(dx, file) # (B, T, C)
+    write(dw, file) # (C, )
+    write(db, file) # (C, )
@@ -0,0 +1,169 @@
+/*
+Compares the int8 KV cache with the fp32 one (see llmc/kvcache.h), for decoding on CPU.
+
+At B=1, a decode step reads the weights and the KV cache of the sequence so far, and the
+cache grows with the context: at T=1024 it is 72 MB for GPT-2 small and 600 MB for
+GPT-2 XL, as much as or more than the weights, once they are quantized (see
+quantize_gpt2.c). The int8 cache stores 3.8x fewer bytes per position, which lets more
+streams fit in RAM (and in cache), and takes that much off the bytes that a decode step
+reads, more the longer the context.
+
+First the quality. It samples texts with the fp32 cache, and scores them with both
+caches, as the model's perplexity on them: it fails if that of the int8 cache is worse
+by more than KV_INT8_PERPLEXITY_TOLERANCE. It also samples texts with the int8 cache and
+scores them with the fp32 one, next to those sampled with the fp32 cache, as a check on
+what the int8 cache generates. Then the speed: the time of a decode step at a few lengths
+of the context, with either cache.
+
+compile and run as:
+make kvcache_gpt2 && ./kvcache_gpt2 [model.bin] [tokens] [texts]
+e.g.
+./kvcache_gpt2 gpt2_124M.bin 1024 4
+./kvcache_gpt2 gpt2_124M_q4.bin 1024 4
+*/
+#define TESTING
+#include "train_gpt2.c"
+
+// how much worse (relative) the perplexity may be with the int8 cache than with fp32
+#define KV_INT8_PERPLEXITY_TOLERANCE 0.01f
+#define TIMED_STEPS 8 // decode steps timed at each length of the context
+
+double seconds_since(struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void init_cache(KVPool* pool, KVCache* cache, GPT2* model, int int8, int max_seq_len) {
+    kvpool_init(pool, model->config.num_layers, model->config.num_heads, model->config.channels, kv_blocks(max_seq_len), int8);
+    kvcache_init(cache, pool, max_seq_len);
+}
+
+void free_cache(KVPool* pool, KVCache* cache) {
+    kvcache_free(cache);
+    kvpool_free(pool);
+}
+
+// samples n tokens, the first one given, with a KV cache of either format
+void sample_text(GPT2* model, Sampler* sampler, int int8, int* tokens, int n, unsigned long long rng_state) {
+    KVPool pool;
+    KVCache cache;
+    init_cache(&pool, &cache, model, int8, n);
+    for (int t = 1; t < n; t++) {
+        float* logits = gpt2_forward_cached(model, &cache, tokens + t - 1, 1);
+        tokens[t] = sampler_sample(sampler, logits, random_f32(&rng_state));
+    }
+    free_cache(&pool, &cache);
+}
+
+// the model's perplexity on tokens[1..n), given the tokens before each, with a KV cache
+// of either format. the text goes through GPT2_CACHED_ROWS positions at a time
+double perplexity(GPT2* model, int int8, const int* tokens, int n) {
+    size_t V = model->config.vocab_size;
+    size_t Vp = model->config.padded_vocab_size;
+    KVPool pool;
+    KVCache cache;
+    init_cache(&pool, &cache, model, int8, n);
+    double nll = 0.0;
+    for (int done = 0; done < n - 1;) {
+        int rows = n - 1 - done < GPT2_CACHED_ROWS ? n - 1 - done : GPT2_CACHED_ROWS;
+        const float* logits = gpt2_forward_cached(model, &cache, (int*)tokens + done, rows);
+        for (int r = 0; r < rows; r++) {
+            const float* logits_r = logits + r * Vp;
+            float maxval = -INFINITY;
+            for (int i = 0; i < V; i++) { maxval = fmaxf(maxval, logits_r[i]); }
+            double sum = 0.0;
+            for (int i = 0; i < V; i++) { sum += expf(logits_r[i] - maxval); }
+            nll += maxval + log(sum) - logits_r[tokens[done + r + 1]];
+        }
+        done += rows;
+    }
+    free_cache(&pool, &cache);
+    return exp(nll / (n - 1));
+}
+
+// the seconds per decode step after ctx positions of tokens, with a KV cache of either format
+double time_decode(GPT2* model, int int8, const int* tokens, int ctx) {
+    KVPool pool;
+    KVCache cache;
+    init_cache(&pool, &cache, model, int8, ctx + TIMED_STEPS);
+    gpt2_forward_cached(model, &cache, (int*)tokens, ctx);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < TIMED_STEPS; i++) {
+        gpt2_forward_cached(model, &cache, (int*)tokens + ctx + i, 1);
+    }
+    double s = seconds_since(&start) / TIMED_STEPS;
+    free_cache(&pool, &cache);
+    return s;
+}
+
+int main(int argc, char** argv) {
+    const char* model_path = argc > 1 ? argv[1] : "gpt2_124M.bin";
+    GPT2 model;
+    gpt2_build_from_checkpoint(&model, model_path);
+    int maxT = model.config.max_seq_len;
+    int n = argc > 2 ? atoi(argv[2]) : maxT;
+    int num_texts = argc > 3 ? atoi(argv[3]) : 4;
+    if (n < 2 * TIMED_STEPS || n > maxT || num_texts < 1) {
+        printf("Error: texts of %d tokens must be in [%d, %d], and at least one\n", n, 2 * TIMED_STEPS, maxT);
+        exit(EXIT_FAILURE);
+    }
+
+    KVPool fp32_pool, int8_pool;
+    kvpool_init(&fp32_pool, model.config.num_layers, model.config.num_heads, model.config.channels, 1, 0);
+    kvpool_init(&int8_pool, model.config.num_layers, model.config.num_heads, model.config.channels, 1, 1);
+    size_t fp32_bytes = kvpool_position_bytes(&fp32_pool);
+    size_t int8_bytes = kvpool_position_bytes(&int8_pool);
+    kvpool_free(&fp32_pool);
+    kvpool_free(&int8_pool);
+    printf("KV cache per position: fp32 %.1f KB, int8 %.1f KB (%.2fx less), %.1f MB and %.1f MB per stream at T=%d\n",
+           fp32_bytes / 1024.0, int8_bytes / 1024.0, (double)fp32_bytes / int8_bytes,
+           fp32_bytes * (double)maxT / (1 << 20), int8_bytes * (double)maxT / (1 << 20), maxT);
+
+    // the texts: sampled at temperature 1 after the last token, GPT-2's EOT token
+    Sampler sampler;
+    sampler_init(&sampler, model.config.vocab_size, 1, sampler_default_config());
+    int* texts = (int*)mallocCheck((size_t)2 * num_texts * n * sizeof(int));
+    double ppl[2][2] = {{0.0}}; // [sampled with int8][scored with int8], the geometric means
+    printf("\n%-6s %-12s %14s %14s\n", "text", "sampled with", "fp32 cache ppl", "int8 cache ppl");
+    for (int i = 0; i < num_texts; i++) {
+        for (int sampled_int8 = 0; sampled_int8 < 2; sampled_int8++) {
+            int* text = texts + (size_t)(2 * i + sampled_int8) * n;
+            text[0] = model.config.vocab_size - 1;
+            sample_text(&model, &sampler, sampled_int8, text, n, 1337 + i);
+            double fp32_ppl = perplexity(&model, 0, text, n);
+            ppl[sampled_int8][0] += log(fp32_ppl) / num_texts;
+            if (sampled_int8) {
+                printf("%-6d %-12s %14.3f %14s\n", i, "int8", fp32_ppl, "");
+            } else {
+                double int8_ppl = perplexity(&model, 1, text, n);
+                ppl[0][1] += log(int8_ppl) / num_texts;
+                printf("%-6d %-12s %14.3f %14.3f\n", i, "fp32", fp32_ppl, int8_ppl);
+            }
+        }
+    }
+    float worse = exp(ppl[0][1] - ppl[0][0]) - 1.0;
+    int ok = worse <= KV_INT8_PERPLEXITY_TOLERANCE;
+    printf("texts sampled with the fp32 cache: perplexity %.3f with it, %.3f with the int8 cache (%+.2f%%, tolerance %.1f%%): %s\n",
+           exp(ppl[0][0]), exp(ppl[0][1]), 100.0f * worse, 100.0f * KV_INT8_PERPLEXITY_TOLERANCE, ok ? "OK" : "FAIL");
+    printf("texts sampled with the int8 cache: perplexity %.3f with the fp32 cache (%+.2f%% vs those sampled with it)\n",
+           exp(ppl[1][0]), 100.0 * (exp(ppl[1][0] - ppl[0][0]) - 1.0));
+
+    // the speed of a decode step at a few lengths of the context, in the first text
+    printf("\n%8s %14s %14s %9s %16s\n", "context", "fp32 ms/token", "int8 ms/token", "speedup", "int8 KV MB");
+    int last = n - TIMED_STEPS;
+    for (int ctx = 64 < last ? 64 : last; ; ctx = 2 * ctx < last ? 2 * ctx : last) {
+        double fp32_s = time_decode(&model, 0, texts, ctx);
+        double int8_s = time_decode(&model, 1, texts, ctx);
+        printf("%8d %14.2f %14.2f %8.2fx %16.1f\n", ctx, fp32_s * 1e3, int8_s * 1e3, fp32_s / int8_s,
+               int8_bytes * (double)ctx / (1 << 20));
+        if (ctx == last) { break; }
+    }
+
+    free(texts);
+    sampler_free(&sampler);
+    gpt2_free(&model);
+    printf("overall okay: %d\n", ok);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,201 @@
+/*
+A region ("arena") allocator for the large buffers of the CPU model: the parameters,
+their gradients, the AdamW moments and the activations. Everything is freed at once
+with arena_free.
+
+- Large allocations (>= 2 MB) start close to a 2 MB boundary, everything else on a 64
+  byte cache line. Not exactly on it: on 2 MB pages the physical addresses are contiguous,
+  so buffers that all start on a 2 MB boundary map to the same cache sets, and a loop
+  that streams through several of them at the same index (e.g. params, grads, m and v
+  in the AdamW update) keeps evicting its own lines, ~4x slower in dev/cpu/arena.c.
+- So the n-th large allocation is shifted by (n % ARENA_COLOURS) * ARENA_COLOUR_BYTES
+  past the boundary, which puts the buffers on different cache sets.
+- On Linux the blocks are mmap'ed and marked with madvise(MADV_HUGEPAGE), so with
+  transparent huge pages in "madvise" (or "always") mode they are backed by 2 MB pages:
+  one TLB entry covers 512x more memory, and e.g. the optimizer's streaming pass over
+  ~2 GB of state, or the gather of embedding rows, stops missing in the TLB.
+- The memory is not touched when it is allocated. Linux places every page on the NUMA
+  node of the thread that first writes it, so if the main thread memsets or fread()s a
+  buffer, all of it lands on one socket and the threads on the other socket read it
+  remotely. arena_first_touch zeroes a range with an OpenMP schedule(static) loop over
+  its pages, so that the page of every element ends up on the node of the thread that a
+  schedule(static) loop over the same range hands that element to. For this to mean
+  anything the threads must be pinned, e.g. OMP_PROC_BIND=spread OMP_PLACES=cores.
+
+Blocks are reserved in multiples of ARENA_BLOCK_BYTES (only the touched pages are ever
+backed by memory), and an allocation that doesn't fit in the last block starts a new one.
+dev/cpu/arena.c measures the effect of both on TLB misses and remote memory accesses.
+*/
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define ARENA_HUGE_PAGE (2 * 1024 * 1024)
+#define ARENA_ALIGNMENT 64
+#define ARENA_PAGE 4096
+#define ARENA_BLOCK_BYTES ((size_t)64 * 1024 * 1024)
+#define ARENA_MAX_BLOCKS 64
+#define ARENA_COLOURS 16
+#define ARENA_COLOUR_BYTES (ARENA_PAGE + ARENA_ALIGNMENT)
+
+typedef struct {
+    char* base;
+    size_t size;
+    size_t used;
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock blocks[ARENA_MAX_BLOCKS];
+    int num_blocks;
+    size_t bytes_allocated; // sum of the requested sizes
+    int num_large; // number of allocations of at least ARENA_HUGE_PAGE, for the colouring
+} Arena;
+
+void arena_init(Arena* arena) {
+    arena->num_blocks = 0;
+    arena->bytes_allocated = 0;
+    arena->num_large = 0;
+}
+
+size_t arena_round_up(size_t n, size_t alignment) {
+    return (n + alignment - 1) / alignment * alignment;
+}
+
+// a new block of at least size bytes (a multiple of ARENA_HUGE_PAGE), on a 2 MB boundary
+char* arena_map_block(size_t size) {
+#ifdef _WIN32
+    char* base = (char*)_aligned_malloc(size, ARENA_HUGE_PAGE);
+    return base;
+#else
+    // over-allocate by one huge page and trim, so that the start is aligned
+    size_t mapped = size + ARENA_HUGE_PAGE;
+    char* raw = (char*)mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) { return NULL; }
+    char* base = (char*)arena_round_up((size_t)raw, ARENA_HUGE_PAGE);
+    if (base > raw) { munmap(raw, base - raw); }
+    char* end = base + size;
+    if (raw + mapped > end) { munmap(end, raw + mapped - end); }
+#ifdef MADV_HUGEPAGE
+    madvise(base, size, MADV_HUGEPAGE);
+#endif
+    return base;
+#endif
+}
+
+void* arena_alloc(Arena* arena, size_t bytes) {
+    int large = bytes >= ARENA_HUGE_PAGE;
+    size_t alignment = large ? ARENA_HUGE_PAGE : ARENA_ALIGNMENT;
+    size_t colour = large ? (size_t)(arena->num_large % ARENA_COLOURS) * ARENA_COLOUR_BYTES : 0;
+    ArenaBlock* block = arena->num_blocks > 0 ? &arena->blocks[arena->num_blocks - 1] : NULL;
+    size_t offset = block != NULL ? arena_round_up(block->used, alignment) + colour : colour;
+    if (block == NULL || offset + bytes > block->size) {
+        if (arena->num_blocks == ARENA_MAX_BLOCKS) {
+            fprintf(stderr, "Error: arena is out of blocks (%d)\n", ARENA_MAX_BLOCKS);
+            exit(EXIT_FAILURE);
+        }
+        size_t needed = colour + bytes;
+        size_t size = arena_round_up(needed > ARENA_BLOCK_BYTES ? needed : ARENA_BLOCK_BYTES, ARENA_HUGE_PAGE);
+        char* base = arena_map_block(size);
+        if (base == NULL) {
+            fprintf(stderr, "Error: arena failed to map %zu bytes\n", size);
+            exit(EXIT_FAILURE);
+        }
+        block = &arena->blocks[arena->num_blocks++];
+        block->base = base;
+        block->size = size;
+        block->used = 0;
+        offset = colour;
+    }
+    arena->num_large += large;
+    block->used = offset + bytes;
+    arena->bytes_allocated += bytes;
+    return block->base + offset;
+}
+
+// zeroes [ptr, ptr + bytes) from the OpenMP threads, each writing the pages of its
+// schedule(static) share first, which places them on its NUMA node (see top)
+void arena_first_touch(void* ptr, size_t bytes) {
+    // the loop goes over the pages themselves, not ARENA_PAGE chunks from ptr: the large
+    // allocations don't start on a page (see ARENA_COLOUR_BYTES), so such chunks would
+    // each span two pages, written by two threads. the first and last pages, which only
+    // partially belong to the range, are clipped to it
+    uintptr_t start = (uintptr_t)ptr;
+    uintptr_t end = start + bytes;
+    uintptr_t first_page = start / ARENA_PAGE;
+    long num_pages = bytes == 0 ? 0 : (long)((end + ARENA_PAGE - 1) / ARENA_PAGE - first_page);
+    #pragma omp parallel for schedule(static)
+    for (long p = 0; p < num_pages; p++) {
+        uintptr_t page_start = (first_page + p) * ARENA_PAGE;
+        uintptr_t from = page_start > start ? page_start : start;
+        uintptr_t to = page_start + ARENA_PAGE < end ? page_start + ARENA_PAGE : end;
+        memset((void*)from, 0, to - from);
+    }
+}
+
+void arena_free(Arena* arena) {
+    for (int i = 0; i < arena->num_blocks; i++) {
+#ifdef _WIN32
+        _aligned_free(arena->blocks[i].base);
+#else
+        munmap(arena->blocks[i].base, arena->blocks[i].size);
+#endif
+    }
+    arena_init(arena);
+}
+
+// how many bytes of the arena are currently backed by transparent huge pages, from the
+// AnonHugePages of its mappings in /proc/self/smaps. -1 where that is not available
+long long arena_huge_page_bytes(const Arena* arena) {
+#ifdef __linux__
+    FILE* f = fopen("/proc/self/smaps", "r");
+    if (f == NULL) { return -1; }
+    char line[512];
+    int in_arena = 0;
+    long long total = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        unsigned long start, end;
+        long long kb;
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            in_arena = 0;
+            for (int i = 0; i < arena->num_blocks; i++) {
+                unsigned long b = (unsigned long)arena->blocks[i].base;
+                if (start < b + arena->blocks[i].size && b < end) { in_arena = 1; }
+            }
+        } else if (in_arena && sscanf(line, "AnonHugePages: %lld kB", &kb) == 1) {
+            total += kb * 1024;
+        }
+    }
+    fclose(f);
+    return total;
+#else
+    return -1;
+#endif
+}
+
+void arena_print_report(const Arena* arena) {
+    size_t reserved = 0;
+    for (int i = 0; i < arena->num_blocks; i++) { reserved += arena->blocks[i].size; }
+    long long huge = arena_huge_page_bytes(arena);
+    printf("arena: %.1f MB allocated in %d blocks (%.1f MB reserved), ",
+           arena->bytes_allocated / 1e6, arena->num_blocks, reserved / 1e6);
+    if (huge >= 0) {
+        printf("%.1f MB on 2 MB pages\n", huge / 1e6);
+    } else {
+        printf("huge pages unknown\n");
+    }
+}
+
+#endif
@@ -0,0 +1,138 @@
+/*
+bfloat16 for the CPU kernels: conversions, stochastic rounding and dot products.
+
+bf16 is the upper half of an fp32: the same 8 bit exponent, and 7 instead of 23 bits of
+mantissa. Converting to fp32 is a shift, and from fp32 we round to nearest even, or
+stochastically: a value between two bf16 neighbours rounds up with probability equal to
+its distance from the lower one, so the rounding error is zero in expectation.
+
+The dot products multiply bf16 by bf16 and accumulate in fp32. With AVX512-BF16 (e.g.
+-march=native on Cooper Lake, Sapphire Rapids, Zen 4) they use vdpbf16ps, 32 products
+per instruction. Elsewhere they are emulated in fp32, which gives the same products
+(a product of two bf16 is exact in fp32) but sums them in a different order, so the
+results differ in the last bits between the two.
+*/
+#ifndef BF16_H
+#define BF16_H
+
+#include <stdint.h>
+#include <string.h>
+#if defined(__AVX512BF16__)
+#include <immintrin.h>
+#endif
+
+typedef uint16_t bf16;
+
+// the largest tile of bf16_dot_tile
+#define BF16_TILE_ROWS 8
+#define BF16_TILE_COLS 2
+
+float bf16_to_float(bf16 x) {
+    uint32_t bits = (uint32_t)x << 16;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// round to nearest, ties to even
+bf16 float_to_bf16(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    if ((bits & 0x7fffffff) > 0x7f800000) { return (bf16)((bits >> 16) | 0x0040); } // NaN stays (quiet) NaN
+    bits += 0x7fff + ((bits >> 16) & 1);
+    return (bf16)(bits >> 16);
+}
+
+// round up with probability (f - lower) / (upper - lower), where random is uniform over
+// 32 bits (its low 16 are used). infinities and NaN are truncated, which keeps them
+bf16 float_to_bf16_stochastic(float f, uint32_t random) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    if ((bits & 0x7f800000) != 0x7f800000) { bits += random & 0xffff; }
+    return (bf16)(bits >> 16);
+}
+
+// SquirrelNoise5, a hash of (position, seed) that is as good as a random number, so the
+// rounding of every element is independent, and the same whichever thread does it
+uint32_t bf16_random(uint32_t position, uint32_t seed) {
+    uint32_t bits = position;
+    bits *= 0xd2a80a3f;
+    bits += seed;
+    bits ^= (bits >> 9);
+    bits += 0xa884f197;
+    bits ^= (bits >> 11);
+    bits *= 0x6c736f4b;
+    bits ^= (bits >> 13);
+    bits += 0xb79f3abb;
+    bits ^= (bits >> 15);
+    bits *= 0x1b56c4f5;
+    bits ^= (bits >> 17);
+    return bits;
+}
+
+// out[i] = float_to_bf16(in[i]) for i < n
+void bf16_from_float_row(bf16* out, const float* in, int n) {
+    int i = 0;
+#if defined(__AVX512BF16__)
+    for (; i + 16 <= n; i += 16) {
+        __m256bh v = _mm512_cvtneps_pbh(_mm512_loadu_ps(in + i));
+        _mm256_storeu_si256((__m256i*)(out + i), (__m256i)v);
+    }
+#endif
+    for (; i < n; i++) { out[i] = float_to_bf16(in[i]); }
+}
+
+// out[r * ldo + c] = sum_i a[r * lda + i] * b[c * ldb + i], for r < rows, c < cols and
+// i < n: a tile of the dot products of a few rows of a with a few rows of b, which loads
+// every vector of a once for all the rows of b and vice versa. rows <= BF16_TILE_ROWS,
+// cols <= BF16_TILE_COLS. every dot product is summed in the same order, whatever the
+// size of the tile it is in
+void bf16_dot_tile(float* out, int ldo, const bf16* a, int lda, int rows, const bf16* b, int ldb, int cols, int n) {
+    float acc[BF16_TILE_ROWS][BF16_TILE_COLS] = {{0.0f}};
+    int i = 0;
+#if defined(__AVX512BF16__)
+    if (rows == BF16_TILE_ROWS && cols == BF16_TILE_COLS) {
+        // the common case: with a constant tile size the accumulators stay in registers
+        __m512 vacc[BF16_TILE_ROWS][BF16_TILE_COLS];
+        for (int r = 0; r < BF16_TILE_ROWS; r++) {
+            for (int c = 0; c < BF16_TILE_COLS; c++) { vacc[r][c] = _mm512_setzero_ps(); }
+        }
+        for (; i + 32 <= n; i += 32) {
+            __m512bh vb[BF16_TILE_COLS];
+            for (int c = 0; c < BF16_TILE_COLS; c++) { vb[c] = (__m512bh)_mm512_loadu_si512(b + (size_t)c * ldb + i); }
+            for (int r = 0; r < BF16_TILE_ROWS; r++) {
+                __m512bh va = (__m512bh)_mm512_loadu_si512(a + (size_t)r * lda + i);
+                for (int c = 0; c < BF16_TILE_COLS; c++) { vacc[r][c] = _mm512_dpbf16_ps(vacc[r][c], va, vb[c]); }
+            }
+        }
+        for (int r = 0; r < BF16_TILE_ROWS; r++) {
+            for (int c = 0; c < BF16_TILE_COLS; c++) { acc[r][c] = _mm512_reduce_add_ps(vacc[r][c]); }
+        }
+    } else {
+        for (int r = 0; r < rows; r++) {
+            for (int c = 0; c < cols; c++) {
+                __m512 vacc = _mm512_setzero_ps();
+                for (int j = 0; j + 32 <= n; j += 32) {
+                    vacc = _mm512_dpbf16_ps(vacc, (__m512bh)_mm512_loadu_si512(a + (size_t)r * lda + j),
+                                            (__m512bh)_mm512_loadu_si512(b + (size_t)c * ldb + j));
+                }
+                acc[r][c] = _mm512_reduce_add_ps(vacc);
+            }
+        }
+    }
+    i = n / 32 * 32;
+#endif
+    for (int r = 0; r < rows; r++) {
+        for (int c = 0; c < cols; c++) {
+            const bf16* ar = a + (size_t)r * lda;
+            const bf16* bc = b + (size_t)c * ldb;
+            float sum = acc[r][c];
+            for (int j = i; j < n; j++) {
+                sum += bf16_to_float(ar[j]) * bf16_to_float(bc[j]);
+            }
+            out[r * ldo + c] = sum;
+        }
+    }
+}
+
+#endif
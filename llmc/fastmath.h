@@ -0,0 +1,88 @@
+/*
+Vectorizable single precision exp, tanh and sech^2, for the CPU kernels.
+
+libm's expf/tanhf/coshf are opaque calls, so a loop over them runs one element at a
+time, and the GeLU/softmax kernels end up bound by libm instead of memory bandwidth.
+The functions below are plain arithmetic and bit manipulation, with no branches and no
+tables, so that when they are inlined into a loop the compiler can vectorize it
+(they are also marked "omp declare simd" for loops outside of this translation unit).
+
+Accuracy, measured by dev/test/test_fastmath.c against double precision references:
+- fast_expf: max 2 ULP for x in [-87.33, 88.37], the range where the result is a normal
+  float below 2^128 / 1.42. Below it the result is flushed to 0 (instead of going through
+  the denormals), above it it saturates at exp(88.37) ~= 2.4e38 instead of overflowing.
+  NaN inputs are not supported.
+- fast_tanhf: max 3 ULP over all finite x. An odd polynomial for |x| < 0.625, above that
+  (1 - e) / (1 + e) with e = exp(-2|x|), which is exactly +-1 once e is below 2^-25.
+- fast_sech2f: sech^2(x) = 1 - tanh^2(x), from the same e as tanh: 4e / (1 + e)^2. Max
+  5 ULP. Unlike (1 - t)(1 + t) from t = tanh(x), this keeps its relative precision when
+  tanh(x) rounds to +-1, and inlined next to fast_tanhf the exp is computed only once.
+*/
+#ifndef FASTMATH_H
+#define FASTMATH_H
+
+#include <stdint.h>
+#include <math.h>
+
+typedef union {
+    float f;
+    int32_t i;
+} FloatBits;
+
+// exp(x), by range reduction x = n*ln(2) + r with |r| <= ln(2)/2, a degree 6 polynomial
+// for exp(r) (the Cephes coefficients), and a multiplication by 2^n built from its bits
+#pragma omp declare simd
+float fast_expf(float x) {
+    // clamp to the range where 2^n is a normal float, n in [-126, 127]
+    float xc = x < -87.33654f ? -87.33654f : x;
+    xc = xc > 88.37626f ? 88.37626f : xc;
+    float n = floorf(xc * 1.44269504088896341f + 0.5f);
+    n = n > 127.0f ? 127.0f : n;
+    // r = x - n*ln(2), with ln(2) split into two parts so that n*C1 is exact. The fmafs
+    // keep -Ofast from re-associating this back into x - n*ln(2), which costs ~60 ULP at |x| ~ 70
+    float r = fmaf(n, -0.693359375f, xc);
+    r = fmaf(n, 2.12194440e-4f, r);
+    float r2 = r * r;
+    float p = 1.9875691500e-4f;
+    p = p * r + 1.3981999507e-3f;
+    p = p * r + 8.3334519073e-3f;
+    p = p * r + 4.1665795894e-2f;
+    p = p * r + 1.6666665459e-1f;
+    p = p * r + 5.0000001201e-1f;
+    p = p * r2 + r + 1.0f;
+    FloatBits scale;
+    scale.i = ((int32_t)n + 127) << 23;
+    float y = p * scale.f;
+    return x < -87.33654f ? 0.0f : y;
+}
+
+// tanh(x). For |x| < 0.625 an odd polynomial (the Cephes tanhf coefficients), where
+// (1 - e) / (1 + e) would lose its relative precision to cancellation
+#pragma omp declare simd
+float fast_tanhf(float x) {
+    float ax = x < 0.0f ? -x : x;
+    // small |x|
+    float z = x * x;
+    float p = -5.70498872745e-3f;
+    p = p * z + 2.06390887954e-2f;
+    p = p * z - 5.37397155531e-2f;
+    p = p * z + 1.33314422036e-1f;
+    p = p * z - 3.33332819422e-1f;
+    float small = p * z * x + x;
+    // large |x|
+    float e = fast_expf(-2.0f * ax);
+    float large = (1.0f - e) / (1.0f + e);
+    large = x < 0.0f ? -large : large;
+    return ax < 0.625f ? small : large;
+}
+
+// sech^2(x) = 1 - tanh^2(x), the derivative of tanh(x)
+#pragma omp declare simd
+float fast_sech2f(float x) {
+    float ax = x < 0.0f ? -x : x;
+    float e = fast_expf(-2.0f * ax);
+    float d = 1.0f + e;
+    return 4.0f * e / (d * d);
+}
+
+#endif
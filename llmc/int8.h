@@ -0,0 +1,97 @@
+/*
+int8 weights for CPU inference: quantization with a scale per row, and dot products of
+fp32 vectors with int8 rows.
+
+A row w of n weights is stored as q = round(w / scale) in [-127, 127] with
+scale = max|w| / 127, so every row uses the whole int8 range whatever its magnitude. The
+dot products convert the int8 values to fp32 as they load them (exactly) and multiply
+and accumulate in fp32; the caller applies the scale of the row to the result. Only the
+weights are quantized: the activations stay fp32, so the error is that of the weights
+alone. What is gained is memory traffic, a quarter of the bytes of fp32 weights, which
+is what bounds a matmul with a few rows of input, as when decoding.
+*/
+#ifndef INT8_H
+#define INT8_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+#if defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+// the tiles of int8_dot_tile: a full tile of rows, and a single row with more columns
+#define INT8_TILE_ROWS 8
+#define INT8_TILE_COLS 2
+#define INT8_ROW_TILE_COLS 8
+
+// q[r * n + i] = round(w[r * n + i] / scale[r]), for rows of n weights. a row of zeros
+// (e.g. the padding of wte) gets scale 0 and all q 0
+void int8_quantize_rows(int8_t* q, float* scale, const float* w, size_t rows, size_t n) {
+    for (size_t r = 0; r < rows; r++) {
+        const float* w_r = w + r * n;
+        float absmax = 0.0f;
+        for (size_t i = 0; i < n; i++) { absmax = fmaxf(absmax, fabsf(w_r[i])); }
+        scale[r] = absmax / 127.0f;
+        float inv_scale = absmax > 0.0f ? 127.0f / absmax : 0.0f;
+        for (size_t i = 0; i < n; i++) { q[r * n + i] = (int8_t)lrintf(w_r[i] * inv_scale); }
+    }
+}
+
+// the tile of int8_dot_tile for constant rows and cols, which is inlined so that the
+// accumulators stay in registers
+static inline __attribute__((always_inline))
+void int8_dot_tile_(float* out, int ldo, const float* a, int lda, const int rows, const int8_t* b, int ldb, const int cols, int n) {
+    float acc[INT8_TILE_ROWS][INT8_ROW_TILE_COLS] = {{0.0f}};
+    int i = 0;
+#if defined(__AVX512F__)
+    __m512 vacc[INT8_TILE_ROWS][INT8_ROW_TILE_COLS];
+    for (int r = 0; r < rows; r++) {
+        for (int c = 0; c < cols; c++) { vacc[r][c] = _mm512_setzero_ps(); }
+    }
+    for (; i + 16 <= n; i += 16) {
+        __m512 vb[INT8_ROW_TILE_COLS];
+        for (int c = 0; c < cols; c++) {
+            __m128i q = _mm_loadu_si128((const __m128i*)(b + (size_t)c * ldb + i));
+            vb[c] = _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(q));
+        }
+        for (int r = 0; r < rows; r++) {
+            __m512 va = _mm512_loadu_ps(a + (size_t)r * lda + i);
+            for (int c = 0; c < cols; c++) { vacc[r][c] = _mm512_fmadd_ps(va, vb[c], vacc[r][c]); }
+        }
+    }
+    for (int r = 0; r < rows; r++) {
+        for (int c = 0; c < cols; c++) { acc[r][c] = _mm512_reduce_add_ps(vacc[r][c]); }
+    }
+#endif
+    for (int r = 0; r < rows; r++) {
+        for (int c = 0; c < cols; c++) {
+            const float* ar = a + (size_t)r * lda;
+            const int8_t* bc = b + (size_t)c * ldb;
+            float sum = acc[r][c];
+            for (int j = i; j < n; j++) { sum += ar[j] * (float)bc[j]; }
+            out[r * ldo + c] = sum;
+        }
+    }
+}
+
+// out[r * ldo + c] = sum_i a[r * lda + i] * b[c * ldb + i], for r < rows, c < cols and
+// i < n: the dot products of a few fp32 rows of a with a few int8 rows of b, which loads
+// (and converts) every vector of b once for all the rows of a. either rows <= INT8_TILE_ROWS
+// and cols <= INT8_TILE_COLS, or rows = 1 and cols <= INT8_ROW_TILE_COLS. every dot
+// product is summed in the same order, whatever the size of the tile it is in
+void int8_dot_tile(float* out, int ldo, const float* a, int lda, int rows, const int8_t* b, int ldb, int cols, int n) {
+    if (rows == INT8_TILE_ROWS && cols == INT8_TILE_COLS) {
+        int8_dot_tile_(out, ldo, a, lda, INT8_TILE_ROWS, b, ldb, INT8_TILE_COLS, n);
+    } else if (rows == 1 && cols == INT8_ROW_TILE_COLS) {
+        int8_dot_tile_(out, ldo, a, lda, 1, b, ldb, INT8_ROW_TILE_COLS, n);
+    } else {
+        for (int r = 0; r < rows; r++) {
+            for (int c = 0; c < cols; c++) {
+                int8_dot_tile_(out + r * ldo + c, ldo, a + (size_t)r * lda, lda, 1, b + (size_t)c * ldb, ldb, 1, n);
+            }
+        }
+    }
+}
+
+#endif
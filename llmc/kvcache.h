@@ -0,0 +1,247 @@
+/*
+A paged KV cache for decoding with the CPU model (see gpt2_forward_cached in train_gpt2.c):
+the keys and values of every layer and head at the positions of a sequence seen so far.
+With it, each new token runs the model over just itself and attends to the cached
+positions, instead of running the whole sequence again.
+
+The memory is a KVPool of fixed-size blocks of KV_BLOCK_SIZE positions, shared by all the
+sequences (KVCache) decoded at once. Each sequence has a block table, the pool blocks
+holding its positions in order, and takes a block off the pool's free list only when its
+positions fill the last one. So a sequence holds memory for its actual length, rounded up
+to a block, rather than for max_seq_len: with sessions of very different lengths, the same
+RAM holds many more of them than with a contiguous max_seq_len buffer per session.
+
+The keys and the values are each (L, num_blocks, NH, KV_BLOCK_SIZE, hs): within a block,
+the positions of a head are contiguous, which is how attention reads them, one dot
+product per position, and it goes from block to block through the block table.
+kvcache_reserve takes the blocks for the next positions, or fails if the pool is out of
+them, e.g. for a server to wait or preempt a sequence. kvcache_truncate forgets the
+positions from pos on, e.g. the rejected draft tokens of speculative decoding, and gives
+the blocks past them back. Nothing needs to be cleared, they're just overwritten next.
+
+Blocks are reference counted, so that sequences can share the blocks of a common prefix
+(see llmc/prefixcache.h): a block goes back on the free list when its last holder
+releases it. A shared block is never written to: kvcache_reserve first copies it, if the
+next position falls into it.
+
+A pool can also store the keys and values in int8, each vector of hs values with a scale
+of its own (see llmc/int8.h), in (L, num_blocks, NH, KV_BLOCK_SIZE) next to them: hs + 4
+bytes per head and position instead of 4 hs, 3.8x less at hs = 64. As the context grows,
+reading the cache is what bounds attention when decoding, and with quantized weights
+the cache can be as many bytes as the weights; attention then converts the int8 values
+to fp32 in registers. kvcache_store writes a position in either format.
+*/
+#ifndef KVCACHE_H
+#define KVCACHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "utils.h"
+#include "int8.h"
+
+#define KV_BLOCK_SIZE 16 // positions per block: 4 KB per head at hs = 64
+
+typedef struct {
+    int num_layers;
+    int num_heads;
+    int head_size;
+    int num_blocks;
+    int int8; // keys and values in int8 rather than fp32
+    float* key; // (L, num_blocks, NH, KV_BLOCK_SIZE, hs), NULL if int8
+    float* value; // (L, num_blocks, NH, KV_BLOCK_SIZE, hs), NULL if int8
+    int8_t* key_int8; // (L, num_blocks, NH, KV_BLOCK_SIZE, hs), NULL if fp32
+    int8_t* value_int8; // (L, num_blocks, NH, KV_BLOCK_SIZE, hs), NULL if fp32
+    float* key_scale; // (L, num_blocks, NH, KV_BLOCK_SIZE), NULL if fp32
+    float* value_scale; // (L, num_blocks, NH, KV_BLOCK_SIZE), NULL if fp32
+    int* ref_counts; // (num_blocks), the holders of each block, 0 if free
+    int* free_blocks; // a stack of the num_free blocks with no holders
+    int num_free;
+} KVPool;
+
+typedef struct {
+    KVPool* pool;
+    int max_seq_len;
+    int pos; // the number of positions in the cache
+    int num_blocks; // the number of blocks in the block table, holding positions up to pos
+    int* block_table; // (ceil(max_seq_len / KV_BLOCK_SIZE)), the pool blocks in order
+} KVCache;
+
+// the number of blocks that hold n positions
+int kv_blocks(int n) {
+    return (n + KV_BLOCK_SIZE - 1) / KV_BLOCK_SIZE;
+}
+
+void kvpool_init(KVPool* pool, int num_layers, int num_heads, int channels, int num_blocks, int int8) {
+    pool->num_layers = num_layers;
+    pool->num_heads = num_heads;
+    pool->head_size = channels / num_heads;
+    pool->num_blocks = num_blocks;
+    pool->int8 = int8;
+    size_t n = (size_t)num_layers * num_blocks * channels * KV_BLOCK_SIZE;
+    size_t num_scales = (size_t)num_layers * num_blocks * num_heads * KV_BLOCK_SIZE;
+    pool->key = int8 ? NULL : (float*)mallocCheck(n * sizeof(float));
+    pool->value = int8 ? NULL : (float*)mallocCheck(n * sizeof(float));
+    pool->key_int8 = int8 ? (int8_t*)mallocCheck(n) : NULL;
+    pool->value_int8 = int8 ? (int8_t*)mallocCheck(n) : NULL;
+    pool->key_scale = int8 ? (float*)mallocCheck(num_scales * sizeof(float)) : NULL;
+    pool->value_scale = int8 ? (float*)mallocCheck(num_scales * sizeof(float)) : NULL;
+    pool->ref_counts = (int*)mallocCheck(num_blocks * sizeof(int));
+    pool->free_blocks = (int*)mallocCheck(num_blocks * sizeof(int));
+    // the low blocks on top, so that they are taken first
+    for (int i = 0; i < num_blocks; i++) {
+        pool->ref_counts[i] = 0;
+        pool->free_blocks[i] = num_blocks - 1 - i;
+    }
+    pool->num_free = num_blocks;
+}
+
+void kvpool_free(KVPool* pool) {
+    free(pool->key);
+    free(pool->value);
+    free(pool->key_int8);
+    free(pool->value_int8);
+    free(pool->key_scale);
+    free(pool->value_scale);
+    free(pool->ref_counts);
+    free(pool->free_blocks);
+}
+
+// takes a free block, with one holder. the pool must have one
+int kvpool_take(KVPool* pool) {
+    int b = pool->free_blocks[--pool->num_free];
+    pool->ref_counts[b] = 1;
+    return b;
+}
+
+void kvpool_retain(KVPool* pool, int b) {
+    pool->ref_counts[b]++;
+}
+
+void kvpool_release(KVPool* pool, int b) {
+    if (--pool->ref_counts[b] == 0) { pool->free_blocks[pool->num_free++] = b; }
+}
+
+// the bytes of the keys and values of a position, in all layers and heads
+size_t kvpool_position_bytes(const KVPool* pool) {
+    size_t head_bytes = pool->int8 ? pool->head_size * sizeof(int8_t) + sizeof(float) : pool->head_size * sizeof(float);
+    return 2 * (size_t)pool->num_layers * pool->num_heads * head_bytes;
+}
+
+// the first of the KV_BLOCK_SIZE positions of layer l, head h in pool block b
+size_t kvpool_offset_(const KVPool* pool, int l, int b, int h) {
+    return (((size_t)l * pool->num_blocks + b) * pool->num_heads + h) * KV_BLOCK_SIZE;
+}
+
+// the keys (values) of layer l, head h, at the KV_BLOCK_SIZE positions of pool block b,
+// of an fp32 pool
+float* kvpool_key(const KVPool* pool, int l, int b, int h) {
+    return pool->key + kvpool_offset_(pool, l, b, h) * pool->head_size;
+}
+float* kvpool_value(const KVPool* pool, int l, int b, int h) {
+    return pool->value + kvpool_offset_(pool, l, b, h) * pool->head_size;
+}
+// the same of an int8 pool, and their scales, one per position
+int8_t* kvpool_key_int8(const KVPool* pool, int l, int b, int h) {
+    return pool->key_int8 + kvpool_offset_(pool, l, b, h) * pool->head_size;
+}
+int8_t* kvpool_value_int8(const KVPool* pool, int l, int b, int h) {
+    return pool->value_int8 + kvpool_offset_(pool, l, b, h) * pool->head_size;
+}
+float* kvpool_key_scale(const KVPool* pool, int l, int b, int h) {
+    return pool->key_scale + kvpool_offset_(pool, l, b, h);
+}
+float* kvpool_value_scale(const KVPool* pool, int l, int b, int h) {
+    return pool->value_scale + kvpool_offset_(pool, l, b, h);
+}
+
+void kvpool_copy_block(KVPool* pool, int dst, int src) {
+    // a block is NH * KV_BLOCK_SIZE positions of hs values in every layer
+    size_t n = (size_t)pool->num_heads * KV_BLOCK_SIZE;
+    size_t hs = pool->head_size;
+    for (int l = 0; l < pool->num_layers; l++) {
+        if (pool->int8) {
+            memcpy(kvpool_key_int8(pool, l, dst, 0), kvpool_key_int8(pool, l, src, 0), n * hs);
+            memcpy(kvpool_value_int8(pool, l, dst, 0), kvpool_value_int8(pool, l, src, 0), n * hs);
+            memcpy(kvpool_key_scale(pool, l, dst, 0), kvpool_key_scale(pool, l, src, 0), n * sizeof(float));
+            memcpy(kvpool_value_scale(pool, l, dst, 0), kvpool_value_scale(pool, l, src, 0), n * sizeof(float));
+        } else {
+            memcpy(kvpool_key(pool, l, dst, 0), kvpool_key(pool, l, src, 0), n * hs * sizeof(float));
+            memcpy(kvpool_value(pool, l, dst, 0), kvpool_value(pool, l, src, 0), n * hs * sizeof(float));
+        }
+    }
+}
+
+void kvcache_init(KVCache* cache, KVPool* pool, int max_seq_len) {
+    cache->pool = pool;
+    cache->max_seq_len = max_seq_len;
+    cache->pos = 0;
+    cache->num_blocks = 0;
+    cache->block_table = (int*)mallocCheck(kv_blocks(max_seq_len) * sizeof(int));
+}
+
+void kvcache_truncate(KVCache* cache, int pos) {
+    if (pos < 0 || pos > cache->pos) {
+        printf("Error: can't truncate a KV cache of %d positions to %d\n", cache->pos, pos);
+        exit(EXIT_FAILURE);
+    }
+    cache->pos = pos;
+    while (cache->num_blocks > kv_blocks(pos)) {
+        kvpool_release(cache->pool, cache->block_table[--cache->num_blocks]);
+    }
+}
+
+void kvcache_free(KVCache* cache) {
+    kvcache_truncate(cache, 0);
+    free(cache->block_table);
+}
+
+// makes room for n positions after pos: takes the blocks they need off the pool, and
+// copies the block that pos falls into, if it is shared. returns 0, taking none, if
+// there aren't enough free, or they would go past max_seq_len
+int kvcache_reserve(KVCache* cache, int n) {
+    KVPool* pool = cache->pool;
+    if (cache->pos + n > cache->max_seq_len) { return 0; }
+    int need = kv_blocks(cache->pos + n) - cache->num_blocks;
+    if (need < 0) { need = 0; }
+    int* partial = &cache->block_table[cache->pos / KV_BLOCK_SIZE];
+    int copy = n > 0 && cache->pos % KV_BLOCK_SIZE != 0 && pool->ref_counts[*partial] > 1;
+    if (need + copy > pool->num_free) { return 0; }
+    if (copy) {
+        int b = kvpool_take(pool);
+        kvpool_copy_block(pool, b, *partial);
+        kvpool_release(pool, *partial);
+        *partial = b;
+    }
+    for (int i = 0; i < need; i++) {
+        cache->block_table[cache->num_blocks++] = kvpool_take(pool);
+    }
+    return 1;
+}
+
+// the key (value) of layer l, head h, at position t of the sequence, t < KV_BLOCK_SIZE * num_blocks,
+// of an fp32 pool
+float* kvcache_key(const KVCache* cache, int l, int h, int t) {
+    return kvpool_key(cache->pool, l, cache->block_table[t / KV_BLOCK_SIZE], h) + (t % KV_BLOCK_SIZE) * cache->pool->head_size;
+}
+float* kvcache_value(const KVCache* cache, int l, int h, int t) {
+    return kvpool_value(cache->pool, l, cache->block_table[t / KV_BLOCK_SIZE], h) + (t % KV_BLOCK_SIZE) * cache->pool->head_size;
+}
+
+// writes the key and value of layer l, head h, at position t, in the format of the pool
+void kvcache_store(const KVCache* cache, int l, int h, int t, const float* key, const float* value) {
+    const KVPool* pool = cache->pool;
+    int b = cache->block_table[t / KV_BLOCK_SIZE];
+    int j = t % KV_BLOCK_SIZE;
+    int hs = pool->head_size;
+    if (pool->int8) {
+        int8_quantize_rows(kvpool_key_int8(pool, l, b, h) + j * hs, kvpool_key_scale(pool, l, b, h) + j, key, 1, hs);
+        int8_quantize_rows(kvpool_value_int8(pool, l, b, h) + j * hs, kvpool_value_scale(pool, l, b, h) + j, value, 1, hs);
+    } else {
+        memcpy(kvpool_key(pool, l, b, h) + j * hs, key, hs * sizeof(float));
+        memcpy(kvpool_value(pool, l, b, h) + j * hs, value, hs * sizeof(float));
+    }
+}
+
+#endif
@@ -0,0 +1,127 @@
+/*
+A static memory planner, for buffers whose lifetimes are known ahead of time.
+
+Every tensor is used by a range of steps of a fixed schedule (e.g. the kernel calls
+of the backward pass, in order), from the first step that touches it to the last one,
+inclusive. Two tensors whose ranges are disjoint are never alive at the same time, so
+they can share memory. The planner assigns every tensor an offset into a single
+buffer such that tensors whose ranges intersect never overlap. Since the ranges are
+inclusive, the inputs and outputs of one step never overlap either, so no kernel has
+to support running in place.
+
+Finding the smallest such buffer is NP-hard in general. We use the common "greedy by
+size" heuristic: the tensors are placed largest first, each at the lowest offset where
+it fits between the tensors already placed that are alive at the same time. For
+schedules that repeat layer after layer it ends up within a layer or so of the peak of
+the live sizes, which is a lower bound of any plan (see memplan_peak).
+*/
+#ifndef MEMPLAN_H
+#define MEMPLAN_H
+
+#include <stddef.h>
+#include <stdlib.h>
+// defines: mallocCheck
+#include "utils.h"
+
+typedef struct {
+    size_t size; // in elements
+    int first; // first and last step that use the tensor, -1 if it is never used
+    int last;
+    size_t offset; // in elements, assigned by memplan_assign
+} MemPlanTensor;
+
+void memplan_init(MemPlanTensor* tensors, int n) {
+    for (int i = 0; i < n; i++) {
+        tensors[i].size = 0;
+        tensors[i].first = -1;
+        tensors[i].last = -1;
+        tensors[i].offset = 0;
+    }
+}
+
+// record that the tensor is used at this step of the schedule
+void memplan_use(MemPlanTensor* t, int step) {
+    if (t->first < 0 || step < t->first) { t->first = step; }
+    if (step > t->last) { t->last = step; }
+}
+
+int memplan_is_used(const MemPlanTensor* t) {
+    return t->first >= 0 && t->size > 0;
+}
+
+int memplan_alive_together(const MemPlanTensor* a, const MemPlanTensor* b) {
+    return a->first <= b->last && b->first <= a->last;
+}
+
+size_t memplan_round_up(size_t n, size_t alignment) {
+    return (n + alignment - 1) / alignment * alignment;
+}
+
+// largest first, ties by first use and then by index, so that the plan is deterministic
+int memplan_compare(const void* pa, const void* pb) {
+    const MemPlanTensor* a = *(const MemPlanTensor* const*)pa;
+    const MemPlanTensor* b = *(const MemPlanTensor* const*)pb;
+    if (a->size != b->size) { return a->size > b->size ? -1 : 1; }
+    if (a->first != b->first) { return a->first < b->first ? -1 : 1; }
+    return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+// assigns the offsets of the used tensors, every one a multiple of alignment (in elements),
+// and returns the size of the buffer that holds them all
+size_t memplan_assign(MemPlanTensor* tensors, int n, size_t alignment) {
+    MemPlanTensor** order = (MemPlanTensor**)mallocCheck(n * sizeof(MemPlanTensor*));
+    int num_used = 0;
+    for (int i = 0; i < n; i++) {
+        if (memplan_is_used(&tensors[i])) { order[num_used++] = &tensors[i]; }
+    }
+    qsort(order, num_used, sizeof(MemPlanTensor*), memplan_compare);
+
+    // the already placed tensors that are alive together with the current one, by offset
+    MemPlanTensor** live = (MemPlanTensor**)mallocCheck((num_used + 1) * sizeof(MemPlanTensor*));
+    size_t total = 0;
+    for (int i = 0; i < num_used; i++) {
+        MemPlanTensor* t = order[i];
+        int num_live = 0;
+        for (int j = 0; j < i; j++) {
+            if (!memplan_alive_together(t, order[j])) { continue; }
+            // insertion sort by offset, there are only a few of them
+            int k = num_live++;
+            while (k > 0 && live[k-1]->offset > order[j]->offset) { live[k] = live[k-1]; k--; }
+            live[k] = order[j];
+        }
+        // the first gap between them that is large enough
+        size_t size = memplan_round_up(t->size, alignment);
+        size_t offset = 0;
+        for (int k = 0; k < num_live; k++) {
+            if (live[k]->offset >= offset + size) { break; }
+            size_t end = live[k]->offset + memplan_round_up(live[k]->size, alignment);
+            if (end > offset) { offset = end; }
+        }
+        t->offset = offset;
+        if (offset + size > total) { total = offset + size; }
+    }
+    free(live);
+    free(order);
+    return total;
+}
+
+// the largest total size of the tensors alive at any one step, a lower bound of memplan_assign
+size_t memplan_peak(const MemPlanTensor* tensors, int n, size_t alignment) {
+    int num_steps = 0;
+    for (int i = 0; i < n; i++) {
+        if (memplan_is_used(&tensors[i]) && tensors[i].last + 1 > num_steps) { num_steps = tensors[i].last + 1; }
+    }
+    size_t peak = 0;
+    for (int s = 0; s < num_steps; s++) {
+        size_t live = 0;
+        for (int i = 0; i < n; i++) {
+            if (memplan_is_used(&tensors[i]) && tensors[i].first <= s && s <= tensors[i].last) {
+                live += memplan_round_up(tensors[i].size, alignment);
+            }
+        }
+        if (live > peak) { peak = live; }
+    }
+    return peak;
+}
+
+#endif
@@ -0,0 +1,335 @@
+/*
+A prefix cache for decoding with the paged KV cache (see llmc/kvcache.h): the KV blocks
+of prompts already computed, in a radix tree keyed by their tokens, so that a request
+whose prompt starts with one of them (e.g. a long system prompt) shares its blocks and
+only runs the model over the rest (see gpt2_forward_cached in train_gpt2.c):
+
+    int matched = prefixcache_match(&prefix_cache, prompt, n, &cache);
+    gpt2_forward_cached(&model, &cache, prompt + matched, n - matched);
+    prefixcache_insert(&prefix_cache, prompt, n, &cache);
+
+The tree works on whole blocks of KV_BLOCK_SIZE tokens, the unit the pool shares: the
+edge into each node is a run of blocks and their tokens, and the children of a node
+differ in their first block. A match is the longest run of cached blocks, short of the
+last token of the prompt, whose logits are still needed. The tree holds a reference to
+its blocks, and each sequence that matched them another one, so they stay put until
+both are done; the sequences write their own positions to blocks of their own.
+
+The tree holds at most max_blocks blocks (none at all with max_blocks = 0). Past that,
+prefixcache_insert evicts the least recently used leaves whose blocks no sequence holds,
+giving their blocks back to the pool, and so does prefixcache_evict, e.g. when the pool is
+short of blocks for a new request. The blocks a sequence still holds stay, so the tree
+can be over max_blocks until the sequence is freed: prefixcache_trim then evicts it back
+down. The eviction is a linear scan over the nodes, which is cheap next to the forward
+passes that fill them.
+
+The stats count the lookups, the hits, and the prompt tokens found (the prefill saved).
+With the seconds of the prefills that did run, from prefixcache_prefilled, that is an
+estimate of the time saved, prefixcache_saved_seconds.
+*/
+#ifndef PREFIXCACHE_H
+#define PREFIXCACHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+#include "kvcache.h"
+
+typedef struct PrefixNode {
+    struct PrefixNode* parent;
+    struct PrefixNode** children;
+    int num_children;
+    int* tokens; // (num_blocks * KV_BLOCK_SIZE), the tokens of the edge from the parent
+    int* blocks; // (num_blocks), their pool blocks
+    int num_blocks;
+    unsigned long long last_used;
+    int index; // in PrefixCache.nodes
+} PrefixNode;
+
+typedef struct {
+    long long lookups; // calls to prefixcache_match
+    long long hits; // of them, with a prefix found
+    long long lookup_tokens; // the tokens of their prompts
+    long long matched_tokens; // of them, found in the cache: the prefill saved
+    long long inserted_blocks;
+    long long evicted_blocks;
+    long long prefill_tokens; // the prefills that did run, from prefixcache_prefilled
+    double prefill_seconds;
+} PrefixCacheStats;
+
+typedef struct {
+    KVPool* pool;
+    PrefixNode root; // the empty prefix, with no blocks
+    int max_blocks;
+    int num_blocks; // held by the tree
+    unsigned long long clock; // for last_used
+    PrefixNode** nodes; // all the nodes but the root
+    int num_nodes;
+    int nodes_capacity;
+    PrefixCacheStats stats;
+} PrefixCache;
+
+void prefixcache_init(PrefixCache* pc, KVPool* pool, int max_blocks) {
+    memset(pc, 0, sizeof(PrefixCache));
+    pc->pool = pool;
+    pc->max_blocks = max_blocks;
+}
+
+// ----------------------------------------------------------------------------
+// the tree
+
+int prefixcache_block_equal_(const PrefixNode* node, int b, const int* tokens) {
+    return memcmp(node->tokens + b * KV_BLOCK_SIZE, tokens, KV_BLOCK_SIZE * sizeof(int)) == 0;
+}
+
+// the child of node whose edge starts with the block of tokens, or NULL
+PrefixNode* prefixcache_child_(const PrefixNode* node, const int* tokens) {
+    for (int i = 0; i < node->num_children; i++) {
+        if (prefixcache_block_equal_(node->children[i], 0, tokens)) { return node->children[i]; }
+    }
+    return NULL;
+}
+
+void prefixcache_add_child_(PrefixNode* node, PrefixNode* child) {
+    node->children = (PrefixNode**)realloc(node->children, (node->num_children + 1) * sizeof(PrefixNode*));
+    if (node->children == NULL) {
+        printf("Error: out of memory for the prefix cache\n");
+        exit(EXIT_FAILURE);
+    }
+    node->children[node->num_children++] = child;
+    child->parent = node;
+}
+
+void prefixcache_remove_child_(PrefixNode* node, PrefixNode* child) {
+    for (int i = 0; i < node->num_children; i++) {
+        if (node->children[i] == child) {
+            node->children[i] = node->children[--node->num_children];
+            return;
+        }
+    }
+}
+
+// a new node under parent, for the blocks of tokens[0..num_blocks * KV_BLOCK_SIZE)
+PrefixNode* prefixcache_new_node_(PrefixCache* pc, PrefixNode* parent, const int* tokens, const int* blocks, int num_blocks) {
+    PrefixNode* node = (PrefixNode*)mallocCheck(sizeof(PrefixNode));
+    node->children = NULL;
+    node->num_children = 0;
+    node->tokens = (int*)mallocCheck((size_t)num_blocks * KV_BLOCK_SIZE * sizeof(int));
+    node->blocks = (int*)mallocCheck(num_blocks * sizeof(int));
+    memcpy(node->tokens, tokens, (size_t)num_blocks * KV_BLOCK_SIZE * sizeof(int));
+    memcpy(node->blocks, blocks, num_blocks * sizeof(int));
+    node->num_blocks = num_blocks;
+    node->last_used = pc->clock;
+    if (pc->num_nodes == pc->nodes_capacity) {
+        pc->nodes_capacity = pc->nodes_capacity == 0 ? 64 : 2 * pc->nodes_capacity;
+        pc->nodes = (PrefixNode**)realloc(pc->nodes, pc->nodes_capacity * sizeof(PrefixNode*));
+        if (pc->nodes == NULL) {
+            printf("Error: out of memory for the prefix cache\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    node->index = pc->num_nodes;
+    pc->nodes[pc->num_nodes++] = node;
+    prefixcache_add_child_(parent, node);
+    return node;
+}
+
+void prefixcache_free_node_(PrefixCache* pc, PrefixNode* node) {
+    PrefixNode* last = pc->nodes[--pc->num_nodes];
+    pc->nodes[node->index] = last;
+    last->index = node->index;
+    free(node->children);
+    free(node->tokens);
+    free(node->blocks);
+    free(node);
+}
+
+// splits the edge into node after its first k blocks, into a new parent of node. returns it
+PrefixNode* prefixcache_split_(PrefixCache* pc, PrefixNode* node, int k) {
+    PrefixNode* parent = node->parent;
+    prefixcache_remove_child_(parent, node);
+    PrefixNode* head = prefixcache_new_node_(pc, parent, node->tokens, node->blocks, k);
+    head->last_used = node->last_used;
+    int rest = node->num_blocks - k;
+    memmove(node->tokens, node->tokens + k * KV_BLOCK_SIZE, (size_t)rest * KV_BLOCK_SIZE * sizeof(int));
+    memmove(node->blocks, node->blocks + k, rest * sizeof(int));
+    node->num_blocks = rest;
+    prefixcache_add_child_(head, node);
+    return head;
+}
+
+// ----------------------------------------------------------------------------
+// eviction
+
+// the least recently used leaf whose blocks only the tree holds, or NULL
+PrefixNode* prefixcache_lru_leaf_(const PrefixCache* pc) {
+    PrefixNode* lru = NULL;
+    for (int i = 0; i < pc->num_nodes; i++) {
+        PrefixNode* node = pc->nodes[i];
+        if (node->num_children > 0 || (lru != NULL && node->last_used >= lru->last_used)) { continue; }
+        int held = 0;
+        for (int b = 0; b < node->num_blocks; b++) {
+            held |= pc->pool->ref_counts[node->blocks[b]] > 1;
+        }
+        if (!held) { lru = node; }
+    }
+    return lru;
+}
+
+// evicts least recently used prefixes until n blocks went back to the pool, or none are
+// left that no sequence holds. returns the number of blocks that went back
+int prefixcache_evict(PrefixCache* pc, int n) {
+    int evicted = 0;
+    while (evicted < n) {
+        PrefixNode* leaf = prefixcache_lru_leaf_(pc);
+        if (leaf == NULL) { break; }
+        for (int b = 0; b < leaf->num_blocks; b++) {
+            kvpool_release(pc->pool, leaf->blocks[b]);
+        }
+        evicted += leaf->num_blocks;
+        pc->num_blocks -= leaf->num_blocks;
+        prefixcache_remove_child_(leaf->parent, leaf);
+        prefixcache_free_node_(pc, leaf);
+    }
+    pc->stats.evicted_blocks += evicted;
+    return evicted;
+}
+
+// evicts down to max_blocks, e.g. after freeing a sequence that held blocks of the tree
+void prefixcache_trim(PrefixCache* pc) {
+    if (pc->num_blocks > pc->max_blocks) {
+        prefixcache_evict(pc, pc->num_blocks - pc->max_blocks);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// lookup and insertion
+
+// looks up the longest cached prefix of tokens[0..n), short of the last token, and puts
+// its blocks into the empty cache, which then starts at its end. returns its length, a
+// multiple of KV_BLOCK_SIZE, the tokens the model doesn't need to run over
+int prefixcache_match(PrefixCache* pc, const int* tokens, int n, KVCache* cache) {
+    if (cache->pos != 0 || cache->num_blocks != 0 || cache->pool != pc->pool) {
+        printf("Error: a prefix can only go into an empty KV cache of the same pool\n");
+        exit(EXIT_FAILURE);
+    }
+    int max_blocks = (n - 1 < cache->max_seq_len ? n - 1 : cache->max_seq_len) / KV_BLOCK_SIZE;
+    pc->clock++;
+    int matched = 0; // blocks
+    PrefixNode* node = &pc->root;
+    while (matched < max_blocks) {
+        PrefixNode* child = prefixcache_child_(node, tokens + matched * KV_BLOCK_SIZE);
+        if (child == NULL) { break; }
+        child->last_used = pc->clock;
+        int b = 0;
+        while (b < child->num_blocks && matched < max_blocks &&
+               prefixcache_block_equal_(child, b, tokens + matched * KV_BLOCK_SIZE)) {
+            kvpool_retain(pc->pool, child->blocks[b]);
+            cache->block_table[cache->num_blocks++] = child->blocks[b];
+            b++;
+            matched++;
+        }
+        if (b < child->num_blocks) { break; }
+        node = child;
+    }
+    cache->pos = matched * KV_BLOCK_SIZE;
+    pc->stats.lookups++;
+    pc->stats.hits += matched > 0;
+    pc->stats.lookup_tokens += n;
+    pc->stats.matched_tokens += cache->pos;
+    return cache->pos;
+}
+
+// undoes prefixcache_match of tokens[0..n) into cache, e.g. for a request that can't
+// start yet after all: gives the blocks back, and takes the lookup out of the stats
+void prefixcache_unmatch(PrefixCache* pc, int n, KVCache* cache) {
+    pc->stats.lookups--;
+    pc->stats.hits -= cache->pos > 0;
+    pc->stats.lookup_tokens -= n;
+    pc->stats.matched_tokens -= cache->pos;
+    kvcache_truncate(cache, 0);
+}
+
+// adds the whole blocks of tokens[0..n) to the tree, from the cache that computed them
+// (n <= cache->pos), taking a reference to those it didn't have yet. then evicts down to
+// max_blocks, as far as it can (see prefixcache_trim)
+void prefixcache_insert(PrefixCache* pc, const int* tokens, int n, KVCache* cache) {
+    if (n > cache->pos || cache->pool != pc->pool) {
+        printf("Error: can't cache a prefix of %d tokens from a KV cache of %d positions\n", n, cache->pos);
+        exit(EXIT_FAILURE);
+    }
+    if (pc->max_blocks == 0) { return; } // caching nothing
+    int num_blocks = n / KV_BLOCK_SIZE;
+    pc->clock++;
+    int done = 0; // blocks
+    PrefixNode* node = &pc->root;
+    while (done < num_blocks) {
+        PrefixNode* child = prefixcache_child_(node, tokens + done * KV_BLOCK_SIZE);
+        if (child == NULL) {
+            // the rest is new
+            int rest = num_blocks - done;
+            for (int b = done; b < num_blocks; b++) {
+                kvpool_retain(pc->pool, cache->block_table[b]);
+            }
+            prefixcache_new_node_(pc, node, tokens + done * KV_BLOCK_SIZE, cache->block_table + done, rest);
+            pc->num_blocks += rest;
+            pc->stats.inserted_blocks += rest;
+            break;
+        }
+        child->last_used = pc->clock;
+        int b = 0;
+        while (b < child->num_blocks && done < num_blocks &&
+               prefixcache_block_equal_(child, b, tokens + done * KV_BLOCK_SIZE)) {
+            b++;
+            done++;
+        }
+        if (b < child->num_blocks) {
+            if (done == num_blocks) { break; } // they end within the edge, already cached
+            child = prefixcache_split_(pc, child, b); // they leave it
+        }
+        node = child;
+    }
+    prefixcache_trim(pc);
+}
+
+// ----------------------------------------------------------------------------
+// stats
+
+// records a prefill that did run, over n tokens in the given seconds
+void prefixcache_prefilled(PrefixCache* pc, int n, double seconds) {
+    pc->stats.prefill_tokens += n;
+    pc->stats.prefill_seconds += seconds;
+}
+
+float prefixcache_hit_rate(const PrefixCache* pc) {
+    return pc->stats.lookups == 0 ? 0.0f : (float)pc->stats.hits / pc->stats.lookups;
+}
+
+// the fraction of the prompt tokens found in the cache
+float prefixcache_token_hit_rate(const PrefixCache* pc) {
+    return pc->stats.lookup_tokens == 0 ? 0.0f : (float)pc->stats.matched_tokens / pc->stats.lookup_tokens;
+}
+
+// the prefill time saved: the tokens found, at the mean seconds per token of the prefills
+double prefixcache_saved_seconds(const PrefixCache* pc) {
+    if (pc->stats.prefill_tokens == 0) { return 0.0; }
+    return pc->stats.matched_tokens * pc->stats.prefill_seconds / pc->stats.prefill_tokens;
+}
+
+void prefixcache_free(PrefixCache* pc) {
+    for (int i = 0; i < pc->num_nodes; i++) {
+        PrefixNode* node = pc->nodes[i];
+        for (int b = 0; b < node->num_blocks; b++) {
+            kvpool_release(pc->pool, node->blocks[b]);
+        }
+        free(node->children);
+        free(node->tokens);
+        free(node->blocks);
+        free(node);
+    }
+    free(pc->root.children);
+    free(pc->nodes);
+}
+
+#endif
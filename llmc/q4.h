@@ -0,0 +1,189 @@
+/*
+4-bit weights for CPU inference, in groups: every Q4_GROUP consecutive weights of a row
+share an fp16 scale and minimum, w = scale * q + min with q in [0, 15], where
+scale = (max - min) / 15 over the group. That is 16 bytes of q and 4 of scale and min
+per 32 weights, 5 bits per weight, against 8 for int8 (see llmc/int8.h) and 32 for fp32.
+
+The dot products dequantize the weights to fp32 as they load them and multiply and
+accumulate in fp32, with the activations in fp32, like int8_dot_tile.
+*/
+#ifndef Q4_H
+#define Q4_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#if defined(__AVX512F__) || defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+#define Q4_GROUP 32
+
+// IEEE half precision
+typedef uint16_t fp16;
+
+// a group of Q4_GROUP weights: q[j] holds weight j in its low 4 bits, and weight
+// j + Q4_GROUP / 2 in its high 4 bits
+typedef struct {
+    fp16 scale;
+    fp16 min;
+    uint8_t q[Q4_GROUP / 2];
+} q4_block;
+
+// the tiles of q4_dot_tile, as for int8_dot_tile
+#define Q4_TILE_ROWS 8
+#define Q4_TILE_COLS 2
+#define Q4_ROW_TILE_COLS 8
+
+float fp16_to_float(fp16 h) {
+#if defined(__F16C__)
+    return _cvtsh_ss(h);
+#else
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    uint32_t bits;
+    if (exponent == 0) {
+        // zero and subnormals, mantissa * 2^-24
+        float f = (float)mantissa * 5.9604644775390625e-08f;
+        memcpy(&bits, &f, sizeof(bits));
+        bits |= sign;
+    } else if (exponent == 31) {
+        bits = sign | 0x7f800000 | (mantissa << 13); // inf, NaN
+    } else {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+#endif
+}
+
+// round to nearest, ties to even. beyond the largest half (65504) is infinity
+fp16 float_to_fp16(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    uint16_t sign = (bits >> 16) & 0x8000;
+    uint32_t abs_bits = bits & 0x7fffffff;
+    if (abs_bits > 0x7f800000) { return sign | 0x7e00; } // NaN
+    if (abs_bits >= 0x477ff000) { return sign | 0x7c00; } // >= 65520 rounds to infinity
+    if (abs_bits < 0x38800000) {
+        // below the smallest normal (2^-14), multiples of 2^-24
+        float a;
+        memcpy(&a, &abs_bits, sizeof(a));
+        return sign | (uint16_t)lrintf(a * 16777216.0f);
+    }
+    abs_bits += 0xfff + ((abs_bits >> 13) & 1);
+    return sign | (uint16_t)((((abs_bits >> 23) - 112) << 10) | ((abs_bits >> 13) & 0x3ff));
+}
+
+// quantize rows of n weights, n a multiple of Q4_GROUP, into n / Q4_GROUP blocks each
+void q4_quantize_rows(q4_block* out, const float* w, size_t rows, size_t n) {
+    size_t num_blocks = rows * n / Q4_GROUP;
+    for (size_t g = 0; g < num_blocks; g++) {
+        const float* w_g = w + g * Q4_GROUP;
+        float lo = w_g[0], hi = w_g[0];
+        for (int i = 1; i < Q4_GROUP; i++) { lo = fminf(lo, w_g[i]); hi = fmaxf(hi, w_g[i]); }
+        q4_block* block = out + g;
+        block->scale = float_to_fp16((hi - lo) / 15.0f);
+        block->min = float_to_fp16(lo);
+        // with the scale and min as stored, which are rounded to fp16
+        float scale = fp16_to_float(block->scale);
+        float min = fp16_to_float(block->min);
+        float inv_scale = scale > 0.0f ? 1.0f / scale : 0.0f;
+        for (int j = 0; j < Q4_GROUP / 2; j++) {
+            long q_lo = lrintf((w_g[j] - min) * inv_scale);
+            long q_hi = lrintf((w_g[j + Q4_GROUP / 2] - min) * inv_scale);
+            q_lo = q_lo < 0 ? 0 : q_lo > 15 ? 15 : q_lo;
+            q_hi = q_hi < 0 ? 0 : q_hi > 15 ? 15 : q_hi;
+            block->q[j] = (uint8_t)(q_lo | (q_hi << 4));
+        }
+    }
+}
+
+// the n weights of a row, n a multiple of Q4_GROUP
+void q4_dequantize_row(float* out, const q4_block* blocks, int n) {
+    for (int g = 0; g < n / Q4_GROUP; g++) {
+        float scale = fp16_to_float(blocks[g].scale);
+        float min = fp16_to_float(blocks[g].min);
+        for (int j = 0; j < Q4_GROUP / 2; j++) {
+            out[g * Q4_GROUP + j] = scale * (blocks[g].q[j] & 0x0f) + min;
+            out[g * Q4_GROUP + j + Q4_GROUP / 2] = scale * (blocks[g].q[j] >> 4) + min;
+        }
+    }
+}
+
+// the tile of q4_dot_tile for constant rows and cols, inlined to keep the accumulators
+// in registers
+static inline __attribute__((always_inline))
+void q4_dot_tile_(float* out, int ldo, const float* a, int lda, const int rows, const q4_block* b, int ldb, const int cols, int n) {
+#if defined(__AVX512F__)
+    __m512 vacc[Q4_TILE_ROWS][Q4_ROW_TILE_COLS];
+    for (int r = 0; r < rows; r++) {
+        for (int c = 0; c < cols; c++) { vacc[r][c] = _mm512_setzero_ps(); }
+    }
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    for (int g = 0; g < n / Q4_GROUP; g++) {
+        __m512 vlo[Q4_ROW_TILE_COLS], vhi[Q4_ROW_TILE_COLS];
+        for (int c = 0; c < cols; c++) {
+            const q4_block* block = b + (size_t)c * ldb + g;
+            __m512 scale = _mm512_set1_ps(fp16_to_float(block->scale));
+            __m512 min = _mm512_set1_ps(fp16_to_float(block->min));
+            __m128i q = _mm_loadu_si128((const __m128i*)block->q);
+            __m128i q_lo = _mm_and_si128(q, nibble);
+            __m128i q_hi = _mm_and_si128(_mm_srli_epi16(q, 4), nibble);
+            vlo[c] = _mm512_fmadd_ps(_mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(q_lo)), scale, min);
+            vhi[c] = _mm512_fmadd_ps(_mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(q_hi)), scale, min);
+        }
+        for (int r = 0; r < rows; r++) {
+            __m512 va_lo = _mm512_loadu_ps(a + (size_t)r * lda + g * Q4_GROUP);
+            __m512 va_hi = _mm512_loadu_ps(a + (size_t)r * lda + g * Q4_GROUP + Q4_GROUP / 2);
+            for (int c = 0; c < cols; c++) {
+                vacc[r][c] = _mm512_fmadd_ps(va_lo, vlo[c], vacc[r][c]);
+                vacc[r][c] = _mm512_fmadd_ps(va_hi, vhi[c], vacc[r][c]);
+            }
+        }
+    }
+    for (int r = 0; r < rows; r++) {
+        for (int c = 0; c < cols; c++) { out[r * ldo + c] = _mm512_reduce_add_ps(vacc[r][c]); }
+    }
+#else
+    float w[Q4_GROUP];
+    float acc[Q4_TILE_ROWS][Q4_ROW_TILE_COLS] = {{0.0f}};
+    for (int g = 0; g < n / Q4_GROUP; g++) {
+        for (int c = 0; c < cols; c++) {
+            q4_dequantize_row(w, b + (size_t)c * ldb + g, Q4_GROUP);
+            for (int r = 0; r < rows; r++) {
+                const float* ar = a + (size_t)r * lda + g * Q4_GROUP;
+                for (int i = 0; i < Q4_GROUP; i++) { acc[r][c] += ar[i] * w[i]; }
+            }
+        }
+    }
+    for (int r = 0; r < rows; r++) {
+        for (int c = 0; c < cols; c++) { out[r * ldo + c] = acc[r][c]; }
+    }
+#endif
+}
+
+// out[r * ldo + c] = sum_i a[r * lda + i] * w_c[i], for r < rows, c < cols and i < n, where
+// w_c is the row of n weights in the blocks from b + c * ldb on (ldb counts blocks): the
+// dot products of a few fp32 rows of a with a few q4 rows of b, which dequantizes every
+// group of b once for all the rows of a. n is a multiple of Q4_GROUP. either
+// rows <= Q4_TILE_ROWS and cols <= Q4_TILE_COLS, or rows = 1 and cols <= Q4_ROW_TILE_COLS.
+// every dot product is summed in the same order, whatever the size of the tile it is in
+void q4_dot_tile(float* out, int ldo, const float* a, int lda, int rows, const q4_block* b, int ldb, int cols, int n) {
+    if (rows == Q4_TILE_ROWS && cols == Q4_TILE_COLS) {
+        q4_dot_tile_(out, ldo, a, lda, Q4_TILE_ROWS, b, ldb, Q4_TILE_COLS, n);
+    } else if (rows == 1 && cols == Q4_ROW_TILE_COLS) {
+        q4_dot_tile_(out, ldo, a, lda, 1, b, ldb, Q4_ROW_TILE_COLS, n);
+    } else {
+        for (int r = 0; r < rows; r++) {
+            for (int c = 0; c < cols; c++) {
+                q4_dot_tile_(out + r * ldo + c, ldo, a + (size_t)r * lda, lda, 1, b + (size_t)c * ldb, ldb, 1, n);
+            }
+        }
+    }
+}
+
+#endif
@@ -1,10 +1,29 @@
 /*
 Implements a simple Sampler, used during model inference to sample tokens.
+
+sample_softmax samples from the softmax of the logits as they are. The Sampler below
+adds temperature, top-k, top-p (nucleus) and min-p, and also works directly on the
+logits, with a single (vectorized) exp per candidate token:
+- the max logit first, then min-p is a threshold on the logits, no exp needed:
+  p_i >= min_p * p_max <=> logit_i >= max + temperature * ln(min_p)
+- top-k with a min-heap of the k largest logits so far: one compare per token, which almost
+  never passes once the heap is full, so it's O(V) and predictable. large k falls back to
+  partial selection (quickselect)
+- the exps of the candidates, exp((logit - max) / temperature), and their sum
+- top-p without a sort: first only the tokens that can be in the nucleus, as a token with
+  p < (1 - top_p) / (n - 1) can't be (all the tokens below it add up to less than 1 - top_p),
+  then quickselect that keeps the partitions whose sums the nucleus needs, O(n) expected
+- then a walk over the candidates with a coin scaled by their sum, instead of dividing
+sampler_probs gives the same distribution as probabilities, for the speculative sampling
+at the end (see speculative_gpt2.c).
 */
 #ifndef SAMPLER_H
 #define SAMPLER_H
 
 #include <math.h>
+#include <stdlib.h>
+#include "utils.h"
+#include "fastmath.h"
 
 // Simple xorshift RNG
 unsigned int random_u32(unsigned long long *state) {
@@ -24,13 +43,13 @@ int sample_softmax(const float* logits, int n, float coin) {
     // coin is a random number in [0, 1), usually from random_f32()
     double norm = 0;
     for (int i = 0; i < n; i++) {
-        norm += expf(logits[i]);
+        norm += fast_expf(logits[i]);
     }
     // instead of dividing all exp(logits), we can just multiply coin.
     coin *= norm;
     float cdf = 0.0f;
     for (int i = 0; i < n; i++) {
-        cdf += expf(logits[i]);
+        cdf += fast_expf(logits[i]);
         if (coin < cdf) {
             return i;
         }
@@ -38,4 +57,277 @@ int sample_softmax(const float* logits, int n, float coin) {
     return n - 1; // in case of rounding errors
 }
 
-#endif
\ No newline at end of file
+// ----------------------------------------------------------------------------
+// Sampler: temperature, top-k, top-p and min-p
+
+typedef struct {
+    float temperature; // divides the logits. 0 is greedy (the argmax)
+    int top_k; // only the k most likely tokens, 0 for all
+    float top_p; // only the fewest most likely tokens that add up to top_p, 1 for all
+    float min_p; // only the tokens at least min_p times as likely as the most likely one, 0 for all
+} SamplerConfig;
+
+typedef struct {
+    SamplerConfig config;
+    int vocab_size;
+    int max_rows;
+    // per row: the candidate tokens, and their exp((logit - max) / temperature)
+    int* indices; // (max_rows, vocab_size)
+    float* values; // (max_rows, vocab_size)
+} Sampler;
+
+// plain sampling from the model's distribution
+SamplerConfig sampler_default_config(void) {
+    SamplerConfig config = {1.0f, 0, 1.0f, 0.0f};
+    return config;
+}
+
+void sampler_init(Sampler* sampler, int vocab_size, int max_rows, SamplerConfig config) {
+    sampler->config = config;
+    sampler->vocab_size = vocab_size;
+    sampler->max_rows = max_rows;
+    sampler->indices = (int*)mallocCheck((size_t)max_rows * vocab_size * sizeof(int));
+    sampler->values = (float*)mallocCheck((size_t)max_rows * vocab_size * sizeof(float));
+}
+
+void sampler_free(Sampler* sampler) {
+    free(sampler->indices);
+    free(sampler->values);
+}
+
+// partition values[lo..hi] (and indices along) in descending order (Hoare's scheme, which
+// also splits runs of equal values evenly): returns p in [lo, hi) such that
+// values[lo..p] >= values[p+1..hi]
+int sampler_partition_(float* values, int* indices, int lo, int hi) {
+    #define SAMPLER_SWAP_(a, b) { float v = values[a]; values[a] = values[b]; values[b] = v; \
+                                  int x = indices[a]; indices[a] = indices[b]; indices[b] = x; }
+    // the median of three as the pivot, with the other two as sentinels at the ends
+    int mid = lo + (hi - lo) / 2;
+    if (values[mid] > values[lo]) SAMPLER_SWAP_(mid, lo);
+    if (values[hi] > values[lo]) SAMPLER_SWAP_(hi, lo);
+    if (values[hi] > values[mid]) SAMPLER_SWAP_(hi, mid);
+    float pivot = values[mid];
+    int i = lo - 1, j = hi + 1;
+    while (1) {
+        do { i++; } while (values[i] > pivot);
+        do { j--; } while (values[j] < pivot);
+        if (i >= j) { return j; }
+        SAMPLER_SWAP_(i, j);
+    }
+    #undef SAMPLER_SWAP_
+}
+
+// move the k largest values (and their indices) to the front, in no particular order
+void sampler_select(float* values, int* indices, int n, int k) {
+    int lo = 0, hi = n - 1;
+    while (lo < hi) {
+        int p = sampler_partition_(values, indices, lo, hi);
+        if (k - 1 <= p) { hi = p; } else { lo = p + 1; }
+    }
+}
+
+// the k largest values so far as a min-heap in values[0..count) (and their indices along):
+// push adds v, replace_root puts v in place of the smallest
+#define SAMPLER_HEAP_MAX_K 1024
+void sampler_heap_push_(float* values, int* indices, int count, float v, int index) {
+    int i = count;
+    while (i > 0 && values[(i - 1) / 2] > v) {
+        values[i] = values[(i - 1) / 2];
+        indices[i] = indices[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    values[i] = v;
+    indices[i] = index;
+}
+
+void sampler_heap_replace_root_(float* values, int* indices, int count, float v, int index) {
+    int i = 0;
+    while (1) {
+        int child = 2 * i + 1;
+        if (child >= count) { break; }
+        if (child + 1 < count && values[child + 1] < values[child]) { child++; }
+        if (values[child] >= v) { break; }
+        values[i] = values[child];
+        indices[i] = indices[child];
+        i = child;
+    }
+    values[i] = v;
+    indices[i] = index;
+}
+
+// move the fewest largest values whose sum reaches target to the front: returns how many.
+// quickselect where each partition's sum decides which side the nucleus ends in
+int sampler_nucleus_(float* values, int* indices, int n, float target) {
+    int lo = 0, hi = n - 1;
+    while (lo < hi) {
+        int p = sampler_partition_(values, indices, lo, hi);
+        float s = 0.0f;
+        #pragma omp simd reduction(+:s)
+        for (int j = lo; j <= p; j++) { s += values[j]; }
+        if (s >= target) { hi = p; } else { target -= s; lo = p + 1; }
+    }
+    return lo + 1;
+}
+
+// the candidates of one row of logits after temperature, min-p, top-k and top-p, into
+// indices and values (not normalized, their sum goes to total). returns how many there are
+int sampler_candidates(Sampler* sampler, const float* logits, int* indices, float* values, float* total) {
+    SamplerConfig config = sampler->config;
+    int n = sampler->vocab_size;
+    float max = logits[0];
+    #pragma omp simd reduction(max:max)
+    for (int i = 0; i < n; i++) { max = fmaxf(max, logits[i]); }
+    float inv_temperature = 1.0f / config.temperature;
+    float sum = 0.0f;
+    int count;
+    float threshold = config.min_p > 0.0f ? max + config.temperature * logf(config.min_p) : -INFINITY;
+    int top_k = config.top_k > 0 && config.top_k < n ? config.top_k : 0;
+    if (top_k > 0 && top_k <= SAMPLER_HEAP_MAX_K) {
+        // the heap of the top_k largest logits (at least the threshold)
+        count = 0;
+        for (int i = 0; i < n; i++) {
+            float v = logits[i];
+            if (v < threshold) { continue; }
+            if (count < top_k) {
+                sampler_heap_push_(values, indices, count++, v, i);
+            } else if (v > values[0]) {
+                sampler_heap_replace_root_(values, indices, count, v, i);
+            }
+        }
+    } else if (config.min_p > 0.0f || top_k > 0) {
+        count = 0;
+        for (int i = 0; i < n; i++) {
+            if (logits[i] >= threshold) {
+                indices[count] = i;
+                values[count] = logits[i];
+                count++;
+            }
+        }
+        if (top_k > 0 && count > top_k) {
+            sampler_select(values, indices, count, top_k);
+            count = top_k;
+        }
+    } else {
+        count = n;
+    }
+    if (count == n) {
+        #pragma omp simd reduction(+:sum)
+        for (int i = 0; i < n; i++) {
+            indices[i] = i;
+            values[i] = fast_expf((logits[i] - max) * inv_temperature);
+            sum += values[i];
+        }
+    } else {
+        #pragma omp simd reduction(+:sum)
+        for (int j = 0; j < count; j++) {
+            values[j] = fast_expf((values[j] - max) * inv_temperature);
+            sum += values[j];
+        }
+    }
+    if (config.top_p < 1.0f && count > 1) {
+        // only the tokens that can be in the nucleus (branchless, most are cut), then the
+        // nucleus of them. the most likely token, exp(0), always stays
+        float cutoff = fminf((1.0f - config.top_p) / (count - 1) * sum, fast_expf(0.0f));
+        int m = 0;
+        for (int j = 0; j < count; j++) {
+            float v = values[j];
+            int x = indices[j];
+            values[m] = v;
+            indices[m] = x;
+            m += v >= cutoff;
+        }
+        count = sampler_nucleus_(values, indices, m, config.top_p * sum);
+        sum = 0.0f;
+        #pragma omp simd reduction(+:sum)
+        for (int j = 0; j < count; j++) { sum += values[j]; }
+    }
+    *total = sum;
+    return count;
+}
+
+// sample a token from one row of logits (of vocab_size), with the scratch of row 0
+// coin is a random number in [0, 1), usually from random_f32()
+int sampler_sample(Sampler* sampler, const float* logits, float coin) {
+    int n = sampler->vocab_size;
+    if (sampler->config.temperature <= 0.0f) {
+        int argmax = 0;
+        for (int i = 1; i < n; i++) { if (logits[i] > logits[argmax]) { argmax = i; } }
+        return argmax;
+    }
+    float total;
+    int count = sampler_candidates(sampler, logits, sampler->indices, sampler->values, &total);
+    coin *= total;
+    float cdf = 0.0f;
+    for (int j = 0; j < count; j++) {
+        cdf += sampler->values[j];
+        if (coin < cdf) {
+            return sampler->indices[j];
+        }
+    }
+    return sampler->indices[count - 1]; // in case of rounding errors
+}
+
+// the distribution that sampler_sample samples one row of logits from, as probabilities
+// over the whole vocabulary (zero outside the candidates), with the scratch of row 0.
+// greedy (temperature 0) puts all of it on the argmax
+void sampler_probs(Sampler* sampler, const float* logits, float* probs) {
+    int n = sampler->vocab_size;
+    for (int i = 0; i < n; i++) { probs[i] = 0.0f; }
+    if (sampler->config.temperature <= 0.0f) {
+        probs[sampler_sample(sampler, logits, 0.0f)] = 1.0f;
+        return;
+    }
+    float total;
+    int count = sampler_candidates(sampler, logits, sampler->indices, sampler->values, &total);
+    float inv_total = 1.0f / total;
+    for (int j = 0; j < count; j++) {
+        probs[sampler->indices[j]] = sampler->values[j] * inv_total;
+    }
+}
+
+// speculative sampling (https://arxiv.org/abs/2211.17192, https://arxiv.org/abs/2302.01318):
+// a token drawn from a draft model's distribution q is kept with probability min(1, p/q),
+// where p is the target model's distribution. if it isn't, the replacement is drawn from
+// max(0, p - q), normalized. either way the token that comes out is distributed as p.
+// coin is a random number in [0, 1), usually from random_f32()
+int sampler_speculative_accept(const float* p, const float* q, int token, float coin) {
+    return coin * q[token] < p[token];
+}
+
+int sampler_speculative_residual(const float* p, const float* q, int n, float coin) {
+    float norm = 0.0f;
+    for (int i = 0; i < n; i++) { norm += fmaxf(p[i] - q[i], 0.0f); }
+    if (norm <= 0.0f) {
+        // p == q up to rounding, when nothing should have been rejected: sample from p
+        for (int i = 0; i < n; i++) { if (coin < p[i]) { return i; } coin -= p[i]; }
+        return n - 1;
+    }
+    coin *= norm;
+    float cdf = 0.0f;
+    int last = 0;
+    for (int i = 0; i < n; i++) {
+        float r = fmaxf(p[i] - q[i], 0.0f);
+        if (r > 0.0f) { last = i; }
+        cdf += r;
+        if (coin < cdf) {
+            return i;
+        }
+    }
+    return last; // in case of rounding errors
+}
+
+// sample a token from each of rows rows of logits, stride floats apart, each with its own
+// rng state (so a row's samples don't depend on the others), in parallel. rows <= max_rows
+void sampler_sample_rows(Sampler* sampler, const float* logits, int rows, size_t stride,
+                         unsigned long long* rng_states, int* tokens) {
+    #pragma omp parallel for
+    for (int r = 0; r < rows; r++) {
+        // a copy of the sampler that works in the scratch of row r
+        Sampler row = *sampler;
+        row.indices += (size_t)r * sampler->vocab_size;
+        row.values += (size_t)r * sampler->vocab_size;
+        tokens[r] = sampler_sample(&row, logits + r * stride, random_f32(&rng_states[r]));
+    }
+}
+
+#endif
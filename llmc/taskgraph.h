@@ -0,0 +1,370 @@
+/*
+A static task graph with a work-stealing executor, for the CPU code.
+
+A TaskGraph is built once (e.g. once per (B,T) of the model) and then executed
+many times. Every task is a function pointer plus a small blob of arguments, and
+declares the memory ranges it reads and writes. The edges of the graph are not
+given by hand: when a task is added, it gets an edge from every earlier task it
+conflicts with (read-after-write, write-after-read, write-after-write on any
+overlapping range). So the graph holds exactly the real data dependencies of the
+original sequential program, and running it is equivalent to running the tasks
+one after another in the order they were added.
+
+The TaskPool is a set of persistent worker threads. Each worker owns a deque of
+ready tasks: it pops the most recently pushed task from its own deque (good for
+cache reuse, as that is usually the successor of what it just ran) and, when it
+runs dry, steals the oldest task from another worker's deque. A task that
+finishes decrements the pending-dependency count of its successors and pushes
+the ones that become ready onto its own deque.
+
+Workers are plain pthreads, not OpenMP threads. Any orphaned OpenMP worksharing
+(omp for / omp single) inside a task therefore just runs on the calling thread.
+On Windows the executor falls back to running the tasks sequentially.
+*/
+#ifndef TASKGRAPH_H
+#define TASKGRAPH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+// defines: mallocCheck
+#include "utils.h"
+#ifndef _WIN32
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#endif
+
+// ----------------------------------------------------------------------------
+// graph construction
+
+// max size of the argument blob of a task, it is copied into the graph
+#define TASK_ARG_BYTES 160
+// max number of memory ranges a single task can read + write
+#define TASK_MAX_RANGES 12
+
+typedef void (*task_fn)(void* arg);
+
+typedef struct {
+    const char* start;
+    const char* end;
+    int is_write;
+} TaskRange;
+
+typedef struct {
+    task_fn fn;
+    double arg[TASK_ARG_BYTES / sizeof(double)]; // (double for alignment)
+    TaskRange ranges[TASK_MAX_RANGES];
+    int num_ranges;
+    int num_deps; // number of predecessors
+    int* succ; // indices of the successors
+    int num_succ;
+    int cap_succ;
+} Task;
+
+typedef struct {
+    Task* tasks;
+    int num_tasks;
+    int cap_tasks;
+    size_t num_edges;
+    // runtime state, one counter of outstanding dependencies per task
+#ifndef _WIN32
+    atomic_int* pending;
+#endif
+} TaskGraph;
+
+void taskgraph_init(TaskGraph* g) {
+    g->tasks = NULL;
+    g->num_tasks = 0;
+    g->cap_tasks = 0;
+    g->num_edges = 0;
+#ifndef _WIN32
+    g->pending = NULL;
+#endif
+}
+
+void taskgraph_free(TaskGraph* g) {
+    for (int i = 0; i < g->num_tasks; i++) { free(g->tasks[i].succ); }
+    free(g->tasks);
+#ifndef _WIN32
+    free(g->pending);
+#endif
+    taskgraph_init(g);
+}
+
+int taskranges_conflict(const Task* a, const Task* b) {
+    for (int i = 0; i < a->num_ranges; i++) {
+        const TaskRange* ra = &a->ranges[i];
+        for (int j = 0; j < b->num_ranges; j++) {
+            const TaskRange* rb = &b->ranges[j];
+            if (!ra->is_write && !rb->is_write) { continue; } // two reads never conflict
+            if (ra->start < rb->end && rb->start < ra->end) { return 1; }
+        }
+    }
+    return 0;
+}
+
+// begin a new task. the arguments are copied, so arg can live on the stack.
+// the ranges it touches are then declared with taskgraph_reads/taskgraph_writes,
+// and the task is only wired into the graph with taskgraph_commit.
+Task* taskgraph_begin(TaskGraph* g, task_fn fn, const void* arg, size_t arg_size) {
+    assert(arg_size <= TASK_ARG_BYTES);
+    if (g->num_tasks == g->cap_tasks) {
+        g->cap_tasks = g->cap_tasks == 0 ? 256 : 2 * g->cap_tasks;
+        g->tasks = (Task*)realloc(g->tasks, g->cap_tasks * sizeof(Task));
+        if (g->tasks == NULL) { fprintf(stderr, "Error: TaskGraph realloc failed\n"); exit(EXIT_FAILURE); }
+    }
+    Task* task = &g->tasks[g->num_tasks];
+    task->fn = fn;
+    memcpy(task->arg, arg, arg_size);
+    task->num_ranges = 0;
+    task->num_deps = 0;
+    task->succ = NULL;
+    task->num_succ = 0;
+    task->cap_succ = 0;
+    return task;
+}
+
+void taskgraph_range(Task* task, const void* ptr, size_t bytes, int is_write) {
+    if (ptr == NULL || bytes == 0) { return; }
+    assert(task->num_ranges < TASK_MAX_RANGES);
+    TaskRange* r = &task->ranges[task->num_ranges++];
+    r->start = (const char*)ptr;
+    r->end = (const char*)ptr + bytes;
+    r->is_write = is_write;
+}
+#define taskgraph_reads(task, ptr, bytes) taskgraph_range(task, ptr, bytes, 0)
+#define taskgraph_writes(task, ptr, bytes) taskgraph_range(task, ptr, bytes, 1)
+
+void taskgraph_commit(TaskGraph* g) {
+    int id = g->num_tasks++;
+    Task* task = &g->tasks[id];
+    // add an edge from every earlier task that we conflict with
+    for (int j = 0; j < id; j++) {
+        Task* prev = &g->tasks[j];
+        if (!taskranges_conflict(task, prev)) { continue; }
+        if (prev->num_succ == prev->cap_succ) {
+            prev->cap_succ = prev->cap_succ == 0 ? 8 : 2 * prev->cap_succ;
+            prev->succ = (int*)realloc(prev->succ, prev->cap_succ * sizeof(int));
+            if (prev->succ == NULL) { fprintf(stderr, "Error: TaskGraph realloc failed\n"); exit(EXIT_FAILURE); }
+        }
+        prev->succ[prev->num_succ++] = id;
+        task->num_deps++;
+        g->num_edges++;
+    }
+}
+
+// ----------------------------------------------------------------------------
+// work-stealing executor
+
+#ifndef _WIN32
+
+// a deque of ready task ids, guarded by a lock. each task is pushed at most
+// once per run, so a capacity of num_tasks never overflows.
+typedef struct {
+    int* ids;
+    int capacity;
+    int top; // steal end (oldest)
+    int bottom; // owner end (newest)
+    atomic_flag lock;
+} TaskDeque;
+
+void taskdeque_lock(TaskDeque* d) { while (atomic_flag_test_and_set_explicit(&d->lock, memory_order_acquire)) { sched_yield(); } }
+void taskdeque_unlock(TaskDeque* d) { atomic_flag_clear_explicit(&d->lock, memory_order_release); }
+
+void taskdeque_push(TaskDeque* d, int id) {
+    taskdeque_lock(d);
+    assert(d->bottom - d->top < d->capacity);
+    d->ids[d->bottom % d->capacity] = id;
+    d->bottom++;
+    taskdeque_unlock(d);
+}
+
+int taskdeque_pop(TaskDeque* d) {
+    int id = -1;
+    taskdeque_lock(d);
+    if (d->bottom > d->top) { d->bottom--; id = d->ids[d->bottom % d->capacity]; }
+    taskdeque_unlock(d);
+    return id;
+}
+
+int taskdeque_steal(TaskDeque* d) {
+    int id = -1;
+    taskdeque_lock(d);
+    if (d->bottom > d->top) { id = d->ids[d->top % d->capacity]; d->top++; }
+    taskdeque_unlock(d);
+    return id;
+}
+
+typedef struct TaskPool TaskPool;
+
+typedef struct {
+    TaskPool* pool;
+    int index;
+    pthread_t thread;
+    unsigned int rng; // for picking steal victims
+} TaskWorker;
+
+struct TaskPool {
+    int num_threads; // including the thread that calls taskgraph_run
+    TaskWorker* workers;
+    TaskDeque* deques;
+    TaskGraph* graph; // the graph currently being run
+    atomic_int remaining; // tasks not yet finished in the current run
+    atomic_int active; // spawned workers that have not yet left the current run
+    // sleeping/waking the workers between runs
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int generation;
+    int shutdown;
+};
+
+void taskpool_run_task(TaskPool* pool, TaskGraph* g, int worker, int id) {
+    Task* task = &g->tasks[id];
+    task->fn(task->arg);
+    for (int i = 0; i < task->num_succ; i++) {
+        int s = task->succ[i];
+        if (atomic_fetch_sub_explicit(&g->pending[s], 1, memory_order_acq_rel) == 1) {
+            taskdeque_push(&pool->deques[worker], s);
+        }
+    }
+    atomic_fetch_sub_explicit(&pool->remaining, 1, memory_order_acq_rel);
+}
+
+void taskpool_work(TaskPool* pool, int worker) {
+    TaskGraph* g = pool->graph;
+    TaskWorker* self = &pool->workers[worker];
+    int idle_spins = 0;
+    while (atomic_load_explicit(&pool->remaining, memory_order_acquire) > 0) {
+        int id = taskdeque_pop(&pool->deques[worker]);
+        if (id < 0) {
+            // our deque ran dry, try to steal from a random victim, then the others in turn
+            self->rng = self->rng * 1664525u + 1013904223u;
+            int start = (int)((self->rng >> 8) % pool->num_threads);
+            for (int k = 0; k < pool->num_threads && id < 0; k++) {
+                int victim = (start + k) % pool->num_threads;
+                if (victim != worker) { id = taskdeque_steal(&pool->deques[victim]); }
+            }
+        }
+        if (id < 0) {
+            // nothing ready anywhere, the remaining tasks wait on running ones
+            if (++idle_spins > 64) { sched_yield(); }
+            continue;
+        }
+        idle_spins = 0;
+        taskpool_run_task(pool, g, worker, id);
+    }
+}
+
+void* taskpool_worker_main(void* arg) {
+    TaskWorker* self = (TaskWorker*)arg;
+    TaskPool* pool = self->pool;
+    int seen_generation = 0;
+    while (1) {
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->generation == seen_generation && !pool->shutdown) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+        }
+        if (pool->shutdown) { pthread_mutex_unlock(&pool->mutex); break; }
+        seen_generation = pool->generation;
+        pthread_mutex_unlock(&pool->mutex);
+        taskpool_work(pool, self->index);
+        atomic_fetch_sub_explicit(&pool->active, 1, memory_order_acq_rel);
+    }
+    return NULL;
+}
+
+void taskpool_init(TaskPool* pool, int num_threads) {
+    if (num_threads < 1) { num_threads = 1; }
+    pool->num_threads = num_threads;
+    pool->workers = (TaskWorker*)mallocCheck(num_threads * sizeof(TaskWorker));
+    pool->deques = (TaskDeque*)mallocCheck(num_threads * sizeof(TaskDeque));
+    for (int i = 0; i < num_threads; i++) {
+        pool->deques[i].ids = NULL;
+        pool->deques[i].capacity = 0;
+        atomic_flag_clear(&pool->deques[i].lock);
+    }
+    pool->graph = NULL;
+    atomic_init(&pool->remaining, 0);
+    atomic_init(&pool->active, 0);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->generation = 0;
+    pool->shutdown = 0;
+    // worker 0 is the thread that calls taskgraph_run, the others are spawned here
+    for (int i = 0; i < num_threads; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        pool->workers[i].rng = 1337u + 7919u * i;
+        if (i > 0 && pthread_create(&pool->workers[i].thread, NULL, taskpool_worker_main, &pool->workers[i]) != 0) {
+            fprintf(stderr, "Error: TaskPool failed to create thread %d\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void taskpool_free(TaskPool* pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+    for (int i = 1; i < pool->num_threads; i++) { pthread_join(pool->workers[i].thread, NULL); }
+    for (int i = 0; i < pool->num_threads; i++) { free(pool->deques[i].ids); }
+    free(pool->deques);
+    free(pool->workers);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->cond);
+}
+
+void taskgraph_run(TaskGraph* g, TaskPool* pool) {
+    if (g->num_tasks == 0) { return; }
+    if (g->pending == NULL) { g->pending = (atomic_int*)mallocCheck(g->cap_tasks * sizeof(atomic_int)); }
+    // make sure every deque can hold all the tasks of this graph
+    for (int i = 0; i < pool->num_threads; i++) {
+        TaskDeque* d = &pool->deques[i];
+        if (d->capacity < g->num_tasks) {
+            free(d->ids);
+            d->ids = (int*)mallocCheck(g->num_tasks * sizeof(int));
+            d->capacity = g->num_tasks;
+        }
+        d->top = 0;
+        d->bottom = 0;
+    }
+    // reset the dependency counters and deal out the initially ready tasks
+    int next = 0;
+    for (int i = 0; i < g->num_tasks; i++) {
+        atomic_init(&g->pending[i], g->tasks[i].num_deps);
+        if (g->tasks[i].num_deps == 0) {
+            TaskDeque* d = &pool->deques[next++ % pool->num_threads];
+            d->ids[d->bottom++] = i;
+        }
+    }
+    pool->graph = g;
+    atomic_store(&pool->remaining, g->num_tasks);
+    atomic_store(&pool->active, pool->num_threads - 1);
+    // wake up the workers and join in ourselves as worker 0
+    pthread_mutex_lock(&pool->mutex);
+    pool->generation++;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+    taskpool_work(pool, 0);
+    // all tasks are done, but wait until every worker has left this run before
+    // returning, so that none of them is still looking at the deques of this run
+    while (atomic_load_explicit(&pool->active, memory_order_acquire) > 0) { sched_yield(); }
+}
+
+#else
+
+// no pthreads: run the tasks in the order they were added, which respects all edges
+typedef struct { int num_threads; } TaskPool;
+void taskpool_init(TaskPool* pool, int num_threads) { pool->num_threads = 1; }
+void taskpool_free(TaskPool* pool) {}
+void taskgraph_run(TaskGraph* g, TaskPool* pool) {
+    for (int i = 0; i < g->num_tasks; i++) { g->tasks[i].fn(g->tasks[i].arg); }
+}
+
+#endif
+
+#endif // TASKGRAPH_H
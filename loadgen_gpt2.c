@@ -0,0 +1,275 @@
+/*
+A load generator for server_gpt2.c, for benchmarking it locally. It keeps a number of
+connections busy, each sending its next request as soon as the previous one is done (a
+closed loop), until it has sent them all. The prompts are random tokens, the first of
+them the same in every request, as a system prompt would be, which the server's prefix
+cache can share.
+
+Client side, it measures the time to first token (TTFT) of every request, from sending it
+to its first token, the time between its tokens (ITL) and to its last, and the tokens per
+second over the run. At the end, it prints the server's own metrics as well.
+
+compile and run as:
+make loadgen_gpt2 && ./loadgen_gpt2 [options]
+e.g., with the server running:
+./loadgen_gpt2 -s /tmp/gpt2.sock -c 16 -n 128 -l 256 -x 192 -g 64
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+// defines: mallocCheck
+#include "llmc/utils.h"
+// defines: random_u32
+#include "llmc/sampler.h"
+
+#define MAX_CONNS 256
+#define BUFFER_SIZE (1 << 16)
+
+typedef struct {
+    int fd;
+    char in[BUFFER_SIZE];
+    size_t in_len;
+    int request; // in flight, -1 if none
+    double sent;
+    double first_token;
+    double last_token;
+    int tokens; // received so far
+} Client;
+
+double now_seconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int connect_server(const char* socket_path, int port) {
+    int fd;
+    if (port > 0) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) { perror("connect"); exit(EXIT_FAILURE); }
+    } else {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+        if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) { perror("connect"); exit(EXIT_FAILURE); }
+    }
+    return fd;
+}
+
+void send_all(int fd, const char* data, size_t n) {
+    while (n > 0) {
+        ssize_t k = send(fd, data, n, MSG_NOSIGNAL);
+        if (k < 0 && errno == EINTR) { continue; }
+        if (k <= 0) { perror("send"); exit(EXIT_FAILURE); }
+        data += k;
+        n -= k;
+    }
+}
+
+// reads a line of the reply into line (without the newline), blocking
+void read_line(Client* c, char* line, size_t size) {
+    for (;;) {
+        char* newline = (char*)memchr(c->in, '\n', c->in_len);
+        if (newline != NULL) {
+            size_t n = newline - c->in;
+            if (n >= size) { n = size - 1; }
+            memcpy(line, c->in, n);
+            line[n] = '\0';
+            c->in_len -= newline + 1 - c->in;
+            memmove(c->in, newline + 1, c->in_len);
+            return;
+        }
+        ssize_t k = recv(c->fd, c->in + c->in_len, BUFFER_SIZE - c->in_len, 0);
+        if (k < 0 && errno == EINTR) { continue; }
+        if (k <= 0) { printf("Error: the server closed the connection\n"); exit(EXIT_FAILURE); }
+        c->in_len += k;
+    }
+}
+
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// sorts the values, and prints their mean and percentiles in ms
+void print_latencies(const char* name, double* values, int n) {
+    if (n == 0) { printf("%-6s no samples\n", name); return; }
+    qsort(values, n, sizeof(double), compare_doubles);
+    double sum = 0.0;
+    for (int i = 0; i < n; i++) { sum += values[i]; }
+    printf("%-6s mean %8.2f ms | p50 %8.2f | p90 %8.2f | p99 %8.2f | max %8.2f\n", name, 1e3 * sum / n,
+           1e3 * values[(int)(0.50 * (n - 1) + 0.5)], 1e3 * values[(int)(0.90 * (n - 1) + 0.5)],
+           1e3 * values[(int)(0.99 * (n - 1) + 0.5)], 1e3 * values[n - 1]);
+}
+
+void error_usage() {
+    fprintf(stderr, "Usage:   ./loadgen_gpt2 [options]\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -s <string> Unix domain socket of the server (default = /tmp/gpt2.sock)\n");
+    fprintf(stderr, "  -p <int>    or its localhost TCP port (default = 0, the socket)\n");
+    fprintf(stderr, "  -c <int>    concurrent connections (default = 8, at most %d)\n", MAX_CONNS);
+    fprintf(stderr, "  -n <int>    requests in all (default = 64)\n");
+    fprintf(stderr, "  -l <int>    prompt tokens (default = 128)\n");
+    fprintf(stderr, "  -x <int>    of them, the same in every request (default = 64)\n");
+    fprintf(stderr, "  -g <int>    max tokens to generate per request (default = 64)\n");
+    fprintf(stderr, "  -t <float>  temperature (default = 1.0)\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+    const char* socket_path = "/tmp/gpt2.sock";
+    int port = 0;
+    int num_clients = 8;
+    int num_requests = 64;
+    int prompt_len = 128;
+    int shared_len = 64;
+    int max_tokens = 64;
+    float temperature = 1.0f;
+    for (int i = 1; i < argc; i+=2) {
+        if (i + 1 >= argc) { error_usage(); } // must have arg after flag
+        if (argv[i][0] != '-') { error_usage(); } // must start with dash
+        if (strlen(argv[i]) != 2) { error_usage(); } // must be -x (one dash, one letter)
+        if (argv[i][1] == 's') { socket_path = argv[i+1]; }
+        else if (argv[i][1] == 'p') { port = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'c') { num_clients = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'n') { num_requests = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'l') { prompt_len = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'x') { shared_len = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'g') { max_tokens = atoi(argv[i+1]); }
+        else if (argv[i][1] == 't') { temperature = atof(argv[i+1]); }
+        else { error_usage(); }
+    }
+    if (num_clients < 1 || num_clients > MAX_CONNS || num_requests < 1 || prompt_len < 1 ||
+        shared_len < 0 || shared_len > prompt_len || max_tokens < 1) { error_usage(); }
+
+    // the vocabulary and context of the model, for the prompts
+    Client* clients = (Client*)mallocCheck(num_clients * sizeof(Client));
+    for (int i = 0; i < num_clients; i++) {
+        clients[i].fd = connect_server(socket_path, port);
+        clients[i].in_len = 0;
+        clients[i].request = -1;
+    }
+    char line[BUFFER_SIZE];
+    send_all(clients[0].fd, "INFO\n", 5);
+    read_line(&clients[0], line, sizeof(line));
+    int vocab_size, max_seq_len;
+    if (sscanf(line, "INFO %d %d", &vocab_size, &max_seq_len) != 2) { printf("Error: bad reply %s\n", line); exit(EXIT_FAILURE); }
+    if (prompt_len >= max_seq_len) { printf("Error: prompts of %d tokens, the context is %d\n", prompt_len, max_seq_len); exit(EXIT_FAILURE); }
+    printf("model: vocab %d, context %d | %d connections, %d requests, prompts of %d tokens (%d shared), up to %d tokens each\n",
+           vocab_size, max_seq_len, num_clients, num_requests, prompt_len, shared_len, max_tokens);
+
+    // the requests, as lines: the shared prefix, then tokens of their own
+    unsigned long long rng_state = 1337;
+    int* shared = (int*)mallocCheck((shared_len + 1) * sizeof(int));
+    for (int i = 0; i < shared_len; i++) { shared[i] = random_u32(&rng_state) % vocab_size; }
+    size_t line_size = 64 + (size_t)prompt_len * 12;
+    char* request_line = (char*)mallocCheck(line_size);
+
+    double* ttft = (double*)mallocCheck(num_requests * sizeof(double));
+    double* e2e = (double*)mallocCheck(num_requests * sizeof(double));
+    double* itl = (double*)mallocCheck((size_t)num_requests * max_tokens * sizeof(double));
+    int num_ok = 0, num_itl = 0;
+    long long total_tokens = 0;
+    int sent = 0, done = 0, errors = 0;
+    struct pollfd fds[MAX_CONNS];
+    double start = now_seconds();
+    while (done < num_requests) {
+        // every idle connection sends its next request
+        for (int i = 0; i < num_clients && sent < num_requests; i++) {
+            Client* c = &clients[i];
+            if (c->request >= 0) { continue; }
+            int n = snprintf(request_line, line_size, "GEN %d %.3f %d", max_tokens, temperature, sent);
+            for (int t = 0; t < prompt_len; t++) {
+                int token = t < shared_len ? shared[t] : (int)(random_u32(&rng_state) % vocab_size);
+                n += snprintf(request_line + n, line_size - n, " %d", token);
+            }
+            n += snprintf(request_line + n, line_size - n, "\n");
+            c->request = sent++;
+            c->tokens = 0;
+            c->sent = now_seconds();
+            send_all(c->fd, request_line, n);
+        }
+        for (int i = 0; i < num_clients; i++) {
+            fds[i].fd = clients[i].fd;
+            fds[i].events = POLLIN;
+        }
+        if (poll(fds, num_clients, -1) < 0) {
+            if (errno == EINTR) { continue; }
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+        double now = now_seconds();
+        for (int i = 0; i < num_clients; i++) {
+            if (fds[i].revents == 0) { continue; }
+            Client* c = &clients[i];
+            ssize_t k = recv(c->fd, c->in + c->in_len, BUFFER_SIZE - c->in_len, 0);
+            if (k <= 0) { printf("Error: the server closed the connection\n"); exit(EXIT_FAILURE); }
+            c->in_len += k;
+            char* begin = c->in;
+            char* newline;
+            while ((newline = (char*)memchr(begin, '\n', c->in + c->in_len - begin)) != NULL) {
+                *newline = '\0';
+                if (strncmp(begin, "TOK ", 4) == 0) {
+                    if (c->tokens == 0) { c->first_token = now; }
+                    else { itl[num_itl++] = now - c->last_token; }
+                    c->last_token = now;
+                    c->tokens++;
+                    total_tokens++;
+                } else if (strncmp(begin, "DONE ", 5) == 0 || strncmp(begin, "ERR ", 4) == 0) {
+                    if (begin[0] == 'E') {
+                        printf("request %d: %s\n", c->request, begin);
+                        errors++;
+                    } else if (c->tokens > 0) {
+                        ttft[num_ok] = c->first_token - c->sent;
+                        e2e[num_ok++] = now - c->sent;
+                    }
+                    c->request = -1;
+                    done++;
+                }
+                begin = newline + 1;
+            }
+            c->in_len -= begin - c->in;
+            memmove(c->in, begin, c->in_len);
+        }
+    }
+    double seconds = now_seconds() - start;
+
+    printf("\n%d requests in %.2f s: %.2f requests/s, %lld tokens generated, %.1f tokens/s, %.1f prompt tokens/s, %d errors\n",
+           num_requests, seconds, num_requests / seconds, total_tokens, total_tokens / seconds,
+           (double)num_requests * prompt_len / seconds, errors);
+    print_latencies("TTFT", ttft, num_ok);
+    print_latencies("ITL", itl, num_itl);
+    print_latencies("E2E", e2e, num_ok);
+
+    printf("\nserver metrics:\n");
+    send_all(clients[0].fd, "METRICS\n", 8);
+    for (;;) {
+        read_line(&clients[0], line, sizeof(line));
+        if (strcmp(line, "END") == 0) { break; }
+        printf("  %s\n", line);
+    }
+
+    for (int i = 0; i < num_clients; i++) { close(clients[i].fd); }
+    free(clients);
+    free(shared);
+    free(request_line);
+    free(ttft);
+    free(e2e);
+    free(itl);
+    return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
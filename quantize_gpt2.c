@@ -0,0 +1,191 @@
+/*
+Quantizes a GPT-2 checkpoint for CPU inference. The matmul weights, that is wte (which is
+also the LM head) and the qkv, attention projection, fc and fc projection weights of every
+layer, go to either
+- int8 with one fp32 scale per output channel (row), checkpoint version 6, see llmc/int8.h
+- q4 in groups of 32 with an fp16 scale and min each, checkpoint version 7, see llmc/q4.h
+Everything else stays fp32. gpt2_build_from_checkpoint in train_gpt2.c loads both, for
+inference.
+
+Then it compares the models: the perplexity on the tinyshakespeare val set (it fails if
+the new model is worse than the fp32 one by more than the tolerance of its format), and
+the time of the forward pass at B=1, where it is bound by reading the weights, as when
+decoding. Checkpoints given after the format are compared too, e.g. the int8 model
+next to the q4 one.
+
+compile and run as:
+make quantize_gpt2 && ./quantize_gpt2 [gpt2_124M.bin] [gpt2_124M_int8.bin] [int8|q4] [more.bin ...]
+e.g.
+./quantize_gpt2 gpt2_124M.bin gpt2_124M_int8.bin int8
+./quantize_gpt2 gpt2_124M.bin gpt2_124M_q4.bin q4 gpt2_124M_int8.bin
+*/
+#define TESTING
+#include "train_gpt2.c"
+
+// how much worse (relative) the val perplexity may be than that of the fp32 model
+#define INT8_PERPLEXITY_TOLERANCE 0.02f
+#define Q4_PERPLEXITY_TOLERANCE 0.10f
+#define VAL_BATCHES 10
+#define MAX_CHECKPOINTS 8
+
+// version 6 (int8) or 7 (q4)
+void write_quantized_checkpoint(GPT2 *model, const char* path, int version) {
+    int header[256] = {0};
+    header[0] = 20240326; // magic
+    header[1] = version;
+    header[2] = model->config.max_seq_len;
+    header[3] = model->config.vocab_size;
+    header[4] = model->config.num_layers;
+    header[5] = model->config.num_heads;
+    header[6] = model->config.channels;
+    header[7] = model->config.padded_vocab_size;
+    if (version == 7 && model->config.channels % Q4_GROUP != 0) {
+        printf("Error: q4 needs channels divisible by %d\n", Q4_GROUP);
+        exit(EXIT_FAILURE);
+    }
+    FILE* f = fopenCheck(path, "wb");
+    fwrite(header, sizeof(int), 256, f);
+    const float* w = model->params_memory;
+    size_t bytes = 0;
+    for (int i = 0; i < NUM_PARAMETER_TENSORS; i++) {
+        size_t n = model->param_sizes[i];
+        if (!param_is_quantized(i)) {
+            fwrite(w, sizeof(float), n, f);
+            bytes += n * sizeof(float);
+            w += n;
+            continue;
+        }
+        size_t row_length = param_row_length(model->config, i);
+        size_t rows = n / row_length;
+        float* dequantized = (float*)mallocCheck(n * sizeof(float));
+        if (version == 6) {
+            // the scales of all the rows, then all the int8 values
+            int8_t* q = (int8_t*)mallocCheck(n);
+            float* scale = (float*)mallocCheck(rows * sizeof(float));
+            int8_quantize_rows(q, scale, w, rows, row_length);
+            for (size_t j = 0; j < n; j++) { dequantized[j] = scale[j / row_length] * q[j]; }
+            fwrite(scale, sizeof(float), rows, f);
+            fwrite(q, sizeof(int8_t), n, f);
+            bytes += rows * sizeof(float) + n;
+            free(q);
+            free(scale);
+        } else {
+            q4_block* blocks = (q4_block*)mallocCheck(n / Q4_GROUP * sizeof(q4_block));
+            q4_quantize_rows(blocks, w, rows, row_length);
+            for (size_t r = 0; r < rows; r++) {
+                q4_dequantize_row(dequantized + r * row_length, blocks + r * row_length / Q4_GROUP, row_length);
+            }
+            fwrite(blocks, sizeof(q4_block), n / Q4_GROUP, f);
+            bytes += n / Q4_GROUP * sizeof(q4_block);
+            free(blocks);
+        }
+        double error = 0.0, norm = 0.0;
+        for (size_t j = 0; j < n; j++) {
+            error += (double)(dequantized[j] - w[j]) * (dequantized[j] - w[j]);
+            norm += (double)w[j] * w[j];
+        }
+        printf("tensor %2d: %zu x %zu, rms error %.2e of the rms weight\n", i, rows, row_length, sqrt(error / norm));
+        free(dequantized);
+        w += n;
+    }
+    fcloseCheck(f);
+    printf("wrote %s: %.1f MB of parameters, from %.1f MB\n", path, bytes / 1e6, model->num_parameters * sizeof(float) / 1e6);
+}
+
+// the mean loss over the first VAL_BATCHES batches of B x T tokens
+float val_loss(const char* checkpoint_path, const char* val_tokens, int B, int T) {
+    GPT2 model;
+    gpt2_build_from_checkpoint(&model, checkpoint_path);
+    DataLoader loader;
+    dataloader_init(&loader, val_tokens, B, T, 0, 1, 0);
+    float loss = 0.0f;
+    for (int i = 0; i < VAL_BATCHES; i++) {
+        dataloader_next_batch(&loader);
+        loss += gpt2_forward_no_grad(&model, loader.inputs, loader.targets, B, T);
+    }
+    dataloader_free(&loader);
+    gpt2_free(&model);
+    return loss / VAL_BATCHES;
+}
+
+// the fastest of a few forward passes at B,T, in ms
+double time_forward(const char* checkpoint_path, int B, int T) {
+    GPT2 model;
+    gpt2_build_from_checkpoint(&model, checkpoint_path);
+    int* inputs = (int*)mallocCheck(B * T * sizeof(int));
+    for (int i = 0; i < B * T; i++) { inputs[i] = i % model.config.vocab_size; }
+    double best = 1e30;
+    for (int r = 0; r < 5; r++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        gpt2_forward_no_grad(&model, inputs, NULL, B, T);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+        if (ms < best) { best = ms; }
+    }
+    free(inputs);
+    gpt2_free(&model);
+    return best;
+}
+
+int main(int argc, char** argv) {
+    const char* fp32_path = argc > 1 ? argv[1] : "gpt2_124M.bin";
+    const char* out_path = argc > 2 ? argv[2] : "gpt2_124M_int8.bin";
+    const char* format = argc > 3 ? argv[3] : "int8";
+    int version;
+    float tolerance;
+    if (strcmp(format, "int8") == 0) {
+        version = 6;
+        tolerance = INT8_PERPLEXITY_TOLERANCE;
+    } else if (strcmp(format, "q4") == 0) {
+        version = 7;
+        tolerance = Q4_PERPLEXITY_TOLERANCE;
+    } else {
+        printf("Error: unknown format %s, use int8 or q4\n", format);
+        exit(EXIT_FAILURE);
+    }
+
+    GPT2 model;
+    gpt2_build_from_checkpoint(&model, fp32_path);
+    if (gpt2_is_quantized(&model)) {
+        printf("Error: %s is already quantized\n", fp32_path);
+        exit(EXIT_FAILURE);
+    }
+    int maxT = model.config.max_seq_len;
+    write_quantized_checkpoint(&model, out_path, version);
+    gpt2_free(&model);
+
+    // the models to compare: the fp32 one, the new one, and any given after the format
+    const char* paths[MAX_CHECKPOINTS];
+    int num_checkpoints = 0;
+    paths[num_checkpoints++] = fp32_path;
+    paths[num_checkpoints++] = out_path;
+    for (int i = 4; i < argc && num_checkpoints < MAX_CHECKPOINTS; i++) { paths[num_checkpoints++] = argv[i]; }
+
+    const char* val_tokens = "dev/data/tinyshakespeare/tiny_shakespeare_val.bin";
+    int has_val = access(val_tokens, F_OK) != -1;
+    if (!has_val) { printf("%s not found, skipping the perplexity check (run dev/data/tinyshakespeare.py)\n", val_tokens); }
+    int B = 4;
+    int T = maxT < 256 ? maxT : 256;
+    float ppl[MAX_CHECKPOINTS];
+    double ms[MAX_CHECKPOINTS][2];
+    for (int i = 0; i < num_checkpoints; i++) {
+        ppl[i] = has_val ? expf(val_loss(paths[i], val_tokens, B, T)) : 0.0f;
+        ms[i][0] = time_forward(paths[i], 1, 1);
+        ms[i][1] = time_forward(paths[i], 1, 8);
+    }
+
+    printf("\n%-32s %12s %18s %18s\n", "checkpoint", "val ppl", "B=1 T=1 ms (tok/s)", "B=1 T=8 (ms)");
+    for (int i = 0; i < num_checkpoints; i++) {
+        printf("%-32s %12.4f %9.1f (%6.1f) %18.1f\n", paths[i], ppl[i], ms[i][0], 1000.0 / ms[i][0], ms[i][1]);
+    }
+    int ok = 1;
+    if (has_val) {
+        // the perplexity regression check, for the model we just wrote
+        ok = ppl[1] <= ppl[0] * (1.0f + tolerance);
+        printf("%s val perplexity %+.2f%% of fp32 (tolerance %.0f%%): %s\n",
+               format, 100.0f * (ppl[1] / ppl[0] - 1.0f), 100.0f * tolerance, ok ? "OK" : "FAIL");
+    }
+    printf("overall okay: %d\n", ok);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
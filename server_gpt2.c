@@ -0,0 +1,693 @@
+/*
+A local inference server on CPU, with continuous batching. It keeps the model resident,
+mapped read-only from the checkpoint (see gpt2_map_checkpoint in train_gpt2.c), listens
+on a Unix domain socket or a localhost TCP port, and streams back the tokens of each
+request as they are sampled.
+
+Decoding at B=1 is bound by reading the weights, so a forward pass over a few dozen rows
+takes about the time of one. Each step, the server puts the next row of every request
+being decoded into a single forward pass (see gpt2_forward_batch), and fills the rest of
+its GPT2_CACHED_ROWS rows with chunks of the prompts of the requests that came in, oldest
+first. A request joins the batch at the step after it arrives and leaves it at the step
+it ends, so the batch stays full under load, instead of waiting for the slowest request
+of a static batch. The prompts going through in chunks (chunked prefill) bound the time
+a step of those being decoded can take.
+
+Each request has a KV cache of its own, with blocks from a shared pool (see
+llmc/kvcache.h), and the pool has the blocks for the whole request taken at admission,
+so that it never runs out halfway. A request waits while there are none free, or no free
+slot. Prompts (and whole conversations, at the end) go into a prefix cache (see
+llmc/prefixcache.h), so a request that starts with a cached prefix, e.g. a system
+prompt, shares its blocks and only runs the rest. Its blocks are evicted when the pool is
+short of them.
+
+The protocol is text, a line per message. A client sends
+    GEN <max_tokens> <temperature> <seed> <token> <token> ...
+and gets back a line "TOK <token>" per token sampled, then
+    DONE <reason> <prompt tokens> <cached prompt tokens> <generated tokens>
+where the reason is "length" (max_tokens, or the end of the context) or "stop" (the
+stop token), or "ERR <message>" for a bad request. A connection has one request at a
+time, those after it wait their turn, and closing it cancels its request. Also
+    INFO     -> INFO <vocab_size> <max_seq_len>
+    METRICS  -> "<name> <value>" lines, then END
+The metrics: time to first token (TTFT), inter-token latency (ITL) and time in the queue,
+as percentiles over the last METRICS_SAMPLES, the tokens per second while busy, the mean
+batch, and the prefix cache. They are also printed at exit (Ctrl-C).
+
+compile and run as:
+make server_gpt2 && ./server_gpt2 [options]
+e.g.
+./server_gpt2 -e gpt2_124M.bin -s /tmp/gpt2.sock
+./server_gpt2 -e gpt2_124M_q4.bin -p 8080 -k 1 -b 32
+and load it with loadgen_gpt2.c
+*/
+#define TESTING
+#include "train_gpt2.c"
+#include "llmc/prefixcache.h"
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#define MAX_LINE (1 << 16) // bytes of a request line
+#define METRICS_SAMPLES (1 << 16) // latencies kept for the percentiles
+
+// ----------------------------------------------------------------------------
+// buffers of the connections
+
+// like mallocCheck, for the arrays that grow
+void* realloc_check(void* ptr, size_t size) {
+    void* p = realloc(ptr, size);
+    if (p == NULL) {
+        fprintf(stderr, "Error: realloc of %zu bytes failed\n", size);
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} Buffer;
+
+void buffer_reserve(Buffer* b, size_t n) {
+    if (b->len + n <= b->cap) { return; }
+    size_t cap = b->cap == 0 ? 4096 : b->cap;
+    while (cap < b->len + n) { cap *= 2; }
+    b->data = (char*)realloc_check(b->data, cap);
+    b->cap = cap;
+}
+
+void buffer_printf(Buffer* b, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    buffer_reserve(b, n + 1);
+    va_start(args, format);
+    vsnprintf(b->data + b->len, n + 1, format, args);
+    va_end(args);
+    b->len += n;
+}
+
+void buffer_consume(Buffer* b, size_t n) {
+    memmove(b->data, b->data + n, b->len - n);
+    b->len -= n;
+}
+
+// ----------------------------------------------------------------------------
+// latency samples: a ring of the last METRICS_SAMPLES
+
+typedef struct {
+    double* values;
+    long long count; // all time
+} Samples;
+
+void samples_add(Samples* s, double v) {
+    s->values[s->count++ % METRICS_SAMPLES] = v;
+}
+
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// the p-th percentiles of the samples kept, into out, in the order of ps
+void samples_percentiles(const Samples* s, const double* ps, int num, double* out) {
+    int n = s->count < METRICS_SAMPLES ? (int)s->count : METRICS_SAMPLES;
+    if (n == 0) {
+        for (int i = 0; i < num; i++) { out[i] = 0.0; }
+        return;
+    }
+    double* sorted = (double*)mallocCheck(n * sizeof(double));
+    memcpy(sorted, s->values, n * sizeof(double));
+    qsort(sorted, n, sizeof(double), compare_doubles);
+    for (int i = 0; i < num; i++) {
+        int k = (int)(ps[i] / 100.0 * (n - 1) + 0.5);
+        out[i] = sorted[k];
+    }
+    free(sorted);
+}
+
+// ----------------------------------------------------------------------------
+// the server
+
+typedef struct {
+    int* tokens; // (max_seq_len) the prompt, then the tokens sampled
+    int num_prompt;
+    int num_tokens;
+    int max_tokens;
+    int cached; // the prompt tokens found in the prefix cache
+    float temperature;
+    unsigned long long rng_state;
+    double arrival; // seconds
+    double last_token;
+} Request;
+
+typedef struct {
+    int fd; // -1 once closed
+    Buffer in;
+    Buffer out;
+    int waiting; // has a request in the queue
+    int slot; // or running in this slot, -1 if not
+    Request request;
+} Conn;
+
+typedef struct {
+    int conn; // -1 if free
+    long long admitted; // the order of admission
+    KVCache cache;
+    Sampler sampler;
+} Slot;
+
+typedef struct {
+    GPT2 model;
+    KVPool pool;
+    PrefixCache prefix_cache;
+    int stop_token; // ends a request, or -1
+    int listen_fd;
+    Conn* conns;
+    int num_conns;
+    Slot* slots;
+    int num_slots;
+    long long num_admitted;
+    // metrics
+    double start;
+    double busy_seconds;
+    long long requests; // done
+    long long cancelled;
+    long long prompt_tokens;
+    long long cached_tokens;
+    long long generated_tokens;
+    long long steps;
+    long long step_rows;
+    long long decode_rows;
+    Samples ttft;
+    Samples itl;
+    Samples queue;
+} Server;
+
+volatile sig_atomic_t stop_requested = 0;
+
+void handle_sigint(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+double now_seconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int num_running(const Server* s) {
+    int n = 0;
+    for (int i = 0; i < s->num_slots; i++) { n += s->slots[i].conn >= 0; }
+    return n;
+}
+
+int num_waiting(const Server* s) {
+    int n = 0;
+    for (int i = 0; i < s->num_conns; i++) { n += s->conns[i].fd >= 0 && s->conns[i].waiting; }
+    return n;
+}
+
+void write_metrics(Server* s, Buffer* b) {
+    double ps[3] = {50.0, 90.0, 99.0};
+    double ttft[3], itl[3], queue[3];
+    samples_percentiles(&s->ttft, ps, 3, ttft);
+    samples_percentiles(&s->itl, ps, 3, itl);
+    samples_percentiles(&s->queue, ps, 3, queue);
+    double busy = s->busy_seconds > 0.0 ? s->busy_seconds : 1.0;
+    long long steps = s->steps > 0 ? s->steps : 1;
+    buffer_printf(b, "uptime_s %.1f\nbusy_s %.1f\n", now_seconds() - s->start, s->busy_seconds);
+    buffer_printf(b, "requests %lld\ncancelled %lld\nrunning %d\nwaiting %d\n",
+                  s->requests, s->cancelled, num_running(s), num_waiting(s));
+    buffer_printf(b, "prompt_tokens %lld\ncached_prompt_tokens %lld\ngenerated_tokens %lld\n",
+                  s->prompt_tokens, s->cached_tokens, s->generated_tokens);
+    buffer_printf(b, "generated_tokens_per_s %.1f\nprefill_tokens_per_s %.1f\n",
+                  s->generated_tokens / busy, (s->step_rows - s->decode_rows) / busy);
+    buffer_printf(b, "ttft_ms_p50 %.2f\nttft_ms_p90 %.2f\nttft_ms_p99 %.2f\n", 1e3 * ttft[0], 1e3 * ttft[1], 1e3 * ttft[2]);
+    buffer_printf(b, "itl_ms_p50 %.2f\nitl_ms_p90 %.2f\nitl_ms_p99 %.2f\n", 1e3 * itl[0], 1e3 * itl[1], 1e3 * itl[2]);
+    buffer_printf(b, "queue_ms_p50 %.2f\nqueue_ms_p90 %.2f\nqueue_ms_p99 %.2f\n", 1e3 * queue[0], 1e3 * queue[1], 1e3 * queue[2]);
+    buffer_printf(b, "steps %lld\nmean_rows_per_step %.2f\nmean_decode_rows_per_step %.2f\n",
+                  s->steps, (double)s->step_rows / steps, (double)s->decode_rows / steps);
+    buffer_printf(b, "kv_blocks %d\nkv_blocks_free %d\nprefix_cache_blocks %d\n",
+                  s->pool.num_blocks, s->pool.num_free, s->prefix_cache.num_blocks);
+    buffer_printf(b, "prefix_cache_hit_rate %.3f\nprefix_cache_token_hit_rate %.3f\nprefix_cache_saved_s %.2f\n",
+                  prefixcache_hit_rate(&s->prefix_cache), prefixcache_token_hit_rate(&s->prefix_cache),
+                  prefixcache_saved_seconds(&s->prefix_cache));
+}
+
+// ----------------------------------------------------------------------------
+// connections
+
+int open_listener(const char* socket_path, int port) {
+    int fd;
+    if (port > 0) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) { perror("socket"); exit(EXIT_FAILURE); }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // local only
+        addr.sin_port = htons(port);
+        if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) { perror("bind"); exit(EXIT_FAILURE); }
+        printf("listening on 127.0.0.1:%d\n", port);
+    } else {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) { perror("socket"); exit(EXIT_FAILURE); }
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+            printf("Error: socket path %s is too long\n", socket_path);
+            exit(EXIT_FAILURE);
+        }
+        strcpy(addr.sun_path, socket_path);
+        unlink(socket_path); // that of a previous run
+        if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) { perror("bind"); exit(EXIT_FAILURE); }
+        printf("listening on %s\n", socket_path);
+    }
+    if (listen(fd, 128) < 0) { perror("listen"); exit(EXIT_FAILURE); }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+void accept_conns(Server* s) {
+    for (;;) {
+        int fd = accept(s->listen_fd, NULL, NULL);
+        if (fd < 0) { return; } // EAGAIN: no more
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        int i = 0;
+        while (i < s->num_conns && s->conns[i].fd >= 0) { i++; }
+        if (i == s->num_conns) {
+            s->conns = (Conn*)realloc_check(s->conns, (s->num_conns + 1) * sizeof(Conn));
+            memset(&s->conns[i], 0, sizeof(Conn));
+            s->conns[i].request.tokens = (int*)mallocCheck(s->model.config.max_seq_len * sizeof(int));
+            s->num_conns++;
+        }
+        Conn* c = &s->conns[i];
+        c->fd = fd;
+        c->in.len = 0;
+        c->out.len = 0;
+        c->waiting = 0;
+        c->slot = -1;
+    }
+}
+
+void close_conn(Server* s, Conn* c) {
+    if (c->slot >= 0) {
+        // cancel its request: the blocks go back to the pool
+        Slot* slot = &s->slots[c->slot];
+        kvcache_free(&slot->cache);
+        prefixcache_trim(&s->prefix_cache); // the blocks it held are the tree's alone now
+        slot->conn = -1;
+        s->cancelled++;
+    }
+    close(c->fd);
+    c->fd = -1;
+    c->waiting = 0;
+    c->slot = -1;
+}
+
+// parses the line of a GEN request into c->request, or returns an error message
+const char* parse_request(Server* s, Conn* c, char* line) {
+    Request* r = &c->request;
+    int maxT = s->model.config.max_seq_len;
+    int V = s->model.config.vocab_size;
+    char* end;
+    r->max_tokens = (int)strtol(line, &end, 10);
+    if (end == line || r->max_tokens < 1) { return "max_tokens must be at least 1"; }
+    line = end;
+    r->temperature = strtof(line, &end);
+    if (end == line || r->temperature < 0.0f) { return "temperature must be at least 0"; }
+    line = end;
+    r->rng_state = strtoull(line, &end, 10);
+    if (end == line) { return "no seed"; }
+    r->rng_state = r->rng_state * 2654435761ull + 1; // xorshift needs a nonzero state
+    line = end;
+    r->num_prompt = 0;
+    for (;;) {
+        long t = strtol(line, &end, 10);
+        if (end == line) { break; }
+        line = end;
+        if (t < 0 || t >= V) { return "token out of range"; }
+        if (r->num_prompt == maxT - 1) { return "prompt too long"; }
+        r->tokens[r->num_prompt++] = (int)t;
+    }
+    while (*line == ' ' || *line == '\r') { line++; }
+    if (*line != '\0') { return "not a token"; }
+    if (r->num_prompt == 0) { return "no prompt"; }
+    // stop at the end of the context
+    if (r->num_prompt + r->max_tokens > maxT) { r->max_tokens = maxT - r->num_prompt; }
+    if (kv_blocks(r->num_prompt + r->max_tokens - 1) > s->pool.num_blocks) { return "the KV pool is too small"; }
+    r->num_tokens = r->num_prompt;
+    return NULL;
+}
+
+// handles the lines of the connection, until it has a request in the queue or running
+void process_input(Server* s, Conn* c) {
+    while (c->fd >= 0 && !c->waiting && c->slot < 0) {
+        char* newline = (char*)memchr(c->in.data, '\n', c->in.len);
+        if (newline == NULL) {
+            if (c->in.len >= MAX_LINE) {
+                buffer_printf(&c->out, "ERR line too long\n");
+                c->in.len = 0;
+            }
+            return;
+        }
+        *newline = '\0';
+        char* line = c->in.data;
+        if (strncmp(line, "GEN ", 4) == 0) {
+            const char* error = parse_request(s, c, line + 4);
+            if (error != NULL) {
+                buffer_printf(&c->out, "ERR %s\n", error);
+            } else {
+                c->request.arrival = now_seconds();
+                c->waiting = 1;
+            }
+        } else if (strncmp(line, "INFO", 4) == 0) {
+            buffer_printf(&c->out, "INFO %d %d\n", s->model.config.vocab_size, s->model.config.max_seq_len);
+        } else if (strncmp(line, "METRICS", 7) == 0) {
+            write_metrics(s, &c->out);
+            buffer_printf(&c->out, "END\n");
+        } else {
+            buffer_printf(&c->out, "ERR unknown command\n");
+        }
+        buffer_consume(&c->in, newline + 1 - c->in.data);
+    }
+}
+
+void read_conn(Server* s, Conn* c) {
+    for (;;) {
+        buffer_reserve(&c->in, 4096);
+        ssize_t n = recv(c->fd, c->in.data + c->in.len, c->in.cap - c->in.len, 0);
+        if (n > 0) { c->in.len += n; continue; }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { break; }
+        if (n < 0 && errno == EINTR) { continue; }
+        close_conn(s, c); // closed by the client, or an error
+        return;
+    }
+    process_input(s, c);
+}
+
+void flush_conn(Server* s, Conn* c) {
+    while (c->out.len > 0) {
+        ssize_t n = send(c->fd, c->out.data, c->out.len, MSG_NOSIGNAL);
+        if (n > 0) { buffer_consume(&c->out, n); continue; }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { return; }
+        if (n < 0 && errno == EINTR) { continue; }
+        close_conn(s, c);
+        return;
+    }
+}
+
+// ----------------------------------------------------------------------------
+// scheduling
+
+// moves the oldest requests in the queue into free slots, while the pool has the blocks
+// for them, evicting cached prefixes as needed
+void admit_requests(Server* s) {
+    for (;;) {
+        int free_slot = -1;
+        for (int i = 0; i < s->num_slots && free_slot < 0; i++) {
+            if (s->slots[i].conn < 0) { free_slot = i; }
+        }
+        Conn* c = NULL;
+        for (int i = 0; i < s->num_conns; i++) {
+            Conn* ci = &s->conns[i];
+            if (ci->fd >= 0 && ci->waiting && (c == NULL || ci->request.arrival < c->request.arrival)) { c = ci; }
+        }
+        if (free_slot < 0 || c == NULL) { return; }
+        Request* r = &c->request;
+        int positions = r->num_prompt + r->max_tokens - 1;
+        Slot* slot = &s->slots[free_slot];
+        kvcache_init(&slot->cache, &s->pool, positions);
+        // match before evicting: the sequence then holds the blocks of its cached prefix, so
+        // they can't be evicted, and it only needs free blocks for the positions past it
+        r->cached = prefixcache_match(&s->prefix_cache, r->tokens, r->num_prompt, &slot->cache);
+        int need = kv_blocks(positions) - slot->cache.num_blocks;
+        if (s->pool.num_free < need) { prefixcache_evict(&s->prefix_cache, need - s->pool.num_free); }
+        if (s->pool.num_free < need) { // until requests end
+            prefixcache_unmatch(&s->prefix_cache, r->num_prompt, &slot->cache);
+            kvcache_free(&slot->cache);
+            return;
+        }
+        if (!kvcache_reserve(&slot->cache, positions - r->cached)) {
+            printf("Error: the KV pool is out of blocks\n");
+            exit(EXIT_FAILURE);
+        }
+        slot->sampler.config.temperature = r->temperature;
+        slot->conn = (int)(c - s->conns);
+        slot->admitted = s->num_admitted++;
+        c->waiting = 0;
+        c->slot = free_slot;
+        samples_add(&s->queue, now_seconds() - r->arrival);
+        s->prompt_tokens += r->num_prompt;
+        s->cached_tokens += r->cached;
+    }
+}
+
+void end_request(Server* s, Slot* slot, const char* reason) {
+    Conn* c = &s->conns[slot->conn];
+    Request* r = &c->request;
+    // the whole conversation, for a follow-up request
+    prefixcache_insert(&s->prefix_cache, r->tokens, slot->cache.pos, &slot->cache);
+    kvcache_free(&slot->cache);
+    prefixcache_trim(&s->prefix_cache); // the blocks it held are the tree's alone now
+    slot->conn = -1;
+    c->slot = -1;
+    buffer_printf(&c->out, "DONE %s %d %d %d\n", reason, r->num_prompt, r->cached, r->num_tokens - r->num_prompt);
+    s->requests++;
+    process_input(s, c); // the next request of the connection
+}
+
+// one forward pass: a row for each request being decoded, then chunks of the prompts
+void step(Server* s) {
+    int num_seqs = 0, T = 0;
+    KVCache* caches[GPT2_CACHED_ROWS];
+    int counts[GPT2_CACHED_ROWS];
+    int seq_slot[GPT2_CACHED_ROWS];
+    int tokens[GPT2_CACHED_ROWS];
+    for (int i = 0; i < s->num_slots; i++) {
+        Slot* slot = &s->slots[i];
+        if (slot->conn < 0) { continue; }
+        Request* r = &s->conns[slot->conn].request;
+        if (r->num_tokens == r->num_prompt) { continue; } // in prefill
+        caches[num_seqs] = &slot->cache;
+        counts[num_seqs] = 1;
+        seq_slot[num_seqs++] = i;
+        tokens[T++] = r->tokens[r->num_tokens - 1];
+    }
+    int decode_rows = T;
+    while (T < GPT2_CACHED_ROWS) {
+        // the prompt admitted first, of those not done
+        int next = -1;
+        for (int i = 0; i < s->num_slots; i++) {
+            Slot* slot = &s->slots[i];
+            if (slot->conn < 0 || slot->cache.pos >= s->conns[slot->conn].request.num_prompt) { continue; }
+            int taken = 0;
+            for (int k = decode_rows; k < num_seqs; k++) { taken |= seq_slot[k] == i; }
+            if (!taken && (next < 0 || slot->admitted < s->slots[next].admitted)) { next = i; }
+        }
+        if (next < 0) { break; }
+        Slot* slot = &s->slots[next];
+        Request* r = &s->conns[slot->conn].request;
+        int n = r->num_prompt - slot->cache.pos;
+        if (n > GPT2_CACHED_ROWS - T) { n = GPT2_CACHED_ROWS - T; }
+        caches[num_seqs] = &slot->cache;
+        counts[num_seqs] = n;
+        seq_slot[num_seqs++] = next;
+        memcpy(tokens + T, r->tokens + slot->cache.pos, n * sizeof(int));
+        T += n;
+    }
+    if (T == 0) { return; }
+
+    double start = now_seconds();
+    const float* logits = gpt2_forward_batch(&s->model, caches, tokens, counts, num_seqs);
+    double now = now_seconds();
+    s->busy_seconds += now - start;
+    s->steps++;
+    s->step_rows += T;
+    s->decode_rows += decode_rows;
+    if (T > decode_rows) {
+        // the share of the step of the prompts, for the time saved by the prefix cache
+        prefixcache_prefilled(&s->prefix_cache, T - decode_rows, (now - start) * (T - decode_rows) / T);
+    }
+
+    // sample the next token of each request with all its tokens so far in the cache
+    size_t Vp = s->model.config.padded_vocab_size;
+    int row = 0;
+    for (int k = 0; k < num_seqs; k++) {
+        row += counts[k];
+        Slot* slot = &s->slots[seq_slot[k]];
+        Conn* c = &s->conns[slot->conn];
+        Request* r = &c->request;
+        if (slot->cache.pos < r->num_tokens) { continue; } // more of the prompt to go
+        if (r->num_tokens == r->num_prompt) {
+            // the prompt is in, for requests that start with it
+            prefixcache_insert(&s->prefix_cache, r->tokens, r->num_prompt, &slot->cache);
+        }
+        int token = sampler_sample(&slot->sampler, logits + (size_t)(row - 1) * Vp, random_f32(&r->rng_state));
+        r->tokens[r->num_tokens++] = token;
+        buffer_printf(&c->out, "TOK %d\n", token);
+        samples_add(r->num_tokens == r->num_prompt + 1 ? &s->ttft : &s->itl,
+                    now - (r->num_tokens == r->num_prompt + 1 ? r->arrival : r->last_token));
+        r->last_token = now;
+        s->generated_tokens++;
+        if (token == s->stop_token) {
+            end_request(s, slot, "stop");
+        } else if (r->num_tokens - r->num_prompt == r->max_tokens) {
+            end_request(s, slot, "length");
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+// main
+
+void error_usage() {
+    fprintf(stderr, "Usage:   ./server_gpt2 [options]\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -e <string> model checkpoint, fp32, int8 or q4 (default = gpt2_124M.bin)\n");
+    fprintf(stderr, "  -s <string> Unix domain socket to listen on (default = /tmp/gpt2.sock)\n");
+    fprintf(stderr, "  -p <int>    listen on this localhost TCP port instead (default = 0, the socket)\n");
+    fprintf(stderr, "  -b <int>    max requests decoded together (default = 16, at most %d)\n", GPT2_CACHED_ROWS);
+    fprintf(stderr, "  -m <int>    MB of KV cache, the shared pool of blocks (default = 1024)\n");
+    fprintf(stderr, "  -k <int>    int8 KV cache (default = 0, fp32)\n");
+    fprintf(stderr, "  -c <int>    max KV blocks of the prefix cache (default = -1, half the pool)\n");
+    fprintf(stderr, "  -t <int>    stop token (default = 50256, GPT-2's EOT; -1 for none)\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+    const char* model_path = "gpt2_124M.bin";
+    const char* socket_path = "/tmp/gpt2.sock";
+    int port = 0;
+    int max_seqs = 16;
+    int kv_mb = 1024;
+    int kv_int8 = 0;
+    int prefix_blocks = -1;
+    int stop_token = 50256;
+    for (int i = 1; i < argc; i+=2) {
+        if (i + 1 >= argc) { error_usage(); } // must have arg after flag
+        if (argv[i][0] != '-') { error_usage(); } // must start with dash
+        if (strlen(argv[i]) != 2) { error_usage(); } // must be -x (one dash, one letter)
+        if (argv[i][1] == 'e') { model_path = argv[i+1]; }
+        else if (argv[i][1] == 's') { socket_path = argv[i+1]; }
+        else if (argv[i][1] == 'p') { port = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'b') { max_seqs = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'm') { kv_mb = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'k') { kv_int8 = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'c') { prefix_blocks = atoi(argv[i+1]); }
+        else if (argv[i][1] == 't') { stop_token = atoi(argv[i+1]); }
+        else { error_usage(); }
+    }
+    if (max_seqs < 1 || max_seqs > GPT2_CACHED_ROWS || kv_mb < 1) { error_usage(); }
+
+    Server s;
+    memset(&s, 0, sizeof(s));
+    gpt2_map_checkpoint(&s.model, model_path);
+    GPT2Config config = s.model.config;
+    s.stop_token = stop_token < config.vocab_size ? stop_token : -1;
+
+    // the pool: as many blocks as fit in kv_mb
+    KVPool probe;
+    kvpool_init(&probe, config.num_layers, config.num_heads, config.channels, 1, kv_int8);
+    size_t block_bytes = kvpool_position_bytes(&probe) * KV_BLOCK_SIZE;
+    kvpool_free(&probe);
+    int num_blocks = (int)(((size_t)kv_mb << 20) / block_bytes);
+    if (num_blocks < kv_blocks(config.max_seq_len)) {
+        printf("Error: %d MB of KV cache is less than a sequence of %d positions\n", kv_mb, config.max_seq_len);
+        exit(EXIT_FAILURE);
+    }
+    kvpool_init(&s.pool, config.num_layers, config.num_heads, config.channels, num_blocks, kv_int8);
+    prefixcache_init(&s.prefix_cache, &s.pool, prefix_blocks < 0 ? num_blocks / 2 : prefix_blocks);
+    printf("KV cache: %d blocks of %d positions, %s, %.1f MB; prefix cache up to %d blocks\n", num_blocks,
+           KV_BLOCK_SIZE, kv_int8 ? "int8" : "fp32", (double)num_blocks * block_bytes / (1 << 20), s.prefix_cache.max_blocks);
+
+    s.num_slots = max_seqs;
+    s.slots = (Slot*)mallocCheck(max_seqs * sizeof(Slot));
+    for (int i = 0; i < max_seqs; i++) {
+        s.slots[i].conn = -1;
+        sampler_init(&s.slots[i].sampler, config.vocab_size, 1, sampler_default_config());
+    }
+    s.ttft.values = (double*)mallocCheck(METRICS_SAMPLES * sizeof(double));
+    s.itl.values = (double*)mallocCheck(METRICS_SAMPLES * sizeof(double));
+    s.queue.values = (double*)mallocCheck(METRICS_SAMPLES * sizeof(double));
+    s.listen_fd = open_listener(socket_path, port);
+    s.start = now_seconds();
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_sigint; // no SA_RESTART: it interrupts poll
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    printf("max %d requests at a time, up to %d rows per forward pass\n", max_seqs, GPT2_CACHED_ROWS);
+
+    struct pollfd* fds = NULL;
+    int* fd_conn = NULL;
+    while (!stop_requested) {
+        // wait for the clients only when there's nothing to run
+        int busy = num_running(&s) > 0 || num_waiting(&s) > 0;
+        fds = (struct pollfd*)realloc_check(fds, (s.num_conns + 1) * sizeof(struct pollfd));
+        fd_conn = (int*)realloc_check(fd_conn, (s.num_conns + 1) * sizeof(int));
+        int n = 0;
+        fds[n].fd = s.listen_fd;
+        fds[n].events = POLLIN;
+        fd_conn[n++] = -1;
+        for (int i = 0; i < s.num_conns; i++) {
+            if (s.conns[i].fd < 0) { continue; }
+            fds[n].fd = s.conns[i].fd;
+            fds[n].events = POLLIN | (s.conns[i].out.len > 0 ? POLLOUT : 0);
+            fd_conn[n++] = i;
+        }
+        int ready = poll(fds, n, busy ? 0 : -1);
+        if (ready < 0 && errno != EINTR) { perror("poll"); exit(EXIT_FAILURE); }
+        for (int k = 0; ready > 0 && k < n; k++) {
+            if (fds[k].revents == 0) { continue; }
+            if (fd_conn[k] < 0) { accept_conns(&s); continue; }
+            Conn* c = &s.conns[fd_conn[k]];
+            if (fds[k].revents & (POLLIN | POLLHUP | POLLERR)) { read_conn(&s, c); }
+            if (c->fd >= 0 && (fds[k].revents & POLLOUT)) { flush_conn(&s, c); }
+        }
+        admit_requests(&s);
+        step(&s);
+        for (int i = 0; i < s.num_conns; i++) {
+            if (s.conns[i].fd >= 0 && s.conns[i].out.len > 0) { flush_conn(&s, &s.conns[i]); }
+        }
+    }
+
+    printf("\n");
+    Buffer report = {0};
+    write_metrics(&s, &report);
+    fwrite(report.data, 1, report.len, stdout);
+    free(report.data);
+    for (int i = 0; i < s.num_conns; i++) {
+        if (s.conns[i].fd >= 0) { close_conn(&s, &s.conns[i]); }
+        free(s.conns[i].in.data);
+        free(s.conns[i].out.data);
+        free(s.conns[i].request.tokens);
+    }
+    close(s.listen_fd);
+    if (port == 0) { unlink(socket_path); }
+    for (int i = 0; i < max_seqs; i++) { sampler_free(&s.slots[i].sampler); }
+    prefixcache_free(&s.prefix_cache);
+    kvpool_free(&s.pool);
+    gpt2_free(&s.model);
+    free(s.slots);
+    free(s.conns);
+    free(fds);
+    free(fd_conn);
+    free(s.ttft.values);
+    free(s.itl.values);
+    free(s.queue.values);
+    return 0;
+}
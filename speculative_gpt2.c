@@ -0,0 +1,304 @@
+/*
+Speculative decoding on CPU. A small draft model proposes k tokens, one at a time. The
+large target model then scores all of them in a single forward pass over k+1 positions,
+with its KV cache (see gpt2_forward_cached in train_gpt2.c). Speculative sampling (see
+llmc/sampler.h) keeps a prefix of the draft and adds one token of the target's own, so
+the text comes out distributed exactly as if sampled from the target alone.
+
+Decoding at B=1 is bound by reading the weights, and a forward pass over k+1 positions
+reads them once, in about the time of one position. So every accepted draft token saves a
+forward pass of the target, at the price of a forward pass of the draft. The two models
+need the same vocabulary: e.g. a d12 draft for a d24 or d48 target, or a q4 copy of the
+target itself (see quantize_gpt2.c).
+
+First it checks that decoding with the KV cache gives the logits of the full forward
+pass. Then, with the same prompt and sampler, it decodes with the target alone, and
+speculatively for a few k. It reports the acceptance rate of the draft tokens, the tokens
+per forward pass of the target, and the speedup. When greedy (temperature 0), both must
+decode the same tokens.
+
+compile and run as:
+make speculative_gpt2 && ./speculative_gpt2 [target.bin] [draft.bin] [temperature] [tokens] [k ...]
+e.g.
+./speculative_gpt2 gpt2_350M.bin gpt2_124M.bin 1.0 256
+./speculative_gpt2 gpt2_124M.bin gpt2_124M_q4.bin 0 256 4 8
+*/
+#define TESTING
+#include "train_gpt2.c"
+
+#define PROMPT_TOKENS 32
+#define MAX_K 16 // draft tokens per round, at most GPT2_CACHED_ROWS - 1
+#define CHECK_TOKENS 80 // positions of the KV cache check: a prompt in 2 chunks, then one at a time
+#define CHECK_STEPS 8
+
+int sample_mult(float* probabilities, int n, float coin) {
+    // sample index from probabilities (they must sum to 1!)
+    // coin is a random number in [0, 1), usually from random_f32()
+    float cdf = 0.0f;
+    for (int i = 0; i < n; i++) {
+        cdf += probabilities[i];
+        if (coin < cdf) {
+            return i;
+        }
+    }
+    return n - 1; // in case of rounding errors
+}
+
+double seconds_since(struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// the largest difference between the logits with the KV cache and those of the full
+// forward pass, relative to the largest logit
+float check_kvcache(GPT2* model, int* tokens) {
+    int T = CHECK_TOKENS;
+    size_t V = model->config.vocab_size;
+    size_t Vp = model->config.padded_vocab_size;
+    gpt2_forward_no_grad(model, tokens, NULL, 1, T);
+    const float* ref = model->acts_no_grad.logits;
+    KVPool pool;
+    kvpool_init(&pool, model->config.num_layers, model->config.num_heads, model->config.channels, kv_blocks(T), 0);
+    KVCache cache;
+    kvcache_init(&cache, &pool, T);
+    float max_diff = 0.0f, max_logit = 0.0f;
+    int prompt = T - CHECK_STEPS;
+    for (int t = prompt - 1; t < T; t++) {
+        // the prompt all at once, and the positions after it one by one
+        const float* logits = t == prompt - 1 ? gpt2_forward_cached(model, &cache, tokens, prompt) + (GPT2_CACHED_ROWS - 1) * Vp
+                                              : gpt2_forward_cached(model, &cache, tokens + t, 1);
+        if (t == prompt - 1) {
+            // the rows of the prompt's last (full) chunk
+            const float* chunk = logits - (GPT2_CACHED_ROWS - 1) * Vp;
+            for (int r = 0; r < GPT2_CACHED_ROWS; r++) {
+                for (int i = 0; i < V; i++) {
+                    float ref_i = ref[(prompt - GPT2_CACHED_ROWS + r) * Vp + i];
+                    max_diff = fmaxf(max_diff, fabsf(chunk[r * Vp + i] - ref_i));
+                    max_logit = fmaxf(max_logit, fabsf(ref_i));
+                }
+            }
+        } else {
+            for (int i = 0; i < V; i++) {
+                max_diff = fmaxf(max_diff, fabsf(logits[i] - ref[t * Vp + i]));
+                max_logit = fmaxf(max_logit, fabsf(ref[t * Vp + i]));
+            }
+        }
+    }
+    kvcache_free(&cache);
+    kvpool_free(&pool);
+    return max_diff / max_logit;
+}
+
+// decodes n tokens after the prompt with the model alone, into out. returns the seconds
+// it took, after the prompt
+double decode(GPT2* model, Sampler* sampler, int* prompt, int prompt_len, int* out, int n, unsigned long long rng_state) {
+    size_t Vp = model->config.padded_vocab_size;
+    KVPool pool;
+    kvpool_init(&pool, model->config.num_layers, model->config.num_heads, model->config.channels, kv_blocks(prompt_len + n), 0);
+    KVCache cache;
+    kvcache_init(&cache, &pool, prompt_len + n);
+    int rows = prompt_len < GPT2_CACHED_ROWS ? prompt_len : GPT2_CACHED_ROWS;
+    float* logits = gpt2_forward_cached(model, &cache, prompt, prompt_len) + (rows - 1) * Vp;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < n; i++) {
+        out[i] = sampler_sample(sampler, logits, random_f32(&rng_state));
+        if (i < n - 1) { logits = gpt2_forward_cached(model, &cache, out + i, 1); }
+    }
+    double s = seconds_since(&start);
+    kvcache_free(&cache);
+    kvpool_free(&pool);
+    return s;
+}
+
+typedef struct {
+    int rounds; // forward passes of the target
+    int drafted; // draft tokens proposed
+    int accepted; // draft tokens kept
+    double seconds; // after the prompt
+    double target_seconds; // of that, in the forward passes of the target
+} SpeculativeStats;
+
+// decodes n tokens after the prompt, drafting k at a time with the draft model, into out
+SpeculativeStats decode_speculative(GPT2* target, GPT2* draft, Sampler* sampler, int k,
+                                    int* prompt, int prompt_len, int* out, int n, unsigned long long rng_state) {
+    size_t V = target->config.vocab_size;
+    size_t Vp = target->config.padded_vocab_size;
+    // the whole sequence so far, with room for a round's drafts past the end. both caches
+    // hold a prefix of it, never its last token, which is fed to them in the next round
+    int capacity = prompt_len + n + k + 1;
+    int* tokens = (int*)mallocCheck(capacity * sizeof(int));
+    memcpy(tokens, prompt, prompt_len * sizeof(int));
+    int len = prompt_len;
+    KVPool target_pool, draft_pool;
+    kvpool_init(&target_pool, target->config.num_layers, target->config.num_heads, target->config.channels, kv_blocks(capacity), 0);
+    kvpool_init(&draft_pool, draft->config.num_layers, draft->config.num_heads, draft->config.channels, kv_blocks(capacity), 0);
+    KVCache target_cache, draft_cache;
+    kvcache_init(&target_cache, &target_pool, capacity);
+    kvcache_init(&draft_cache, &draft_pool, capacity);
+    float* q = (float*)mallocCheck((size_t)k * V * sizeof(float)); // the draft's distributions
+    float* p = (float*)mallocCheck(V * sizeof(float)); // the target's, one at a time
+    SpeculativeStats stats = {0, 0, 0, 0.0, 0.0};
+
+    // the prompt, but for its last token (not timed, as in decode)
+    if (len > 1) {
+        gpt2_forward_cached(target, &target_cache, tokens, len - 1);
+        gpt2_forward_cached(draft, &draft_cache, tokens, len - 1);
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (len < prompt_len + n) {
+        // the draft proposes k tokens, into tokens[len..len+k)
+        int* d = tokens + len;
+        int fed = len - draft_cache.pos;
+        int rows = fed < GPT2_CACHED_ROWS ? fed : GPT2_CACHED_ROWS;
+        float* logits = gpt2_forward_cached(draft, &draft_cache, tokens + draft_cache.pos, fed) + (rows - 1) * Vp;
+        for (int i = 0; i < k; i++) {
+            if (i > 0) { logits = gpt2_forward_cached(draft, &draft_cache, d + i - 1, 1); }
+            sampler_probs(sampler, logits, q + i * V);
+            d[i] = sample_mult(q + i * V, V, random_f32(&rng_state));
+        }
+        // the target scores the last token and all k of them in one forward pass: row i of
+        // the last k+1 is its distribution for d[i], and the last row for the token after
+        fed = len + k - target_cache.pos;
+        rows = fed < GPT2_CACHED_ROWS ? fed : GPT2_CACHED_ROWS;
+        struct timespec target_start;
+        clock_gettime(CLOCK_MONOTONIC, &target_start);
+        logits = gpt2_forward_cached(target, &target_cache, tokens + target_cache.pos, fed) + (rows - k - 1) * Vp;
+        stats.target_seconds += seconds_since(&target_start);
+        stats.rounds++;
+        stats.drafted += k;
+        // keep the draft tokens up to the first rejected one, which is replaced
+        int a = 0;
+        int next = -1;
+        for (; a < k; a++) {
+            sampler_probs(sampler, logits + a * Vp, p);
+            if (!sampler_speculative_accept(p, q + a * V, d[a], random_f32(&rng_state))) {
+                next = sampler_speculative_residual(p, q + a * V, V, random_f32(&rng_state));
+                break;
+            }
+        }
+        if (next < 0) {
+            // all accepted, the target adds one more
+            sampler_probs(sampler, logits + k * Vp, p);
+            next = sample_mult(p, V, random_f32(&rng_state));
+        }
+        stats.accepted += a;
+        d[a] = next;
+        len += a + 1;
+        // forget the rejected draft tokens: the caches hold the sequence up to d[a - 1]
+        kvcache_truncate(&target_cache, len - 1);
+        if (draft_cache.pos > len - 1) { kvcache_truncate(&draft_cache, len - 1); }
+    }
+    stats.seconds = seconds_since(&start);
+    memcpy(out, tokens + prompt_len, n * sizeof(int));
+    free(tokens);
+    free(q);
+    free(p);
+    kvcache_free(&target_cache);
+    kvcache_free(&draft_cache);
+    kvpool_free(&target_pool);
+    kvpool_free(&draft_pool);
+    return stats;
+}
+
+int main(int argc, char** argv) {
+    const char* target_path = argc > 1 ? argv[1] : "gpt2_350M.bin";
+    const char* draft_path = argc > 2 ? argv[2] : "gpt2_124M.bin";
+    float temperature = argc > 3 ? atof(argv[3]) : 1.0f;
+    int n = argc > 4 ? atoi(argv[4]) : 128;
+    int ks[MAX_K] = {2, 4, 8};
+    int num_ks = 3;
+    if (argc > 5) {
+        num_ks = 0;
+        for (int i = 5; i < argc && num_ks < MAX_K; i++) { ks[num_ks++] = atoi(argv[i]); }
+    }
+    for (int i = 0; i < num_ks; i++) {
+        if (ks[i] < 1 || ks[i] > MAX_K) {
+            printf("Error: k must be in [1, %d]\n", MAX_K);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    GPT2 target, draft;
+    gpt2_build_from_checkpoint(&target, target_path);
+    gpt2_build_from_checkpoint(&draft, draft_path);
+    if (target.config.vocab_size != draft.config.vocab_size || target.config.padded_vocab_size != draft.config.padded_vocab_size) {
+        printf("Error: the target and the draft have different vocabularies\n");
+        exit(EXIT_FAILURE);
+    }
+    int maxT = target.config.max_seq_len < draft.config.max_seq_len ? target.config.max_seq_len : draft.config.max_seq_len;
+    if (PROMPT_TOKENS + n + MAX_K + 1 > maxT || CHECK_TOKENS > maxT) {
+        printf("Error: %d tokens after the prompt don't fit in the context of %d\n", n, maxT);
+        exit(EXIT_FAILURE);
+    }
+
+    // the prompt: the start of the tinyshakespeare val set, or else the GPT-2 EOT token
+    int tokens[CHECK_TOKENS];
+    const char* val_tokens = "dev/data/tinyshakespeare/tiny_shakespeare_val.bin";
+    int prompt_len;
+    if (access(val_tokens, F_OK) != -1) {
+        DataLoader loader;
+        dataloader_init(&loader, val_tokens, 1, CHECK_TOKENS, 0, 1, 0);
+        dataloader_next_batch(&loader);
+        memcpy(tokens, loader.inputs, CHECK_TOKENS * sizeof(int));
+        dataloader_free(&loader);
+        prompt_len = PROMPT_TOKENS;
+    } else {
+        for (int i = 0; i < CHECK_TOKENS; i++) { tokens[i] = (i * 7919) % target.config.vocab_size; }
+        tokens[0] = target.config.vocab_size - 1; // GPT-2's EOT token, 50256, for GPT-2's vocab
+        prompt_len = 1;
+    }
+
+    // the KV cache gives the logits of the full forward pass, for both models
+    float target_diff = check_kvcache(&target, tokens);
+    float draft_diff = check_kvcache(&draft, tokens);
+    int ok = target_diff < 1e-4f && draft_diff < 1e-4f;
+    printf("KV cache vs full forward pass, max logit difference (relative): target %.2e, draft %.2e: %s\n",
+           target_diff, draft_diff, ok ? "OK" : "FAIL");
+
+    SamplerConfig config = sampler_default_config();
+    config.temperature = temperature;
+    Sampler sampler;
+    sampler_init(&sampler, target.config.vocab_size, 1, config);
+    unsigned long long seed = 1337;
+    int* plain = (int*)mallocCheck(n * sizeof(int));
+    int* speculative = (int*)mallocCheck(n * sizeof(int));
+
+    // decoding with each model alone, for reference
+    double draft_s = decode(&draft, &sampler, tokens, prompt_len, speculative, n, seed);
+    double target_s = decode(&target, &sampler, tokens, prompt_len, plain, n, seed);
+    printf("\n%d tokens, temperature %.2f, after a prompt of %d\n", n, temperature, prompt_len);
+    printf("%-24s %9.1f ms/token %8.1f tokens/s\n", "draft alone", draft_s * 1e3 / n, n / draft_s);
+    printf("%-24s %9.1f ms/token %8.1f tokens/s\n", "target alone", target_s * 1e3 / n, n / target_s);
+
+    // a pass of the target over k+1 positions costs about as much as over one while it's
+    // bound by reading the weights: the speedup is the tokens per pass over the cost of a
+    // pass plus k draft tokens, relative to a pass of the target alone
+    printf("\n%4s %12s %18s %16s %14s %9s %9s\n", "k", "acceptance", "tokens/target pass", "target pass ms",
+           "ms/token", "tokens/s", "speedup");
+    for (int i = 0; i < num_ks; i++) {
+        int k = ks[i];
+        SpeculativeStats stats = decode_speculative(&target, &draft, &sampler, k, tokens, prompt_len, speculative, n, seed);
+        // the tokens of the last round may overshoot n, count only the first n
+        printf("%4d %11.1f%% %18.2f %16.1f %14.1f %9.1f %8.2fx\n", k, 100.0 * stats.accepted / stats.drafted,
+               (double)n / stats.rounds, stats.target_seconds * 1e3 / stats.rounds, stats.seconds * 1e3 / n,
+               n / stats.seconds, target_s / stats.seconds);
+        if (temperature <= 0.0f) {
+            // greedy: the target's own tokens, exactly
+            int same = 0;
+            while (same < n && speculative[same] == plain[same]) { same++; }
+            printf("     greedy, the first %d of %d tokens as the target alone: %s\n", same, n, same == n ? "OK" : "FAIL");
+            ok &= same == n;
+        }
+    }
+
+    free(plain);
+    free(speculative);
+    sampler_free(&sampler);
+    gpt2_free(&target);
+    gpt2_free(&draft);
+    printf("overall okay: %d\n", ok);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
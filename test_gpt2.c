@@ -36,6 +36,30 @@ int check_tensor(float *a, float *b, int n, const char* label) {
     return ok;
 }
 
+// runs one training step of a freshly loaded model with the given number of threads, QKV
+// layout and scheduling (layer by layer, or the task graph), and returns a copy of the mean
+// loss, the gradients and the updated parameters
+float* training_step_snapshot(int num_threads, int qkv_head_major, int use_task_graph, int* x, int* y, int B, int T, size_t* n) {
+    #ifdef OMP
+    omp_set_num_threads(num_threads);
+    #endif
+    GPT2 model;
+    gpt2_build_from_checkpoint(&model, "gpt2_124M.bin");
+    model.qkv_head_major = qkv_head_major;
+    model.use_task_graph = use_task_graph;
+    gpt2_forward(&model, x, y, B, T);
+    gpt2_zero_grad(&model);
+    gpt2_backward(&model);
+    float* snapshot = (float*)mallocCheck((1 + 2 * model.num_parameters) * sizeof(float));
+    snapshot[0] = model.mean_loss;
+    memcpy(snapshot + 1, model.grads_memory, model.num_parameters * sizeof(float));
+    gpt2_update(&model, 1e-4f, 0.9f, 0.999f, 1e-8f, 0.01f, 1);
+    memcpy(snapshot + 1 + model.num_parameters, model.params_memory, model.num_parameters * sizeof(float));
+    *n = 1 + 2 * model.num_parameters;
+    gpt2_free(&model);
+    return snapshot;
+}
+
 int main(int argc, char *argv[]) {
 
     // build the GPT-2 model from a checkpoint
@@ -66,7 +90,7 @@ int main(int argc, char *argv[]) {
     printf("seq_len: %d\n", T);
 
     ParameterTensors expected_grads;
-    float* expected_grads_memory = malloc_and_point_parameters(&expected_grads, model.param_sizes);
+    float* expected_grads_memory = malloc_and_point_parameters(&expected_grads, model.param_sizes, NULL);
 
     // inputs and expected outputs, only used for error checking
     int* x = (int*) malloc(B * T * sizeof(int));
@@ -167,6 +191,14 @@ int main(int argc, char *argv[]) {
             for (int i = 0; i < 16; i++) {
                 allok = allok && gradoks[i];
             }
+
+            // the no_grad forward cycles through a single layer of buffers, but runs the same
+            // kernels in the same order, so it must reproduce the loss and probs bitwise
+            float no_grad_loss = gpt2_forward_no_grad(&model, x, y, B, T);
+            int no_grad_ok = no_grad_loss == model.mean_loss &&
+                             memcmp(model.acts_no_grad.probs, model.acts.probs, B * T * Vp * sizeof(float)) == 0;
+            printf("no_grad forward bitwise identical (loss, probs): %d\n", no_grad_ok);
+            allok = allok && no_grad_ok;
         }
 
         gpt2_update(&model, 1e-4f, 0.9f, 0.999f, 1e-8f, 0.01f, step+1);
@@ -181,6 +213,50 @@ int main(int argc, char *argv[]) {
         printf("step %d: loss %f (took %f ms) OK = %d\n", step, model.mean_loss, time_elapsed_s * 1000, step_loss_ok);
     }
 
+    // the reductions are deterministic (see reduce_tree), so a training step must give
+    // bitwise identical results no matter how many threads it runs on
+    #ifdef OMP
+    int num_threads = omp_get_max_threads() > 1 ? omp_get_max_threads() : 4;
+    size_t n1, nN;
+    float* snapshot1 = training_step_snapshot(1, 1, 0, x, y, B, T, &n1);
+    float* snapshotN = training_step_snapshot(num_threads, 1, 0, x, y, B, T, &nN);
+    int determinism_ok = n1 == nN && memcmp(snapshot1, snapshotN, n1 * sizeof(float)) == 0;
+    printf("1 vs %d threads bitwise identical (loss, grads, params): %d\n", num_threads, determinism_ok);
+    allok = allok && determinism_ok;
+    free(snapshot1);
+    free(snapshotN);
+    #endif
+
+    // the head-major QKV layout only changes where attention finds its inputs, not the
+    // order of any arithmetic, so it must give bitwise identical results as well
+    size_t nh, ni;
+    float* snapshot_head_major = training_step_snapshot(1, 1, 0, x, y, B, T, &nh);
+    float* snapshot_interleaved = training_step_snapshot(1, 0, 0, x, y, B, T, &ni);
+    int layout_ok = nh == ni && memcmp(snapshot_head_major, snapshot_interleaved, nh * sizeof(float)) == 0;
+    printf("head-major vs interleaved qkv bitwise identical (loss, grads, params): %d\n", layout_ok);
+    allok = allok && layout_ok;
+    free(snapshot_interleaved);
+
+    // the task graph cuts the rows into more, smaller tiles the more threads there are (see
+    // task_graph_tile_rows), and must still be bitwise identical at any number of threads:
+    // at least 8, so that the tiles get down to 16 rows
+    size_t ng1, ngN;
+    float* snapshot_graph1 = training_step_snapshot(1, 1, 1, x, y, B, T, &ng1);
+    #ifdef OMP
+    int graph_threads = num_threads > 8 ? num_threads : 8;
+    float* snapshot_graphN = training_step_snapshot(graph_threads, 1, 1, x, y, B, T, &ngN);
+    int graph_determinism_ok = ng1 == ngN && memcmp(snapshot_graph1, snapshot_graphN, ng1 * sizeof(float)) == 0;
+    printf("task graph, 1 vs %d threads bitwise identical (loss, grads, params): %d\n", graph_threads, graph_determinism_ok);
+    allok = allok && graph_determinism_ok;
+    free(snapshot_graphN);
+    #endif
+    // vs layer by layer, it sums some of the gradients over the tiles in another order, so
+    // it is only close
+    int graph_ok = ng1 == nh && check_tensor(snapshot_graph1, snapshot_head_major, (int)nh, "task graph vs layer by layer (loss, grads, params)");
+    allok = allok && graph_ok;
+    free(snapshot_head_major);
+    free(snapshot_graph1);
+
     // final judgement
     printf("overall okay: %d\n", allok);
 
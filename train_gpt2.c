@@ -1,10 +1,16 @@
 /*
-This file trains the GPT-2 model.
-This version is the clean, minimal, reference. As such:
+This file trains the GPT-2 model, and runs it for inference.
+This version is the reference for the CPU. As such:
 - it runs on CPU.
-- it does not make the code too complex; it is readable.
-- it does not use any processor-specific instructions, intrinsics and such.
-- it _does_ use a few OpenMP pragmas because this is a large speedup at very low cost
+- it tries to keep the code readable; the plain loops of each kernel are still there.
+- its kernels are written in plain C, which the compiler vectorizes (we compile with
+  -Ofast -march=native). the exceptions sit behind the headers in llmc/: the bf16
+  (AVX512-BF16), int8 and q4 (AVX512F, F16C) tiles use intrinsics where the CPU has them,
+  with a scalar fallback, and the matrix-vector products prefetch with __builtin_prefetch.
+- it uses OpenMP pragmas because this is a large speedup at very low cost, and pthreads
+  for the task graph executor (see llmc/taskgraph.h).
+- on POSIX, it mmaps its memory: the arena (see llmc/arena.h), and optionally the
+  parameters of a checkpoint (see gpt2_map_checkpoint).
 There will be other versions of this code that specialize it and make it fast.
 */
 
@@ -27,10 +33,74 @@ There will be other versions of this code that specialize it and make it fast.
 #include "llmc/tokenizer.h"
 // defines: dataloader_init, dataloader_reset, dataloader_next_batch, dataloader_free
 #include "llmc/dataloader.h"
+// defines: random_f32, Sampler, sampler_init, sampler_sample, sampler_free
+#include "llmc/sampler.h"
+// defines: taskgraph_init, taskgraph_begin, taskgraph_commit, taskgraph_run, taskpool_init
+#include "llmc/taskgraph.h"
+// defines: fast_expf, fast_tanhf, fast_sech2f
+#include "llmc/fastmath.h"
+// defines: memplan_init, memplan_use, memplan_assign, memplan_peak
+#include "llmc/memplan.h"
+// defines: arena_init, arena_alloc, arena_first_touch, arena_free, arena_print_report
+#include "llmc/arena.h"
+// defines: bf16, float_to_bf16, float_to_bf16_stochastic, bf16_from_float_row, bf16_dot_tile
+#include "llmc/bf16.h"
+// defines: int8_quantize_rows, int8_dot_tile
+#include "llmc/int8.h"
+// defines: q4_block, q4_quantize_rows, q4_dequantize_row, q4_dot_tile
+#include "llmc/q4.h"
+// defines: KVPool, KVCache, kvpool_init, kvcache_init, kvcache_reserve, kvcache_truncate, kvcache_store, kvpool_key
+#include "llmc/kvcache.h"
 
 // ----------------------------------------------------------------------------
 // all the individual layers' forward and backward passes
 // B = batch_size, T = sequence_length, C = channels, V = vocab_size
+// note on threading: the layers below don't open their own OpenMP parallel regions.
+// Instead they use "orphaned" worksharing (omp for), which binds to the
+// single parallel region that gpt2_forward / gpt2_backward open around the whole pass.
+// This saves a fork/join per layer, which matters at small B*T. Each worksharing loop
+// is statically partitioned and ends in an implicit barrier (unless marked nowait).
+// When called outside of a parallel region, the layers simply run on the calling thread.
+
+// deterministic reductions: the results must not depend on the number of threads, so that
+// runs on different machines can be compared bitwise. Sums are cut into blocks of a fixed
+// size, each block is summed serially, and the block partials are combined in a pairwise
+// tree of a fixed shape. The thread that handles a block changes with OMP_NUM_THREADS,
+// the order of the float additions does not. Elementwise loops use a fixed chunk size for
+// the same reason: it pins where the vectorized loop bodies and their scalar tails fall.
+#define REDUCE_BLOCK 256 // elements per block, for sums of scalars
+#define REDUCE_BLOCK_ROWS 8 // rows per block, for sums of (N,C) rows into C (e.g. dbias)
+
+// combines partials, which is (num_blocks, n), into its first row with a fixed-shape tree
+void reduce_tree(float* partials, int num_blocks, int n) {
+    for (int stride = 1; stride < num_blocks; stride *= 2) {
+        int num_pairs = (num_blocks - stride + 2 * stride - 1) / (2 * stride);
+        #pragma omp for collapse(2)
+        for (int p = 0; p < num_pairs; p++) {
+            for (int i = 0; i < n; i++) {
+                int k = p * 2 * stride;
+                partials[k * n + i] += partials[(k + stride) * n + i];
+            }
+        }
+    }
+}
+
+// returns the sum of x, scratch must hold at least ceil(N / REDUCE_BLOCK) floats
+float reduce_sum(const float* x, int N, float* scratch) {
+    int num_blocks = (N + REDUCE_BLOCK - 1) / REDUCE_BLOCK;
+    #pragma omp for
+    for (int k = 0; k < num_blocks; k++) {
+        int end = (k + 1) * REDUCE_BLOCK < N ? (k + 1) * REDUCE_BLOCK : N;
+        float sum = 0.0f;
+        for (int i = k * REDUCE_BLOCK; i < end; i++) { sum += x[i]; }
+        scratch[k] = sum;
+    }
+    reduce_tree(scratch, num_blocks, 1);
+    float sum = scratch[0];
+    // make sure everyone has read the result before scratch gets reused
+    #pragma omp barrier
+    return sum;
+}
 
 void encoder_forward(float* out,
                    int* inp, float* wte, float* wpe,
@@ -39,6 +109,7 @@ void encoder_forward(float* out,
     // inp is (B,T) of integers, holding the token ids at each (b,t) position
     // wte is (V,C) of token embeddings, short for "weight token embeddings"
     // wpe is (maxT,C) of position embeddings, short for "weight positional embedding"
+    #pragma omp for collapse(2)
     for (int b = 0; b < B; b++) {
         for (int t = 0; t < T; t++) {
             // seek to the output position in out[b,t,:]
@@ -50,6 +121,7 @@ void encoder_forward(float* out,
             // seek to the position in wpe corresponding to the position
             float* wpe_t = wpe + t * C;
             // add the two vectors and store the result in out[b,t,:]
+            #pragma omp simd
             for (int i = 0; i < C; i++) {
                 out_bt[i] = wte_ix[i] + wpe_t[i];
             }
@@ -57,24 +129,138 @@ void encoder_forward(float* out,
     }
 }
 
+void encoder_forward_int8(float* out,
+                          int* inp, const int8_t* wte, const float* wte_scale, float* wpe,
+                          int B, int T, int C) {
+    // encoder_forward with wte quantized to int8, with a scale per row (see matmul_forward_quantized)
+    #pragma omp for collapse(2)
+    for (int b = 0; b < B; b++) {
+        for (int t = 0; t < T; t++) {
+            float* out_bt = out + b * T * C + t * C;
+            int ix = inp[b * T + t];
+            const int8_t* wte_ix = wte + (size_t)ix * C;
+            float scale = wte_scale[ix];
+            float* wpe_t = wpe + t * C;
+            #pragma omp simd
+            for (int i = 0; i < C; i++) {
+                out_bt[i] = scale * wte_ix[i] + wpe_t[i];
+            }
+        }
+    }
+}
+
+void encoder_forward_q4(float* out,
+                        int* inp, const q4_block* wte, float* wpe,
+                        int B, int T, int C) {
+    // encoder_forward with wte quantized to q4 (see llmc/q4.h)
+    #pragma omp for collapse(2)
+    for (int b = 0; b < B; b++) {
+        for (int t = 0; t < T; t++) {
+            float* out_bt = out + b * T * C + t * C;
+            int ix = inp[b * T + t];
+            float* wpe_t = wpe + t * C;
+            q4_dequantize_row(out_bt, wte + (size_t)ix * C / Q4_GROUP, C);
+            #pragma omp simd
+            for (int i = 0; i < C; i++) {
+                out_bt[i] += wpe_t[i];
+            }
+        }
+    }
+}
+
+// encoder_backward splits the work over threads such that every element of dwte and
+// dwpe is owned by exactly one thread, which accumulates into it in the serial order
+#define ENCODER_BACKWARD_SLICE 16
 void encoder_backward(float* dwte, float* dwpe,
                       float* dout, int* inp,
                       int B, int T, int C) {
-    for (int b = 0; b < B; b++) {
-        for (int t = 0; t < T; t++) {
+    // dwpe: each position t is owned by one thread, which sums over b
+    #pragma omp for nowait
+    for (int t = 0; t < T; t++) {
+        float* dwpe_t = dwpe + t * C;
+        for (int b = 0; b < B; b++) {
             float* dout_bt = dout + b * T * C + t * C;
-            int ix = inp[b * T + t];
-            float* dwte_ix = dwte + ix * C;
-            float* dwpe_t = dwpe + t * C;
+            #pragma omp simd
             for (int i = 0; i < C; i++) {
-                float d = dout_bt[i];
-                dwte_ix[i] += d;
-                dwpe_t[i] += d;
+                dwpe_t[i] += dout_bt[i];
+            }
+        }
+    }
+    // dwte: the same token can appear at many (b,t), so instead of per-thread copies
+    // of the (V,C) dwte, each thread owns a slice of the channels for all tokens
+    #pragma omp for
+    for (int c = 0; c < C; c += ENCODER_BACKWARD_SLICE) {
+        int c_end = c + ENCODER_BACKWARD_SLICE < C ? c + ENCODER_BACKWARD_SLICE : C;
+        for (int b = 0; b < B; b++) {
+            for (int t = 0; t < T; t++) {
+                float* dout_bt = dout + b * T * C + t * C;
+                int ix = inp[b * T + t];
+                float* dwte_ix = dwte + ix * C;
+                #pragma omp simd
+                for (int i = c; i < c_end; i++) {
+                    dwte_ix[i] += dout_bt[i];
+                }
             }
         }
     }
 }
 
+// the layernorm statistics of a row of C floats x, in a single pass with Welford's update:
+// a running mean and M2 = sum((x - mean)^2), so the variance never comes from a difference
+// like sum(x^2) - sum(x)^2, which cancels catastrophically when the mean is large compared
+// to the standard deviation. A running update is a serial dependency, so to vectorize we keep
+// LAYERNORM_LANES interleaved statistics (lane j sees x[j], x[j + LANES], ...) and merge them
+// pairwise at the end (Chan et al.). The lane count is fixed, not the machine's vector
+// width, so the result is the same everywhere.
+#define LAYERNORM_LANES 16
+void layernorm_row_stats(float* mean, float* rstd, const float* x, int C) {
+    float eps = 1e-5f;
+    float lane_mean[LAYERNORM_LANES];
+    float lane_m2[LAYERNORM_LANES];
+    float lane_n[LAYERNORM_LANES];
+    int full = C / LAYERNORM_LANES;
+    for (int j = 0; j < LAYERNORM_LANES; j++) {
+        lane_mean[j] = 0.0f;
+        lane_m2[j] = 0.0f;
+        lane_n[j] = (float)full;
+    }
+    for (int k = 0; k < full; k++) {
+        const float* x_k = x + k * LAYERNORM_LANES;
+        float inv_n = 1.0f / (float)(k + 1);
+        #pragma omp simd
+        for (int j = 0; j < LAYERNORM_LANES; j++) {
+            float delta = x_k[j] - lane_mean[j];
+            lane_mean[j] += delta * inv_n;
+            lane_m2[j] += delta * (x_k[j] - lane_mean[j]);
+        }
+    }
+    // the C % LANES leftover elements go one each into the first lanes
+    for (int j = 0; j < C - full * LAYERNORM_LANES; j++) {
+        float xj = x[full * LAYERNORM_LANES + j];
+        lane_n[j] += 1.0f;
+        float delta = xj - lane_mean[j];
+        lane_mean[j] += delta / lane_n[j];
+        lane_m2[j] += delta * (xj - lane_mean[j]);
+    }
+    // merge the lanes in a fixed pairwise tree. Lane counts never increase with j, so an
+    // empty right lane (C < LANES) is the only special case
+    for (int stride = 1; stride < LAYERNORM_LANES; stride *= 2) {
+        for (int j = 0; j + stride < LAYERNORM_LANES; j += 2 * stride) {
+            float na = lane_n[j];
+            float nb = lane_n[j + stride];
+            if (nb == 0.0f) { continue; }
+            float n = na + nb;
+            float delta = lane_mean[j + stride] - lane_mean[j];
+            lane_mean[j] += delta * (nb / n);
+            lane_m2[j] += lane_m2[j + stride] + delta * delta * (na * nb / n);
+            lane_n[j] = n;
+        }
+    }
+    *mean = lane_mean[0];
+    // the variance is without any bias correction
+    *rstd = 1.0f / sqrtf(lane_m2[0] / C + eps);
+}
+
 void layernorm_forward(float* out, float* mean, float* rstd,
                        float* inp, float* weight, float* bias,
                        int B, int T, int C) {
@@ -83,90 +269,174 @@ void layernorm_forward(float* out, float* mean, float* rstd,
     // mean and rstd are (B,T) buffers, to be used later in backward pass
     // at each position (b,t) of the input, the C-dimensional vector
     // of activations gets normalized, then scaled and shifted
-    float eps = 1e-5f;
-    for (int b = 0; b < B; b++) {
-        for (int t = 0; t < T; t++) {
-            // seek to the input position inp[b,t,:]
-            float* x = inp + b * T * C + t * C;
-            // calculate the mean
-            float m = 0.0f;
-            for (int i = 0; i < C; i++) {
-                m += x[i];
-            }
-            m = m/C;
-            // calculate the variance (without any bias correction)
-            float v = 0.0f;
-            for (int i = 0; i < C; i++) {
-                float xshift = x[i] - m;
-                v += xshift * xshift;
-            }
-            v = v/C;
-            // calculate the rstd (reciprocal standard deviation)
-            float s = 1.0f / sqrtf(v + eps);
-            // seek to the output position in out[b,t,:]
-            float* out_bt = out + b * T * C + t * C;
-            for (int i = 0; i < C; i++) {
-                float n = (s * (x[i] - m)); // normalize
-                float o = n * weight[i] + bias[i]; // scale and shift
-                out_bt[i] = o; // write
-            }
-            // cache the mean and rstd for the backward pass later
-            mean[b * T + t] = m;
-            rstd[b * T + t] = s;
+    #pragma omp for
+    for (int bt = 0; bt < B * T; bt++) {
+        // seek to the input position inp[b,t,:]
+        float* x = inp + bt * C;
+        // calculate the mean and rstd (reciprocal standard deviation) in one pass
+        float m, s;
+        layernorm_row_stats(&m, &s, x, C);
+        // seek to the output position in out[b,t,:]
+        float* out_bt = out + bt * C;
+        #pragma omp simd
+        for (int i = 0; i < C; i++) {
+            float n = (s * (x[i] - m)); // normalize
+            float o = n * weight[i] + bias[i]; // scale and shift
+            out_bt[i] = o; // write
         }
+        // cache the mean and rstd for the backward pass later
+        mean[bt] = m;
+        rstd[bt] = s;
     }
 }
 
-void layernorm_backward(float* dinp, float* dweight, float* dbias,
-                        float* dout, float* inp, float* weight, float* mean, float* rstd,
-                        int B, int T, int C) {
-    for (int b = 0; b < B; b++) {
-        for (int t = 0; t < T; t++) {
-            float* dout_bt = dout + b * T * C + t * C;
-            float* inp_bt = inp + b * T * C + t * C;
-            float* dinp_bt = dinp + b * T * C + t * C;
-            float mean_bt = mean[b * T + t];
-            float rstd_bt = rstd[b * T + t];
+void residual_layernorm_forward(float* residual, float* out, float* mean, float* rstd,
+                                float* inp1, float* inp2, float* weight, float* bias,
+                                int B, int T, int C) {
+    // fuses residual_forward and the layernorm_forward that always follows it:
+    // residual = inp1 + inp2, out = layernorm(residual), all (B,T,C).
+    // the inputs are read from memory once, the statistics and the normalization then
+    // re-read the residual row while it is still in L1
+    #pragma omp for
+    for (int bt = 0; bt < B * T; bt++) {
+        float* inp1_bt = inp1 + bt * C;
+        float* inp2_bt = inp2 + bt * C;
+        float* residual_bt = residual + bt * C;
+        float* out_bt = out + bt * C;
+        #pragma omp simd
+        for (int i = 0; i < C; i++) {
+            residual_bt[i] = inp1_bt[i] + inp2_bt[i];
+        }
+        float m, s;
+        layernorm_row_stats(&m, &s, residual_bt, C);
+        #pragma omp simd
+        for (int i = 0; i < C; i++) {
+            float n = s * (residual_bt[i] - m); // normalize
+            out_bt[i] = n * weight[i] + bias[i]; // scale and shift
+        }
+        mean[bt] = m;
+        rstd[bt] = s;
+    }
+}
 
-            // first: two reduce operations
+void residual_layernorm_backward(float* dinp1, float* dinp2, float* dresidual,
+                                 float* dweight, float* dbias, float* scratch,
+                                 float* dout, float* residual, float* weight, float* mean, float* rstd,
+                                 int B, int T, int C, int accumulate) {
+    // fuses layernorm_backward and the residual_backward of the residual add that produced
+    // the layernorm's input. if accumulate, dresidual already holds the gradient that reached
+    // the residual stream from above and the layernorm's dinp is added to it, otherwise it is
+    // written. the total is then passed on to both inputs of the add (dinp1 and dinp2) while
+    // the row is hot in cache. they are the first to write their gradient, so they are overwritten.
+    // with dinp1 and dinp2 NULL, this is just layernorm_backward into dresidual.
+    // the rows are processed in blocks of REDUCE_BLOCK_ROWS. Each block sums its rows'
+    // contributions to dweight and dbias into its own partial in scratch, which must hold
+    // (ceil(B*T / REDUCE_BLOCK_ROWS), 2*C) floats, and the partials are then combined with
+    // reduce_tree, so the result does not depend on the number of threads.
+    // if scratch is NULL (e.g. in a task), we accumulate into dweight/dbias directly
+    int BT = B * T;
+    int num_blocks = (BT + REDUCE_BLOCK_ROWS - 1) / REDUCE_BLOCK_ROWS;
+    #pragma omp for
+    for (int k = 0; k < num_blocks; k++) {
+        float* dweight_acc = dweight;
+        float* dbias_acc = dbias;
+        if (scratch != NULL) {
+            dweight_acc = scratch + k * 2 * C;
+            dbias_acc = dweight_acc + C;
+            for (int i = 0; i < 2 * C; i++) { dweight_acc[i] = 0.0f; }
+        }
+        int end = (k + 1) * REDUCE_BLOCK_ROWS < BT ? (k + 1) * REDUCE_BLOCK_ROWS : BT;
+        for (int bt = k * REDUCE_BLOCK_ROWS; bt < end; bt++) {
+            float* dout_bt = dout + bt * C;
+            float* inp_bt = residual + bt * C;
+            float* dresidual_bt = dresidual + bt * C;
+            float mean_bt = mean[bt];
+            float rstd_bt = rstd[bt];
+
+            // first: two reduce operations, and the weight and bias gradients, which
+            // only need norm_bti, so that the second pass does nothing but dinp
             float dnorm_mean = 0.0f;
             float dnorm_norm_mean = 0.0f;
+            #pragma omp simd reduction(+:dnorm_mean, dnorm_norm_mean)
             for (int i = 0; i < C; i++) {
                 float norm_bti = (inp_bt[i] - mean_bt) * rstd_bt;
                 float dnorm_i = weight[i] * dout_bt[i];
                 dnorm_mean += dnorm_i;
                 dnorm_norm_mean += dnorm_i * norm_bti;
+                // gradient contribution to bias
+                dbias_acc[i] += dout_bt[i];
+                // gradient contribution to weight
+                dweight_acc[i] += norm_bti * dout_bt[i];
             }
             dnorm_mean = dnorm_mean / C;
             dnorm_norm_mean = dnorm_norm_mean / C;
 
-            // now iterate again and accumulate all the gradients
+            // now iterate again for the gradient to the input. norm_bti is recomputed,
+            // a subtract and a multiply are cheaper than storing and reloading it
+            #pragma omp simd
             for (int i = 0; i < C; i++) {
                 float norm_bti = (inp_bt[i] - mean_bt) * rstd_bt;
                 float dnorm_i = weight[i] * dout_bt[i];
-                // gradient contribution to bias
-                dbias[i] += dout_bt[i];
-                // gradient contribution to weight
-                dweight[i] += norm_bti * dout_bt[i];
                 // gradient contribution to input
                 float dval = 0.0f;
                 dval += dnorm_i; // term 1
                 dval -= dnorm_mean; // term 2
                 dval -= norm_bti * dnorm_norm_mean; // term 3
                 dval *= rstd_bt; // final scale
-                dinp_bt[i] += dval;
+                dresidual_bt[i] = (accumulate ? dresidual_bt[i] : 0.0f) + dval;
+            }
+            // and backward through the residual add
+            if (dinp1 != NULL) {
+                float* dinp1_bt = dinp1 + bt * C;
+                float* dinp2_bt = dinp2 + bt * C;
+                #pragma omp simd
+                for (int i = 0; i < C; i++) {
+                    dinp1_bt[i] = dresidual_bt[i];
+                    dinp2_bt[i] = dresidual_bt[i];
+                }
             }
         }
     }
+
+    if (scratch != NULL) {
+        reduce_tree(scratch, num_blocks, 2 * C);
+        #pragma omp for
+        for (int i = 0; i < C; i++) {
+            dweight[i] += scratch[i];
+            dbias[i] += scratch[C + i];
+        }
+    }
+}
+
+void layernorm_backward(float* dinp, float* dweight, float* dbias, float* scratch,
+                        float* dout, float* inp, float* weight, float* mean, float* rstd,
+                        int B, int T, int C, int accumulate) {
+    residual_layernorm_backward(NULL, NULL, dinp, dweight, dbias, scratch, dout, inp, weight, mean, rstd, B, T, C, accumulate);
+}
+
+#define GELU_SCALING_FACTOR sqrtf(2.0f / M_PI)
+// the (approximate) GeLU of a single value, used by gelu_forward and the matmul epilogue
+#pragma omp declare simd
+float gelu(float x) {
+    float cube = 0.044715f * x * x * x;
+    return 0.5f * x * (1.0f + fast_tanhf(GELU_SCALING_FACTOR * (x + cube)));
+}
+
+// matmul outputs are normally (B,T,OC). Given a head size hs that divides OC, they can be
+// stored head-major instead, as (B, OC/hs, T, hs): for the QKV matmul that is all T query
+// vectors of head 0, then those of head 1, ..., then the keys and the values the same way,
+// so that attention walks over contiguous memory. hs = OC is the usual (B,T,OC) layout
+int matmul_out_index(int b, int t, int o, int T, int OC, int hs) {
+    return b * T * OC + (o / hs) * T * hs + t * hs + o % hs;
 }
 
 void matmul_forward_naive(float* out,
                          const float* inp, const float* weight, const float* bias,
-                         int B, int T, int C, int OC) {
+                         int B, int T, int C, int OC, int head_size) {
     // the most naive implementation of matrix multiplication
-    // this serves as an algorithmic reference, and as a fallback for
-    // unfriendly input shapes inside matmul_forward(), below.
-    #pragma omp parallel for collapse(2)
+    // this serves as an algorithmic reference
+    int hs = head_size > 0 ? head_size : OC;
+    #pragma omp for collapse(2)
     for (int b = 0; b < B; b++) {
         for (int t = 0; t < T; t++) {
             int bt = b * T + t;
@@ -175,34 +445,174 @@ void matmul_forward_naive(float* out,
                 for (int i = 0; i < C; i++) {
                     val += inp[bt * C + i] * weight[o*C + i];
                 }
-                out[bt * OC + o] = val;
+                out[matmul_out_index(b, t, o, T, OC, hs)] = val;
             }
         }
     }
 }
 
-void matmul_forward(float* out,
-                    const float* inp, const float* weight, const float* bias,
-                    int B, int T, int C, int OC) {
-    // most of the running time is spent here and in matmul_backward
-    // therefore, the implementation below is very mildly optimized
-    // this function is otherwise identical to that of matmul_forward_naive()
-    // OC is short for "output channels"
-    // inp is (B,T,C), weight is (OC, C), bias is (OC)
-    // out will be (B,T,OC)
+// epilogues that matmul_forward_epilogue applies to its register tile before storing it
+#define MATMUL_EPILOGUE_NONE 0 // out = inp @ weight^T + bias
+#define MATMUL_EPILOGUE_GELU 1 // out = gelu(inp @ weight^T + bias), pre = inp @ weight^T + bias
+
+void matmul_forward_bf16(float* out, float* pre,
+                         const float* inp, const bf16* weight, const float* bias,
+                         int B, int T, int C, int OC, int epilogue, int head_size) {
+    // matmul_forward_epilogue with the weight in bf16 (see use_bf16 in GPT2). the rows of
+    // inp are rounded to bf16 too, a tile at a time, and the dot products accumulate in
+    // fp32 (see bf16_dot_tile), as in the bf16 matmuls of mixed precision training on GPUs.
+    // out, pre and bias are fp32. any B*T works, the last tile may have fewer rows
+    int hs = head_size > 0 ? head_size : OC;
+    const int LOOP_UNROLL = BF16_TILE_ROWS;
+    int BT = B * T;
+    #pragma omp for
+    for (int obt = 0; obt < BT; obt += LOOP_UNROLL) {
+        int rows = BT - obt < LOOP_UNROLL ? BT - obt : LOOP_UNROLL;
+        bf16 inp_tile[LOOP_UNROLL * C];
+        bf16_from_float_row(inp_tile, inp + (size_t)obt * C, rows * C);
+        int row_offset[LOOP_UNROLL];
+        for (int ibt = 0; ibt < rows; ibt++) {
+            int bt = obt + ibt;
+            row_offset[ibt] = matmul_out_index(bt / T, bt % T, 0, T, OC, hs);
+        }
+        // a few output channels at a time, so every vector of the tile is loaded just once for them
+        for (int o0 = 0; o0 < OC; o0 += BF16_TILE_COLS) {
+            int cols = OC - o0 < BF16_TILE_COLS ? OC - o0 : BF16_TILE_COLS;
+            float result[LOOP_UNROLL][BF16_TILE_COLS];
+            bf16_dot_tile(&result[0][0], BF16_TILE_COLS, inp_tile, C, rows, weight + (size_t)o0 * C, C, cols, C);
+            for (int oc = 0; oc < cols; oc++) {
+                int o = o0 + oc;
+                int col_offset = matmul_out_index(0, 0, o, T, OC, hs);
+                for (int ibt = 0; ibt < rows; ibt++) {
+                    float val = result[ibt][oc] + ((bias != NULL) ? bias[o] : 0.0f);
+                    if (epilogue == MATMUL_EPILOGUE_GELU) {
+                        if (pre != NULL) { pre[row_offset[ibt] + col_offset] = val; }
+                        val = gelu(val);
+                    }
+                    out[row_offset[ibt] + col_offset] = val;
+                }
+            }
+        }
+    }
+}
 
-    // make sure the tiled loop will be correct or fallback to naive version
-    const int LOOP_UNROLL = 8;
-    if (B*T % LOOP_UNROLL != 0) {
-        matmul_forward_naive(out, inp, weight, bias, B, T, C, OC);
-        return;
+#define MATMUL_GEMV_COLS 4 // output channels per pass over the input in matmul_forward_gemv
+#define MATMUL_GEMV_ROWS 4 // rows of the input per pass over the weights of those channels
+#define MATMUL_GEMV_MAX_ROWS 16 // matmul_forward_epilogue uses matmul_forward_gemv up to this B*T
+#define MATMUL_GEMV_PREFETCH 8 // how many groups of MATMUL_GEMV_COLS ahead the weights are prefetched
+#define CACHE_LINE_FLOATS 16
+
+// sum[r][c] = x[r, :C] . w[c, :C] for rows (a constant, see below) rows of x and
+// MATMUL_GEMV_COLS rows of w, with a vector of partial sums a cache line wide per dot
+// product. if ahead is not NULL, it is prefetched as far as w is read
+static inline __attribute__((always_inline))
+void matmul_gemv_tile_(float sum[MATMUL_GEMV_ROWS][MATMUL_GEMV_COLS], const float* x, const int rows,
+                       const float* w, const float* ahead, int C) {
+    float acc[MATMUL_GEMV_ROWS][MATMUL_GEMV_COLS][CACHE_LINE_FLOATS] = {{{0.0f}}};
+    int i0 = 0;
+    for (; i0 + CACHE_LINE_FLOATS <= C; i0 += CACHE_LINE_FLOATS) {
+        if (ahead != NULL) {
+            for (int c = 0; c < MATMUL_GEMV_COLS; c++) { __builtin_prefetch(ahead + c * C + i0, 0, 3); }
+        }
+        for (int r = 0; r < rows; r++) {
+            for (int c = 0; c < MATMUL_GEMV_COLS; c++) {
+                for (int k = 0; k < CACHE_LINE_FLOATS; k++) {
+                    acc[r][c][k] += x[r * C + i0 + k] * w[c * C + i0 + k];
+                }
+            }
+        }
+    }
+    for (int r = 0; r < rows; r++) {
+        for (int c = 0; c < MATMUL_GEMV_COLS; c++) {
+            sum[r][c] = 0.0f;
+            for (int k = 0; k < CACHE_LINE_FLOATS; k++) { sum[r][c] += acc[r][c][k]; }
+            for (int i = i0; i < C; i++) { sum[r][c] += x[r * C + i] * w[c * C + i]; }
+        }
     }
+}
+
+void matmul_forward_gemv(float* out, float* pre,
+                         const float* inp, const float* weight, const float* bias,
+                         int B, int T, int C, int OC, int epilogue, int head_size, int bt_start) {
+    // matmul_forward_epilogue for a few rows of inp (B*T <= MATMUL_GEMV_MAX_ROWS, e.g. 1 when
+    // decoding, or the k+1 positions that verify a draft in speculative decoding), where it
+    // is bound by reading the weight from memory. so the threads split the output channels,
+    // not the rows, and while reading the weights for the first rows we prefetch those a
+    // few groups of channels ahead (into all the caches: with the non-temporal hint it was
+    // several times slower, see dev/cpu/matmul_gemv.c). every weight loaded into a register
+    // is used for MATMUL_GEMV_ROWS rows, and the later tiles of rows find the weights in L1.
+    // only the rows from bt_start on, e.g. those after the last full tile of the tiled loop
+    int hs = head_size > 0 ? head_size : OC;
+    int BT = B * T;
+    #pragma omp for schedule(static)
+    for (int o0 = 0; o0 < OC; o0 += MATMUL_GEMV_COLS) {
+        int cols = OC - o0 < MATMUL_GEMV_COLS ? OC - o0 : MATMUL_GEMV_COLS;
+        const float* w = weight + (size_t)o0 * C;
+        const float* ahead = weight + (size_t)(o0 + MATMUL_GEMV_PREFETCH * MATMUL_GEMV_COLS) * C;
+        int can_prefetch = o0 + (MATMUL_GEMV_PREFETCH + 1) * MATMUL_GEMV_COLS <= OC;
+        for (int r0 = bt_start; r0 < BT; r0 += MATMUL_GEMV_ROWS) {
+            int rows = BT - r0 < MATMUL_GEMV_ROWS ? BT - r0 : MATMUL_GEMV_ROWS;
+            const float* x = inp + (size_t)r0 * C;
+            const float* prefetch = can_prefetch && r0 == bt_start ? ahead : NULL;
+            float sum[MATMUL_GEMV_ROWS][MATMUL_GEMV_COLS];
+            if (cols == MATMUL_GEMV_COLS) {
+                // a constant number of rows, so that the accumulators stay in registers
+                switch (rows) {
+                    case 1: matmul_gemv_tile_(sum, x, 1, w, prefetch, C); break;
+                    case 2: matmul_gemv_tile_(sum, x, 2, w, prefetch, C); break;
+                    case 3: matmul_gemv_tile_(sum, x, 3, w, prefetch, C); break;
+                    default: matmul_gemv_tile_(sum, x, MATMUL_GEMV_ROWS, w, prefetch, C); break;
+                }
+            } else {
+                for (int r = 0; r < rows; r++) {
+                    for (int c = 0; c < cols; c++) {
+                        sum[r][c] = 0.0f;
+                        for (int i = 0; i < C; i++) { sum[r][c] += x[r * C + i] * w[c * C + i]; }
+                    }
+                }
+            }
+            // the bias and the epilogue, as in matmul_forward_epilogue
+            for (int r = 0; r < rows; r++) {
+                int bt = r0 + r;
+                for (int c = 0; c < cols; c++) {
+                    int o = o0 + c;
+                    float val = sum[r][c] + ((bias != NULL) ? bias[o] : 0.0f);
+                    int index = matmul_out_index(bt / T, bt % T, o, T, OC, hs);
+                    if (epilogue == MATMUL_EPILOGUE_GELU) {
+                        if (pre != NULL) { pre[index] = val; }
+                        val = gelu(val);
+                    }
+                    out[index] = val;
+                }
+            }
+        }
+    }
+}
+
+void matmul_forward_tiled(float* out, float* pre,
+                          const float* inp, const float* weight, const float* bias,
+                          int B, int T, int C, int OC, int epilogue, int head_size) {
+    // the tiled loop of matmul_forward_epilogue, for any B*T: the full tiles of LOOP_UNROLL
+    // rows, and matmul_forward_gemv the rows after them. each row of a full tile sums over
+    // C in the same order however many tiles there are, so the tiles of the task graph get
+    // the same results at any number of threads (see task_graph_tile_rows), as long as
+    // their rows are a multiple of LOOP_UNROLL
+    int hs = head_size > 0 ? head_size : OC;
+    const int LOOP_UNROLL = 8;
+    int BT_tiled = B*T - B*T % LOOP_UNROLL;
 
     // collapse the B and T loops into one and turn it into a strided loop.
     // then we can tile the inner loop, and reuse the loaded weight LOOP_UNROLL many times
-    #pragma omp parallel for
-    for (int obt = 0; obt < B * T; obt += LOOP_UNROLL) {
+    #pragma omp for
+    for (int obt = 0; obt < BT_tiled; obt += LOOP_UNROLL) {
+        // where the rows of this tile start in out (see matmul_out_index)
+        int row_offset[LOOP_UNROLL];
+        for (int ibt = 0; ibt < LOOP_UNROLL; ibt++) {
+            int bt = obt + ibt;
+            row_offset[ibt] = matmul_out_index(bt / T, bt % T, 0, T, OC, hs);
+        }
         for (int o = 0; o < OC; o++) {
+            int col_offset = matmul_out_index(0, 0, o, T, OC, hs);
             // we'll keep LOOP_UNROLL many results in registers
             float result[LOOP_UNROLL];
             // initialize the bias, if it exists
@@ -219,46 +629,173 @@ void matmul_forward(float* out,
                     result[ibt] += inp[bt * C + i] * w;
                 }
             }
+            // apply the epilogue while the results are still in registers
+            if (epilogue == MATMUL_EPILOGUE_GELU) {
+                if (pre != NULL) {
+                    for (int ibt = 0; ibt < LOOP_UNROLL; ibt++) {
+                        pre[row_offset[ibt] + col_offset] = result[ibt];
+                    }
+                }
+                #pragma omp simd
+                for (int ibt = 0; ibt < LOOP_UNROLL; ibt++) {
+                    result[ibt] = gelu(result[ibt]);
+                }
+            }
             // write back results to main memory
             for (int ibt = 0; ibt < LOOP_UNROLL; ibt++) {
-                int bt = obt + ibt;
-                out[bt * OC + o] = result[ibt];
+                out[row_offset[ibt] + col_offset] = result[ibt];
             }
         }
     }
+    if (BT_tiled < B*T) {
+        matmul_forward_gemv(out, pre, inp, weight, bias, B, T, C, OC, epilogue, head_size, BT_tiled);
+    }
 }
 
-void matmul_backward(float* dinp, float* dweight, float* dbias,
-                     const float* dout, const float* inp, const float* weight,
-                     int B, int T, int C, int OC) {
-    // most of the running time is spent here and in matmul_forward
-    // this backward could be done in a single "round" of loops
-    // but that doesn't afford an efficient parallelization strategy
+void matmul_forward_epilogue(float* out, float* pre,
+                             const float* inp, const float* weight, const bf16* weight_bf16, const float* bias,
+                             int B, int T, int C, int OC, int epilogue, int head_size) {
+    // most of the running time is spent here and in matmul_backward
+    // therefore, the implementation below is very mildly optimized
+    // this function is otherwise identical to that of matmul_forward_naive()
+    // OC is short for "output channels"
+    // inp is (B,T,C), weight is (OC, C), bias is (OC)
+    // out will be (B,T,OC), and so will pre, the pre-activation, if the epilogue has one.
+    // pre can be NULL if it is not needed (it is for gelu_backward)
+    // with head_size > 0, out and pre are stored head-major instead (see matmul_out_index)
+    // if weight_bf16 is not NULL, it is used instead of weight (see matmul_forward_bf16)
+    if (weight_bf16 != NULL) {
+        matmul_forward_bf16(out, pre, inp, weight_bf16, bias, B, T, C, OC, epilogue, head_size);
+        return;
+    }
+    // a few rows go to the matrix-vector products of matmul_forward_gemv, the rest to the
+    // tiled loop of matmul_forward_tiled
+    if (B*T <= MATMUL_GEMV_MAX_ROWS) {
+        matmul_forward_gemv(out, pre, inp, weight, bias, B, T, C, OC, epilogue, head_size, 0);
+        return;
+    }
+    matmul_forward_tiled(out, pre, inp, weight, bias, B, T, C, OC, epilogue, head_size);
+}
 
-    // backward into inp first, parallelize over B,T
-    #pragma omp parallel for collapse(2)
+#define MATMUL_QUANTIZED_BLOCK 64 // output channels per work item of matmul_forward_quantized
+void matmul_forward_quantized(float* out, float* pre,
+                              const float* inp, const int8_t* weight_int8, const float* scale,
+                              const q4_block* weight_q4, const float* bias,
+                              int B, int T, int C, int OC, int epilogue, int head_size) {
+    // matmul_forward_epilogue with a quantized weight, either int8 (see llmc/int8.h), where
+    // row o is scale[o] * weight_int8[o,:], or q4 (see llmc/q4.h), where row o is the C / Q4_GROUP
+    // blocks from weight_q4 + o * C / Q4_GROUP on. the other one is NULL. the inputs stay fp32.
+    // the weight takes a quarter (int8) or less (q4) of the bytes, which is what bounds the
+    // forward pass at small B*T, e.g. when decoding. there every thread gets a block of output
+    // channels instead of a tile of rows, as there may be just a single row
+    int hs = head_size > 0 ? head_size : OC;
+    int BT = B * T;
+    #pragma omp for collapse(2)
+    for (int obt = 0; obt < BT; obt += INT8_TILE_ROWS) {
+        for (int ob = 0; ob < OC; ob += MATMUL_QUANTIZED_BLOCK) {
+            int rows = BT - obt < INT8_TILE_ROWS ? BT - obt : INT8_TILE_ROWS;
+            int o_end = ob + MATMUL_QUANTIZED_BLOCK < OC ? ob + MATMUL_QUANTIZED_BLOCK : OC;
+            // a full tile of rows 2 output channels at a time, otherwise row by row, 8 at a time
+            // (the tiles of int8_dot_tile and q4_dot_tile are the same). a tile more than half
+            // full, e.g. the k+1 rows that verify the drafts of speculative decoding, is padded
+            // with rows of zeros to a full one, which from there on costs less than row by row
+            int full = rows > INT8_TILE_ROWS / 2;
+            int tile_rows = full ? INT8_TILE_ROWS : 1;
+            int tile_cols = full ? INT8_TILE_COLS : INT8_ROW_TILE_COLS;
+            const float* inp_rows = inp + (size_t)obt * C;
+            float padded[full && rows < INT8_TILE_ROWS ? INT8_TILE_ROWS * C : 1];
+            if (full && rows < INT8_TILE_ROWS) {
+                memcpy(padded, inp_rows, (size_t)rows * C * sizeof(float));
+                memset(padded + (size_t)rows * C, 0, (size_t)(INT8_TILE_ROWS - rows) * C * sizeof(float));
+                inp_rows = padded;
+            }
+            for (int r0 = 0; r0 < rows; r0 += tile_rows) {
+                for (int o0 = ob; o0 < o_end; o0 += tile_cols) {
+                    int cols = o_end - o0 < tile_cols ? o_end - o0 : tile_cols;
+                    float result[INT8_TILE_ROWS * INT8_ROW_TILE_COLS];
+                    const float* inp_tile = inp_rows + (size_t)r0 * C;
+                    if (weight_q4 != NULL) {
+                        q4_dot_tile(result, cols, inp_tile, C, tile_rows, weight_q4 + (size_t)o0 * C / Q4_GROUP, C / Q4_GROUP, cols, C);
+                    } else {
+                        int8_dot_tile(result, cols, inp_tile, C, tile_rows, weight_int8 + (size_t)o0 * C, C, cols, C);
+                    }
+                    for (int ibt = 0; ibt < tile_rows && r0 + ibt < rows; ibt++) {
+                        int bt = obt + r0 + ibt;
+                        for (int oc = 0; oc < cols; oc++) {
+                            int o = o0 + oc;
+                            float val = result[ibt * cols + oc];
+                            if (weight_q4 == NULL) { val *= scale[o]; }
+                            val += (bias != NULL) ? bias[o] : 0.0f;
+                            int index = matmul_out_index(bt / T, bt % T, o, T, OC, hs);
+                            if (epilogue == MATMUL_EPILOGUE_GELU) {
+                                if (pre != NULL) { pre[index] = val; }
+                                val = gelu(val);
+                            }
+                            out[index] = val;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+void matmul_forward(float* out,
+                    const float* inp, const float* weight, const float* bias,
+                    int B, int T, int C, int OC) {
+    matmul_forward_epilogue(out, NULL, inp, weight, NULL, bias, B, T, C, OC, MATMUL_EPILOGUE_NONE, 0);
+}
+
+void matmul_backward_inp(float* dinp,
+                         const float* dout, const float* weight, const bf16* weight_bf16,
+                         int B, int T, int C, int OC, int head_size, int accumulate) {
+    // backward into inp, parallelize over B,T. dinp is added to if accumulate, else written
+    // note the nowait: matmul_backward below moves straight on to the weight
+    // gradients, which don't read dinp, so there is no need to wait for all threads
+    // if weight_bf16 is not NULL, the weight is read from it instead, in fp32 arithmetic
+    int hs = head_size > 0 ? head_size : OC;
+    #pragma omp for collapse(2) nowait
     for (int b = 0; b < B; b++) {
         for (int t = 0; t < T; t++) {
-            const float* dout_bt = dout + b * T * OC + t * OC;
             float* dinp_bt = dinp + b * T * C + t * C;
-            for (int o = 0; o < OC; o++) {
-                const float* wrow = weight + o*C;
-                float d = dout_bt[o];
-                for (int i = 0; i < C; i++) {
-                    dinp_bt[i] += wrow[i] * d;
+            if (!accumulate) {
+                // cleared here, while the row is about to be in cache anyway
+                for (int i = 0; i < C; i++) { dinp_bt[i] = 0.0f; }
+            }
+            // dout of this position is contiguous within each head (one head if hs = OC)
+            for (int oh = 0; oh < OC; oh += hs) {
+                const float* dout_bth = dout + matmul_out_index(b, t, oh, T, OC, hs);
+                for (int j = 0; j < hs; j++) {
+                    float d = dout_bth[j];
+                    if (weight_bf16 != NULL) {
+                        const bf16* wrow = weight_bf16 + (size_t)(oh + j)*C;
+                        for (int i = 0; i < C; i++) {
+                            dinp_bt[i] += bf16_to_float(wrow[i]) * d;
+                        }
+                    } else {
+                        const float* wrow = weight + (oh + j)*C;
+                        for (int i = 0; i < C; i++) {
+                            dinp_bt[i] += wrow[i] * d;
+                        }
+                    }
                 }
             }
         }
     }
-    // backward into weight/bias, parallelize over output channels OC
-    #pragma omp parallel for
-    for (int o = 0; o < OC; o++) {
+}
+
+void matmul_backward_weight(float* dweight, float* dbias,
+                            const float* dout, const float* inp,
+                            int B, int T, int C, int OC, int o_start, int o_end, int head_size) {
+    // backward into weight/bias, for the output channels o_start <= o < o_end
+    int hs = head_size > 0 ? head_size : OC;
+    for (int o = o_start; o < o_end; o++) {
+        const float* dout_o = dout + matmul_out_index(0, 0, o, T, OC, hs);
         for (int b = 0; b < B; b++) {
             for (int t = 0; t < T; t++) {
-                const float* dout_bt = dout + b * T * OC + t * OC;
                 const float* inp_bt = inp + b * T * C + t * C;
                 float* dwrow = dweight + o*C;
-                float d = dout_bt[o];
+                float d = dout_o[matmul_out_index(b, t, 0, T, OC, hs)];
                 if (dbias != NULL) { dbias[o] += d; }
                 for (int i = 0; i < C; i++) {
                     dwrow[i] += inp_bt[i] * d;
@@ -268,75 +805,347 @@ void matmul_backward(float* dinp, float* dweight, float* dbias,
     }
 }
 
+void matmul_backward(float* dinp, float* dweight, float* dbias,
+                     const float* dout, const float* inp, const float* weight, const bf16* weight_bf16,
+                     int B, int T, int C, int OC, int head_size, int accumulate) {
+    // most of the running time is spent here and in matmul_forward
+    // this backward could be done in a single "round" of loops
+    // but that doesn't afford an efficient parallelization strategy
+    // dout is head-major if head_size > 0, as matmul_forward_epilogue wrote out
+
+    // backward into inp first, parallelize over B,T
+    matmul_backward_inp(dinp, dout, weight, weight_bf16, B, T, C, OC, head_size, accumulate);
+    // backward into weight/bias, parallelize over output channels OC
+    #pragma omp for
+    for (int o = 0; o < OC; o++) {
+        matmul_backward_weight(dweight, dbias, dout, inp, B, T, C, OC, o, o + 1, head_size);
+    }
+}
+
+// where the query (qkv = 0), key (1) or value (2) vector of head h at position t of sequence b
+// starts in the (B, T, 3C) output of the QKV matmul, which is either interleaved, or head-major
+// as (B, 3, NH, T, hs) (see matmul_out_index). The vectors of consecutive positions are
+// qkv_stride floats apart
+int qkv_offset(int head_major, int b, int t, int qkv, int h, int T, int C, int NH) {
+    int hs = C / NH;
+    return matmul_out_index(b, t, qkv * C + h * hs, T, 3 * C, head_major ? hs : 3 * C);
+}
+int qkv_stride(int head_major, int C, int NH) {
+    return head_major ? C / NH : 3 * C;
+}
+
+// attention is computed per head as a few matrix products over tiles of ATTENTION_TILE rows
+// (query positions), with the same register tiling idea as matmul_forward: a row of the
+// right hand side is loaded once and used for all the rows of the tile. Because of the
+// causal mask, a tile of rows [i0, i1) only ever needs the positions j < i1: the tiles
+// above the diagonal are never computed at all, the diagonal tile is masked element-wise
+#define ATTENTION_TILE 8 // rows per tile, as LOOP_UNROLL in matmul_forward
+#define ATTENTION_CHUNK 16 // columns of the accumulators of attention_matmul_nn
+#define ATTENTION_MASK_LOWER 0 // a(i, j) is used only if j <= i, e.g. att in att @ V
+#define ATTENTION_MASK_UPPER 1 // a(i, j) is used only if j >= i, e.g. att^T in att^T @ dout
+
+// c[i, j] (+)= alpha * (a[i, :n] . b[j, :n]) for the rows i0 <= i < i1 and the unmasked
+// columns j <= i, e.g. the query @ key^T scores. Row i of a is at a + i * lda, etc.
+void attention_matmul_nt(float* c, int ldc, const float* a, int lda, const float* b, int ldb,
+                         int i0, int i1, int n, float alpha, int accumulate) {
+    // left of the diagonal tile, in groups of 4 columns, so that every load of a
+    // feeds 4 dot products
+    int j_full = i0 - i0 % 4;
+    for (int j = 0; j < j_full; j += 4) {
+        const float* b0 = b + j * ldb;
+        const float* b1 = b0 + ldb;
+        const float* b2 = b1 + ldb;
+        const float* b3 = b2 + ldb;
+        for (int i = i0; i < i1; i++) {
+            const float* a_i = a + i * lda;
+            float v0 = 0.0f, v1 = 0.0f, v2 = 0.0f, v3 = 0.0f;
+            #pragma omp simd reduction(+:v0, v1, v2, v3)
+            for (int k = 0; k < n; k++) {
+                float x = a_i[k];
+                v0 += x * b0[k];
+                v1 += x * b1[k];
+                v2 += x * b2[k];
+                v3 += x * b3[k];
+            }
+            float* c_ij = c + i * ldc + j;
+            c_ij[0] = (accumulate ? c_ij[0] : 0.0f) + alpha * v0;
+            c_ij[1] = (accumulate ? c_ij[1] : 0.0f) + alpha * v1;
+            c_ij[2] = (accumulate ? c_ij[2] : 0.0f) + alpha * v2;
+            c_ij[3] = (accumulate ? c_ij[3] : 0.0f) + alpha * v3;
+        }
+    }
+    // the rest, one column at a time, up to the diagonal
+    for (int j = j_full; j < i1; j++) {
+        const float* b_j = b + j * ldb;
+        for (int i = (j > i0 ? j : i0); i < i1; i++) {
+            const float* a_i = a + i * lda;
+            float val = 0.0f;
+            #pragma omp simd reduction(+:val)
+            for (int k = 0; k < n; k++) {
+                val += a_i[k] * b_j[k];
+            }
+            c[i * ldc + j] = (accumulate ? c[i * ldc + j] : 0.0f) + alpha * val;
+        }
+    }
+}
+
+// c[i, :n] (+)= alpha * sum_j a(i, j) * b[j, :n] for the rows i0 <= i < i1, where the sum
+// runs over the j < N that the mask allows, and a(i, j) = a[i * a_row + j * a_col] so that
+// a can also be a transpose, e.g. att @ value (mask lower) and att^T @ dout (mask upper)
+void attention_matmul_nn(float* c, int ldc, const float* a, int a_row, int a_col,
+                         const float* b, int ldb, int i0, int i1, int N, int n,
+                         float alpha, int mask, int accumulate) {
+    // the j where all the rows of the tile are unmasked, and the diagonal tile j in [i0, i1)
+    int full_start = mask == ATTENTION_MASK_UPPER ? i1 : 0;
+    int full_end = mask == ATTENTION_MASK_LOWER ? i0 : N;
+    int rows = i1 - i0;
+    for (int k0 = 0; k0 < n; k0 += ATTENTION_CHUNK) {
+        int kc = n - k0 < ATTENTION_CHUNK ? n - k0 : ATTENTION_CHUNK;
+        // the (ATTENTION_TILE, ATTENTION_CHUNK) block of c is accumulated in registers,
+        // and every row chunk of b is loaded once for all the rows of the tile
+        float acc[ATTENTION_TILE][ATTENTION_CHUNK];
+        for (int r = 0; r < ATTENTION_TILE; r++) {
+            for (int k = 0; k < ATTENTION_CHUNK; k++) { acc[r][k] = 0.0f; }
+        }
+        if (rows == ATTENTION_TILE && kc == ATTENTION_CHUNK) {
+            // the fast path, with compile time trip counts
+            for (int j = full_start; j < full_end; j++) {
+                const float* b_j = b + j * ldb + k0;
+                for (int r = 0; r < ATTENTION_TILE; r++) {
+                    float a_ij = a[(i0 + r) * a_row + j * a_col];
+                    #pragma omp simd
+                    for (int k = 0; k < ATTENTION_CHUNK; k++) {
+                        acc[r][k] += a_ij * b_j[k];
+                    }
+                }
+            }
+        } else {
+            for (int j = full_start; j < full_end; j++) {
+                const float* b_j = b + j * ldb + k0;
+                for (int r = 0; r < rows; r++) {
+                    float a_ij = a[(i0 + r) * a_row + j * a_col];
+                    for (int k = 0; k < kc; k++) {
+                        acc[r][k] += a_ij * b_j[k];
+                    }
+                }
+            }
+        }
+        // the diagonal tile, masked per element
+        for (int j = i0; j < i1 && j < N; j++) {
+            const float* b_j = b + j * ldb + k0;
+            for (int r = 0; r < rows; r++) {
+                int i = i0 + r;
+                if (mask == ATTENTION_MASK_LOWER ? j > i : j < i) { continue; }
+                float a_ij = a[i * a_row + j * a_col];
+                for (int k = 0; k < kc; k++) {
+                    acc[r][k] += a_ij * b_j[k];
+                }
+            }
+        }
+        for (int r = 0; r < rows; r++) {
+            float* c_i = c + (i0 + r) * ldc + k0;
+            for (int k = 0; k < kc; k++) {
+                c_i[k] = (accumulate ? c_i[k] : 0.0f) + alpha * acc[r][k];
+            }
+        }
+    }
+}
+
+void attention_forward_tile(float* out, float* preatt, float* att,
+                            float* inp,
+                            int b, int tile, int h, int T, int C, int NH, int head_major) {
+    // the forward pass of attention for the query positions i0 <= t < i1 of head h
+    int hs = C / NH; // head size
+    float scale = 1.0 / sqrtf(hs);
+    int ts = qkv_stride(head_major, C, NH);
+    int i0 = tile * ATTENTION_TILE;
+    int i1 = i0 + ATTENTION_TILE < T ? i0 + ATTENTION_TILE : T;
+    float* query = inp + qkv_offset(head_major, b, 0, 0, h, T, C, NH);
+    float* key = inp + qkv_offset(head_major, b, 0, 1, h, T, C, NH);
+    float* value = inp + qkv_offset(head_major, b, 0, 2, h, T, C, NH);
+    float* preatt_bh = preatt + b*NH*T*T + h*T*T;
+    float* att_bh = att + b*NH*T*T + h*T*T;
+    float* out_bh = out + b * T * C + h * hs;
+
+    // pass 1: preatt = scale * query @ key^T
+    attention_matmul_nt(preatt_bh, T, query, ts, key, ts, i0, i1, hs, scale, 0);
+
+    // pass 2: the softmax of every row
+    for (int t = i0; t < i1; t++) {
+        float* preatt_bth = preatt_bh + t*T;
+        float* att_bth = att_bh + t*T;
+        float maxval = -10000.0f; // TODO something better
+        for (int t2 = 0; t2 <= t; t2++) {
+            if (preatt_bth[t2] > maxval) {
+                maxval = preatt_bth[t2];
+            }
+        }
+        // maxval is being calculated and subtracted only for numerical stability
+        float expsum = 0.0f;
+        for (int t2 = 0; t2 <= t; t2++) {
+            float expv = fast_expf(preatt_bth[t2] - maxval);
+            expsum += expv;
+            att_bth[t2] = expv;
+        }
+        float expsum_inv = expsum == 0.0f ? 0.0f : 1.0f / expsum;
+        for (int t2 = 0; t2 < T; t2++) {
+            if (t2 <= t) {
+                att_bth[t2] *= expsum_inv;
+            } else {
+                // causal attention mask. not strictly necessary to set to zero here
+                // only doing this explicitly for debugging and checking to PyTorch
+                att_bth[t2] = 0.0f;
+            }
+        }
+    }
+
+    // pass 3: out = att @ value
+    attention_matmul_nn(out_bh, C, att_bh, T, 1, value, ts, i0, i1, T, hs, 1.0f, ATTENTION_MASK_LOWER, 0);
+}
+
 void attention_forward(float* out, float* preatt, float* att,
                        float* inp,
-                       int B, int T, int C, int NH) {
-    // input is (B, T, 3C) holding the query, key, value (Q, K, V) vectors
+                       int B, int T, int C, int NH, int head_major) {
+    // input is (B, T, 3C) holding the query, key, value (Q, K, V) vectors,
+    // or if head_major, (B, 3, NH, T, hs), where each head's keys are contiguous
     // preatt, att are (B, NH, T, T). NH = number of heads, T = sequence length
     // that holds the pre-attention and post-attention scores (used in backward)
     // output is (B, T, C)
     // attention is the only layer that mixes information across time
     // every other operation is applied at every (b,t) position independently
     // (and of course, no layer mixes information across batch)
-    int C3 = C*3;
-    int hs = C / NH; // head size
-    float scale = 1.0 / sqrtf(hs);
 
-    #pragma omp parallel for collapse(3)
+    // because of the causal mask, the work of a tile of rows grows linearly with its
+    // position, so a static split over the tiles would leave the threads holding early
+    // rows idle. Instead each iteration handles the pair of tiles p and num_tiles-1-p,
+    // which always costs about the same, and the static schedule is balanced (for an
+    // odd number of tiles the middle one pairs with itself and is only done once)
+    int num_tiles = (T + ATTENTION_TILE - 1) / ATTENTION_TILE;
+    int num_pairs = (num_tiles + 1) / 2;
+    #pragma omp for collapse(3)
     for (int b = 0; b < B; b++) {
-        for (int t = 0; t < T; t++) {
-            for (int h = 0; h < NH; h++) {
-                float* query_t = inp + b * T * C3 + t * C3 + h * hs;
-                float* preatt_bth = preatt + b*NH*T*T + h*T*T + t*T;
-                float* att_bth = att + b*NH*T*T + h*T*T + t*T;
+        for (int h = 0; h < NH; h++) {
+            for (int p = 0; p < num_pairs; p++) {
+                attention_forward_tile(out, preatt, att, inp, b, p, h, T, C, NH, head_major);
+                if (num_tiles-1-p != p) {
+                    attention_forward_tile(out, preatt, att, inp, b, num_tiles-1-p, h, T, C, NH, head_major);
+                }
+            }
+        }
+    }
+}
 
-                // pass 1: calculate query dot key and maxval
-                float maxval = -10000.0f; // TODO something better
-                for (int t2 = 0; t2 <= t; t2++) {
-                    float* key_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C; // +C because it's key
+#define GPT2_CACHED_ROWS 64 // positions per forward pass with KV caches (see gpt2_forward_batch)
 
-                    // (query_t) dot (key_t2)
+// the rows of a forward pass with KV caches (see gpt2_forward_batch): the new positions of
+// num_seqs sequences, counts[s] consecutive rows for sequence s, after those in caches[s]
+typedef struct {
+    int num_seqs;
+    KVCache** caches;
+    const int* counts;
+    int row_seq[GPT2_CACHED_ROWS]; // the sequence of each row
+    int row_pos[GPT2_CACHED_ROWS]; // and its position
+} KVBatch;
+
+void attention_forward_cached(float* out, float* att, float* inp, const KVBatch* batch, int l,
+                              int T, int C, int NH, int maxT) {
+    // attention for the T new positions of a batch of sequences (B = 1), each at its
+    // position in its sequence, with the keys and values of the positions before them from
+    // the KV cache of the sequence, layer l, which has the blocks for them reserved (see
+    // llmc/kvcache.h), in fp32 or int8.
+    // inp is (T, 3C) holding their query, key, value (Q, K, V) vectors, interleaved
+    // att is (NH, T, maxT), the scores of each row (only needed within this call)
+    // output is (T, C)
+    int hs = C / NH; // head size
+    float scale = 1.0f / sqrtf(hs);
+    // append the new keys and values to the caches first, each position attends to itself
+    #pragma omp for collapse(2)
+    for (int h = 0; h < NH; h++) {
+        for (int t = 0; t < T; t++) {
+            const KVCache* cache = batch->caches[batch->row_seq[t]];
+            kvcache_store(cache, l, h, batch->row_pos[t], inp + t * 3*C + C + h * hs, inp + t * 3*C + 2*C + h * hs);
+        }
+    }
+    // the rows of different sequences attend to very different numbers of positions
+    #pragma omp for collapse(2) schedule(dynamic)
+    for (int h = 0; h < NH; h++) {
+        for (int t = 0; t < T; t++) {
+            const KVCache* cache = batch->caches[batch->row_seq[t]];
+            const KVPool* pool = cache->pool;
+            const int* block_table = cache->block_table;
+            const float* query_t = inp + t * 3*C + h * hs;
+            float* att_ht = att + ((size_t)h * T + t) * maxT;
+            float* out_ht = out + t * C + h * hs;
+            int n = batch->row_pos[t] + 1; // the causal mask: the positions of its sequence up to its own
+            int nb = kv_blocks(n);
+
+            // pass 1: the scores, and their max, block by block
+            float maxval = -10000.0f;
+            for (int b = 0; b < nb; b++) {
+                int t0 = b * KV_BLOCK_SIZE;
+                int bn = n - t0 < KV_BLOCK_SIZE ? n - t0 : KV_BLOCK_SIZE;
+                if (pool->int8) {
+                    // the dot products with the int8 keys, INT8_ROW_TILE_COLS at a time,
+                    // then their scales
+                    const int8_t* key = kvpool_key_int8(pool, l, block_table[b], h);
+                    const float* key_scale = kvpool_key_scale(pool, l, block_table[b], h);
+                    for (int j = 0; j < bn; j += INT8_ROW_TILE_COLS) {
+                        int cols = bn - j < INT8_ROW_TILE_COLS ? bn - j : INT8_ROW_TILE_COLS;
+                        int8_dot_tile(att_ht + t0 + j, 0, query_t, hs, 1, key + j * hs, hs, cols, hs);
+                    }
+                    for (int j = 0; j < bn; j++) {
+                        float val = att_ht[t0 + j] * key_scale[j] * scale;
+                        att_ht[t0 + j] = val;
+                        if (val > maxval) { maxval = val; }
+                    }
+                    continue;
+                }
+                const float* key = kvpool_key(pool, l, block_table[b], h);
+                for (int j = 0; j < bn; j++) {
+                    const float* key_t2 = key + j * hs;
                     float val = 0.0f;
+                    #pragma omp simd reduction(+:val)
                     for (int i = 0; i < hs; i++) {
                         val += query_t[i] * key_t2[i];
                     }
                     val *= scale;
-                    if (val > maxval) {
-                        maxval = val;
-                    }
-
-                    preatt_bth[t2] = val;
-                }
-
-                // pass 2: calculate the exp and keep track of sum
-                // maxval is being calculated and subtracted only for numerical stability
-                float expsum = 0.0f;
-                for (int t2 = 0; t2 <= t; t2++) {
-                    float expv = expf(preatt_bth[t2] - maxval);
-                    expsum += expv;
-                    att_bth[t2] = expv;
+                    att_ht[t0 + j] = val;
+                    if (val > maxval) { maxval = val; }
                 }
-                float expsum_inv = expsum == 0.0f ? 0.0f : 1.0f / expsum;
-
-                // pass 3: normalize to get the softmax
-                for (int t2 = 0; t2 < T; t2++) {
-                    if (t2 <= t) {
-                        att_bth[t2] *= expsum_inv;
-                    } else {
-                        // causal attention mask. not strictly necessary to set to zero here
-                        // only doing this explicitly for debugging and checking to PyTorch
-                        att_bth[t2] = 0.0f;
+            }
+            // pass 2: the softmax
+            float expsum = 0.0f;
+            for (int t2 = 0; t2 < n; t2++) {
+                float expv = fast_expf(att_ht[t2] - maxval);
+                expsum += expv;
+                att_ht[t2] = expv;
+            }
+            float expsum_inv = expsum == 0.0f ? 0.0f : 1.0f / expsum;
+            // pass 3: out = att @ value, block by block
+            for (int i = 0; i < hs; i++) { out_ht[i] = 0.0f; }
+            for (int b = 0; b < nb; b++) {
+                int t0 = b * KV_BLOCK_SIZE;
+                int bn = n - t0 < KV_BLOCK_SIZE ? n - t0 : KV_BLOCK_SIZE;
+                if (pool->int8) {
+                    const int8_t* value = kvpool_value_int8(pool, l, block_table[b], h);
+                    const float* value_scale = kvpool_value_scale(pool, l, block_table[b], h);
+                    for (int j = 0; j < bn; j++) {
+                        const int8_t* value_t2 = value + j * hs;
+                        float a = att_ht[t0 + j] * expsum_inv * value_scale[j];
+                        #pragma omp simd
+                        for (int i = 0; i < hs; i++) {
+                            out_ht[i] += a * (float)value_t2[i];
+                        }
                     }
+                    continue;
                 }
-
-                // pass 4: accumulate weighted values into the output of attention
-                float* out_bth = out + b * T * C + t * C + h * hs;
-                for (int i = 0; i < hs; i++) { out_bth[i] = 0.0f; }
-                for (int t2 = 0; t2 <= t; t2++) {
-                    float* value_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C*2; // +C*2 because it's value
-                    float att_btht2 = att_bth[t2];
+                const float* value = kvpool_value(pool, l, block_table[b], h);
+                for (int j = 0; j < bn; j++) {
+                    const float* value_t2 = value + j * hs;
+                    float a = att_ht[t0 + j] * expsum_inv;
+                    #pragma omp simd
                     for (int i = 0; i < hs; i++) {
-                        out_bth[i] += att_btht2 * value_t2[i];
+                        out_ht[i] += a * value_t2[i];
                     }
                 }
             }
@@ -344,102 +1153,141 @@ void attention_forward(float* out, float* preatt, float* att,
     }
 }
 
-void attention_backward(float* dinp, float* dpreatt, float* datt,
-                        float* dout, float* inp, float* att,
-                        int B, int T, int C, int NH) {
-    // inp/dinp are (B, T, 3C) Q,K,V
-    // att/datt/dpreatt are (B, NH, T, T)
-    // dout is (B, T, C)
-    int C3 = C*3;
+void attention_backward_rows(float* dinp, float* dpreatt, float* datt,
+                             float* dout, float* inp, float* att,
+                             int b, int tile, int h, int T, int C, int NH, int head_major, int accumulate) {
+    // backward for the query positions of a tile of rows: everything that is owned by
+    // those rows, i.e. datt, dpreatt and dquery. dkey/dvalue are gathered by columns below
     int hs = C / NH; // head size
     float scale = 1.f / sqrtf(hs);
+    int ts = qkv_stride(head_major, C, NH);
+    int i0 = tile * ATTENTION_TILE;
+    int i1 = i0 + ATTENTION_TILE < T ? i0 + ATTENTION_TILE : T;
+    float* key = inp + qkv_offset(head_major, b, 0, 1, h, T, C, NH);
+    float* value = inp + qkv_offset(head_major, b, 0, 2, h, T, C, NH);
+    float* dquery = dinp + qkv_offset(head_major, b, 0, 0, h, T, C, NH);
+    float* att_bh = att + b*NH*T*T + h*T*T;
+    float* datt_bh = datt + b*NH*T*T + h*T*T;
+    float* dpreatt_bh = dpreatt + b*NH*T*T + h*T*T;
+    float* dout_bh = dout + b * T * C + h * hs;
+
+    // backward pass 3, through out = att @ value, into att: datt (+)= dout @ value^T
+    attention_matmul_nt(datt_bh, T, dout_bh, C, value, ts, i0, i1, hs, 1.0f, accumulate);
+
+    // backward pass 2, the softmax
+    // note that softmax (like e.g. tanh) doesn't need the input (preatt) to backward
+    // the local derivative is att[t2] * (indicator(t2 == t3) - att[t3]), and summing it
+    // against datt[t2] over t2 collapses to att[t3] * (datt[t3] - sum_t2 att[t2] * datt[t2])
+    for (int t = i0; t < i1; t++) {
+        float* att_bth = att_bh + t*T;
+        float* datt_bth = datt_bh + t*T;
+        float* dpreatt_bth = dpreatt_bh + t*T;
+        float dot = 0.0f;
+        for (int t2 = 0; t2 <= t; t2++) {
+            dot += att_bth[t2] * datt_bth[t2];
+        }
+        for (int t3 = 0; t3 <= t; t3++) {
+            dpreatt_bth[t3] = (accumulate ? dpreatt_bth[t3] : 0.0f) + att_bth[t3] * (datt_bth[t3] - dot);
+        }
+    }
 
-    for (int b = 0; b < B; b++) {
-        for (int t = 0; t < T; t++) {
-            for (int h = 0; h < NH; h++) {
-                float* att_bth = att + b*NH*T*T + h*T*T + t*T;
-                float* datt_bth = datt + b*NH*T*T + h*T*T + t*T;
-                float* dpreatt_bth = dpreatt + b*NH*T*T + h*T*T + t*T;
-                float* dquery_t = dinp + b * T * C3 + t * C3 + h * hs;
-                float* query_t = inp + b * T * C3 + t * C3 + h * hs;
-
-                // backward pass 4, through the value accumulation
-                float* dout_bth = dout + b * T * C + t * C + h * hs;
-                for (int t2 = 0; t2 <= t; t2++) {
-                    float* value_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C*2; // +C*2 because it's value
-                    float* dvalue_t2 = dinp + b * T * C3 + t2 * C3 + h * hs + C*2;
-                    for (int i = 0; i < hs; i++) {
-                        // in the forward pass this was:
-                        // out_bth[i] += att_bth[t2] * value_t2[i];
-                        // so now we have:
-                        datt_bth[t2] += value_t2[i] * dout_bth[i];
-                        dvalue_t2[i] += att_bth[t2] * dout_bth[i];
-                    }
-                }
+    // backward pass 1, through preatt = scale * query @ key^T, into the query:
+    // dquery (+)= scale * dpreatt @ key
+    attention_matmul_nn(dquery, ts, dpreatt_bh, T, 1, key, ts, i0, i1, T, hs, scale, ATTENTION_MASK_LOWER, accumulate);
+}
 
-                // backward pass 2 & 3, the softmax
-                // note that softmax (like e.g. tanh) doesn't need the input (preatt) to backward
-                for (int t2 = 0; t2 <= t; t2++) {
-                    for (int t3 = 0; t3 <= t; t3++) {
-                        float indicator = t2 == t3 ? 1.0f : 0.0f;
-                        float local_derivative = att_bth[t2] * (indicator - att_bth[t3]);
-                        dpreatt_bth[t3] += local_derivative * datt_bth[t2];
-                    }
-                }
+void attention_backward_cols(float* dinp, float* dpreatt,
+                             float* dout, float* inp, float* att,
+                             int b, int tile, int h, int T, int C, int NH, int head_major, int accumulate) {
+    // backward into the keys and values of a tile of positions j0 <= t2 < j1 of head h,
+    // which received contributions from all the query positions t >= t2
+    int hs = C / NH; // head size
+    float scale = 1.f / sqrtf(hs);
+    int ts = qkv_stride(head_major, C, NH);
+    int j0 = tile * ATTENTION_TILE;
+    int j1 = j0 + ATTENTION_TILE < T ? j0 + ATTENTION_TILE : T;
+    float* query = inp + qkv_offset(head_major, b, 0, 0, h, T, C, NH);
+    float* dkey = dinp + qkv_offset(head_major, b, 0, 1, h, T, C, NH);
+    float* dvalue = dinp + qkv_offset(head_major, b, 0, 2, h, T, C, NH);
+    float* att_bh = att + b*NH*T*T + h*T*T;
+    float* dpreatt_bh = dpreatt + b*NH*T*T + h*T*T;
+    float* dout_bh = dout + b * T * C + h * hs;
+    // dkey (+)= scale * dpreatt^T @ query, dvalue (+)= att^T @ dout
+    attention_matmul_nn(dkey, ts, dpreatt_bh, 1, T, query, ts, j0, j1, T, hs, scale, ATTENTION_MASK_UPPER, accumulate);
+    attention_matmul_nn(dvalue, ts, att_bh, 1, T, dout_bh, C, j0, j1, T, hs, 1.0f, ATTENTION_MASK_UPPER, accumulate);
+}
 
-                // backward pass 1, the query @ key matmul
-                for (int t2 = 0; t2 <= t; t2++) {
-                    float* key_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C; // +C because it's key
-                    float* dkey_t2 = dinp + b * T * C3 + t2 * C3 + h * hs + C; // +C because it's key
-                    for (int i = 0; i < hs; i++) {
-                        // in the forward pass this was:
-                        // preatt_bth[t2] += (query_t[i] * key_t2[i]) * scale;
-                        // so now we have:
-                        dquery_t[i] += key_t2[i] * dpreatt_bth[t2] * scale;
-                        dkey_t2[i] += query_t[i] * dpreatt_bth[t2] * scale;
-                    }
+void attention_backward(float* dinp, float* dpreatt, float* datt,
+                        float* dout, float* inp, float* att,
+                        int B, int T, int C, int NH, int head_major, int accumulate) {
+    // inp/dinp are (B, T, 3C) Q,K,V, in the layout given by head_major (see attention_forward)
+    // att/datt/dpreatt are (B, NH, T, T)
+    // dout is (B, T, C)
+    // dinp, datt and dpreatt are added to if accumulate, else written. either way only their
+    // causal (lower) triangles are touched, and the upper triangles are never read
+    // the backward is split in two phases so that every output has a single owner:
+    // first by tiles of query rows (datt, dpreatt, dquery), then by tiles of key columns
+    // (dkey, dvalue). as in the forward pass, tile p is paired with num_tiles-1-p to give
+    // every iteration the same amount of work
+    int num_tiles = (T + ATTENTION_TILE - 1) / ATTENTION_TILE;
+    int num_pairs = (num_tiles + 1) / 2;
+    #pragma omp for collapse(3)
+    for (int b = 0; b < B; b++) {
+        for (int h = 0; h < NH; h++) {
+            for (int p = 0; p < num_pairs; p++) {
+                attention_backward_rows(dinp, dpreatt, datt, dout, inp, att, b, p, h, T, C, NH, head_major, accumulate);
+                if (num_tiles-1-p != p) {
+                    attention_backward_rows(dinp, dpreatt, datt, dout, inp, att, b, num_tiles-1-p, h, T, C, NH, head_major, accumulate);
+                }
+            }
+        }
+    }
+    // (implicit barrier here: the columns need dpreatt of all the rows below them)
+    #pragma omp for collapse(3)
+    for (int b = 0; b < B; b++) {
+        for (int h = 0; h < NH; h++) {
+            for (int p = 0; p < num_pairs; p++) {
+                attention_backward_cols(dinp, dpreatt, dout, inp, att, b, p, h, T, C, NH, head_major, accumulate);
+                if (num_tiles-1-p != p) {
+                    attention_backward_cols(dinp, dpreatt, dout, inp, att, b, num_tiles-1-p, h, T, C, NH, head_major, accumulate);
                 }
             }
         }
     }
 }
 
-#define GELU_SCALING_FACTOR sqrtf(2.0f / M_PI)
 void gelu_forward(float* out, float* inp, int N) {
     // (approximate) GeLU elementwise non-linearity in the MLP block of Transformer
+    #pragma omp for simd schedule(static, REDUCE_BLOCK)
     for (int i = 0; i < N; i++) {
-        float x = inp[i];
-        float cube = 0.044715f * x * x * x;
-        out[i] = 0.5f * x * (1.0f + tanhf(GELU_SCALING_FACTOR * (x + cube)));
+        out[i] = gelu(inp[i]);
     }
 }
 
-// we want to use -Ofast optimization, but sadly GeLU breaks, so disable this flag just for it (#168)
-#pragma float_control(precise, on, push)
-#if defined(__GNUC__) && !defined(__clang__)
-__attribute__((optimize("no-finite-math-only")))
-#endif
-void gelu_backward(float* dinp, float* inp, float* dout, int N) {
+// note: this used to need -Ofast disabled (#168), because 1/coshf^2 relied on coshf
+// overflowing to inf for large inputs. fast_sech2f never overflows, so no special flags
+void gelu_backward(float* dinp, float* inp, float* dout, int N, int accumulate) {
+    #pragma omp for simd schedule(static, REDUCE_BLOCK)
     for (int i = 0; i < N; i++) {
         float x = inp[i];
         float cube = 0.044715f * x * x * x;
         float tanh_arg = GELU_SCALING_FACTOR * (x + cube);
-        float tanh_out = tanhf(tanh_arg);
-        float coshf_out = coshf(tanh_arg);
-        float sech_out = 1.0f / (coshf_out * coshf_out);
+        float tanh_out = fast_tanhf(tanh_arg);
+        float sech_out = fast_sech2f(tanh_arg);
         float local_grad = 0.5f * (1.0f + tanh_out) + x * 0.5f * sech_out * GELU_SCALING_FACTOR * (1.0f + 3.0f * 0.044715f * x * x);
-        dinp[i] += local_grad * dout[i];
+        dinp[i] = (accumulate ? dinp[i] : 0.0f) + local_grad * dout[i];
     }
 }
-#pragma float_control(pop)
 
 void residual_forward(float* out, float* inp1, float* inp2, int N) {
+    #pragma omp for simd schedule(static, REDUCE_BLOCK)
     for (int i = 0; i < N; i++) {
         out[i] = inp1[i] + inp2[i];
     }
 }
 
 void residual_backward(float* dinp1, float* dinp2, float* dout, int N) {
+    #pragma omp for simd schedule(static, REDUCE_BLOCK)
     for (int i = 0; i < N; i++) {
         dinp1[i] += dout[i];
         dinp2[i] += dout[i];
@@ -451,7 +1299,7 @@ void softmax_forward(float* probs, float* logits, int B, int T, int V, int Vp) {
     // input: logits is (B,T,Vp) of the unnormalized log probabilities
     // Vp is the padded vocab size (for efficiency), V is the "real" vocab size
     // example: Vp is 50304 and V is 50257
-    #pragma omp parallel for collapse(2)
+    #pragma omp for collapse(2)
     for (int b = 0; b < B; b++) {
         for (int t = 0; t < T; t++) {
             // probs <- softmax(logits)
@@ -467,7 +1315,7 @@ void softmax_forward(float* probs, float* logits, int B, int T, int V, int Vp) {
             }
             float sum = 0.0f;
             for (int i = 0; i < V; i++) {
-                probs_bt[i] = expf(logits_bt[i] - maxval);
+                probs_bt[i] = fast_expf(logits_bt[i] - maxval);
                 sum += probs_bt[i];
             }
             // note we only loop to V, leaving the padded dimensions
@@ -489,6 +1337,7 @@ void crossentropy_forward(float* losses,
     // output: losses is (B,T) of the individual losses at each position
     // input: probs are (B,T,Vp) of the probabilities
     // input: targets is (B,T) of integers giving the correct index in logits
+    #pragma omp for collapse(2)
     for (int b = 0; b < B; b++) {
         for (int t = 0; t < T; t++) {
             // loss = -log(probs[target])
@@ -501,20 +1350,24 @@ void crossentropy_forward(float* losses,
 
 void crossentropy_softmax_backward(float* dlogits,
                            float* dlosses, float* probs, int* targets,
-                           int B, int T, int V, int Vp) {
-    // backwards through both softmax and crossentropy
+                           int B, int T, int V, int Vp, int accumulate) {
+    // backwards through both softmax and crossentropy. dlogits is added to if accumulate, else written
+    #pragma omp for collapse(2)
     for (int b = 0; b < B; b++) {
         for (int t = 0; t < T; t++) {
             float* dlogits_bt = dlogits + b * T * Vp + t * Vp;
             float* probs_bt = probs + b * T * Vp + t * Vp;
             float dloss = dlosses[b * T + t];
             int ix = targets[b * T + t];
-            // note we only loop to V, leaving the padded dimensions
-            // of dlogits untouched, so gradient there stays at zero
+            // note we only loop to V, the gradient of the padded dimensions is zero
+            #pragma omp simd
             for (int i = 0; i < V; i++) {
                 float p = probs_bt[i];
                 float indicator = i == ix ? 1.0f : 0.0f;
-                dlogits_bt[i] += (p - indicator) * dloss;
+                dlogits_bt[i] = (accumulate ? dlogits_bt[i] : 0.0f) + (p - indicator) * dloss;
+            }
+            if (!accumulate) {
+                for (int i = V; i < Vp; i++) { dlogits_bt[i] = 0.0f; }
             }
         }
     }
@@ -577,14 +1430,15 @@ void fill_in_parameter_sizes(size_t* param_sizes, GPT2Config config) {
 }
 
 // allocate memory for the parameters and point the individual tensors to the right places
-float* malloc_and_point_parameters(ParameterTensors* params, size_t* param_sizes) {
-    size_t num_parameters = 0;
-    for (size_t i = 0; i < NUM_PARAMETER_TENSORS; i++) {
-        num_parameters += param_sizes[i];
-    }
-    // malloc all parameters all at once
-    float* params_memory = (float*)mallocCheck(num_parameters * sizeof(float));
-    // assign all the tensors
+// the memory comes from the arena if there is one, else from malloc
+// the parameter tensors that checkpoint versions 6 and 7 store in int8 and q4 (see
+// quantize_gpt2.c): wte, which is also the LM head, and the four matmul weights of every layer
+int param_is_quantized(int i) { return i == 0 || i == 4 || i == 6 || i == 10 || i == 12; }
+
+// the length of their rows, along which the matmuls take their dot products
+size_t param_row_length(GPT2Config config, int i) { return i == 12 ? 4 * config.channels : config.channels; }
+
+void point_parameters(ParameterTensors* params, size_t* param_sizes, float* params_memory) {
     float** ptrs[] = {
         &params->wte, &params->wpe, &params->ln1w, &params->ln1b, &params->qkvw, &params->qkvb,
         &params->attprojw, &params->attprojb, &params->ln2w, &params->ln2b, &params->fcw, &params->fcb,
@@ -595,6 +1449,24 @@ float* malloc_and_point_parameters(ParameterTensors* params, size_t* param_sizes
         *(ptrs[i]) = params_memory_iterator;
         params_memory_iterator += param_sizes[i];
     }
+}
+
+float* malloc_and_point_parameters(ParameterTensors* params, size_t* param_sizes, Arena* arena) {
+    size_t num_parameters = 0;
+    for (size_t i = 0; i < NUM_PARAMETER_TENSORS; i++) {
+        num_parameters += param_sizes[i];
+    }
+    // malloc all parameters all at once
+    float* params_memory;
+    if (arena != NULL) {
+        params_memory = (float*)arena_alloc(arena, num_parameters * sizeof(float));
+        // as a whole, because the only loop over all of them is gpt2_update's
+        arena_first_touch(params_memory, num_parameters * sizeof(float));
+    } else {
+        params_memory = (float*)mallocCheck(num_parameters * sizeof(float));
+    }
+    // assign all the tensors
+    point_parameters(params, param_sizes, params_memory);
     return params_memory;
 }
 
@@ -625,7 +1497,7 @@ typedef struct {
     float* losses; // (B, T)
 } ActivationTensors;
 
-void fill_in_activation_sizes(size_t* act_sizes, GPT2Config config, int B, int T) {
+void fill_in_activation_sizes(size_t* act_sizes, GPT2Config config, int B, int T, int recompute) {
     size_t C = config.channels;
     size_t NH = config.num_heads;
     size_t L = config.num_layers;
@@ -644,7 +1516,7 @@ void fill_in_activation_sizes(size_t* act_sizes, GPT2Config config, int B, int T
     act_sizes[11] = L * B * T; // ln2_mean
     act_sizes[12] = L * B * T; // ln2_rstd
     act_sizes[13] = L * B * T * 4 * C; // fch
-    act_sizes[14] = L * B * T * 4 * C; // fch_gelu
+    act_sizes[14] = (recompute ? 1 : L) * B * T * 4 * C; // fch_gelu, a single layer if we recompute it in backward
     act_sizes[15] = L * B * T * C; // fcproj
     act_sizes[16] = L * B * T * C; // residual3
     act_sizes[17] = B * T * C; // lnf
@@ -655,12 +1527,13 @@ void fill_in_activation_sizes(size_t* act_sizes, GPT2Config config, int B, int T
     act_sizes[22] = B * T; // losses
 }
 
-float* malloc_and_point_activations(ActivationTensors* acts, size_t* act_sizes) {
+float* malloc_and_point_activations(ActivationTensors* acts, size_t* act_sizes, Arena* arena) {
     size_t num_activations = 0;
     for (size_t i = 0; i < NUM_ACTIVATION_TENSORS; i++) {
         num_activations += act_sizes[i];
     }
-    float* acts_memory = (float*)mallocCheck(num_activations * sizeof(float));
+    float* acts_memory = arena != NULL ? (float*)arena_alloc(arena, num_activations * sizeof(float))
+                                       : (float*)mallocCheck(num_activations * sizeof(float));
     float** ptrs[] = {
         &acts->encoded, &acts->ln1, &acts->ln1_mean, &acts->ln1_rstd, &acts->qkv, &acts->atty,
         &acts->preatt, &acts->att, &acts->attproj, &acts->residual2, &acts->ln2, &acts->ln2_mean,
@@ -670,6 +1543,8 @@ float* malloc_and_point_activations(ActivationTensors* acts, size_t* act_sizes)
     float* acts_memory_iterator = acts_memory;
     for (size_t i = 0; i < NUM_ACTIVATION_TENSORS; i++) {
         *(ptrs[i]) = acts_memory_iterator;
+        // tensor by tensor, the layers split each of them into contiguous ranges of rows
+        if (arena != NULL) { arena_first_touch(acts_memory_iterator, act_sizes[i] * sizeof(float)); }
         acts_memory_iterator += act_sizes[i];
     }
     return acts_memory;
@@ -677,11 +1552,16 @@ float* malloc_and_point_activations(ActivationTensors* acts, size_t* act_sizes)
 
 typedef struct {
     GPT2Config config;
+    // all the buffers below are allocated from here, and freed together (see llmc/arena.h)
+    Arena arena;
     // the weights (parameters) of the model, and their sizes
     ParameterTensors params;
     size_t param_sizes[NUM_PARAMETER_TENSORS];
     float* params_memory;
     size_t num_parameters;
+    // the mapping of the checkpoint file, if params_memory is in it (see gpt2_map_checkpoint)
+    void* params_map;
+    size_t params_map_size;
     // gradients of the weights
     ParameterTensors grads;
     float* grads_memory;
@@ -693,25 +1573,58 @@ typedef struct {
     size_t act_sizes[NUM_ACTIVATION_TENSORS];
     float* acts_memory;
     size_t num_activations;
-    // gradients of the activations
-    ActivationTensors grads_acts;
+    // gradients of the activations, one set of pointers per layer (see gpt2_plan_grads_acts)
+    ActivationTensors* grads_acts;
     float* grads_acts_memory;
+    // block partials of the deterministic reductions (see reduce_tree)
+    float* scratch;
     // other run state configuration
     int batch_size; // the batch size (B) of current forward pass
     int seq_len; // the sequence length (T) of current forward pass
     int* inputs; // the input tokens for the current forward pass
     int* targets; // the target tokens for the current forward pass
     float mean_loss; // after a forward pass with targets, will be populated with the mean loss
+    // optionally, run the passes as a graph of tasks instead of layer by layer
+    int use_task_graph;
+    // optionally, keep fch_gelu for only one layer and recompute it from fch in backward
+    int recompute;
+    // store the QKV matmul's output head-major (B, 3, NH, T, hs) for attention (default on)
+    int qkv_head_major;
+    // optionally, mixed precision: the matmuls use a bf16 copy of the weights (and round
+    // their inputs to bf16), the fp32 params stay the master weights that AdamW updates
+    int use_bf16;
+    bf16* params_bf16_memory; // the bf16 copy, with the same layout as params_memory
+    // weight-only quantization, if loaded from a version 6 (int8) or 7 (q4) checkpoint, for
+    // inference only: the matmul weights are int8 with a scale per row, or q4 in groups with a
+    // scale and min each (see matmul_forward_quantized)
+    int8_t* params_int8_memory; // NULL if not int8, else with the same layout as params_memory
+    float* int8_scales[NUM_PARAMETER_TENSORS]; // one per row, NULL for the tensors that stay fp32
+    q4_block* params_q4_memory; // NULL if not q4, else a block per Q4_GROUP of params_memory
+    // the single layer of activations of gpt2_forward_no_grad, and the B,T they are for
+    ActivationTensors acts_no_grad;
+    float* acts_no_grad_memory;
+    float* scratch_no_grad;
+    int no_grad_batch_size;
+    int no_grad_seq_len;
+    // the single layer of activations of gpt2_forward_batch, for GPT2_CACHED_ROWS positions
+    ActivationTensors acts_cached;
+    float* acts_cached_memory;
+    TaskPool task_pool;
+    TaskGraph forward_graph; // built lazily for the current B,T
+    TaskGraph backward_graph;
 } GPT2;
 
-void gpt2_build_from_checkpoint(GPT2 *model, const char* checkpoint_path) {
+void gpt2_load_checkpoint_(GPT2 *model, const char* checkpoint_path, int map) {
 
     // read in model from a checkpoint file
     FILE *model_file = fopenCheck(checkpoint_path, "rb");
     int model_header[256];
     freadCheck(model_header, sizeof(int), 256, model_file);
     if (model_header[0] != 20240326) { printf("Bad magic model file\n"); exit(1); }
-    if (model_header[1] != 3) {
+    // version 3 is all fp32, versions 6 and 7 have the matmul weights in int8 and q4
+    // (see quantize_gpt2.c)
+    int version = model_header[1];
+    if (version != 3 && version != 6 && version != 7) {
         printf("Bad version in model file\n");
         printf("---> HINT: try to re-run `python train_gpt2.py`\n");
         exit(1);
@@ -745,21 +1658,805 @@ void gpt2_build_from_checkpoint(GPT2 *model, const char* checkpoint_path) {
     model->num_parameters = num_parameters;
 
     // read in all the parameters from file
-    model->params_memory = malloc_and_point_parameters(&model->params, model->param_sizes);
-    freadCheck(model->params_memory, sizeof(float), num_parameters, model_file);
+    arena_init(&model->arena);
+    model->params_int8_memory = NULL;
+    for (int i = 0; i < NUM_PARAMETER_TENSORS; i++) { model->int8_scales[i] = NULL; }
+    model->params_q4_memory = NULL;
+    model->params_map = NULL;
+    model->params_map_size = 0;
+    #ifdef _WIN32
+    map = 0; // read in as usual
+    #endif
+    if (version == 3 && map) {
+        #ifndef _WIN32
+        // the parameters are the file after the header, read-only, in the page cache, where
+        // every process that maps the file shares them
+        size_t size = 256 * sizeof(int) + num_parameters * sizeof(float);
+        fseekCheck(model_file, 0, SEEK_END);
+        if ((size_t)ftell(model_file) < size) { printf("Error: %s is truncated\n", checkpoint_path); exit(1); }
+        int flags = MAP_PRIVATE;
+        #ifdef MAP_POPULATE
+        flags |= MAP_POPULATE; // read it all in now, rather than in the first forward passes
+        #endif
+        void* mapped = mmap(NULL, size, PROT_READ, flags, fileno(model_file), 0);
+        if (mapped == MAP_FAILED) { printf("Error: can't map %s\n", checkpoint_path); exit(1); }
+        model->params_map = mapped;
+        model->params_map_size = size;
+        model->params_memory = (float*)((char*)mapped + 256 * sizeof(int));
+        point_parameters(&model->params, model->param_sizes, model->params_memory);
+        #endif
+    } else if (version == 3) {
+        model->params_memory = malloc_and_point_parameters(&model->params, model->param_sizes, &model->arena);
+        freadCheck(model->params_memory, sizeof(float), num_parameters, model_file);
+    } else {
+        // in version 6 every quantized tensor is its scales and then its int8 values, in
+        // version 7 its q4 blocks, the others are fp32. params keeps its layout, so that
+        // gpt2_int8 and gpt2_q4 can find the quantized weights from the fp32 pointers, but
+        // the pages of the quantized tensors are never touched, so they take no memory
+        // (see llmc/arena.h)
+        if (version == 7 && C % Q4_GROUP != 0) { printf("Error: q4 needs channels divisible by %d\n", Q4_GROUP); exit(1); }
+        model->params_memory = (float*)arena_alloc(&model->arena, num_parameters * sizeof(float));
+        point_parameters(&model->params, model->param_sizes, model->params_memory);
+        if (version == 6) {
+            model->params_int8_memory = (int8_t*)arena_alloc(&model->arena, num_parameters * sizeof(int8_t));
+        } else {
+            // every tensor starts at a multiple of C, so every quantized one at a block
+            size_t num_blocks = (num_parameters + Q4_GROUP - 1) / Q4_GROUP;
+            model->params_q4_memory = (q4_block*)arena_alloc(&model->arena, num_blocks * sizeof(q4_block));
+        }
+        size_t offset = 0, num_quantized = 0;
+        for (int i = 0; i < NUM_PARAMETER_TENSORS; i++) {
+            size_t n = model->param_sizes[i];
+            if (param_is_quantized(i) && version == 6) {
+                size_t rows = n / param_row_length(model->config, i);
+                model->int8_scales[i] = (float*)arena_alloc(&model->arena, rows * sizeof(float));
+                freadCheck(model->int8_scales[i], sizeof(float), rows, model_file);
+                freadCheck(model->params_int8_memory + offset, sizeof(int8_t), n, model_file);
+                num_quantized += n;
+            } else if (param_is_quantized(i)) {
+                freadCheck(model->params_q4_memory + offset / Q4_GROUP, sizeof(q4_block), n / Q4_GROUP, model_file);
+                num_quantized += n;
+            } else {
+                freadCheck(model->params_memory + offset, sizeof(float), n, model_file);
+            }
+            offset += n;
+        }
+        printf("%s parameters: %zu (inference only)\n", version == 6 ? "int8" : "q4", num_quantized);
+    }
     fcloseCheck(model_file);
 
     // other inits
     model->acts_memory = NULL;
     model->grads_memory = NULL;
+    model->scratch = NULL;
     model->m_memory = NULL;
     model->v_memory = NULL;
+    model->grads_acts = NULL;
     model->grads_acts_memory = NULL;
+    model->acts_no_grad_memory = NULL;
+    model->acts_cached_memory = NULL;
+    model->scratch_no_grad = NULL;
+    model->params_bf16_memory = NULL;
     model->inputs = NULL;
     model->targets = NULL;
     model->batch_size = 0;
     model->seq_len = 0;
     model->mean_loss = -1.0f; // -1.0f will designate no loss
+    model->use_task_graph = 0;
+    model->recompute = 0;
+    model->qkv_head_major = 1;
+    model->use_bf16 = 0;
+    model->task_pool.num_threads = 0; // created on first use
+    taskgraph_init(&model->forward_graph);
+    taskgraph_init(&model->backward_graph);
+}
+
+void gpt2_build_from_checkpoint(GPT2 *model, const char* checkpoint_path) {
+    gpt2_load_checkpoint_(model, checkpoint_path, 0);
+}
+
+void gpt2_map_checkpoint(GPT2 *model, const char* checkpoint_path) {
+    // for inference, e.g. in a server: maps the fp32 parameters of a version 3 checkpoint
+    // instead of reading them into memory, read-only. the quantized checkpoints are read in
+    // as usual, their tensors are laid out differently in memory than in the file
+    gpt2_load_checkpoint_(model, checkpoint_path, 1);
+}
+
+// whether the model was loaded from an int8 or q4 checkpoint, which is for inference only
+int gpt2_is_quantized(GPT2 *model) {
+    return model->params_int8_memory != NULL || model->params_q4_memory != NULL;
+}
+
+// ----------------------------------------------------------------------------
+// mixed precision (use_bf16)
+// the matmuls read the weights from a bf16 copy: half the bytes of the fp32 weights, which
+// they stream through once per B*T tile. everything else stays fp32: the master weights and
+// the AdamW state that gpt2_update works on, the activations, all the gradients, and the
+// accumulators of the matmuls. gpt2_update writes the updated master weights back into the
+// copy with stochastic rounding: most updates are far below the resolution of bf16 (8 bits
+// of mantissa), round to nearest would drop them, rounded stochastically they still count
+// in expectation
+
+// the chunk of the schedule(static, chunk) loops over all the parameters: a single
+// contiguous range per thread, so that it works on the pages it touched first (see
+// arena_first_touch), starting at a multiple of REDUCE_BLOCK, so that the results
+// still don't depend on the number of threads
+size_t gpt2_param_chunk(GPT2 *model) {
+    #ifdef OMP
+    size_t num_threads = omp_get_max_threads();
+    #else
+    size_t num_threads = 1;
+    #endif
+    return arena_round_up((model->num_parameters + num_threads - 1) / num_threads, REDUCE_BLOCK);
+}
+
+// the bf16 copy of a weight, or NULL if the model runs in fp32
+bf16* gpt2_bf16(GPT2 *model, const float* param) {
+    if (model->params_bf16_memory == NULL) { return NULL; }
+    return model->params_bf16_memory + (param - model->params_memory);
+}
+
+// lazily make the bf16 copy of the weights, if use_bf16 was turned on
+void gpt2_init_bf16(GPT2 *model) {
+    if (!model->use_bf16 || model->params_bf16_memory != NULL) { return; }
+    if (gpt2_is_quantized(model)) {
+        printf("Error: use_bf16 needs the fp32 weights, not a quantized checkpoint\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t n = model->num_parameters;
+    model->params_bf16_memory = (bf16*)arena_alloc(&model->arena, n * sizeof(bf16));
+    // round to nearest. this is also the first touch of the copy, by the threads that update it
+    size_t chunk = gpt2_param_chunk(model);
+    #pragma omp parallel for schedule(static, chunk)
+    for (size_t i = 0; i < n; i++) {
+        model->params_bf16_memory[i] = float_to_bf16(model->params_memory[i]);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// weight-only quantization (checkpoint versions 6 and 7, see quantize_gpt2.c)
+
+// the index of the parameter tensor param points into, and where that tensor starts
+int gpt2_param_tensor(GPT2 *model, const float* param, size_t* start) {
+    size_t offset = param - model->params_memory;
+    *start = 0;
+    for (int i = 0; i < NUM_PARAMETER_TENSORS; i++) {
+        if (offset < *start + model->param_sizes[i]) { return i; }
+        *start += model->param_sizes[i];
+    }
+    return -1;
+}
+
+// the int8 weight and the scales of the rows from param on, if param points into a tensor
+// that is quantized to int8. returns 0 otherwise, e.g. if the model isn't quantized at all
+int gpt2_int8(GPT2 *model, const float* param, const int8_t** weight, const float** scale) {
+    if (model->params_int8_memory == NULL) { return 0; }
+    size_t start;
+    int i = gpt2_param_tensor(model, param, &start);
+    if (i < 0 || model->int8_scales[i] == NULL) { return 0; }
+    size_t offset = param - model->params_memory;
+    *weight = model->params_int8_memory + offset;
+    *scale = model->int8_scales[i] + (offset - start) / param_row_length(model->config, i);
+    return 1;
+}
+
+// the q4 blocks from param on, if param points into a tensor that is quantized to q4, or NULL
+const q4_block* gpt2_q4(GPT2 *model, const float* param) {
+    if (model->params_q4_memory == NULL) { return NULL; }
+    size_t start;
+    int i = gpt2_param_tensor(model, param, &start);
+    if (i < 0 || !param_is_quantized(i)) { return NULL; }
+    return model->params_q4_memory + (param - model->params_memory) / Q4_GROUP;
+}
+
+// the matmuls of the forward pass, with the weight in whichever format the model holds it
+void gpt2_matmul_forward(GPT2 *model, float* out, float* pre, const float* inp, const float* weight, const float* bias,
+                         int B, int T, int C, int OC, int epilogue, int head_size) {
+    const int8_t* weight_int8;
+    const float* scale;
+    const q4_block* weight_q4 = gpt2_q4(model, weight);
+    if (weight_q4 != NULL) {
+        matmul_forward_quantized(out, pre, inp, NULL, NULL, weight_q4, bias, B, T, C, OC, epilogue, head_size);
+    } else if (gpt2_int8(model, weight, &weight_int8, &scale)) {
+        matmul_forward_quantized(out, pre, inp, weight_int8, scale, NULL, bias, B, T, C, OC, epilogue, head_size);
+    } else {
+        matmul_forward_epilogue(out, pre, inp, weight, gpt2_bf16(model, weight), bias, B, T, C, OC, epilogue, head_size);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// task graph execution of the forward and backward passes
+// Instead of calling each layer over the whole (B,T) batch, one after another, we
+// record every layer call as a number of tiles (tasks) along with the memory
+// they read and write. The task graph derives the real dependencies from that,
+// e.g. the dweight tiles of a matmul_backward don't wait for its dinp tiles, and
+// the layers of one chunk of rows can run ahead of other rows up to attention.
+// The graphs are built once per (B,T) and executed by a work-stealing pool.
+
+#define TG_BYTES(n) ((size_t)(n) * sizeof(float))
+
+typedef struct { float *out; int* inp; float *wte, *wpe; int B, T, C; } EncoderForwardArgs;
+void encoder_forward_task(void* arg) {
+    EncoderForwardArgs* a = (EncoderForwardArgs*)arg;
+    encoder_forward(a->out, a->inp, a->wte, a->wpe, a->B, a->T, a->C);
+}
+typedef struct { float *dwte, *dwpe, *dout; int* inp; int B, T, C; } EncoderBackwardArgs;
+void encoder_backward_task(void* arg) {
+    EncoderBackwardArgs* a = (EncoderBackwardArgs*)arg;
+    encoder_backward(a->dwte, a->dwpe, a->dout, a->inp, a->B, a->T, a->C);
+}
+typedef struct { float *out, *mean, *rstd, *inp, *weight, *bias; int B, T, C; } LayernormForwardArgs;
+void layernorm_forward_task(void* arg) {
+    LayernormForwardArgs* a = (LayernormForwardArgs*)arg;
+    layernorm_forward(a->out, a->mean, a->rstd, a->inp, a->weight, a->bias, a->B, a->T, a->C);
+}
+typedef struct { float *residual, *out, *mean, *rstd, *inp1, *inp2, *weight, *bias; int B, T, C; } ResidualLayernormForwardArgs;
+void residual_layernorm_forward_task(void* arg) {
+    ResidualLayernormForwardArgs* a = (ResidualLayernormForwardArgs*)arg;
+    residual_layernorm_forward(a->residual, a->out, a->mean, a->rstd, a->inp1, a->inp2, a->weight, a->bias, a->B, a->T, a->C);
+}
+typedef struct { float *dinp1, *dinp2, *dresidual, *dweight, *dbias, *dout, *residual, *weight, *mean, *rstd; int B, T, C, accumulate; } ResidualLayernormBackwardArgs;
+void residual_layernorm_backward_task(void* arg) {
+    ResidualLayernormBackwardArgs* a = (ResidualLayernormBackwardArgs*)arg;
+    residual_layernorm_backward(a->dinp1, a->dinp2, a->dresidual, a->dweight, a->dbias, NULL,
+                                a->dout, a->residual, a->weight, a->mean, a->rstd, a->B, a->T, a->C, a->accumulate);
+}
+typedef struct { float *out, *inp, *weight, *bias; int B, T, C, OC; float* pre; int epilogue, head_size; bf16* weight_bf16; } MatmulForwardArgs;
+void matmul_forward_task(void* arg) {
+    MatmulForwardArgs* a = (MatmulForwardArgs*)arg;
+    if (a->weight_bf16 == NULL) {
+        // never matmul_forward_gemv for a whole tile: which tiles are small enough for it
+        // depends on the number of threads, and it sums in a different order
+        matmul_forward_tiled(a->out, a->pre, a->inp, a->weight, a->bias, a->B, a->T, a->C, a->OC, a->epilogue, a->head_size);
+        return;
+    }
+    matmul_forward_epilogue(a->out, a->pre, a->inp, a->weight, a->weight_bf16, a->bias, a->B, a->T, a->C, a->OC, a->epilogue, a->head_size);
+}
+typedef struct { float *dinp, *dout, *weight; int B, T, C, OC, head_size, accumulate; bf16* weight_bf16; } MatmulBackwardInpArgs;
+void matmul_backward_inp_task(void* arg) {
+    MatmulBackwardInpArgs* a = (MatmulBackwardInpArgs*)arg;
+    matmul_backward_inp(a->dinp, a->dout, a->weight, a->weight_bf16, a->B, a->T, a->C, a->OC, a->head_size, a->accumulate);
+}
+typedef struct { float *dweight, *dbias, *dout, *inp; int B, T, C, OC, o_start, o_end, head_size; } MatmulBackwardWeightArgs;
+void matmul_backward_weight_task(void* arg) {
+    MatmulBackwardWeightArgs* a = (MatmulBackwardWeightArgs*)arg;
+    matmul_backward_weight(a->dweight, a->dbias, a->dout, a->inp, a->B, a->T, a->C, a->OC, a->o_start, a->o_end, a->head_size);
+}
+typedef struct { float *out, *preatt, *att, *inp; int B, T, C, NH, head_major; } AttentionForwardArgs;
+void attention_forward_task(void* arg) {
+    AttentionForwardArgs* a = (AttentionForwardArgs*)arg;
+    attention_forward(a->out, a->preatt, a->att, a->inp, a->B, a->T, a->C, a->NH, a->head_major);
+}
+typedef struct { float *dinp, *dpreatt, *datt, *dout, *inp, *att; int B, T, C, NH, head_major, accumulate; } AttentionBackwardArgs;
+void attention_backward_task(void* arg) {
+    AttentionBackwardArgs* a = (AttentionBackwardArgs*)arg;
+    attention_backward(a->dinp, a->dpreatt, a->datt, a->dout, a->inp, a->att, a->B, a->T, a->C, a->NH, a->head_major, a->accumulate);
+}
+typedef struct { float *out, *inp1, *inp2; int N, accumulate; } ElementwiseArgs; // gelu
+void gelu_forward_task(void* arg) { ElementwiseArgs* a = (ElementwiseArgs*)arg; gelu_forward(a->out, a->inp1, a->N); }
+void gelu_backward_task(void* arg) { ElementwiseArgs* a = (ElementwiseArgs*)arg; gelu_backward(a->out, a->inp1, a->inp2, a->N, a->accumulate); }
+typedef struct { float *probs, *logits; int B, T, V, Vp; } SoftmaxForwardArgs;
+void softmax_forward_task(void* arg) {
+    SoftmaxForwardArgs* a = (SoftmaxForwardArgs*)arg;
+    softmax_forward(a->probs, a->logits, a->B, a->T, a->V, a->Vp);
+}
+typedef struct { float *dlogits, *dlosses, *probs; int* targets; int B, T, V, Vp, accumulate; } CrossentropySoftmaxBackwardArgs;
+void crossentropy_softmax_backward_task(void* arg) {
+    CrossentropySoftmaxBackwardArgs* a = (CrossentropySoftmaxBackwardArgs*)arg;
+    crossentropy_softmax_backward(a->dlogits, a->dlosses, a->probs, a->targets, a->B, a->T, a->V, a->Vp, a->accumulate);
+}
+
+// helper to add one task to the graph, along with the ranges it reads and writes
+#define TG_TASK(g, fn, args) Task* task = taskgraph_begin(g, fn, &args, sizeof(args))
+
+int task_graph_tile_rows(GPT2 *model) {
+    // the row (B*T) dimension is cut into tiles of tile_T positions, which never cross
+    // sequences. make enough tiles to feed the pool, but keep them a multiple of 8 so
+    // that matmul_forward stays on its fast path
+    int B = model->batch_size;
+    int T = model->seq_len;
+    int tile_T = T;
+    while (tile_T % 16 == 0 && B * (T / tile_T) < 2 * model->task_pool.num_threads) { tile_T /= 2; }
+    return tile_T;
+}
+
+void gpt2_build_forward_graph(GPT2 *model) {
+    TaskGraph* g = &model->forward_graph;
+    size_t B = model->batch_size;
+    size_t T = model->seq_len;
+    size_t V = model->config.vocab_size;
+    size_t Vp = model->config.padded_vocab_size;
+    size_t L = model->config.num_layers;
+    size_t NH = model->config.num_heads;
+    size_t C = model->config.channels;
+    size_t hs = C / NH;
+    int tile_T = task_graph_tile_rows(model);
+    ParameterTensors params = model->params;
+    ActivationTensors acts = model->acts;
+
+    // the tasks are added in exactly the order of gpt2_forward, tile by tile
+    for (size_t r = 0; r < B*T; r += tile_T) {
+        {
+            EncoderForwardArgs a = {acts.encoded + r*C, model->inputs + r, params.wte, params.wpe + (r%T)*C, 1, tile_T, (int)C};
+            TG_TASK(g, encoder_forward_task, a);
+            taskgraph_reads(task, a.inp, tile_T * sizeof(int));
+            taskgraph_reads(task, params.wte, TG_BYTES(Vp*C));
+            taskgraph_reads(task, a.wpe, TG_BYTES(tile_T*C));
+            taskgraph_writes(task, a.out, TG_BYTES(tile_T*C));
+            taskgraph_commit(g);
+        }
+        {
+            LayernormForwardArgs a = {acts.ln1 + r*C, acts.ln1_mean + r, acts.ln1_rstd + r, acts.encoded + r*C, params.ln1w, params.ln1b, 1, tile_T, (int)C};
+            TG_TASK(g, layernorm_forward_task, a);
+            taskgraph_reads(task, a.inp, TG_BYTES(tile_T*C));
+            taskgraph_reads(task, params.ln1w, TG_BYTES(C));
+            taskgraph_reads(task, params.ln1b, TG_BYTES(C));
+            taskgraph_writes(task, a.out, TG_BYTES(tile_T*C));
+            taskgraph_writes(task, a.mean, TG_BYTES(tile_T));
+            taskgraph_writes(task, a.rstd, TG_BYTES(tile_T));
+            taskgraph_commit(g);
+        }
+    }
+    for (size_t l = 0; l < L; l++) {
+        float* residual = l == 0 ? acts.encoded : acts.residual3 + (l-1) * B * T * C;
+        float* l_qkvw = params.qkvw + l * 3*C * C;
+        float* l_qkvb = params.qkvb + l * 3*C;
+        float* l_attprojw = params.attprojw + l * C * C;
+        float* l_attprojb = params.attprojb + l * C;
+        float* l_ln2w = params.ln2w + l * C;
+        float* l_ln2b = params.ln2b + l * C;
+        float* l_fcw = params.fcw + l * 4*C * C;
+        float* l_fcb = params.fcb + l * 4*C;
+        float* l_fcprojw = params.fcprojw + l * C * 4*C;
+        float* l_fcprojb = params.fcprojb + l * C;
+        float* l_ln1 = acts.ln1 + l * B * T * C;
+        float* l_qkv = acts.qkv + l * B * T * 3*C;
+        float* l_atty = acts.atty + l * B * T * C;
+        float* l_preatt = acts.preatt + l * B * NH * T * T;
+        float* l_att = acts.att + l * B * NH * T * T;
+        float* l_attproj = acts.attproj + l * B * T * C;
+        float* l_residual2 = acts.residual2 + l * B * T * C;
+        float* l_ln2 = acts.ln2 + l * B * T * C;
+        float* l_ln2_mean = acts.ln2_mean + l * B * T;
+        float* l_ln2_rstd = acts.ln2_rstd + l * B * T;
+        float* l_fch = acts.fch + l * B * T * 4*C;
+        float* l_fch_gelu = acts.fch_gelu + (model->recompute ? 0 : l * B * T * 4*C);
+        float* l_fcproj = acts.fcproj + l * B * T * C;
+        float* l_residual3 = acts.residual3 + l * B * T * C;
+        // the layernorm after the residual3 add is the next layer's ln1, or lnf after the last layer
+        float* n_ln = l < L-1 ? acts.ln1 + (l+1) * B * T * C : acts.lnf;
+        float* n_ln_mean = l < L-1 ? acts.ln1_mean + (l+1) * B * T : acts.lnf_mean;
+        float* n_ln_rstd = l < L-1 ? acts.ln1_rstd + (l+1) * B * T : acts.lnf_rstd;
+        float* n_lnw = l < L-1 ? params.ln1w + (l+1) * C : params.lnfw;
+        float* n_lnb = l < L-1 ? params.ln1b + (l+1) * C : params.lnfb;
+
+        // the part of the block up to attention, per tile of rows
+        for (size_t r = 0; !model->qkv_head_major && r < B*T; r += tile_T) {
+            MatmulForwardArgs a = {l_qkv + r*3*C, l_ln1 + r*C, l_qkvw, l_qkvb, 1, tile_T, (int)C, (int)(3*C)};
+            a.weight_bf16 = gpt2_bf16(model, a.weight);
+            TG_TASK(g, matmul_forward_task, a);
+            taskgraph_reads(task, a.inp, TG_BYTES(tile_T*C));
+            taskgraph_reads(task, l_qkvw, TG_BYTES(3*C*C));
+            taskgraph_reads(task, l_qkvb, TG_BYTES(3*C));
+            taskgraph_writes(task, a.out, TG_BYTES(tile_T*3*C));
+            taskgraph_commit(g);
+        }
+        // head-major, a tile of rows would write a strided slice of every head. Instead the
+        // tiles are groups of heads of one sequence, whose output is contiguous, and just as many
+        for (size_t b = 0; model->qkv_head_major && b < B; b++) {
+            size_t heads = 3*NH;
+            size_t tile_heads = (heads + T/tile_T - 1) / (T/tile_T);
+            for (size_t h = 0; h < heads; h += tile_heads) {
+                size_t num_heads = h + tile_heads < heads ? tile_heads : heads - h;
+                MatmulForwardArgs a = {l_qkv + b*T*3*C + h*T*hs, l_ln1 + b*T*C, l_qkvw + h*hs*C, l_qkvb + h*hs,
+                                       1, (int)T, (int)C, (int)(num_heads*hs), NULL, MATMUL_EPILOGUE_NONE, (int)hs};
+                a.weight_bf16 = gpt2_bf16(model, a.weight);
+                TG_TASK(g, matmul_forward_task, a);
+                taskgraph_reads(task, a.inp, TG_BYTES(T*C));
+                taskgraph_reads(task, a.weight, TG_BYTES(num_heads*hs*C));
+                taskgraph_reads(task, a.bias, TG_BYTES(num_heads*hs));
+                taskgraph_writes(task, a.out, TG_BYTES(T*num_heads*hs));
+                taskgraph_commit(g);
+            }
+        }
+        // attention mixes all positions of a sequence, one task per sequence
+        for (size_t b = 0; b < B; b++) {
+            AttentionForwardArgs a = {l_atty + b*T*C, l_preatt + b*NH*T*T, l_att + b*NH*T*T, l_qkv + b*T*3*C, 1, (int)T, (int)C, (int)NH, model->qkv_head_major};
+            TG_TASK(g, attention_forward_task, a);
+            taskgraph_reads(task, a.inp, TG_BYTES(T*3*C));
+            taskgraph_writes(task, a.out, TG_BYTES(T*C));
+            taskgraph_writes(task, a.preatt, TG_BYTES(NH*T*T));
+            taskgraph_writes(task, a.att, TG_BYTES(NH*T*T));
+            taskgraph_commit(g);
+        }
+        // and the rest of the block, again per tile of rows
+        for (size_t r = 0; r < B*T; r += tile_T) {
+            {
+                MatmulForwardArgs a = {l_attproj + r*C, l_atty + r*C, l_attprojw, l_attprojb, 1, tile_T, (int)C, (int)C};
+                a.weight_bf16 = gpt2_bf16(model, a.weight);
+                TG_TASK(g, matmul_forward_task, a);
+                taskgraph_reads(task, a.inp, TG_BYTES(tile_T*C));
+                taskgraph_reads(task, l_attprojw, TG_BYTES(C*C));
+                taskgraph_reads(task, l_attprojb, TG_BYTES(C));
+                taskgraph_writes(task, a.out, TG_BYTES(tile_T*C));
+                taskgraph_commit(g);
+            }
+            {
+                ResidualLayernormForwardArgs a = {l_residual2 + r*C, l_ln2 + r*C, l_ln2_mean + r, l_ln2_rstd + r,
+                                                  residual + r*C, l_attproj + r*C, l_ln2w, l_ln2b, 1, tile_T, (int)C};
+                TG_TASK(g, residual_layernorm_forward_task, a);
+                taskgraph_reads(task, a.inp1, TG_BYTES(tile_T*C));
+                taskgraph_reads(task, a.inp2, TG_BYTES(tile_T*C));
+                taskgraph_reads(task, l_ln2w, TG_BYTES(C));
+                taskgraph_reads(task, l_ln2b, TG_BYTES(C));
+                taskgraph_writes(task, a.residual, TG_BYTES(tile_T*C));
+                taskgraph_writes(task, a.out, TG_BYTES(tile_T*C));
+                taskgraph_writes(task, a.mean, TG_BYTES(tile_T));
+                taskgraph_writes(task, a.rstd, TG_BYTES(tile_T));
+                taskgraph_commit(g);
+            }
+            {
+                MatmulForwardArgs a = {l_fch_gelu + r*4*C, l_ln2 + r*C, l_fcw, l_fcb, 1, tile_T, (int)C, (int)(4*C), l_fch + r*4*C, MATMUL_EPILOGUE_GELU};
+                a.weight_bf16 = gpt2_bf16(model, a.weight);
+                TG_TASK(g, matmul_forward_task, a);
+                taskgraph_reads(task, a.inp, TG_BYTES(tile_T*C));
+                taskgraph_reads(task, l_fcw, TG_BYTES(4*C*C));
+                taskgraph_reads(task, l_fcb, TG_BYTES(4*C));
+                taskgraph_writes(task, a.pre, TG_BYTES(tile_T*4*C));
+                taskgraph_writes(task, a.out, TG_BYTES(tile_T*4*C));
+                taskgraph_commit(g);
+            }
+            {
+                MatmulForwardArgs a = {l_fcproj + r*C, l_fch_gelu + r*4*C, l_fcprojw, l_fcprojb, 1, tile_T, (int)(4*C), (int)C};
+                a.weight_bf16 = gpt2_bf16(model, a.weight);
+                TG_TASK(g, matmul_forward_task, a);
+                taskgraph_reads(task, a.inp, TG_BYTES(tile_T*4*C));
+                taskgraph_reads(task, l_fcprojw, TG_BYTES(C*4*C));
+                taskgraph_reads(task, l_fcprojb, TG_BYTES(C));
+                taskgraph_writes(task, a.out, TG_BYTES(tile_T*C));
+                taskgraph_commit(g);
+            }
+            {
+                ResidualLayernormForwardArgs a = {l_residual3 + r*C, n_ln + r*C, n_ln_mean + r, n_ln_rstd + r,
+                                                  l_residual2 + r*C, l_fcproj + r*C, n_lnw, n_lnb, 1, tile_T, (int)C};
+                TG_TASK(g, residual_layernorm_forward_task, a);
+                taskgraph_reads(task, a.inp1, TG_BYTES(tile_T*C));
+                taskgraph_reads(task, a.inp2, TG_BYTES(tile_T*C));
+                taskgraph_reads(task, n_lnw, TG_BYTES(C));
+                taskgraph_reads(task, n_lnb, TG_BYTES(C));
+                taskgraph_writes(task, a.residual, TG_BYTES(tile_T*C));
+                taskgraph_writes(task, a.out, TG_BYTES(tile_T*C));
+                taskgraph_writes(task, a.mean, TG_BYTES(tile_T));
+                taskgraph_writes(task, a.rstd, TG_BYTES(tile_T));
+                taskgraph_commit(g);
+            }
+        }
+    }
+    for (size_t r = 0; r < B*T; r += tile_T) {
+        {
+            MatmulForwardArgs a = {acts.logits + r*Vp, acts.lnf + r*C, params.wte, NULL, 1, tile_T, (int)C, (int)Vp};
+            a.weight_bf16 = gpt2_bf16(model, a.weight);
+            TG_TASK(g, matmul_forward_task, a);
+            taskgraph_reads(task, a.inp, TG_BYTES(tile_T*C));
+            taskgraph_reads(task, params.wte, TG_BYTES(Vp*C));
+            taskgraph_writes(task, a.out, TG_BYTES(tile_T*Vp));
+            taskgraph_commit(g);
+        }
+        {
+            SoftmaxForwardArgs a = {acts.probs + r*Vp, acts.logits + r*Vp, 1, tile_T, (int)V, (int)Vp};
+            TG_TASK(g, softmax_forward_task, a);
+            taskgraph_reads(task, a.logits, TG_BYTES(tile_T*Vp));
+            taskgraph_writes(task, a.probs, TG_BYTES(tile_T*Vp));
+            taskgraph_commit(g);
+        }
+    }
+}
+
+// adds the tasks of a matmul_backward: dinp per tile of rows, dweight per tile of output channels
+// if dout is head-major (head_size > 0), the rows of a tile are strided over the whole sequence,
+// so the dinp tiles are whole sequences
+void graph_matmul_backward(GPT2 *model, float* dinp, float* dweight, float* dbias,
+                           float* dout, float* inp, float* weight, int C, int OC, int head_size, int accumulate) {
+    TaskGraph* g = &model->backward_graph;
+    int T = model->seq_len;
+    int BT = model->batch_size * T;
+    int tile_T = head_size > 0 ? T : task_graph_tile_rows(model);
+    for (int r = 0; r < BT; r += tile_T) {
+        MatmulBackwardInpArgs a = {dinp + (size_t)r*C, dout + (size_t)r*OC, weight, 1, tile_T, C, OC, head_size, accumulate, gpt2_bf16(model, weight)};
+        TG_TASK(g, matmul_backward_inp_task, a);
+        taskgraph_reads(task, a.dout, TG_BYTES((size_t)tile_T*OC));
+        taskgraph_reads(task, weight, TG_BYTES((size_t)OC*C));
+        taskgraph_writes(task, a.dinp, TG_BYTES((size_t)tile_T*C));
+        taskgraph_commit(g);
+    }
+    int num_tiles = 4 * model->task_pool.num_threads;
+    int tile_OC = (OC + num_tiles - 1) / num_tiles;
+    for (int o = 0; o < OC; o += tile_OC) {
+        int o_end = o + tile_OC < OC ? o + tile_OC : OC;
+        MatmulBackwardWeightArgs a = {dweight, dbias, dout, inp, model->batch_size, T, C, OC, o, o_end, head_size};
+        TG_TASK(g, matmul_backward_weight_task, a);
+        taskgraph_reads(task, dout, TG_BYTES((size_t)BT*OC));
+        taskgraph_reads(task, inp, TG_BYTES((size_t)BT*C));
+        taskgraph_writes(task, dweight + (size_t)o*C, TG_BYTES((size_t)(o_end - o)*C));
+        if (dbias != NULL) { taskgraph_writes(task, dbias + o, TG_BYTES(o_end - o)); }
+        taskgraph_commit(g);
+    }
+}
+
+// adds the tasks of a residual_layernorm_backward (a layernorm_backward if dinp1 and dinp2 are NULL), per tile of rows
+void graph_residual_layernorm_backward(GPT2 *model, float* dinp1, float* dinp2, float* dresidual, float* dweight, float* dbias,
+                                       float* dout, float* residual, float* weight, float* mean, float* rstd, int C, int accumulate) {
+    TaskGraph* g = &model->backward_graph;
+    int BT = model->batch_size * model->seq_len;
+    int tile_T = task_graph_tile_rows(model);
+    for (int r = 0; r < BT; r += tile_T) {
+        size_t rC = (size_t)r*C;
+        ResidualLayernormBackwardArgs a = {dinp1 != NULL ? dinp1 + rC : NULL, dinp2 != NULL ? dinp2 + rC : NULL, dresidual + rC,
+                                           dweight, dbias, dout + rC, residual + rC, weight, mean + r, rstd + r, 1, tile_T, C, accumulate};
+        TG_TASK(g, residual_layernorm_backward_task, a);
+        taskgraph_reads(task, a.dout, TG_BYTES(tile_T*C));
+        taskgraph_reads(task, a.residual, TG_BYTES(tile_T*C));
+        taskgraph_reads(task, weight, TG_BYTES(C));
+        taskgraph_reads(task, a.mean, TG_BYTES(tile_T));
+        taskgraph_reads(task, a.rstd, TG_BYTES(tile_T));
+        taskgraph_writes(task, a.dresidual, TG_BYTES(tile_T*C));
+        if (dinp1 != NULL) {
+            taskgraph_writes(task, a.dinp1, TG_BYTES(tile_T*C));
+            taskgraph_writes(task, a.dinp2, TG_BYTES(tile_T*C));
+        }
+        taskgraph_writes(task, dweight, TG_BYTES(C));
+        taskgraph_writes(task, dbias, TG_BYTES(C));
+        taskgraph_commit(g);
+    }
+}
+
+void gpt2_build_backward_graph(GPT2 *model) {
+    TaskGraph* g = &model->backward_graph;
+    size_t B = model->batch_size;
+    size_t T = model->seq_len;
+    size_t V = model->config.vocab_size;
+    size_t Vp = model->config.padded_vocab_size;
+    size_t L = model->config.num_layers;
+    size_t NH = model->config.num_heads;
+    size_t C = model->config.channels;
+    size_t hs = C / NH;
+    int tile_T = task_graph_tile_rows(model);
+    ParameterTensors params = model->params;
+    ParameterTensors grads = model->grads;
+    ActivationTensors acts = model->acts;
+    ActivationTensors* grads_acts = model->grads_acts;
+    ActivationTensors dtop = grads_acts[L-1];
+
+    // the tasks are added in exactly the order of gpt2_backward
+    for (size_t r = 0; r < B*T; r += tile_T) {
+        CrossentropySoftmaxBackwardArgs a = {dtop.logits + r*Vp, dtop.losses + r, acts.probs + r*Vp, model->targets + r, 1, tile_T, (int)V, (int)Vp, 0};
+        TG_TASK(g, crossentropy_softmax_backward_task, a);
+        taskgraph_reads(task, a.dlosses, TG_BYTES(tile_T));
+        taskgraph_reads(task, a.probs, TG_BYTES(tile_T*Vp));
+        taskgraph_reads(task, a.targets, tile_T * sizeof(int));
+        taskgraph_writes(task, a.dlogits, TG_BYTES(tile_T*Vp));
+        taskgraph_commit(g);
+    }
+    graph_matmul_backward(model, dtop.lnf, grads.wte, NULL, dtop.logits, acts.lnf, params.wte, C, Vp, 0, 0);
+    float* residual = acts.residual3 + (L-1) * B * T * C; // last layer's residual
+    float* dresidual = dtop.residual3; // write to last layer's residual
+    graph_residual_layernorm_backward(model, dtop.residual2, dtop.fcproj, dresidual,
+                                      grads.lnfw, grads.lnfb, dtop.lnf, residual, params.lnfw, acts.lnf_mean, acts.lnf_rstd, C, 0);
+
+    for (int l = L-1; l >= 0; l--) {
+        residual = l == 0 ? acts.encoded : acts.residual3 + (l-1) * B * T * C;
+        dresidual = l == 0 ? grads_acts[0].encoded : grads_acts[l-1].residual3;
+        float* l_ln1w = params.ln1w + l * C;
+        float* l_qkvw = params.qkvw + l * 3*C * C;
+        float* l_attprojw = params.attprojw + l * C * C;
+        float* l_ln2w = params.ln2w + l * C;
+        float* l_fcw = params.fcw + l * 4*C * C;
+        float* l_fcprojw = params.fcprojw + l * C * 4*C;
+        float* dl_ln1w = grads.ln1w + l * C;
+        float* dl_ln1b = grads.ln1b + l * C;
+        float* dl_qkvw = grads.qkvw + l * 3*C * C;
+        float* dl_qkvb = grads.qkvb + l * 3*C;
+        float* dl_attprojw = grads.attprojw + l * C * C;
+        float* dl_attprojb = grads.attprojb + l * C;
+        float* dl_ln2w = grads.ln2w + l * C;
+        float* dl_ln2b = grads.ln2b + l * C;
+        float* dl_fcw = grads.fcw + l * 4*C * C;
+        float* dl_fcb = grads.fcb + l * 4*C;
+        float* dl_fcprojw = grads.fcprojw + l * C * 4*C;
+        float* dl_fcprojb = grads.fcprojb + l * C;
+        float* l_ln1 = acts.ln1 + l * B * T * C;
+        float* l_ln1_mean = acts.ln1_mean + l * B * T;
+        float* l_ln1_rstd = acts.ln1_rstd + l * B * T;
+        float* l_qkv = acts.qkv + l * B * T * 3*C;
+        float* l_atty = acts.atty + l * B * T * C;
+        float* l_att = acts.att + l * B * NH * T * T;
+        float* l_residual2 = acts.residual2 + l * B * T * C;
+        float* l_ln2 = acts.ln2 + l * B * T * C;
+        float* l_ln2_mean = acts.ln2_mean + l * B * T;
+        float* l_ln2_rstd = acts.ln2_rstd + l * B * T;
+        float* l_fch = acts.fch + l * B * T * 4*C;
+        float* l_fch_gelu = acts.fch_gelu + (model->recompute ? 0 : l * B * T * 4*C);
+        float* dl_ln1 = grads_acts[l].ln1;
+        float* dl_qkv = grads_acts[l].qkv;
+        float* dl_atty = grads_acts[l].atty;
+        float* dl_preatt = grads_acts[l].preatt;
+        float* dl_att = grads_acts[l].att;
+        float* dl_attproj = grads_acts[l].attproj;
+        float* dl_residual2 = grads_acts[l].residual2;
+        float* dl_ln2 = grads_acts[l].ln2;
+        float* dl_fch = grads_acts[l].fch;
+        float* dl_fch_gelu = grads_acts[l].fch_gelu;
+        float* dl_fcproj = grads_acts[l].fcproj;
+
+        for (size_t r = 0; model->recompute && r < B*T; r += tile_T) {
+            ElementwiseArgs a = {l_fch_gelu + r*4*C, l_fch + r*4*C, NULL, (int)(tile_T*4*C)};
+            TG_TASK(g, gelu_forward_task, a);
+            taskgraph_reads(task, a.inp1, TG_BYTES(a.N));
+            taskgraph_writes(task, a.out, TG_BYTES(a.N));
+            taskgraph_commit(g);
+        }
+        graph_matmul_backward(model, dl_fch_gelu, dl_fcprojw, dl_fcprojb, dl_fcproj, l_fch_gelu, l_fcprojw, 4*C, C, 0, 0);
+        for (size_t r = 0; r < B*T; r += tile_T) {
+            ElementwiseArgs a = {dl_fch + r*4*C, l_fch + r*4*C, dl_fch_gelu + r*4*C, (int)(tile_T*4*C), 0};
+            TG_TASK(g, gelu_backward_task, a);
+            taskgraph_reads(task, a.inp1, TG_BYTES(a.N));
+            taskgraph_reads(task, a.inp2, TG_BYTES(a.N));
+            taskgraph_writes(task, a.out, TG_BYTES(a.N));
+            taskgraph_commit(g);
+        }
+        graph_matmul_backward(model, dl_ln2, dl_fcw, dl_fcb, dl_fch, l_ln2, l_fcw, C, 4*C, 0, 0);
+        graph_residual_layernorm_backward(model, dresidual, dl_attproj, dl_residual2, dl_ln2w, dl_ln2b, dl_ln2, l_residual2, l_ln2w, l_ln2_mean, l_ln2_rstd, C, 1);
+        graph_matmul_backward(model, dl_atty, dl_attprojw, dl_attprojb, dl_attproj, l_atty, l_attprojw, C, C, 0, 0);
+        for (size_t b = 0; b < B; b++) {
+            AttentionBackwardArgs a = {dl_qkv + b*T*3*C, dl_preatt + b*NH*T*T, dl_att + b*NH*T*T, dl_atty + b*T*C, l_qkv + b*T*3*C, l_att + b*NH*T*T, 1, (int)T, (int)C, (int)NH, model->qkv_head_major, 0};
+            TG_TASK(g, attention_backward_task, a);
+            taskgraph_reads(task, a.dout, TG_BYTES(T*C));
+            taskgraph_reads(task, a.inp, TG_BYTES(T*3*C));
+            taskgraph_reads(task, a.att, TG_BYTES(NH*T*T));
+            taskgraph_writes(task, a.dinp, TG_BYTES(T*3*C));
+            taskgraph_writes(task, a.dpreatt, TG_BYTES(NH*T*T));
+            taskgraph_writes(task, a.datt, TG_BYTES(NH*T*T));
+            taskgraph_commit(g);
+        }
+        graph_matmul_backward(model, dl_ln1, dl_qkvw, dl_qkvb, dl_qkv, l_ln1, l_qkvw, C, 3*C, model->qkv_head_major ? (int)hs : 0, 0);
+        // ln1 together with the previous layer's residual3 add, if there is one
+        float* dprev_residual2 = l > 0 ? grads_acts[l-1].residual2 : NULL;
+        float* dprev_fcproj = l > 0 ? grads_acts[l-1].fcproj : NULL;
+        graph_residual_layernorm_backward(model, dprev_residual2, dprev_fcproj, dresidual, dl_ln1w, dl_ln1b, dl_ln1, residual, l_ln1w, l_ln1_mean, l_ln1_rstd, C, 1);
+    }
+    for (size_t r = 0; r < B*T; r += tile_T) {
+        EncoderBackwardArgs a = {grads.wte, grads.wpe + (r%T)*C, grads_acts[0].encoded + r*C, model->inputs + r, 1, tile_T, (int)C};
+        TG_TASK(g, encoder_backward_task, a);
+        taskgraph_reads(task, a.dout, TG_BYTES(tile_T*C));
+        taskgraph_reads(task, a.inp, tile_T * sizeof(int));
+        taskgraph_writes(task, grads.wte, TG_BYTES(Vp*C));
+        taskgraph_writes(task, a.dwpe, TG_BYTES(tile_T*C));
+        taskgraph_commit(g);
+    }
+}
+
+void gpt2_init_task_pool(GPT2 *model) {
+    if (model->task_pool.num_threads > 0) { return; }
+    #ifdef OMP
+    taskpool_init(&model->task_pool, omp_get_max_threads());
+    #else
+    taskpool_init(&model->task_pool, 1);
+    #endif
+}
+
+void gpt2_encoder_forward(GPT2 *model, float* out, int* inputs, float* wpe, size_t B, size_t T) {
+    // the encoder for the format of wte, with the position embeddings from wpe on
+    size_t C = model->config.channels;
+    float* wte = model->params.wte;
+    const int8_t* wte_int8;
+    const float* wte_scale;
+    const q4_block* wte_q4 = gpt2_q4(model, wte);
+    if (wte_q4 != NULL) {
+        encoder_forward_q4(out, inputs, wte_q4, wpe, B, T, C);
+    } else if (gpt2_int8(model, wte, &wte_int8, &wte_scale)) {
+        encoder_forward_int8(out, inputs, wte_int8, wte_scale, wpe, B, T, C);
+    } else {
+        encoder_forward(out, inputs, wte, wpe, B, T, C);
+    }
+}
+
+void gpt2_forward_layers(GPT2 *model, ActivationTensors acts, int* inputs, int* targets, size_t B, size_t T, int no_grad,
+                         const KVBatch* batch) {
+    // the forward pass, layer by layer, into acts. if no_grad, acts only has room for a
+    // single layer, which every layer overwrites in turn (see gpt2_forward_no_grad)
+    // with KV caches (B = 1, no_grad, see gpt2_forward_batch) the T rows are new positions
+    // of a batch of sequences, which attend to those in their caches too, and the pass
+    // stops at the logits
+    size_t V = model->config.vocab_size;
+    size_t Vp = model->config.padded_vocab_size;
+    size_t L = model->config.num_layers;
+    size_t NH = model->config.num_heads;
+    size_t C = model->config.channels;
+    int qkv_hs = model->qkv_head_major && batch == NULL ? (int)(C / NH) : 0; // see matmul_out_index
+    ParameterTensors params = model->params; // for brevity
+
+    // one parallel region for the whole forward pass, every thread executes the
+    // same sequence of layer calls below and shares their work (see note on threading)
+    #pragma omp parallel
+    {
+        float* residual;
+        // encoding goes into residual[0]
+        if (batch == NULL) {
+            gpt2_encoder_forward(model, acts.encoded, inputs, params.wpe, B, T);
+        } else {
+            // the rows of each sequence from its own position on
+            for (int s = 0, t = 0; s < batch->num_seqs; t += batch->counts[s], s++) {
+                gpt2_encoder_forward(model, acts.encoded + t * C, inputs + t, params.wpe + (size_t)batch->row_pos[t] * C, 1, batch->counts[s]);
+            }
+        }
+        // the first layer's ln1. The later layernorms are fused with the residual add before them
+        layernorm_forward(acts.ln1, acts.ln1_mean, acts.ln1_rstd, acts.encoded, params.ln1w, params.ln1b, B, T, C);
+        for (int l = 0; l < L; l++) {
+
+            residual = l == 0 ? acts.encoded : acts.residual3 + (no_grad ? 0 : (l-1) * B * T * C);
+            // where this layer's activations go, the only slot if no_grad
+            size_t la = no_grad ? 0 : l;
+
+            // get the pointers of the weights for this layer
+            float* l_qkvw = params.qkvw + l * 3*C * C;
+            float* l_qkvb = params.qkvb + l * 3*C;
+            float* l_attprojw = params.attprojw + l * C * C;
+            float* l_attprojb = params.attprojb + l * C;
+            float* l_ln2w = params.ln2w + l * C;
+            float* l_ln2b = params.ln2b + l * C;
+            float* l_fcw = params.fcw + l * 4*C * C;
+            float* l_fcb = params.fcb + l * 4*C;
+            float* l_fcprojw = params.fcprojw + l * C * 4*C;
+            float* l_fcprojb = params.fcprojb + l * C;
+
+            // get the pointers of the activations for this layer
+            float* l_ln1 = acts.ln1 + la * B * T * C;
+            float* l_qkv = acts.qkv + la * B * T * 3*C;
+            float* l_atty = acts.atty + la * B * T * C;
+            float* l_preatt = acts.preatt + la * B * NH * T * T;
+            float* l_att = acts.att + la * B * NH * T * T;
+            float* l_attproj = acts.attproj + la * B * T * C;
+            float* l_residual2 = acts.residual2 + la * B * T * C;
+            float* l_ln2 = acts.ln2 + la * B * T * C;
+            float* l_ln2_mean = acts.ln2_mean + la * B * T;
+            float* l_ln2_rstd = acts.ln2_rstd + la * B * T;
+            float* l_fch = no_grad ? NULL : acts.fch + l * B * T * 4*C; // only gelu_backward needs it
+            float* l_fch_gelu = acts.fch_gelu + (model->recompute ? 0 : la * B * T * 4*C);
+            float* l_fcproj = acts.fcproj + la * B * T * C;
+            float* l_residual3 = acts.residual3 + la * B * T * C;
+
+            // now do the forward pass
+            gpt2_matmul_forward(model, l_qkv, NULL, l_ln1, l_qkvw, l_qkvb, B, T, C, 3*C, MATMUL_EPILOGUE_NONE, qkv_hs);
+            if (batch != NULL) {
+                attention_forward_cached(l_atty, l_att, l_qkv, batch, l, T, C, NH, model->config.max_seq_len);
+            } else {
+                attention_forward(l_atty, l_preatt, l_att, l_qkv, B, T, C, NH, model->qkv_head_major);
+            }
+            gpt2_matmul_forward(model, l_attproj, NULL, l_atty, l_attprojw, l_attprojb, B, T, C, C, MATMUL_EPILOGUE_NONE, 0);
+            residual_layernorm_forward(l_residual2, l_ln2, l_ln2_mean, l_ln2_rstd, residual, l_attproj, l_ln2w, l_ln2b, B, T, C);
+            gpt2_matmul_forward(model, l_fch_gelu, l_fch, l_ln2, l_fcw, l_fcb, B, T, C, 4*C, MATMUL_EPILOGUE_GELU, 0);
+            gpt2_matmul_forward(model, l_fcproj, NULL, l_fch_gelu, l_fcprojw, l_fcprojb, B, T, 4*C, C, MATMUL_EPILOGUE_NONE, 0);
+            // the layernorm after the residual is the next layer's ln1, or lnf after the last layer
+            if (l < L-1) {
+                size_t n = l + 1;
+                size_t na = no_grad ? 0 : n;
+                residual_layernorm_forward(l_residual3, acts.ln1 + na * B * T * C, acts.ln1_mean + na * B * T, acts.ln1_rstd + na * B * T,
+                                           l_residual2, l_fcproj, params.ln1w + n * C, params.ln1b + n * C, B, T, C);
+            } else {
+                residual_layernorm_forward(l_residual3, acts.lnf, acts.lnf_mean, acts.lnf_rstd,
+                                           l_residual2, l_fcproj, params.lnfw, params.lnfb, B, T, C);
+            }
+        }
+        gpt2_matmul_forward(model, acts.logits, NULL, acts.lnf, params.wte, NULL, B, T, C, Vp, MATMUL_EPILOGUE_NONE, 0);
+        // decoding with KV caches samples from the logits, no need for the probs
+        if (batch == NULL) {
+            softmax_forward(acts.probs, acts.logits, B, T, V, Vp);
+        }
+        // also forward the cross-entropy loss function if we have the targets
+        if (targets != NULL) {
+            crossentropy_forward(acts.losses, acts.probs, targets, B, T, Vp);
+        }
+    }
 }
 
 void gpt2_forward(GPT2 *model, int* inputs, int* targets, size_t B, size_t T) {
@@ -774,8 +2471,6 @@ void gpt2_forward(GPT2 *model, int* inputs, int* targets, size_t B, size_t T) {
     // convenience parameters (size_t to help prevent int overflow)
     size_t V = model->config.vocab_size;
     size_t Vp = model->config.padded_vocab_size;
-    size_t L = model->config.num_layers;
-    size_t NH = model->config.num_heads;
     size_t C = model->config.channels;
 
     // validate inputs, all indices must be in the range [0, V)
@@ -792,17 +2487,20 @@ void gpt2_forward(GPT2 *model, int* inputs, int* targets, size_t B, size_t T) {
         model->batch_size = B;
         model->seq_len = T;
         // and now allocate the space
-        fill_in_activation_sizes(model->act_sizes, model->config, B, T);
+        fill_in_activation_sizes(model->act_sizes, model->config, B, T, model->recompute);
         size_t num_activations = 0;
         for (size_t i = 0; i < NUM_ACTIVATION_TENSORS; i++) {
             num_activations += model->act_sizes[i];
         }
         printf("num_activations: %zu\n", num_activations);
         model->num_activations = num_activations;
-        model->acts_memory = malloc_and_point_activations(&model->acts, model->act_sizes);
+        model->acts_memory = malloc_and_point_activations(&model->acts, model->act_sizes, &model->arena);
         // also create memory for caching inputs and targets
-        model->inputs = (int*)mallocCheck(B * T * sizeof(int));
-        model->targets = (int*)mallocCheck(B * T * sizeof(int)); // might be unused if we never have targets but it's small
+        model->inputs = (int*)arena_alloc(&model->arena, B * T * sizeof(int));
+        model->targets = (int*)arena_alloc(&model->arena, B * T * sizeof(int)); // might be unused if we never have targets but it's small
+        // and the partials of the deterministic reductions, the largest are the layernorm ones
+        size_t num_row_blocks = (B * T + REDUCE_BLOCK_ROWS - 1) / REDUCE_BLOCK_ROWS;
+        model->scratch = (float*)arena_alloc(&model->arena, num_row_blocks * 2 * C * sizeof(float));
     } else {
         // validate B,T is consistent with how we've allocated the memory before
         // in principle we could get more clever here in the future, for now this is safest
@@ -812,6 +2510,9 @@ void gpt2_forward(GPT2 *model, int* inputs, int* targets, size_t B, size_t T) {
         }
     }
 
+    // the bf16 copy of the weights, the first time if use_bf16
+    gpt2_init_bf16(model);
+
     // cache the inputs/targets
     memcpy(model->inputs, inputs, B * T * sizeof(int));
     if (targets != NULL) {
@@ -819,69 +2520,29 @@ void gpt2_forward(GPT2 *model, int* inputs, int* targets, size_t B, size_t T) {
     }
 
     // forward pass
-    ParameterTensors params = model->params; // for brevity
     ActivationTensors acts = model->acts;
-    float* residual;
-    encoder_forward(acts.encoded, inputs, params.wte, params.wpe, B, T, C); // encoding goes into residual[0]
-    for (int l = 0; l < L; l++) {
-
-        residual = l == 0 ? acts.encoded : acts.residual3 + (l-1) * B * T * C;
-
-        // get the pointers of the weights for this layer
-        float* l_ln1w = params.ln1w + l * C;
-        float* l_ln1b = params.ln1b + l * C;
-        float* l_qkvw = params.qkvw + l * 3*C * C;
-        float* l_qkvb = params.qkvb + l * 3*C;
-        float* l_attprojw = params.attprojw + l * C * C;
-        float* l_attprojb = params.attprojb + l * C;
-        float* l_ln2w = params.ln2w + l * C;
-        float* l_ln2b = params.ln2b + l * C;
-        float* l_fcw = params.fcw + l * 4*C * C;
-        float* l_fcb = params.fcb + l * 4*C;
-        float* l_fcprojw = params.fcprojw + l * C * 4*C;
-        float* l_fcprojb = params.fcprojb + l * C;
-
-        // get the pointers of the activations for this layer
-        float* l_ln1 = acts.ln1 + l * B * T * C;
-        float* l_ln1_mean = acts.ln1_mean + l * B * T;
-        float* l_ln1_rstd = acts.ln1_rstd + l * B * T;
-        float* l_qkv = acts.qkv + l * B * T * 3*C;
-        float* l_atty = acts.atty + l * B * T * C;
-        float* l_preatt = acts.preatt + l * B * NH * T * T;
-        float* l_att = acts.att + l * B * NH * T * T;
-        float* l_attproj = acts.attproj + l * B * T * C;
-        float* l_residual2 = acts.residual2 + l * B * T * C;
-        float* l_ln2 = acts.ln2 + l * B * T * C;
-        float* l_ln2_mean = acts.ln2_mean + l * B * T;
-        float* l_ln2_rstd = acts.ln2_rstd + l * B * T;
-        float* l_fch = acts.fch + l * B * T * 4*C;
-        float* l_fch_gelu = acts.fch_gelu + l * B * T * 4*C;
-        float* l_fcproj = acts.fcproj + l * B * T * C;
-        float* l_residual3 = acts.residual3 + l * B * T * C;
+    if (model->use_task_graph) {
+        if (gpt2_is_quantized(model)) {
+            printf("Error: a quantized model runs layer by layer, without use_task_graph\n");
+            exit(EXIT_FAILURE);
+        }
+        if (model->forward_graph.num_tasks == 0) {
+            gpt2_init_task_pool(model);
+            gpt2_build_forward_graph(model);
+            printf("forward task graph: %d tasks, %zu edges\n", model->forward_graph.num_tasks, model->forward_graph.num_edges);
+        }
+        taskgraph_run(&model->forward_graph, &model->task_pool);
+        if (targets != NULL) {
+            crossentropy_forward(acts.losses, acts.probs, model->targets, B, T, Vp);
+        }
+    } else {
+        gpt2_forward_layers(model, acts, inputs, targets, B, T, 0, NULL);
+    }
 
-        // now do the forward pass
-        layernorm_forward(l_ln1, l_ln1_mean, l_ln1_rstd, residual, l_ln1w, l_ln1b, B, T, C);
-        matmul_forward(l_qkv, l_ln1, l_qkvw, l_qkvb, B, T, C, 3*C);
-        attention_forward(l_atty, l_preatt, l_att, l_qkv, B, T, C, NH);
-        matmul_forward(l_attproj, l_atty, l_attprojw, l_attprojb, B, T, C, C);
-        residual_forward(l_residual2, residual, l_attproj, B*T*C);
-        layernorm_forward(l_ln2, l_ln2_mean, l_ln2_rstd, l_residual2, l_ln2w, l_ln2b, B, T, C);
-        matmul_forward(l_fch, l_ln2, l_fcw, l_fcb, B, T, C, 4*C);
-        gelu_forward(l_fch_gelu, l_fch, B*T*4*C);
-        matmul_forward(l_fcproj, l_fch_gelu, l_fcprojw, l_fcprojb, B, T, 4*C, C);
-        residual_forward(l_residual3, l_residual2, l_fcproj, B*T*C);
-    }
-    residual = acts.residual3 + (L-1) * B * T * C; // last residual is in residual3
-    layernorm_forward(acts.lnf, acts.lnf_mean, acts.lnf_rstd, residual, params.lnfw, params.lnfb, B, T, C);
-    matmul_forward(acts.logits, acts.lnf, params.wte, NULL, B, T, C, Vp);
-    softmax_forward(acts.probs, acts.logits, B, T, V, Vp);
-
-    // also forward the cross-entropy loss function if we have the targets
     if (targets != NULL) {
-        crossentropy_forward(model->acts.losses, model->acts.probs, targets, B, T, Vp);
-        // for convenience also evaluate the mean loss
-        float mean_loss = 0.0f;
-        for (int i=0; i<B*T; i++) { mean_loss += model->acts.losses[i]; }
+        // for convenience also evaluate the mean loss. B*T is small, so this runs on the
+        // calling thread, with the same blocked order as inside a parallel region
+        float mean_loss = reduce_sum(model->acts.losses, B*T, model->scratch);
         mean_loss /= B*T;
         model->mean_loss = mean_loss;
     } else {
@@ -890,13 +2551,243 @@ void gpt2_forward(GPT2 *model, int* inputs, int* targets, size_t B, size_t T) {
     }
 }
 
+float gpt2_forward_no_grad(GPT2 *model, int* inputs, int* targets, size_t B, size_t T) {
+    // the forward pass for evaluation and sampling, when no backward pass will follow.
+    // backward needs the activations of every layer, but the forward pass itself only ever
+    // reads those of the layer before, so here all the layers go through the same single
+    // layer of buffers, and the activation memory doesn't grow with the number of layers.
+    // it has its own buffers (acts_no_grad, where e.g. the probs end up) and doesn't touch
+    // the inputs, targets or mean_loss that gpt2_backward uses, so it can run in between.
+    // targets are optional and could be NULL. returns the mean loss, or -1 without targets
+    if (model->params_memory == NULL) {
+        printf("Error: model was not initialized properly.\n");
+        exit(1);
+    }
+    size_t V = model->config.vocab_size;
+    for(int i = 0; i < B * T; i++) {
+        assert(0 <= inputs[i] && inputs[i] < V);
+        if (targets != NULL) {
+            assert(0 <= targets[i] && targets[i] < V);
+        }
+    }
+
+    // lazily allocate a single layer of activations, for this B,T
+    if (model->acts_no_grad_memory == NULL) {
+        model->no_grad_batch_size = B;
+        model->no_grad_seq_len = T;
+        GPT2Config one_layer = model->config;
+        one_layer.num_layers = 1;
+        size_t act_sizes[NUM_ACTIVATION_TENSORS];
+        fill_in_activation_sizes(act_sizes, one_layer, B, T, 0);
+        act_sizes[13] = 0; // fch, the pre-activation of the gelu, is only for gelu_backward
+        size_t num_activations = 0;
+        for (size_t i = 0; i < NUM_ACTIVATION_TENSORS; i++) {
+            num_activations += act_sizes[i];
+        }
+        printf("num_activations (no_grad): %zu\n", num_activations);
+        model->acts_no_grad_memory = malloc_and_point_activations(&model->acts_no_grad, act_sizes, &model->arena);
+        model->scratch_no_grad = (float*)arena_alloc(&model->arena, (B * T + REDUCE_BLOCK - 1) / REDUCE_BLOCK * sizeof(float));
+    } else if (B != model->no_grad_batch_size || T != model->no_grad_seq_len) {
+        printf("Model (no_grad): B=%d T=%d, Desired: B=%d T=%d\n", model->no_grad_batch_size, model->no_grad_seq_len, (int)B, (int)T);
+        exit(EXIT_FAILURE);
+    }
+
+    gpt2_init_bf16(model);
+    // always layer by layer: the task graph lets the layers of different rows overlap,
+    // which needs every layer's buffers
+    gpt2_forward_layers(model, model->acts_no_grad, inputs, targets, B, T, 1, NULL);
+    if (targets == NULL) { return -1.0f; }
+    return reduce_sum(model->acts_no_grad.losses, B*T, model->scratch_no_grad) / (B*T);
+}
+
+void gpt2_reserve_cache(GPT2 *model, KVCache* cache, int n) {
+    // checks that the KV cache fits the model and has room for n more positions, and
+    // reserves the blocks of its pool for them
+    size_t C = model->config.channels;
+    int NH = model->config.num_heads;
+    const KVPool* pool = cache->pool;
+    if (pool->num_layers != model->config.num_layers || pool->num_heads != NH || pool->head_size != C / NH ||
+        cache->max_seq_len > model->config.max_seq_len) {
+        printf("Error: the KV cache doesn't match the model\n");
+        exit(EXIT_FAILURE);
+    }
+    if (n < 1 || cache->pos + n > cache->max_seq_len) {
+        printf("Error: %d tokens after %d cached positions, the cache holds %d\n", n, cache->pos, cache->max_seq_len);
+        exit(EXIT_FAILURE);
+    }
+    if (!kvcache_reserve(cache, n)) {
+        printf("Error: %d tokens after %d cached positions, the KV pool has %d of %d blocks free\n",
+               n, cache->pos, pool->num_free, pool->num_blocks);
+        exit(EXIT_FAILURE);
+    }
+}
+
+float* gpt2_forward_batch(GPT2 *model, KVCache** caches, int* tokens, const int* counts, int num_seqs) {
+    // decoding with KV caches (see llmc/kvcache.h), for a batch of sequences in a single
+    // forward pass, e.g. one new token each of those being decoded, and chunks of prompts:
+    // tokens holds counts[s] tokens of sequence s, after those of sequence s - 1, at most
+    // GPT2_CACHED_ROWS in all. they go at positions caches[s]->pos and on, where they attend
+    // to the cached positions before them, and their keys and values are appended to the
+    // caches, taking blocks off their pools as needed (see kvcache_reserve to check there
+    // are enough). returns the logits of all the rows, in the same order, (rows, Vp), which
+    // stay valid until the next call
+    if (model->params_memory == NULL) {
+        printf("Error: model was not initialized properly.\n");
+        exit(1);
+    }
+    size_t V = model->config.vocab_size;
+    int NH = model->config.num_heads;
+    KVBatch batch;
+    batch.num_seqs = num_seqs;
+    batch.caches = caches;
+    batch.counts = counts;
+    int T = 0;
+    for (int s = 0; s < num_seqs; s++) {
+        if (T + counts[s] > GPT2_CACHED_ROWS) {
+            printf("Error: more than %d tokens in a batch\n", GPT2_CACHED_ROWS);
+            exit(EXIT_FAILURE);
+        }
+        gpt2_reserve_cache(model, caches[s], counts[s]);
+        for (int i = 0; i < counts[s]; i++, T++) {
+            assert(0 <= tokens[T] && tokens[T] < V);
+            batch.row_seq[T] = s;
+            batch.row_pos[T] = caches[s]->pos + i;
+        }
+    }
+    if (T == 0) {
+        printf("Error: an empty batch\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // lazily allocate a single layer of activations for GPT2_CACHED_ROWS positions. the
+    // attention scores only need a row of max_seq_len per position and head
+    if (model->acts_cached_memory == NULL) {
+        GPT2Config one_layer = model->config;
+        one_layer.num_layers = 1;
+        size_t act_sizes[NUM_ACTIVATION_TENSORS];
+        fill_in_activation_sizes(act_sizes, one_layer, 1, GPT2_CACHED_ROWS, 0);
+        act_sizes[6] = 0; // preatt
+        act_sizes[7] = (size_t)NH * GPT2_CACHED_ROWS * model->config.max_seq_len; // att
+        act_sizes[13] = 0; // fch
+        act_sizes[21] = 0; // probs
+        act_sizes[22] = 0; // losses
+        model->acts_cached_memory = malloc_and_point_activations(&model->acts_cached, act_sizes, &model->arena);
+    }
+
+    gpt2_init_bf16(model);
+    gpt2_forward_layers(model, model->acts_cached, tokens, NULL, 1, T, 1, &batch);
+    for (int s = 0; s < num_seqs; s++) {
+        caches[s]->pos += counts[s];
+    }
+    return model->acts_cached.logits;
+}
+
+float* gpt2_forward_cached(GPT2 *model, KVCache* cache, int* tokens, int n) {
+    // decoding with a KV cache, for one sequence (see gpt2_forward_batch): runs the model
+    // over tokens[0..n) at positions cache->pos to cache->pos + n - 1. more than
+    // GPT2_CACHED_ROWS tokens (e.g. a prompt) go through in chunks, the last one full.
+    // returns the logits of the last min(n, GPT2_CACHED_ROWS) positions, (rows, Vp), which
+    // stay valid until the next call
+    gpt2_reserve_cache(model, cache, n);
+    float* logits = NULL;
+    // the first chunk takes the remainder, so that the last one has min(n, GPT2_CACHED_ROWS) rows
+    int rows = (n - 1) % GPT2_CACHED_ROWS + 1;
+    for (int done = 0; done < n; done += rows, rows = GPT2_CACHED_ROWS) {
+        logits = gpt2_forward_batch(model, &cache, tokens + done, &rows, 1);
+    }
+    return logits;
+}
+
 void gpt2_zero_grad(GPT2 *model) {
+    // the gradients of the weights are accumulated into by backward. the gradients of the
+    // activations need no zeroing: the first kernel to produce each of them in gpt2_backward
+    // writes it instead of adding to it, and the residual stream gradients, the only ones
+    // accumulated into, are written by the residual add of the layer above before that
     if(model->grads_memory != NULL) { memset(model->grads_memory, 0, model->num_parameters * sizeof(float)); }
-    if(model->grads_acts_memory != NULL) { memset(model->grads_acts_memory, 0, model->num_activations * sizeof(float)); }
+}
+
+// the position of a field of ActivationTensors, which is NUM_ACTIVATION_TENSORS float pointers
+// in the order of act_sizes (see fill_in_activation_sizes)
+#define ACT_INDEX(field) (offsetof(ActivationTensors, field) / sizeof(float*))
+// ln1 ... residual3 have one (B, T, ...) tensor per layer, the others are outside of the layers
+int act_is_per_layer(int i) { return i >= ACT_INDEX(ln1) && i <= ACT_INDEX(residual3); }
+
+void gpt2_plan_grads_acts(GPT2 *model) {
+    // backward only ever needs the activation gradients of the layer it is working on, plus
+    // the gradient of the residual stream that flows between layers. so instead of laying
+    // them out like the activations, with all L layers side by side, we plan one buffer in
+    // which every (tensor, layer) lives from the kernel call that first writes it to the
+    // one that last reads it, and tensors that are never alive at the same time share memory.
+    // the schedule below must list the same kernel calls, in the same order, as gpt2_backward
+    size_t B = model->batch_size;
+    size_t T = model->seq_len;
+    int L = model->config.num_layers;
+    size_t act_sizes[NUM_ACTIVATION_TENSORS];
+    fill_in_activation_sizes(act_sizes, model->config, B, T, 0);
+
+    // tensor i of layer l is plan[i * L + l], the tensors outside of the layers use l = 0
+    int n = NUM_ACTIVATION_TENSORS * L;
+    MemPlanTensor* plan = (MemPlanTensor*)mallocCheck(n * sizeof(MemPlanTensor));
+    memplan_init(plan, n);
+    size_t unplanned = 0;
+    for (int i = 0; i < NUM_ACTIVATION_TENSORS; i++) {
+        for (int l = 0; l < L; l++) { plan[i * L + l].size = act_is_per_layer(i) ? act_sizes[i] / L : act_sizes[i]; }
+        unplanned += act_sizes[i];
+    }
+    int step = 0;
+    #define PLAN_USE(field, l) memplan_use(&plan[ACT_INDEX(field) * L + (l)], step)
+    PLAN_USE(losses, 0); step++; // dlosses = 1/(B*T)
+    PLAN_USE(losses, 0); PLAN_USE(logits, 0); step++; // crossentropy_softmax_backward
+    PLAN_USE(logits, 0); PLAN_USE(lnf, 0); step++; // matmul_backward
+    PLAN_USE(lnf, 0); PLAN_USE(residual3, L-1); PLAN_USE(residual2, L-1); PLAN_USE(fcproj, L-1); step++; // residual_layernorm_backward
+    for (int l = L-1; l >= 0; l--) {
+        PLAN_USE(fcproj, l); PLAN_USE(fch_gelu, l); step++; // matmul_backward
+        PLAN_USE(fch_gelu, l); PLAN_USE(fch, l); step++; // gelu_backward
+        PLAN_USE(fch, l); PLAN_USE(ln2, l); step++; // matmul_backward
+        // residual_layernorm_backward
+        PLAN_USE(ln2, l); PLAN_USE(residual2, l); PLAN_USE(attproj, l);
+        if (l > 0) { PLAN_USE(residual3, l-1); } else { PLAN_USE(encoded, 0); }
+        step++;
+        PLAN_USE(attproj, l); PLAN_USE(atty, l); step++; // matmul_backward
+        PLAN_USE(atty, l); PLAN_USE(qkv, l); PLAN_USE(preatt, l); PLAN_USE(att, l); step++; // attention_backward
+        PLAN_USE(qkv, l); PLAN_USE(ln1, l); step++; // matmul_backward
+        // residual_layernorm_backward, or layernorm_backward into the encoding for l = 0
+        PLAN_USE(ln1, l);
+        if (l > 0) { PLAN_USE(residual3, l-1); PLAN_USE(residual2, l-1); PLAN_USE(fcproj, l-1); } else { PLAN_USE(encoded, 0); }
+        step++;
+    }
+    PLAN_USE(encoded, 0); step++; // encoder_backward
+    #undef PLAN_USE
+
+    // 16 floats, so that every tensor starts on a cache line
+    size_t planned = memplan_assign(plan, n, 16);
+    size_t peak = memplan_peak(plan, n, 16);
+    model->grads_acts_memory = (float*)arena_alloc(&model->arena, planned * sizeof(float));
+    arena_first_touch(model->grads_acts_memory, planned * sizeof(float));
+    model->grads_acts = (ActivationTensors*)arena_alloc(&model->arena, L * sizeof(ActivationTensors));
+    for (int l = 0; l < L; l++) {
+        float** ptrs = (float**)&model->grads_acts[l];
+        for (int i = 0; i < NUM_ACTIVATION_TENSORS; i++) {
+            // the tensors outside of the layers are the same for every l, and e.g. the
+            // gradients of the layernorm statistics are never used and left NULL
+            MemPlanTensor* t = &plan[i * L + (act_is_per_layer(i) ? l : 0)];
+            ptrs[i] = memplan_is_used(t) ? model->grads_acts_memory + t->offset : NULL;
+        }
+    }
+    printf("grads_acts: %.1f MB planned into %.1f MB (saved %.1f MB, live peak %.1f MB)\n",
+           unplanned * sizeof(float) / 1e6, planned * sizeof(float) / 1e6,
+           (unplanned - planned) * sizeof(float) / 1e6, peak * sizeof(float) / 1e6);
+    free(plan);
 }
 
 void gpt2_backward(GPT2 *model) {
 
+    // a quantized checkpoint has no fp32 weights to train, and a mapped one has them
+    // read-only (see gpt2_map_checkpoint), gpt2_update could not write them
+    if (gpt2_is_quantized(model) || model->params_map != NULL) {
+        printf("Error: a quantized or mapped model is for inference only\n");
+        exit(EXIT_FAILURE);
+    }
     // double check we forwarded previously, with targets
     if (model->mean_loss == -1.0f) {
         printf("Error: must forward with targets before backward\n");
@@ -905,8 +2796,8 @@ void gpt2_backward(GPT2 *model) {
 
     // lazily allocate the memory for gradients of the weights and activations, if needed
     if (model->grads_memory == NULL) {
-        model->grads_memory = malloc_and_point_parameters(&model->grads, model->param_sizes);
-        model->grads_acts_memory = malloc_and_point_activations(&model->grads_acts, model->act_sizes);
+        model->grads_memory = malloc_and_point_parameters(&model->grads, model->param_sizes, &model->arena);
+        gpt2_plan_grads_acts(model);
         gpt2_zero_grad(model);
     }
 
@@ -918,90 +2809,120 @@ void gpt2_backward(GPT2 *model) {
     size_t L = model->config.num_layers;
     size_t NH = model->config.num_heads;
     size_t C = model->config.channels;
+    int qkv_hs = model->qkv_head_major ? (int)(C / NH) : 0; // see matmul_out_index
 
     // backward pass: go in the reverse order of the forward pass, and call backward() functions
     ParameterTensors params = model->params; // for brevity
     ParameterTensors grads = model->grads;
     ActivationTensors acts = model->acts;
-    ActivationTensors grads_acts = model->grads_acts;
-
-    // we kick off the chain rule by filling in dlosses with 1.0f/(B*T)
-    // technically this is a small, inline backward() pass of calculating
-    // total, final loss as the mean over all losses over all (B,T) positions in the batch
-    float dloss_mean = 1.0f / (B*T);
-    for (int i = 0; i < B*T; i++) { grads_acts.losses[i] = dloss_mean; }
-
-    crossentropy_softmax_backward(grads_acts.logits, grads_acts.losses, acts.probs, model->targets, B, T, V, Vp);
-    matmul_backward(grads_acts.lnf, grads.wte, NULL, grads_acts.logits, acts.lnf, params.wte, B, T, C, Vp);
-    float* residual = acts.residual3 + (L-1) * B * T * C; // last layer's residual
-    float* dresidual = grads_acts.residual3 + (L-1) * B * T * C; // write to last layer's residual
-    layernorm_backward(dresidual, grads.lnfw, grads.lnfb, grads_acts.lnf, residual, params.lnfw, acts.lnf_mean, acts.lnf_rstd, B, T, C);
-
-    for (int l = L-1; l >= 0; l--) {
+    ActivationTensors* grads_acts = model->grads_acts; // grads_acts[l] for layer l
 
-        residual = l == 0 ? acts.encoded : acts.residual3 + (l-1) * B * T * C;
-        dresidual = l == 0 ? grads_acts.encoded : grads_acts.residual3 + (l-1) * B * T * C;
+    if (model->use_task_graph) {
+        if (model->backward_graph.num_tasks == 0) {
+            gpt2_init_task_pool(model);
+            gpt2_build_backward_graph(model);
+            printf("backward task graph: %d tasks, %zu edges\n", model->backward_graph.num_tasks, model->backward_graph.num_edges);
+        }
+        float dloss_mean = 1.0f / (B*T);
+        for (int i = 0; i < B*T; i++) { grads_acts[0].losses[i] = dloss_mean; }
+        taskgraph_run(&model->backward_graph, &model->task_pool);
+        return;
+    }
 
-        // get the pointers of the weights for this layer
-        float* l_ln1w = params.ln1w + l * C;
-        float* l_qkvw = params.qkvw + l * 3*C * C;
-        float* l_attprojw = params.attprojw + l * C * C;
-        float* l_ln2w = params.ln2w + l * C;
-        float* l_fcw = params.fcw + l * 4*C * C;
-        float* l_fcprojw = params.fcprojw + l * C * 4*C;
-        // get the pointers of the gradients of the weights for this layer
-        float* dl_ln1w = grads.ln1w + l * C;
-        float* dl_ln1b = grads.ln1b + l * C;
-        float* dl_qkvw = grads.qkvw + l * 3*C * C;
-        float* dl_qkvb = grads.qkvb + l * 3*C;
-        float* dl_attprojw = grads.attprojw + l * C * C;
-        float* dl_attprojb = grads.attprojb + l * C;
-        float* dl_ln2w = grads.ln2w + l * C;
-        float* dl_ln2b = grads.ln2b + l * C;
-        float* dl_fcw = grads.fcw + l * 4*C * C;
-        float* dl_fcb = grads.fcb + l * 4*C;
-        float* dl_fcprojw = grads.fcprojw + l * C * 4*C;
-        float* dl_fcprojb = grads.fcprojb + l * C;
-        // get the pointers of the activations for this layer
-        float* l_ln1 = acts.ln1 + l * B * T * C;
-        float* l_ln1_mean = acts.ln1_mean + l * B * T;
-        float* l_ln1_rstd = acts.ln1_rstd + l * B * T;
-        float* l_qkv = acts.qkv + l * B * T * 3*C;
-        float* l_atty = acts.atty + l * B * T * C;
-        float* l_att = acts.att + l * B * NH * T * T;
-        float* l_residual2 = acts.residual2 + l * B * T * C;
-        float* l_ln2 = acts.ln2 + l * B * T * C;
-        float* l_ln2_mean = acts.ln2_mean + l * B * T;
-        float* l_ln2_rstd = acts.ln2_rstd + l * B * T;
-        float* l_fch = acts.fch + l * B * T * 4*C;
-        float* l_fch_gelu = acts.fch_gelu + l * B * T * 4*C;
-        // get the pointers of the gradients of the activations for this layer
-        float* dl_ln1 = grads_acts.ln1 + l * B * T * C;
-        float* dl_qkv = grads_acts.qkv + l * B * T * 3*C;
-        float* dl_atty = grads_acts.atty + l * B * T * C;
-        float* dl_preatt = grads_acts.preatt + l * B * NH * T * T;
-        float* dl_att = grads_acts.att + l * B * NH * T * T;
-        float* dl_attproj = grads_acts.attproj + l * B * T * C;
-        float* dl_residual2 = grads_acts.residual2 + l * B * T * C;
-        float* dl_ln2 = grads_acts.ln2 + l * B * T * C;
-        float* dl_fch = grads_acts.fch + l * B * T * 4*C;
-        float* dl_fch_gelu = grads_acts.fch_gelu + l * B * T * 4*C;
-        float* dl_fcproj = grads_acts.fcproj + l * B * T * C;
-        float* dl_residual3 = grads_acts.residual3 + l * B * T * C;
-
-        // backprop this layer
-        residual_backward(dl_residual2, dl_fcproj, dl_residual3, B*T*C);
-        matmul_backward(dl_fch_gelu, dl_fcprojw, dl_fcprojb, dl_fcproj, l_fch_gelu, l_fcprojw, B, T, 4*C, C);
-        gelu_backward(dl_fch, l_fch, dl_fch_gelu, B*T*4*C);
-        matmul_backward(dl_ln2, dl_fcw, dl_fcb, dl_fch, l_ln2, l_fcw, B, T, C, 4*C);
-        layernorm_backward(dl_residual2, dl_ln2w, dl_ln2b, dl_ln2, l_residual2, l_ln2w, l_ln2_mean, l_ln2_rstd, B, T, C);
-        residual_backward(dresidual, dl_attproj, dl_residual2, B*T*C);
-        matmul_backward(dl_atty, dl_attprojw, dl_attprojb, dl_attproj, l_atty, l_attprojw, B, T, C, C);
-        attention_backward(dl_qkv, dl_preatt, dl_att, dl_atty, l_qkv, l_att, B, T, C, NH);
-        matmul_backward(dl_ln1, dl_qkvw, dl_qkvb, dl_qkv, l_ln1, l_qkvw, B, T, C, 3*C);
-        layernorm_backward(dresidual, dl_ln1w, dl_ln1b, dl_ln1, residual, l_ln1w, l_ln1_mean, l_ln1_rstd, B, T, C);
-    }
-    encoder_backward(grads.wte, grads.wpe, grads_acts.encoded, model->inputs, B, T, C);
+    // one parallel region for the whole backward pass (see note on threading)
+    #pragma omp parallel
+    {
+        // we kick off the chain rule by filling in dlosses with 1.0f/(B*T)
+        // technically this is a small, inline backward() pass of calculating
+        // total, final loss as the mean over all losses over all (B,T) positions in the batch
+        float dloss_mean = 1.0f / (B*T);
+        #pragma omp for
+        for (int i = 0; i < B*T; i++) { grads_acts[0].losses[i] = dloss_mean; }
+
+        // the last argument of the backward kernels is accumulate: only the residual stream
+        // gradients are added to, everything else is written (see gpt2_zero_grad)
+        ActivationTensors dtop = grads_acts[L-1]; // the last layer, and the ones above it
+        crossentropy_softmax_backward(dtop.logits, dtop.losses, acts.probs, model->targets, B, T, V, Vp, 0);
+        matmul_backward(dtop.lnf, grads.wte, NULL, dtop.logits, acts.lnf, params.wte, gpt2_bf16(model, params.wte), B, T, C, Vp, 0, 0);
+        float* residual = acts.residual3 + (L-1) * B * T * C; // last layer's residual
+        float* dresidual = dtop.residual3; // write to last layer's residual
+        // the layernorms are fused with the backward of the residual add that feeds them,
+        // here lnf with the last layer's residual3 = residual2 + fcproj
+        residual_layernorm_backward(dtop.residual2, dtop.fcproj, dresidual,
+                                    grads.lnfw, grads.lnfb, model->scratch, dtop.lnf, residual, params.lnfw, acts.lnf_mean, acts.lnf_rstd, B, T, C, 0);
+
+        for (int l = L-1; l >= 0; l--) {
+
+            residual = l == 0 ? acts.encoded : acts.residual3 + (l-1) * B * T * C;
+            dresidual = l == 0 ? grads_acts[0].encoded : grads_acts[l-1].residual3;
+
+            // get the pointers of the weights for this layer
+            float* l_ln1w = params.ln1w + l * C;
+            float* l_qkvw = params.qkvw + l * 3*C * C;
+            float* l_attprojw = params.attprojw + l * C * C;
+            float* l_ln2w = params.ln2w + l * C;
+            float* l_fcw = params.fcw + l * 4*C * C;
+            float* l_fcprojw = params.fcprojw + l * C * 4*C;
+            // get the pointers of the gradients of the weights for this layer
+            float* dl_ln1w = grads.ln1w + l * C;
+            float* dl_ln1b = grads.ln1b + l * C;
+            float* dl_qkvw = grads.qkvw + l * 3*C * C;
+            float* dl_qkvb = grads.qkvb + l * 3*C;
+            float* dl_attprojw = grads.attprojw + l * C * C;
+            float* dl_attprojb = grads.attprojb + l * C;
+            float* dl_ln2w = grads.ln2w + l * C;
+            float* dl_ln2b = grads.ln2b + l * C;
+            float* dl_fcw = grads.fcw + l * 4*C * C;
+            float* dl_fcb = grads.fcb + l * 4*C;
+            float* dl_fcprojw = grads.fcprojw + l * C * 4*C;
+            float* dl_fcprojb = grads.fcprojb + l * C;
+            // get the pointers of the activations for this layer
+            float* l_ln1 = acts.ln1 + l * B * T * C;
+            float* l_ln1_mean = acts.ln1_mean + l * B * T;
+            float* l_ln1_rstd = acts.ln1_rstd + l * B * T;
+            float* l_qkv = acts.qkv + l * B * T * 3*C;
+            float* l_atty = acts.atty + l * B * T * C;
+            float* l_att = acts.att + l * B * NH * T * T;
+            float* l_residual2 = acts.residual2 + l * B * T * C;
+            float* l_ln2 = acts.ln2 + l * B * T * C;
+            float* l_ln2_mean = acts.ln2_mean + l * B * T;
+            float* l_ln2_rstd = acts.ln2_rstd + l * B * T;
+            float* l_fch = acts.fch + l * B * T * 4*C;
+            float* l_fch_gelu = acts.fch_gelu + (model->recompute ? 0 : l * B * T * 4*C);
+            // get the pointers of the gradients of the activations for this layer
+            float* dl_ln1 = grads_acts[l].ln1;
+            float* dl_qkv = grads_acts[l].qkv;
+            float* dl_atty = grads_acts[l].atty;
+            float* dl_preatt = grads_acts[l].preatt;
+            float* dl_att = grads_acts[l].att;
+            float* dl_attproj = grads_acts[l].attproj;
+            float* dl_residual2 = grads_acts[l].residual2;
+            float* dl_ln2 = grads_acts[l].ln2;
+            float* dl_fch = grads_acts[l].fch;
+            float* dl_fch_gelu = grads_acts[l].fch_gelu;
+            float* dl_fcproj = grads_acts[l].fcproj;
+
+            // backprop this layer
+            if (model->recompute) {
+                gelu_forward(l_fch_gelu, l_fch, B*T*4*C);
+            }
+            matmul_backward(dl_fch_gelu, dl_fcprojw, dl_fcprojb, dl_fcproj, l_fch_gelu, l_fcprojw, gpt2_bf16(model, l_fcprojw), B, T, 4*C, C, 0, 0);
+            gelu_backward(dl_fch, l_fch, dl_fch_gelu, B*T*4*C, 0);
+            matmul_backward(dl_ln2, dl_fcw, dl_fcb, dl_fch, l_ln2, l_fcw, gpt2_bf16(model, l_fcw), B, T, C, 4*C, 0, 0);
+            residual_layernorm_backward(dresidual, dl_attproj, dl_residual2, dl_ln2w, dl_ln2b, model->scratch, dl_ln2, l_residual2, l_ln2w, l_ln2_mean, l_ln2_rstd, B, T, C, 1);
+            matmul_backward(dl_atty, dl_attprojw, dl_attprojb, dl_attproj, l_atty, l_attprojw, gpt2_bf16(model, l_attprojw), B, T, C, C, 0, 0);
+            attention_backward(dl_qkv, dl_preatt, dl_att, dl_atty, l_qkv, l_att, B, T, C, NH, model->qkv_head_major, 0);
+            matmul_backward(dl_ln1, dl_qkvw, dl_qkvb, dl_qkv, l_ln1, l_qkvw, gpt2_bf16(model, l_qkvw), B, T, C, 3*C, qkv_hs, 0);
+            if (l > 0) {
+                // ln1 together with the previous layer's residual3 = residual2 + fcproj
+                residual_layernorm_backward(grads_acts[l-1].residual2, grads_acts[l-1].fcproj, dresidual,
+                                            dl_ln1w, dl_ln1b, model->scratch, dl_ln1, residual, l_ln1w, l_ln1_mean, l_ln1_rstd, B, T, C, 1);
+            } else {
+                layernorm_backward(dresidual, dl_ln1w, dl_ln1b, model->scratch, dl_ln1, residual, l_ln1w, l_ln1_mean, l_ln1_rstd, B, T, C, 1);
+            }
+        }
+        encoder_backward(grads.wte, grads.wpe, grads_acts[0].encoded, model->inputs, B, T, C);
+    }
 }
 
 void gpt2_update(GPT2 *model, float learning_rate, float beta1, float beta2, float eps, float weight_decay, int t) {
@@ -1009,10 +2930,18 @@ void gpt2_update(GPT2 *model, float learning_rate, float beta1, float beta2, flo
 
     // lazily allocate the memory for m_memory and v_memory
     if (model->m_memory == NULL) {
-        model->m_memory = (float*)calloc(model->num_parameters, sizeof(float));
-        model->v_memory = (float*)calloc(model->num_parameters, sizeof(float));
+        model->m_memory = (float*)arena_alloc(&model->arena, model->num_parameters * sizeof(float));
+        model->v_memory = (float*)arena_alloc(&model->arena, model->num_parameters * sizeof(float));
+        arena_first_touch(model->m_memory, model->num_parameters * sizeof(float)); // (zeroes them)
+        arena_first_touch(model->v_memory, model->num_parameters * sizeof(float));
     }
 
+    // in mixed precision, the new weights are also rounded stochastically into their bf16
+    // copy. the random bits are a hash of the index and the step, so they don't depend on
+    // which thread does the rounding, and are different for every step
+    bf16* params_bf16 = model->params_bf16_memory;
+    size_t chunk = gpt2_param_chunk(model);
+    #pragma omp parallel for schedule(static, chunk)
     for (size_t i = 0; i < model->num_parameters; i++) {
         float param = model->params_memory[i];
         float grad = model->grads_memory[i];
@@ -1029,49 +2958,24 @@ void gpt2_update(GPT2 *model, float learning_rate, float beta1, float beta2, flo
         model->m_memory[i] = m;
         model->v_memory[i] = v;
         model->params_memory[i] -= learning_rate * (m_hat / (sqrtf(v_hat) + eps) + weight_decay * param);
+        if (params_bf16 != NULL) {
+            params_bf16[i] = float_to_bf16_stochastic(model->params_memory[i], bf16_random((uint32_t)i, (uint32_t)t));
+        }
     }
 }
 
 void gpt2_free(GPT2 *model) {
-    free(model->params_memory);
-    free(model->grads_memory);
-    free(model->m_memory);
-    free(model->v_memory);
-    free(model->acts_memory);
-    free(model->grads_acts_memory);
-    free(model->inputs);
-    free(model->targets);
+    arena_free(&model->arena); // the parameters, gradients, optimizer state and activations
+    #ifndef _WIN32
+    if (model->params_map != NULL) { munmap(model->params_map, model->params_map_size); }
+    #endif
+    taskgraph_free(&model->forward_graph);
+    taskgraph_free(&model->backward_graph);
+    if (model->task_pool.num_threads > 0) { taskpool_free(&model->task_pool); }
 }
 
 #ifndef TESTING
 // if we are TESTING (see test_gpt2.c), we'll skip the int main below
-// ----------------------------------------------------------------------------
-// sampler
-
-unsigned int random_u32(uint64_t *state) {
-    // xorshift rng: https://en.wikipedia.org/wiki/Xorshift#xorshift.2A
-    *state ^= *state >> 12;
-    *state ^= *state << 25;
-    *state ^= *state >> 27;
-    return (*state * 0x2545F4914F6CDD1Dull) >> 32;
-}
-float random_f32(uint64_t *state) { // random float32 in [0,1)
-    return (random_u32(state) >> 8) / 16777216.0f;
-}
-
-int sample_mult(float* probabilities, int n, float coin) {
-    // sample index from probabilities (they must sum to 1!)
-    // coin is a random number in [0, 1), usually from random_f32()
-    float cdf = 0.0f;
-    for (int i = 0; i < n; i++) {
-        cdf += probabilities[i];
-        if (coin < cdf) {
-            return i;
-        }
-    }
-    return n - 1; // in case of rounding errors
-}
-
 // ----------------------------------------------------------------------------
 // main training loop
 int main() {
@@ -1079,6 +2983,13 @@ int main() {
     // build the GPT-2 model from a checkpoint
     GPT2 model;
     gpt2_build_from_checkpoint(&model, "gpt2_124M.bin");
+    // set to 1 to run the forward/backward passes as a task graph on a work-stealing
+    // pool of OMP_NUM_THREADS threads (see llmc/taskgraph.h), instead of layer by layer
+    model.use_task_graph = 0;
+    // set to 1 to keep fch_gelu for one layer only and recompute it in the backward pass
+    model.recompute = 0;
+    // set to 1 for mixed precision: bf16 weights in the matmuls, fp32 master weights
+    model.use_bf16 = 0;
 
     // build the DataLoaders from tokens files. for now use tiny_shakespeare if available, else tiny_stories
     const char* tiny_stories_train = "dev/data/tinystories/TinyStories_train.bin";
@@ -1101,9 +3012,13 @@ int main() {
     tokenizer_init(&tokenizer, "gpt2_tokenizer.bin");
 
     // some memory for generating samples from the model
-    uint64_t rng_state = 1337;
+    unsigned long long rng_state = 1337;
     int* gen_tokens = (int*)mallocCheck(B * T * sizeof(int));
     const int genT = 64; // number of steps of inference we will do
+    // plain sampling from the model's distribution: no temperature, top-k, top-p or min-p
+    // (see llmc/sampler.h)
+    Sampler sampler;
+    sampler_init(&sampler, model.config.vocab_size, 1, sampler_default_config());
 
     // train
     struct timespec start, end;
@@ -1115,8 +3030,7 @@ int main() {
             dataloader_reset(&val_loader);
             for (int i = 0; i < val_num_batches; i++) {
                 dataloader_next_batch(&val_loader);
-                gpt2_forward(&model, val_loader.inputs, val_loader.targets, B, T);
-                val_loss += model.mean_loss;
+                val_loss += gpt2_forward_no_grad(&model, val_loader.inputs, val_loader.targets, B, T);
             }
             val_loss /= val_num_batches;
             printf("val loss %f\n", val_loss);
@@ -1135,16 +3049,15 @@ int main() {
                 // we re-calculate the forward pass for all of (B,T) positions from scratch
                 // but the inference here is just for sanity checking anyway
                 // and we can maybe optimize a bit more later, with careful tests
-                gpt2_forward(&model, gen_tokens, NULL, B, T);
+                gpt2_forward_no_grad(&model, gen_tokens, NULL, B, T);
                 // furthermore, below we're only using b=0 (i.e. the first row) of all B rows
                 // we're in principle running B "inference streams" in parallel here
                 // but only using position 0
-                // get the Vp-dimensional vector probs[0, t-1, :]
-                float* probs = model.acts.probs + (t-1) * model.config.padded_vocab_size;
+                // get the Vp-dimensional vector logits[0, t-1, :]
+                float* logits = model.acts_no_grad.logits + (t-1) * model.config.padded_vocab_size;
                 float coin = random_f32(&rng_state);
                 // note we're only sampling from the first V elements, ignoring padding
-                // (the probabilities in the padded region should be zero anyway)
-                int next_token = sample_mult(probs, model.config.vocab_size, coin);
+                int next_token = sampler_sample(&sampler, logits, coin);
                 gen_tokens[t] = next_token;
                 // print the generated token, either using the Tokenizer or a fallback
                 if (tokenizer.init_ok) {
@@ -1169,6 +3082,8 @@ int main() {
         clock_gettime(CLOCK_MONOTONIC, &end);
         double time_elapsed_s = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
         printf("step %d: train loss %f (took %f ms)\n", step, model.mean_loss, time_elapsed_s * 1000);
+        // after the first step everything is allocated: how much of it is on huge pages
+        if (step == 0) { arena_print_report(&model.arena); }
     }
 
     // free
@@ -1177,6 +3092,7 @@ int main() {
     tokenizer_free(&tokenizer);
     gpt2_free(&model);
     free(gen_tokens);
+    sampler_free(&sampler);
     return 0;
 }
 #endif